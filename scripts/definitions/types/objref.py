@@ -34,7 +34,7 @@ class ObjectRef(Type):
     def cxx_names(self, options):
         if not self.needs_object(options):
             return self.c_names(options)
-        return ((f"obj::{self.name} *", ""),)
+        return ((f"obj::{self.object.cname} *", ""),)
 
     def needs_object(self, options):
         return not bool({"out", "inout", "list", "handle"}.intersection(options))
@@ -13,6 +13,12 @@ constexpr size_t frame_size = 0x1000;
 /// Number of bits of addressing within a page
 constexpr size_t frame_bits = 12;
 
+/// Size of a large page (mapped by a page directory entry)
+constexpr size_t large_page_size = 0x20'0000;
+
+/// Size of a huge page (mapped by a page directory pointer entry)
+constexpr size_t huge_page_size = 0x4000'0000;
+
 /// Number of bits mapped per page table level
 constexpr size_t table_bits = 9;
 
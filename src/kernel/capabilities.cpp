@@ -1,102 +1,167 @@
-#include <util/hash.h>
-
 #include "capabilities.h"
+#include "kassert.h"
 #include "memory.h"
 
-static constexpr size_t one_page_worth = mem::frame_size / sizeof(capability);
-
-inline j6_handle_t make_handle(size_t &counter) {
-    //return util::hash(__atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
-    return __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
-}
-
 cap_table::cap_table(uintptr_t start) :
-    m_caps(reinterpret_cast<capability*>(start), one_page_worth),
-    m_count {0}
+    m_slots {reinterpret_cast<capability*>(start)},
+    m_max_slots {mem::caps_size / sizeof(capability)},
+    m_used_slots {0},
+    m_free {no_slot}
 {}
 
+capability *
+cap_table::get_slot(j6_handle_t id)
+{
+    if (id == j6_handle_invalid)
+        return nullptr;
+
+    size_t index = slot_index(id);
+    if (index >= __atomic_load_n(&m_used_slots, __ATOMIC_ACQUIRE))
+        return nullptr;
+
+    return &m_slots[index];
+}
+
 j6_handle_t
-cap_table::create(obj::kobject *target, j6_cap_t caps)
+cap_table::allocate(j6_handle_t parent, j6_cap_t caps,
+        obj::kobject::type type, obj::kobject *object)
 {
-    j6_handle_t new_handle = make_handle(m_count);
+    util::scoped_lock lock {m_lock};
+
+    size_t index = m_free;
+    capability *slot = nullptr;
+    uint32_t gen = 0;
+
+    if (index != no_slot) {
+        slot = &m_slots[index];
+        m_free = slot->next_free;
+        gen = generation(slot->state);
+    } else {
+        index = m_used_slots;
+        kassert(index < m_max_slots, "Ran out of capability slots");
+        slot = &m_slots[index];
+
+        // Mark the new slot free until it's filled in, before any
+        // lookup can see it
+        __atomic_store_n(&slot->state, free_holders, __ATOMIC_RELAXED);
+        __atomic_store_n(&m_used_slots, index + 1, __ATOMIC_RELEASE);
+    }
+
+    j6_handle_t id = (static_cast<uint64_t>(gen) << 32) | (index + 1);
 
+    slot->id = id;
+    slot->parent = parent;
+    slot->caps = caps;
+    slot->type = type;
+    slot->object = object;
+    slot->next_free = no_slot;
+
+    // Publish the slot: starts with a count of 0 holders
+    __atomic_store_n(&slot->state, static_cast<uint64_t>(gen) << 32, __ATOMIC_RELEASE);
+    return id;
+}
+
+void
+cap_table::free_slot(capability *slot)
+{
     util::scoped_lock lock {m_lock};
 
-    m_caps.insert({
-        new_handle,
-        j6_handle_invalid,
-        0, // starts with a count of 0 holders
-        caps,
-        target->get_type(),
-        target,
-        });
+    // Move to the next generation, so stale handles to this slot
+    // won't match whatever is put here next
+    uint64_t gen = generation(slot->state) + 1;
+    __atomic_store_n(&slot->state, (gen << 32) | free_holders, __ATOMIC_RELEASE);
 
+    slot->object = nullptr;
+    slot->next_free = m_free;
+    m_free = slot - m_slots;
+}
+
+j6_handle_t
+cap_table::create(obj::kobject *target, j6_cap_t caps)
+{
     if (target)
         target->handle_retain();
 
-    return new_handle;
+    return allocate(j6_handle_invalid, caps, target->get_type(), target);
 }
 
 j6_handle_t
 cap_table::derive(j6_handle_t base, j6_cap_t caps)
 {
-    util::scoped_lock lock {m_lock};
-
-    capability *existing = m_caps.find(base);
+    capability *existing = retain(base);
     if (!existing)
         return j6_handle_invalid;
 
     caps &= existing->caps;
 
-    j6_handle_t new_handle = make_handle(m_count);
-
-    m_caps.insert({
-        new_handle,
-        base,
-        0, // starts with a count of 0 holders
-        caps,
-        existing->type,
-        existing->object,
-        });
-
     if (existing->object)
         existing->object->handle_retain();
 
+    j6_handle_t new_handle =
+        allocate(base, caps, existing->type, existing->object);
+
+    release(base);
     return new_handle;
 }
 
 capability *
 cap_table::find_without_retain(j6_handle_t id)
 {
-    util::scoped_lock lock {m_lock};
-    return m_caps.find(id);
+    capability *slot = get_slot(id);
+    if (!slot)
+        return nullptr;
+
+    uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if (generation(state) != (id >> 32) || (holders(state) & free_holders))
+        return nullptr;
+
+    return slot;
 }
 
 capability *
 cap_table::retain(j6_handle_t id)
 {
-    util::scoped_lock lock {m_lock};
-
-    capability *cap = m_caps.find(id);
-    if (!cap)
+    capability *slot = get_slot(id);
+    if (!slot)
         return nullptr;
 
-    ++cap->holders;
-    return cap;
+    const uint32_t gen = id >> 32;
+    uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    do {
+        if (generation(state) != gen || (holders(state) & free_holders))
+            return nullptr;
+    } while (!__atomic_compare_exchange_n(&slot->state, &state, state + 1,
+                true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return slot;
 }
 
 void
 cap_table::release(j6_handle_t id)
 {
-    util::scoped_lock lock {m_lock};
-
-    capability *cap = m_caps.find(id);
-    if (!cap)
+    capability *slot = get_slot(id);
+    if (!slot)
         return;
 
-    if (--cap->holders == 0) {
-        if (cap->object)
-            cap->object->handle_release();
-        m_caps.erase(id);
+    const uint32_t gen = id >> 32;
+    uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    uint64_t next;
+    do {
+        if (generation(state) != gen || (holders(state) & free_holders))
+            return;
+
+        kassert(holders(state), "Releasing a capability with no holders");
+
+        // Dropping the last holder marks the slot free, so nothing
+        // can retain it again while it's torn down
+        next = holders(state) == 1 ?
+            ((state & ~0xffffffffull) | free_holders) : state - 1;
+    } while (!__atomic_compare_exchange_n(&slot->state, &state, next,
+                true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+    if (holders(next) & free_holders) {
+        if (slot->object)
+            slot->object->handle_release();
+        free_slot(slot);
     }
 }
@@ -2,8 +2,8 @@
 /// \file capabilities.h
 /// Capability table definitions
 
+#include <stddef.h>
 #include <j6/types.h>
-#include <util/node_map.h>
 #include <util/spinlock.h>
 
 #include "objects/kobject.h"
@@ -13,14 +13,26 @@ struct capability
     j6_handle_t id;
     j6_handle_t parent;
 
-    uint32_t holders;
+    /// The slot's generation in the high 32 bits, and the number of
+    /// holders in the low 32 bits. Only changed atomically.
+    uint64_t state;
+
     j6_cap_t caps;
     obj::kobject::type type;
     // 1 byte alignment padding
 
+    /// Next slot on the table's free list, while this slot is free
+    uint32_t next_free;
+
     obj::kobject *object;
 };
 
+/// The table of all capabilities. Capabilities are kept in an array of
+/// slots, and a handle encodes both its slot index and the generation of
+/// that slot, so lookups are a single index with no lock. Each slot's
+/// holder count shares a word with its generation, so a lookup racing
+/// with the capability being freed and its slot reused fails its
+/// compare-and-swap instead of retaining the new capability.
 class cap_table
 {
 public:
@@ -44,13 +56,39 @@ public:
     /// (or the object it points to) without retaining it is dangerous.
     capability * find_without_retain(j6_handle_t id);
 
+    /// Get the table slot index a handle refers to. The index is only
+    /// meaningful for handles that are, or were, valid.
+    static inline size_t slot_index(j6_handle_t id) {
+        return static_cast<uint32_t>(id) - 1;
+    }
+
 private:
-    using map_type = util::inplace_map<j6_handle_t, capability, j6_handle_invalid>;
-    map_type m_caps;
+    /// Set in a slot's holder count while the slot is free
+    static constexpr uint32_t free_holders = 0x80000000;
+    static constexpr uint32_t no_slot = 0xffffffff;
+
+    static inline uint32_t generation(uint64_t state) { return state >> 32; }
+    static inline uint32_t holders(uint64_t state) { return state & 0xffffffff; }
+
+    /// Look up a handle's slot, if the handle could be valid
+    capability * get_slot(j6_handle_t id);
+
+    /// Take a free slot and fill it in. Returns the new handle.
+    j6_handle_t allocate(j6_handle_t parent, j6_cap_t caps,
+            obj::kobject::type type, obj::kobject *object);
+
+    /// Return a slot to the free list
+    void free_slot(capability *slot);
+
+    capability *m_slots;
+    size_t m_max_slots;
+
+    /// Slots used so far, the rest of the region is untouched
+    size_t m_used_slots;
+    uint32_t m_free;
 
+    /// Protects slot allocation, lookups don't take it
     util::spinlock m_lock;
-    size_t m_count;
 };
 
 extern cap_table &g_cap_table;
-inline uint64_t & get_map_key(capability &cap) { return cap.id; }
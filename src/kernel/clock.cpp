@@ -3,7 +3,7 @@
 clock * clock::s_instance = nullptr;
 
 clock::clock(uint64_t rate, clock::source source_func, void *data) :
-    m_rate(rate),
+    m_mult((1ull << shift) / rate),
     m_data(data),
     m_source(source_func)
 {
@@ -13,6 +13,16 @@ clock::clock(uint64_t rate, clock::source source_func, void *data) :
     update();
 }
 
+clock::clock(uint64_t ticks, uint64_t ns, clock::source source_func, void *data) :
+    m_mult((static_cast<unsigned __int128>(ns) << shift) / (ticks * 1000)),
+    m_data(data),
+    m_source(source_func)
+{
+    if (s_instance == nullptr)
+        s_instance = this;
+    update();
+}
+
 void
 clock::spinwait(uint64_t us) const
 {
@@ -20,3 +30,10 @@ clock::spinwait(uint64_t us) const
     while (value() < when) asm ("pause");
 }
 
+uint64_t
+clock::tsc_source(void*)
+{
+    uint32_t lo = 0, hi = 0;
+    asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
@@ -11,17 +11,31 @@ public:
     /// value of some clock source.
     using source = uint64_t (*)(void*);
 
+    /// Shift applied after multiplying source ticks by the
+    /// conversion factor
+    static constexpr unsigned shift = 32;
+
     /// Constructor.
     /// \arg rate   Number of source ticks per us
     /// \arg source Function for the clock source
     /// \arg data   Data to pass to the source function
     clock(uint64_t rate, source source_func, void *data);
 
+    /// Constructor for a source calibrated against another clock.
+    /// \arg ticks  Number of source ticks counted during the calibration
+    /// \arg ns     Length of the calibration, in ns
+    /// \arg source Function for the clock source
+    /// \arg data   Data to pass to the source function
+    clock(uint64_t ticks, uint64_t ns, source source_func, void *data);
+
     /// Get the current value of the clock.
     /// \returns Current value of the source, in us
-    /// TODO: optimize divison by finding a multiply and
-    /// shift value instead
-    inline uint64_t value() const { return m_source(m_data) / m_rate; }
+    inline uint64_t value() const { return to_us(m_source(m_data)); }
+
+    /// Convert a value of the clock source to us
+    inline uint64_t to_us(uint64_t ticks) const {
+        return static_cast<unsigned __int128>(ticks) * m_mult >> shift;
+    }
 
     /// Update the internal state via the source
     /// \returns Current value of the clock
@@ -31,12 +45,23 @@ public:
     /// \arg interval  Time to wait, in us
     void spinwait(uint64_t us) const;
 
+    /// Get the factor source ticks are multiplied by before being
+    /// shifted right by `shift` to give us
+    inline uint64_t mult() const { return m_mult; }
+
+    /// Check if this clock reads the TSC, and so can also be
+    /// read directly by userspace
+    inline bool is_tsc() const { return m_source == tsc_source; }
+
+    /// Clock source function that reads the TSC
+    static uint64_t tsc_source(void *);
+
     /// Get the master clock
     static clock & get() { return *s_instance; }
 
 private:
     uint64_t m_current; ///< current us count
-    uint64_t m_rate; ///< source ticks per us
+    uint64_t m_mult; ///< us per source tick, scaled by 2^shift
     void *m_data;
     source m_source;
 
@@ -70,6 +70,29 @@ cpu_validate(cpu_data *c)
 }
 
 
+// Find where the running CPU sits in the core/package topology, from its
+// x2APIC ID and the ID bit widths reported for each topology level.
+static void
+cpu_get_topology(cpu_data *cpu)
+{
+    cpu::cpu_id cpuid;
+    if (cpuid.highest_basic() < 0x0b) {
+        // No topology leaf: treat each CPU as its own core
+        cpu->core = cpuid.get(1).ebx >> 24;
+        cpu->package = 0;
+        return;
+    }
+
+    const auto smt = cpuid.get(0x0b, 0);
+    const auto core = cpuid.get(0x0b, 1);
+    const uint32_t x2apic_id = smt.edx;
+
+    constexpr uint32_t level_core = 2;
+    cpu->core = x2apic_id >> (smt.eax & 0x1f);
+    cpu->package = ((core.ecx >> 8) & 0xff) == level_core ?
+        x2apic_id >> (core.eax & 0x1f) : 0;
+}
+
 // Do early (before cpu_init) initialization work. Only needs to be called manually for
 // the BSP, otherwise cpu_init will call it.
 static void
@@ -86,6 +109,7 @@ cpu_early_init(cpu_data *cpu)
     asm volatile ( "mov %0, %%cr0" :: "r" (cr0_val) );
 
     cpu->features = get_features();
+    cpu_get_topology(cpu);
 
     uintptr_t cr3_val;
     asm ("mov %%cr3, %0" : "=r"(cr3_val));
@@ -93,16 +117,18 @@ cpu_early_init(cpu_data *cpu)
     util::bitset64 cr4_val = 0;
     asm ("mov %%cr4, %0" : "=r"(cr4_val));
     cr4_val
+        .set(cr4::PGE)
         .set(cr4::OSXFSR)
         .set(cr4::OSXMMEXCPT)
         .set(cr4::OSXSAVE);
 
-    // TODO: On KVM setting PCIDE generates a #GP even though
-    // the feature is listed as available in CPUID.
-    /*
-    if (cpu->features[cpu::feature::pcid])
+    // Setting PCIDE raises #GP unless the current PCID (the low bits of
+    // CR3, which firmware may have left set as cache control bits) is 0
+    if (cpu->features[cpu::feature::pcid]) {
+        if (cr3_val & 0xfff)
+            asm volatile ( "mov %0, %%cr3" :: "r" (cr3_val & ~0xfffull) : "memory" );
         cr4_val.set(cr4::PCIDE);
-    */
+    }
     asm volatile ( "mov %0, %%cr4" :: "r" (cr4_val) );
 
     // Enable SYSCALL and NX bit
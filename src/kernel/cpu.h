@@ -3,6 +3,10 @@
 #include <stdint.h>
 #include <cpu/cpu_id.h>
 
+#include "frame_allocator.h"
+#include "tlb.h"
+#include "zero_pool.h"
+
 class GDT;
 class IDT;
 class lapic;
@@ -126,12 +130,23 @@ struct cpu_data
     IDT *idt;
     TSS *tss;
     GDT *gdt;
+    TCB *fpu_owner;
 
     // Members beyond this point do not appear in
     // the assembly version
     lapic *apic;
     panic_data *panic;
     cpu::features features;
+    uint32_t core;      ///< Topology ID of this CPU's core, shared by SMT siblings
+    uint32_t package;   ///< Topology ID of this CPU's package
+    frame_cache frames;
+    zero_pool::cache zeros;
+    tlb::queue tlb;
+    tlb::asid_cache asids;
+
+    /// The vm_space area list this CPU is reading without the space's
+    /// lock, if any. The list won't be freed until this is cleared.
+    const void *area_reader;
 };
 
 extern "C" {
@@ -7,6 +7,7 @@
 #include "kassert.h"
 #include "apic.h"
 #include "clock.h"
+#include "cpu.h"
 #include "device_manager.h"
 #include "interrupts.h"
 #include "logger.h"
@@ -247,12 +248,27 @@ device_manager::load_hpet(const acpi::table_header *header)
         reinterpret_cast<uint64_t*>(hpet->base_address.address + mem::linear_offset));
 }
 
-static uint64_t
-tsc_clock_source(void*)
+/// Create a clock that reads the TSC, calibrated by counting TSC ticks
+/// over a fixed interval of the HPET.
+static clock *
+calibrate_tsc_clock(const hpet &h)
 {
-    uint32_t lo = 0, hi = 0;
-    asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
-    return ((uint64_t)hi << 32) | lo;
+    constexpr uint64_t calibrate_us = 10000;
+    const uint64_t hpet_ticks = h.rate() * calibrate_us;
+
+    uint64_t hpet_start = h.value();
+    uint64_t tsc_start = clock::tsc_source(nullptr);
+
+    uint64_t hpet_end = hpet_start;
+    while (hpet_end - hpet_start < hpet_ticks) {
+        asm ("pause");
+        hpet_end = h.value();
+    }
+    uint64_t tsc_end = clock::tsc_source(nullptr);
+
+    // The HPET period is in femtoseconds
+    uint64_t ns = (hpet_end - hpet_start) * h.period() / 1000000;
+    return new clock(tsc_end - tsc_start, ns, clock::tsc_source, nullptr);
 }
 
 void
@@ -278,12 +294,19 @@ device_manager::init_drivers()
         hpet &h = m_hpets[0];
         h.enable();
 
-        // becomes the singleton
-        master_clock = new clock(h.rate(), hpet_clock_source, &h);
-        log::info(logs::timer, "Created master clock using HPET 0: Rate %d", h.rate());
+        // becomes the singleton. Reading the HPET is slow, so prefer
+        // the TSC when its rate doesn't change with power states.
+        if (current_cpu().features[cpu::feature::invtsc]) {
+            master_clock = calibrate_tsc_clock(h);
+            log::info(logs::timer, "Created master clock using invariant TSC: Mult %lx >> %d",
+                    master_clock->mult(), clock::shift);
+        } else {
+            master_clock = new clock(h.rate(), hpet_clock_source, &h);
+            log::info(logs::timer, "Created master clock using HPET 0: Rate %d", h.rate());
+        }
     } else {
         //TODO: Other clocks, APIC clock?
-        master_clock = new clock(5000, tsc_clock_source, nullptr);
+        master_clock = new clock(5000, clock::tsc_source, nullptr);
     }
 
     kassert(master_clock, "Failed to allocate master clock");
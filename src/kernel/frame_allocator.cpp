@@ -1,13 +1,17 @@
 #include <bootproto/kernel.h>
 
 #include "kassert.h"
+#include "cpu.h"
 #include "debugcon.h"
 #include "frame_allocator.h"
 #include "logger.h"
 #include "memory.h"
+#include "zero_pool.h"
 
 using mem::frame_size;
 
+extern cpu_data **g_cpu_data;
+
 
 frame_allocator &
 frame_allocator::get()
@@ -29,11 +33,198 @@ bsf(uint64_t v)
     return v;
 }
 
+/// Check if all frames in the given range of a block are free
+static bool
+run_free(const bootproto::frame_block &block, size_t frame, size_t count)
+{
+    while (count) {
+        unsigned o3 = frame & 0x3f;
+        size_t n = 64 - o3;
+        if (n > count) n = count;
+
+        uint64_t mask = (n == 64 ? ~0ull : ((1ull << n) - 1)) << o3;
+        if ((block.bitmap[frame >> 6] & mask) != mask)
+            return false;
+
+        frame += n;
+        count -= n;
+    }
+    return true;
+}
+
+/// Mark the given range of frames in a block as used
+static void
+mark_used(bootproto::frame_block &block, size_t frame, size_t count)
+{
+    while (count) {
+        unsigned o1 = (frame >> 12) & 0x3f;
+        unsigned o2 = (frame >> 6) & 0x3f;
+        unsigned o3 = frame & 0x3f;
+        size_t n = 64 - o3;
+        if (n > count) n = count;
+
+        uint64_t mask = (n == 64 ? ~0ull : ((1ull << n) - 1)) << o3;
+        uint64_t &m3 = block.bitmap[(o1 << 6) + o2];
+        m3 &= ~mask;
+        if (!m3) {
+            block.map2[o1] &= ~(1ull << o2);
+            if (!block.map2[o1])
+                block.map1 &= ~(1ull << o1);
+        }
+
+        frame += n;
+        count -= n;
+    }
+}
+
 size_t
 frame_allocator::allocate(size_t count, uintptr_t *address)
 {
+    if (count == 1) {
+        frame_cache &cache = current_cpu().frames;
+        util::scoped_lock cache_lock {cache.lock};
+        if (!cache.count)
+            refill(cache);
+
+        if (cache.count) {
+            *address = cache.frames[--cache.count];
+            return 1;
+        }
+    }
+
+    size_t n = 0;
+    {
+        util::scoped_lock lock {m_lock};
+        n = allocate_locked(count, address);
+    }
+
+    if (!n) {
+        // Free frames may still be held in caches, so take them all back
+        // before giving up
+        reclaim();
+        util::scoped_lock lock {m_lock};
+        n = allocate_locked(count, address);
+    }
+
+    kassert(n, "frame_allocator ran out of free frames!");
+    return n;
+}
+
+bool
+frame_allocator::allocate_aligned(size_t count, uintptr_t *address)
+{
+    kassert(count && !(count & (count - 1)), "allocate_aligned count must be a power of two");
+
+    const uintptr_t align = count * frame_size;
     util::scoped_lock lock {m_lock};
 
+    for (long i = m_count - 1; i >= 0; --i) {
+        frame_block &block = m_blocks[i];
+        if (!block.map1)
+            continue;
+
+        uintptr_t end = block.base + block.count * frame_size;
+        uintptr_t start = (block.base + align - 1) & ~(align - 1);
+
+        for (uintptr_t addr = start; addr + align <= end; addr += align) {
+            size_t frame = (addr - block.base) / frame_size;
+
+            // Skip quickly past 16MiB groups with nothing free
+            if (!(block.map1 & (1ull << ((frame >> 12) & 0x3f))))
+                continue;
+
+            if (!run_free(block, frame, count))
+                continue;
+
+            mark_used(block, frame, count);
+            *address = addr;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+frame_allocator::free(uintptr_t address, size_t count)
+{
+    kassert(address % frame_size == 0, "Trying to free a non page-aligned frame!");
+
+    if (!count)
+        return;
+
+    if (count <= frame_cache::batch) {
+        frame_cache &cache = current_cpu().frames;
+        util::scoped_lock cache_lock {cache.lock};
+        if (cache.count + count > frame_cache::capacity)
+            drain(cache);
+
+        for (size_t i = 0; i < count; ++i)
+            cache.frames[cache.count++] = address + i * frame_size;
+        return;
+    }
+
+    util::scoped_lock lock {m_lock};
+    free_locked(address, count);
+}
+
+void
+frame_allocator::refill(frame_cache &cache)
+{
+    util::scoped_lock lock {m_lock};
+
+    while (cache.count < frame_cache::batch) {
+        uintptr_t phys = 0;
+        size_t n = allocate_locked(frame_cache::batch - cache.count, &phys);
+        if (!n) break;
+
+        for (size_t i = 0; i < n; ++i)
+            cache.frames[cache.count++] = phys + i * frame_size;
+    }
+}
+
+void
+frame_allocator::drain(frame_cache &cache)
+{
+    util::scoped_lock lock {m_lock};
+
+    // Return the oldest frames, keep the most recently freed (and
+    // so most likely to still be cache-hot) frames in the cache
+    for (size_t i = 0; i < frame_cache::batch; ++i)
+        free_locked(cache.frames[i], 1);
+
+    cache.count -= frame_cache::batch;
+    for (size_t i = 0; i < cache.count; ++i)
+        cache.frames[i] = cache.frames[i + frame_cache::batch];
+}
+
+void
+frame_allocator::reclaim()
+{
+    // Frames freed from the zero pools may land in this CPU's cache, so
+    // empty the pools first
+    zero_pool::reclaim();
+
+    // Before SMP is started, only this CPU has a cache
+    unsigned cpus = g_cpu_data ? g_num_cpus : 1;
+    for (unsigned i = 0; i < cpus; ++i) {
+        cpu_data *cpu = g_cpu_data ? g_cpu_data[i] : &current_cpu();
+        if (!cpu)
+            continue;
+
+        frame_cache &cache = cpu->frames;
+        util::scoped_lock cache_lock {cache.lock};
+        util::scoped_lock lock {m_lock};
+
+        for (size_t j = 0; j < cache.count; ++j)
+            free_locked(cache.frames[j], 1);
+        cache.count = 0;
+    }
+}
+
+size_t
+frame_allocator::allocate_locked(size_t count, uintptr_t *address)
+{
     for (long i = m_count - 1; i >= 0; --i) {
         frame_block &block = m_blocks[i];
 
@@ -76,20 +267,12 @@ frame_allocator::allocate(size_t count, uintptr_t *address)
         return n;
     }
 
-    kassert(false, "frame_allocator ran out of free frames!");
     return 0;
 }
 
 void
-frame_allocator::free(uintptr_t address, size_t count)
+frame_allocator::free_locked(uintptr_t address, size_t count)
 {
-    util::scoped_lock lock {m_lock};
-
-    kassert(address % frame_size == 0, "Trying to free a non page-aligned frame!");
-
-    if (!count)
-        return;
-
     //debugcon::write("Freeing   %2d frames at %016lx - %016lx", count, address, address + count * frame_size);
 
     for (long i = 0; i < m_count; ++i) {
@@ -107,7 +290,7 @@ frame_allocator::free(uintptr_t address, size_t count)
         while (count--) {
             block.map1 |= (1ull << o1);
             block.map2[o1] |= (1ull << o2);
-            block.bitmap[o2] |= (1ull << o3);
+            block.bitmap[(o1 << 6) + o2] |= (1ull << o3);
             if (++o3 == 64) {
                 o3 = 0;
                 if (++o2 == 64) {
@@ -117,6 +300,7 @@ frame_allocator::free(uintptr_t address, size_t count)
                 }
             }
         }
+        return;
     }
 }
 
@@ -138,29 +322,7 @@ frame_allocator::used(uintptr_t address, size_t count)
             continue;
 
         uint64_t frame = (address - block.base) >> 12;
-        unsigned o1 = (frame >> 12) & 0x3f;
-        unsigned o2 = (frame >> 6) & 0x3f;
-        unsigned o3 = frame & 0x3f;
-
-        while (count--) {
-            block.bitmap[o2] &= ~(1ull << o3);
-            if (!block.bitmap[o2]) {
-                block.map2[o1] &= ~(1ull << o2);
-
-                if (!block.map2[o1]) {
-                    block.map1 &= ~(1ull << o1);
-                }
-            }
-
-            if (++o3 == 64) {
-                o3 = 0;
-                if (++o2 == 64) {
-                    o2 = 0;
-                    ++o1;
-                    kassert(o1 < 64, "Tried to mark pages past the end of a block");
-                }
-            }
-        }
+        kassert(frame + count <= 64 * 64 * 64, "Tried to mark pages past the end of a block");
+        mark_used(block, frame, count);
     }
 }
-
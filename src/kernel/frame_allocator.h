@@ -10,6 +10,25 @@ namespace bootproto {
     struct frame_block;
 }
 
+/// Per-CPU cache ("magazine") of free frames. Single-frame allocations
+/// and frees are satisfied from here without taking the global lock, and
+/// the cache is refilled or drained in batches from the global bitmap.
+/// Only the owning CPU uses its cache, so its lock is uncontended except
+/// when another CPU reclaims the cache's frames to avoid running out.
+struct frame_cache
+{
+    util::spinlock lock;
+
+    /// Maximum number of frames held in one CPU's cache
+    static constexpr size_t capacity = 64;
+
+    /// Number of frames moved to or from the global bitmap at once
+    static constexpr size_t batch = capacity / 2;
+
+    size_t count;
+    uintptr_t frames[capacity];
+};
+
 /// Allocator for physical memory frames
 class frame_allocator
 {
@@ -29,6 +48,13 @@ public:
     /// \returns      The number of frames retrieved
     size_t allocate(size_t count, uintptr_t *address);
 
+    /// Get an exact run of free frames whose physical address is aligned
+    /// to the size of the run, eg. to back a large or huge page.
+    /// \arg count    The number of frames to get, must be a power of two
+    /// \arg address  [out] The physical address of the first frame
+    /// \returns      True if a suitable run was found and allocated
+    bool allocate_aligned(size_t count, uintptr_t *address);
+
     /// Free previously allocated frames.
     /// \arg address  The physical address of the first frame to free
     /// \arg count    The number of frames to be freed
@@ -43,6 +69,25 @@ public:
     static frame_allocator & get();
 
 private:
+    /// Find free frames in the bitmap. Caller must hold m_lock.
+    /// \returns  The number of frames found, or 0 if none are free
+    size_t allocate_locked(size_t count, uintptr_t *address);
+
+    /// Mark frames free in the bitmap. Caller must hold m_lock.
+    void free_locked(uintptr_t address, size_t count);
+
+    /// Fill the given cache with a batch of frames from the bitmap.
+    /// Caller must hold the cache's lock.
+    void refill(frame_cache &cache);
+
+    /// Return a batch of frames from the given cache to the bitmap.
+    /// Caller must hold the cache's lock.
+    void drain(frame_cache &cache);
+
+    /// Return every frame held in the zero pools and all CPUs' caches to
+    /// the bitmap. Caller must not hold m_lock or any cache's lock.
+    void reclaim();
+
     frame_block *m_blocks;
     size_t m_count;
 
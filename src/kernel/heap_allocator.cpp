@@ -8,6 +8,7 @@
 #include "heap_allocator.h"
 #include "memory.h"
 #include "objects/vm_area.h"
+#include "tlb.h"
 #include "vm_space.h"
 
 uint32_t & get_map_key(heap_allocator::block_info &info) { return info.offset; }
@@ -93,6 +94,9 @@ heap_allocator::free(void *p)
     kassert(addr >= m_start && addr < m_end,
         "Attempt to free non-heap pointer");
 
+    // The debug heap's shootdown must wait until the heap is unlocked,
+    // so the batch is declared first
+    tlb::batch batch {vm_space::kernel_space()};
     util::scoped_lock lock {m_lock};
 
     free_header *block = reinterpret_cast<free_header *>(p);
@@ -108,7 +112,7 @@ heap_allocator::free(void *p)
 
         size_t offset = reinterpret_cast<uintptr_t>(p) - mem::heap_offset;
         size_t pages = mem::bytes_to_pages(size);
-        vm_space::kernel_space().lock(g_kernel_heap_area, offset, pages);
+        vm_space::kernel_space().lock(g_kernel_heap_area, offset, pages, &batch);
         return;
     }
 
@@ -23,6 +23,9 @@ public:
     /// Get the timer rate in ticks per us
     inline uint64_t rate() const { return 1000000000/m_period; }
 
+    /// Get the timer period in femtoseconds
+    inline uint64_t period() const { return m_period; }
+
     /// Get the current timer value
     uint64_t value() const;
 
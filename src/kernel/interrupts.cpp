@@ -11,7 +11,9 @@
 #include "memory.h"
 #include "objects/process.h"
 #include "scheduler.h"
+#include "tlb.h"
 #include "vm_space.h"
+#include "xsave.h"
 
 static const uint16_t PIC1 = 0x20;
 static const uint16_t PIC2 = 0xa0;
@@ -21,7 +23,6 @@ constexpr uintptr_t apic_eoi_addr = 0xfee000b0 + mem::linear_offset;
 extern "C" {
     void isr_handler(cpu_state*);
     void irq_handler(cpu_state*);
-    void _reload_cr3();
 }
 
 uint8_t
@@ -98,6 +99,12 @@ isr_handler(cpu_state *regs)
         kassert(false, "Debug exception", regs);
         break;
 
+    case isr::isrDNA:
+        // task_switch sets CR0.TS rather than restoring extended state
+        if (!xsave_restore_current())
+            kassert(false, "Device not available", regs);
+        break;
+
     case isr::isrDoubleFault:
         kassert(false, "Double fault", regs);
         break;
@@ -189,8 +196,7 @@ isr_handler(cpu_state *regs)
         break;
 
     case isr::ipiShootdown:
-        // TODO: Real shootdown algorithm
-        _reload_cr3();
+        tlb::handle_pending();
         break;
 
     default:
@@ -2,24 +2,75 @@
 #include <util/basic_types.h>
 
 #include "kassert.h"
+#include "frame_allocator.h"
 #include "ipc_message.h"
 #include "j6/types.h"
+#include "memory.h"
+#include "objects/process.h"
+#include "vm_space.h"
+
+DEFINE_SLAB_ALLOCATOR(ipc::message)
 
 namespace ipc {
 
-message::message() : tag {0}, data_size {0}, handle_count {0}, out_of_band {0} {}
+message::message() : tag {0}, data_size {0}, handle_count {0}, out_of_band {0}, remapped {0}, borrowed {0} {}
 
 
 message::message(
     uint64_t in_tag,
     const util::buffer &in_data,
     const util::counted<j6_handle_t> &in_handles) :
-        out_of_band {0}
+        out_of_band {0},
+        remapped {0},
+        borrowed {0}
 {
     set(in_tag, in_data, in_handles);
 }
 
 
+message::message(
+    uint64_t in_tag,
+    util::counted<uintptr_t> in_frames,
+    size_t in_size,
+    const util::counted<j6_handle_t> &in_handles) :
+        out_of_band {0},
+        remapped {0},
+        borrowed {0}
+{
+    set(in_tag, {}, in_handles);
+    kassert(in_frames.count == mem::page_count(in_size), "Wrong frame count for remapped message");
+
+    data_size = in_size;
+    out_of_band = 1;
+    remapped = 1;
+    reinterpret_cast<uintptr_t**>(content)[handle_count] = in_frames.pointer;
+}
+
+
+message::message(
+    uint64_t in_tag,
+    obj::process &sender,
+    const util::buffer &in_data,
+    const util::counted<j6_handle_t> &in_handles) :
+        out_of_band {0},
+        remapped {0},
+        borrowed {0}
+{
+    set(in_tag, {}, in_handles);
+    kassert(handle_count <= max_borrowed_handles, "Too many handles for a borrowed message");
+
+    // Keep the sender's address space around until the data is copied
+    sender.handle_retain();
+
+    data_size = in_data.count;
+    out_of_band = 1;
+    borrowed = 1;
+    void **oob = reinterpret_cast<void**>(content + handle_count * sizeof(j6_handle_t));
+    oob[0] = &sender;
+    oob[1] = in_data.pointer;
+}
+
+
 message::message(message &&other) {
     *this = util::move(other);
 }
@@ -74,11 +125,51 @@ message::handles() const
 {
     return {
         .pointer = reinterpret_cast<const j6_handle_t*>(content),
-        .count = data_size,
+        .count = handle_count,
     };
 }
 
 
+util::counted<uintptr_t>
+message::frames()
+{
+    if (!remapped)
+        return {};
+
+    return {
+        .pointer = reinterpret_cast<uintptr_t**>(content)[handle_count],
+        .count = mem::page_count(data_size),
+    };
+}
+
+
+size_t
+message::copy_data(util::buffer dest) const
+{
+    size_t len = dest.count > data_size ? data_size : dest.count;
+
+    if (borrowed) {
+        void *const *oob = reinterpret_cast<void *const *>(content + handle_count * sizeof(j6_handle_t));
+        obj::process *sender = reinterpret_cast<obj::process*>(oob[0]);
+        return vm_space::copy(sender->space(), obj::process::current().space(),
+                oob[1], dest.pointer, len);
+    }
+
+    if (!remapped) {
+        memcpy(dest.pointer, data().pointer, len);
+        return len;
+    }
+
+    const uintptr_t *list = reinterpret_cast<uintptr_t *const *const>(content)[handle_count];
+    uint8_t *out = reinterpret_cast<uint8_t*>(dest.pointer);
+    for (size_t off = 0; off < len; off += mem::frame_size) {
+        size_t n = len - off > mem::frame_size ? mem::frame_size : len - off;
+        memcpy(out + off, mem::to_virtual<void>(list[off / mem::frame_size]), n);
+    }
+    return len;
+}
+
+
 message &
 message::operator=(message &&other)
 {
@@ -95,7 +186,13 @@ message::operator=(message &&other)
 
     out_of_band = other.out_of_band;
     other.out_of_band = 0;
-    
+
+    remapped = other.remapped;
+    other.remapped = 0;
+
+    borrowed = other.borrowed;
+    other.borrowed = 0;
+
     memcpy(content, other.content, sizeof(content));
     return *this;
 }
@@ -133,9 +230,25 @@ message::set(
 void
 message::clear_oob()
 {
-    if (out_of_band) {
+    if (borrowed) {
+        void **oob = reinterpret_cast<void**>(content + handle_count * sizeof(j6_handle_t));
+        reinterpret_cast<obj::process*>(oob[0])->handle_release();
+        borrowed = 0;
+        out_of_band = 0;
+    } else if (remapped) {
+        // Free any frames that were not moved into a receiver
+        util::counted<uintptr_t> list = frames();
+        frame_allocator &fa = frame_allocator::get();
+        for (uintptr_t frame : list)
+            if (frame) fa.free(frame, 1);
+
+        delete [] list.pointer;
+        remapped = 0;
+        out_of_band = 0;
+    } else if (out_of_band) {
         uint8_t *buf = reinterpret_cast<uint8_t**>(content)[handle_count];
         delete [] buf;
+        out_of_band = 0;
     }
 }
 
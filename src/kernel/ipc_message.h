@@ -3,37 +3,92 @@
 /// Definition of shared message structure
 
 #include <stdint.h>
+#include <arch/memory.h>
 #include <j6/types.h>
 #include <util/counted.h>
 #include <util/pointers.h>
 
+#include "slab_allocated.h"
+
+namespace obj {
+    class process;
+}
+
 namespace ipc {
 
 static constexpr size_t message_size = 64;
 
-struct message
+/// Page-aligned message data at least this large may be moved between
+/// address spaces by remapping its pages, instead of being copied.
+static constexpr size_t remap_threshold = 4 * arch::frame_size;
+
+/// Call data at least this large is left in the caller's address space,
+/// and copied straight into the receiver's buffer when it is received.
+static constexpr size_t borrow_threshold = 1024;
+
+struct message :
+    public slab_allocated<message, arch::frame_size>
 {
     uint64_t tag;
-    uint16_t data_size;
+    uint32_t data_size;
 
     uint16_t handle_count : 4;
     uint16_t out_of_band : 1;
+    uint16_t remapped : 1;
+    uint16_t borrowed : 1;
 
-    uint32_t _reserved;
+    uint16_t _reserved;
 
     uint8_t content[ message_size - 8 ];
 
+    /// Get the message data. Not valid for remapped or borrowed messages,
+    /// use frames() or copy_data() instead.
     util::buffer data();
     util::const_buffer data() const;
 
     util::counted<j6_handle_t> handles();
     util::counted<const j6_handle_t> handles() const;
 
+    /// Get the list of frames holding the data of a remapped message.
+    /// Frames taken out of the list should have their entry set to 0.
+    util::counted<uintptr_t> frames();
+
+    /// Copy the message data into a buffer in the current address space,
+    /// however it is stored.
+    /// \arg dest  The buffer to copy into
+    /// \returns   The number of bytes copied
+    size_t copy_data(util::buffer dest) const;
+
     message();
     message(uint64_t in_tag, const util::buffer &in_data, const util::counted<j6_handle_t> &in_handles);
     message(message &&other);
     ~message();
 
+    /// Constructor for a remapped message, whose data is held in whole
+    /// frames moved out of the sender's address space. The message takes
+    /// ownership of the frames and the list.
+    /// \arg in_tag     The message tag
+    /// \arg in_frames  The frames holding the data, allocated with new[]
+    /// \arg in_size    The size of the data, in bytes
+    /// \arg in_handles The handles to send with the message
+    message(uint64_t in_tag, util::counted<uintptr_t> in_frames, size_t in_size,
+            const util::counted<j6_handle_t> &in_handles);
+
+    /// Constructor for a borrowed message, whose data is left in the
+    /// sender's address space. The sender must stay blocked until the
+    /// message has been delivered, and must not send more handles than
+    /// max_borrowed_handles.
+    /// \arg in_tag     The message tag
+    /// \arg sender     The process sending the message
+    /// \arg in_data    The data, in the sender's address space
+    /// \arg in_handles The handles to send with the message
+    message(uint64_t in_tag, obj::process &sender, const util::buffer &in_data,
+            const util::counted<j6_handle_t> &in_handles);
+
+    /// The most handles a borrowed message can carry
+    static constexpr size_t max_borrowed_handles =
+        (sizeof(content) - sizeof(void*) - sizeof(uintptr_t)) / sizeof(j6_handle_t);
+
     message & operator=(message &&other);
 
     void set(uint64_t in_tag, const util::buffer &in_data, const util::counted<j6_handle_t> &in_handles);
@@ -20,6 +20,7 @@
 #include "smp.h"
 #include "syscall.h"
 #include "sysconf.h"
+#include "zero_pool.h"
 
 extern "C" {
     void kernel_main(bootproto::args *args);
@@ -74,6 +75,9 @@ kernel_main(bootproto::args *args)
     // in debug mode)
     debugcon::init_logger();
 
+    // Start keeping a pool of zeroed frames for anonymous memory
+    zero_pool::init();
+
     // Load the init server
     load_init_server(args->init, args->init_modules);
 
@@ -103,11 +107,12 @@ load_init_server(bootproto::program &program, uintptr_t modules_address)
 
         obj::vm_area *vma = new obj::vm_area_fixed(sect.phys_addr, sect.size, flags);
         space.add(sect.virt_addr, vma, flags);
+        space.map_resident(*vma);
     }
 
     uint64_t iopl = (3ull << 12);
 
     obj::thread *main = p->create_thread();
     main->add_thunk_user(program.entrypoint, modules_address, 0, 0, iopl);
-    main->set_state(obj::thread::state::ready);
+    main->wake();
 }
@@ -2,8 +2,10 @@
 #include <util/format.h>
 #include <util/no_construct.h>
 
+#include "cpu.h"
 #include "kassert.h"
 #include "logger.h"
+#include "objects/thread.h"
 
 // The logger is initialized _before_ global constructors are called,
 // so that we can start log output immediately. Keep its constructor
@@ -16,28 +18,137 @@ namespace log {
 
 namespace {
 
+/// Records are stored in the rings unformatted: the format string pointer
+/// and the raw arguments, with any string arguments copied in after them.
+/// They're only formatted when read.
+struct record
+{
+    uint16_t bytes;
+    uint8_t severity;
+    uint8_t area;
+    uint8_t arg_count;
+    uint8_t _reserved;
+    uint16_t strings;   ///< Bitmask of args that are offsets to strings
+    uint64_t id;
+    const char *format;
+    uint64_t args[0];
+};
+
+/// Fills the end of the ring when a record doesn't fit before wrapping.
+/// Only the first word of a padding record is valid.
+constexpr uint8_t padding_record = 0xff;
+
+constexpr size_t max_record = 256;
+constexpr size_t max_args = 16;
+constexpr unsigned max_gap_spins = 1000;
+
+constexpr size_t
+record_align(size_t n)
+{
+    return (n + 7) & ~7;
+}
+
+/// Find the next conversion in a format string, following the same
+/// rules as util::format.
+/// \arg p          [in/out] The position in the format string
+/// \arg long_type  [out] Whether the conversion is a long type
+/// \returns        The conversion character, or 0 at the end
+char
+next_conversion(const char *&p, bool &long_type)
+{
+    while (*p) {
+        if (*p++ != '%')
+            continue;
+
+        if (*p == '%') {
+            ++p;
+            continue;
+        }
+
+        long_type = false;
+        while (char c = *p) {
+            ++p;
+            switch (c) {
+                case 'l': long_type = true; break;
+                case 'x': case 'd': case 'u': case 's': return c;
+                default: break;
+            }
+        }
+    }
+    return 0;
+}
+
+/// Pack a log message's arguments into a record
+/// \returns  The size of the record, in bytes
+size_t
+pack_record(record *rec, const char *fmt, va_list va)
+{
+    bool long_type = false;
+
+    size_t count = 0;
+    for (const char *p = fmt; count < max_args && next_conversion(p, long_type);)
+        ++count;
+
+    uint8_t *base = reinterpret_cast<uint8_t*>(rec);
+    size_t used = sizeof(record) + count * sizeof(uint64_t);
+
+    rec->format = fmt;
+    rec->arg_count = count;
+    rec->strings = 0;
+
+    const char *p = fmt;
+    for (size_t i = 0; i < count; ++i) {
+        switch (next_conversion(p, long_type)) {
+        case 's': {
+            const char *str = va_arg(va, const char *);
+            rec->args[i] = 0;
+            if (!str || used >= max_record)
+                break;
+
+            // Strings may not outlive the call, so copy them
+            rec->args[i] = used;
+            rec->strings |= 1 << i;
+            while (*str && used < max_record - 1)
+                base[used++] = *str++;
+            base[used++] = 0;
+            break;
+        }
+
+        default:
+            rec->args[i] = long_type ?
+                va_arg(va, uint64_t) : va_arg(va, uint32_t);
+            break;
+        }
+    }
+
+    return record_align(used);
+}
+
 } // anon namespace
 
 logger *logger::s_log = nullptr;
 
 logger::logger() :
-    m_buffer {nullptr, 0},
-    m_start {0},
-    m_end {0},
-    m_count {0}
+    m_rings {},
+    m_ring_size {0},
+    m_count {0},
+    m_readers_waiting {false}
 {
     memset(&m_levels, 0, sizeof(m_levels));
     s_log = this;
 }
 
 logger::logger(util::buffer data) :
-    m_buffer {data},
-    m_start {0},
-    m_end {0},
-    m_count {0}
+    m_rings {},
+    m_ring_size {log_pages * arch::frame_size},
+    m_count {0},
+    m_readers_waiting {false}
 {
-    kassert((data.count & (data.count - 1)) == 0,
-        "log buffer size must be a power of two");
+    kassert(data.count >= m_ring_size * log_cpus,
+        "log buffer is too small for all CPUs");
+
+    for (unsigned i = 0; i < log_cpus; ++i)
+        m_rings[i].data = util::at<uint8_t>(data, i * m_ring_size);
 
     memset(&m_levels, 0, sizeof(m_levels));
     s_log = this;
@@ -51,57 +162,226 @@ logger::logger(util::buffer data) :
 void
 logger::output(level severity, logs area, const char *fmt, va_list args)
 {
-    static constexpr size_t buffer_len = 256;
-    static constexpr size_t message_len = buffer_len - sizeof(j6_log_entry);
+    if (!m_ring_size)
+        return;
+
+    unsigned index = current_cpu().index;
+    if (index >= log_cpus)
+        return;
+
+    // Only this CPU writes to its ring, so no lock is needed. A log from
+    // inside a log on the same CPU would corrupt the ring, so drop it.
+    ring &r = m_rings[index];
+    if (r.busy)
+        return;
+    __atomic_store_n(&r.busy, true, __ATOMIC_SEQ_CST);
+
+    alignas(uint64_t) uint8_t buffer[max_record];
+    record *rec = reinterpret_cast<record*>(buffer);
+
+    size_t size = pack_record(rec, fmt, args);
+    rec->bytes = size;
+    rec->severity = static_cast<uint8_t>(severity);
+    rec->area = static_cast<uint8_t>(area);
+    rec->id = __atomic_add_fetch(&m_count, 1, __ATOMIC_SEQ_CST);
+
+    write(r, rec, size);
+    __atomic_store_n(&r.busy, false, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&m_readers_waiting, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&m_readers_waiting, false, __ATOMIC_SEQ_CST)) {
+        util::scoped_lock lock {m_wait_lock};
+        m_waiting.clear();
+    }
+}
 
-    char buffer[buffer_len];
-    j6_log_entry *header = reinterpret_cast<j6_log_entry *>(buffer);
+void
+logger::write(ring &r, const void *rec, size_t size)
+{
+    size_t head = r.head;
+    size_t pad = 0;
+    if (offset(head) + size > m_ring_size)
+        pad = m_ring_size - offset(head);
+
+    // Remove old entries until there's enough space. Readers check the
+    // tail after reading, so move it before overwriting anything.
+    size_t tail = r.tail;
+    while (m_ring_size - (head - tail) < pad + size) {
+        const record *old = reinterpret_cast<const record*>(r.data + offset(tail));
+        tail += old->bytes;
+    }
+    __atomic_store_n(&r.tail, tail, __ATOMIC_SEQ_CST);
 
-    size_t size = sizeof(j6_log_entry);
-    size += util::vformat({header->message, message_len}, fmt, args);
+    if (pad) {
+        record *p = reinterpret_cast<record*>(r.data + offset(head));
+        p->bytes = pad;
+        p->arg_count = padding_record;
+        head += pad;
+    }
 
-    util::scoped_lock lock {m_lock};
+    memcpy(r.data + offset(head), rec, size);
+    __atomic_store_n(&r.head, head + size, __ATOMIC_SEQ_CST);
+}
 
-    while (free() < size) {
-        // Remove old entries until there's enough space
-        const j6_log_entry *first = util::at<const j6_log_entry>(m_buffer, start());
-        m_start += first->bytes;
+bool
+logger::read_next(ring &r, uint64_t seen, void *out)
+{
+    record *rec = reinterpret_cast<record*>(out);
+
+    while (true) {
+        size_t tail = __atomic_load_n(&r.tail, __ATOMIC_ACQUIRE);
+        size_t head = __atomic_load_n(&r.head, __ATOMIC_ACQUIRE);
+        if (tail == head)
+            return false;
+
+        size_t pos = tail;
+
+        // Start from the hint if it's still in the ring and not past
+        // what we're looking for. Records before it are all older.
+        size_t hint = __atomic_load_n(&r.hint_pos, __ATOMIC_RELAXED);
+        if (hint > tail && hint < head) {
+            const record *h = reinterpret_cast<const record*>(r.data + offset(hint));
+            bool usable = h->arg_count != padding_record && h->id <= seen;
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&r.tail, __ATOMIC_ACQUIRE) > hint)
+                continue;
+
+            if (usable)
+                pos = hint;
+        }
+
+        bool overwritten = false;
+        while (pos < head) {
+            const record *at = reinterpret_cast<const record*>(r.data + offset(pos));
+            size_t bytes = at->bytes;
+            bool padding = at->arg_count == padding_record;
+            uint64_t id = padding ? 0 : at->id;
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&r.tail, __ATOMIC_ACQUIRE) > pos ||
+                bytes < sizeof(uint64_t) || bytes > max_record) {
+                overwritten = true;
+                break;
+            }
+
+            if (padding || id <= seen) {
+                pos += bytes;
+                continue;
+            }
+
+            memcpy(rec, at, bytes);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&r.tail, __ATOMIC_ACQUIRE) > pos) {
+                overwritten = true;
+                break;
+            }
+
+            __atomic_store_n(&r.hint_pos, pos, __ATOMIC_RELAXED);
+            return true;
+        }
+
+        if (!overwritten)
+            return false;
     }
+}
 
-    header->id = ++m_count;
-    header->bytes = size;
-    header->severity = static_cast<uint8_t>(severity);
-    header->area = static_cast<uint8_t>(area);
+void
+logger::wait_for(uint64_t seen)
+{
+    util::scoped_lock lock {m_wait_lock};
 
-    memcpy(util::at<void>(m_buffer, end()), buffer, size);
-    m_end += size;
+    // Writers check this after adding an entry, so either they see it
+    // and wake us, or we see their entry here
+    __atomic_store_n(&m_readers_waiting, true, __ATOMIC_SEQ_CST);
+    if (has_entry(seen))
+        return;
 
-    m_waiting.clear();
+    obj::thread &current = obj::thread::current();
+    m_waiting.add_thread(&current);
+    current.block(lock);
 }
 
 size_t
 logger::get_entry(uint64_t seen, void *buffer, size_t size)
 {
-    util::scoped_lock lock {m_lock};
+    static constexpr size_t buffer_len = 256;
+    static constexpr size_t message_len = buffer_len - sizeof(j6_log_entry);
 
-    while (seen == m_count) {
-        lock.release();
-        m_waiting.wait();
-        lock.reacquire();
+    alignas(uint64_t) uint8_t next[max_record];
+    alignas(uint64_t) uint8_t candidate[max_record];
+    record *rec = reinterpret_cast<record*>(next);
+    record *cand = reinterpret_cast<record*>(candidate);
+
+    unsigned spins = 0;
+    bool rescanned = false;
+    while (true) {
+        uint64_t next_id = 0;
+        for (ring &r : m_rings) {
+            if (!r.data || !read_next(r, seen, candidate))
+                continue;
+
+            if (!next_id || cand->id < next_id) {
+                next_id = cand->id;
+                memcpy(next, candidate, cand->bytes);
+            }
+        }
+
+        if (next_id && next_id != seen + 1) {
+            // An older entry may still be being written on another CPU
+            bool busy = false;
+            for (ring &r : m_rings)
+                busy = busy || __atomic_load_n(&r.busy, __ATOMIC_SEQ_CST);
+
+            // Don't wait forever, the gap may be from an entry that was
+            // overwritten while other CPUs are busy logging
+            if (busy && ++spins < max_gap_spins) {
+                rescanned = false;
+                asm volatile ("pause");
+                continue;
+            }
+
+            // A writer may have committed the missing entry after the scan
+            // above and cleared its busy flag before we checked it, so scan
+            // once more with nothing busy before skipping the gap
+            if (!busy && !rescanned) {
+                rescanned = true;
+                continue;
+            }
+        }
+
+        if (next_id)
+            break;
+
+        if (has_entry(seen))
+            asm volatile ("pause");
+        else
+            wait_for(seen);
     }
 
-    size_t off = m_start;
-    j6_log_entry *ent = util::at<j6_log_entry>(m_buffer, offset(off));
-    while (seen >= ent->id) {
-        off += ent->bytes;
-        kassert(off < m_end, "Got to the end while looking for new log entry");
-        ent = util::at<j6_log_entry>(m_buffer, offset(off));
+    uint64_t args[max_args];
+    for (size_t i = 0; i < rec->arg_count; ++i) {
+        if (rec->strings & (1 << i))
+            args[i] = reinterpret_cast<uint64_t>(next + rec->args[i]);
+        else
+            args[i] = rec->args[i];
     }
 
-    if (size >= ent->bytes)
-        memcpy(buffer, ent, ent->bytes);
+    char out[buffer_len];
+    j6_log_entry *header = reinterpret_cast<j6_log_entry *>(out);
+
+    size_t bytes = sizeof(j6_log_entry);
+    bytes += util::pformat({header->message, message_len}, rec->format, {args, rec->arg_count});
+
+    header->id = rec->id;
+    header->bytes = bytes;
+    header->severity = rec->severity;
+    header->area = rec->area;
+
+    if (size >= bytes)
+        memcpy(buffer, out, bytes);
 
-    return ent->bytes;
+    return bytes;
 }
 
 #define LOG_LEVEL_FUNCTION(name) \
@@ -20,9 +20,13 @@ enum class logs : uint8_t {
 
 namespace log {
 
-/// Size of the log ring buffer. Must be a power of two.
+/// Size of each CPU's log ring buffer. Must be a power of two.
 inline constexpr unsigned log_pages = 16;
 
+/// Number of CPUs that get their own log ring buffer. Logs from CPUs
+/// beyond this are dropped.
+inline constexpr unsigned log_cpus = 64;
+
 enum class level : uint8_t {
     silent, fatal, error, warn, info, verbose, spam, max
 };
@@ -36,7 +40,8 @@ public:
     /// Default constructor. Creates a logger without a backing store.
     logger();
 
-    /// Constructor. Logs are written to the given buffer.
+    /// Constructor. Logs are written to the given buffer, which is split
+    /// into one ring buffer of `log_pages` pages for each CPU.
     /// \arg buffer  Buffer to which logs are written
     logger(util::buffer buffer);
 
@@ -59,7 +64,8 @@ public:
     }
 
     /// Get the next log entry from the buffer. Blocks the current thread until
-    /// a log arrives if there are no entries newer than `seen`.
+    /// a log arrives if there are no entries newer than `seen`. Entries are
+    /// formatted here, when they are read, not when they are logged.
     /// \arg seen    The id of the last-seen log entry, or 0 for none
     /// \arg buffer  The buffer to copy the log message into
     /// \arg size    Size of the passed-in buffer, in bytes
@@ -69,7 +75,9 @@ public:
 
     /// Check whether or not there's a new log entry to get
     /// \arg seen  The id of the last-seen log entry, or 0 for none
-    inline bool has_entry(uint64_t seen) { return seen < m_count; }
+    inline bool has_entry(uint64_t seen) {
+        return seen < __atomic_load_n(&m_count, __ATOMIC_SEQ_CST);
+    }
 
 private:
     friend void spam   (logs area, const char *fmt, ...);
@@ -90,20 +98,44 @@ private:
         return m_levels[static_cast<unsigned>(area)];
     }
 
-    inline size_t offset(size_t i) const { return i & (m_buffer.count - 1); }
+    /// One CPU's log ring. Only the owning CPU writes records, other CPUs
+    /// read them without locking, and check `tail` afterwards to see if
+    /// what they read was overwritten in the meantime.
+    struct ring
+    {
+        uint8_t *data;
+        size_t head;    ///< Where the next record will be written
+        size_t tail;    ///< The oldest record not yet overwritten
+        bool busy;      ///< Set while the owning CPU is writing a record
+
+        /// Position of a recently read record, so readers that are
+        /// keeping up don't scan from the tail every time
+        size_t hint_pos;
+    };
+
+    inline size_t offset(size_t i) const { return i & (m_ring_size - 1); }
+
+    /// Write a packed record into the current CPU's ring
+    void write(ring &r, const void *record, size_t size);
+
+    /// Copy the first record in a ring newer than `seen`
+    /// \returns  True if such a record was found
+    bool read_next(ring &r, uint64_t seen, void *record);
 
-    inline size_t start() const { return offset(m_start); }
-    inline size_t   end() const { return offset(m_end); }
-    inline size_t  free() const { return m_buffer.count - (m_end - m_start); }
+    /// Block until there may be an entry newer than `seen`
+    void wait_for(uint64_t seen);
 
     level m_levels[areas_count];
 
-    util::buffer m_buffer;
-    size_t m_start, m_end;
+    ring m_rings[log_cpus];
+    size_t m_ring_size;
     uint64_t m_count;
 
+    /// Set by readers before blocking, so writers only need to wake them
+    /// once for a whole batch of new entries
+    bool m_readers_waiting;
     wait_queue m_waiting;
-    util::spinlock m_lock;
+    util::spinlock m_wait_lock;
 
     static logger *s_log;
 };
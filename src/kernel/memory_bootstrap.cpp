@@ -38,8 +38,8 @@ frame_allocator &g_frame_allocator = __g_frame_allocator_storage.value;
 static util::no_construct<obj::vm_area_untracked> __g_kernel_heap_area_storage;
 obj::vm_area_untracked &g_kernel_heap_area = __g_kernel_heap_area_storage.value;
 
-static util::no_construct<obj::vm_area_ring> __g_kernel_log_area_storage;
-obj::vm_area_ring &g_kernel_log_area = __g_kernel_log_area_storage.value;
+static util::no_construct<obj::vm_area_untracked> __g_kernel_log_area_storage;
+obj::vm_area_untracked &g_kernel_log_area = __g_kernel_log_area_storage.value;
 
 static util::no_construct<obj::vm_area_untracked> __g_kernel_heapmap_area_storage;
 obj::vm_area_untracked &g_kernel_heapmap_area = __g_kernel_heapmap_area_storage.value;
@@ -108,10 +108,11 @@ memory_initialize_pre_ctors(bootproto::args &kargs)
 
     new (&g_kernel_heap) heap_allocator {mem::heap_offset, mem::heap_size, mem::heapmap_offset};
 
-    // Set up the log area and logger
-    size_t log_buffer_size = log::log_pages * arch::frame_size;
+    // Set up the log area and logger, with a ring for each CPU. Pages
+    // are only allocated as the rings are used.
+    size_t log_buffer_size = log::log_cpus * log::log_pages * arch::frame_size;
     obj::vm_area *logs = new (&g_kernel_log_area)
-        obj::vm_area_ring(log_buffer_size, vm_flag_write);
+        obj::vm_area_untracked(log_buffer_size, vm_flag_write);
     vm.add(mem::logs_offset, logs, vm_flag_exact);
 
     new (&g_logger) log::logger(
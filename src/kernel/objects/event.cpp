@@ -15,6 +15,7 @@ event::signal(uint64_t s)
 {
     uint64_t after = __atomic_or_fetch(&m_signals, s, __ATOMIC_SEQ_CST);
     if (after) wake_observer();
+    m_observers.notify(s);
 }
 
 uint64_t
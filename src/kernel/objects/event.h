@@ -6,6 +6,7 @@
 #include <j6/cap_flags.h>
 
 #include "objects/kobject.h"
+#include "objects/port.h"
 #include "wait_queue.h"
 
 namespace obj {
@@ -31,6 +32,13 @@ public:
     /// \returns  The events which have been signalled, as a bitset
     uint64_t wait();
 
+    virtual port_observers * observers() override { return &m_observers; }
+
+    /// Get the signalled events that haven't yet been consumed by wait()
+    virtual j6_signal_t signals() const override {
+        return __atomic_load_n(&m_signals, __ATOMIC_SEQ_CST);
+    }
+
 private:
     /// Read and consume the current signaled events
     inline uint64_t read() {
@@ -42,6 +50,7 @@ private:
 
     uint64_t m_signals;
     wait_queue m_queue;
+    port_observers m_observers;
 };
 
 } // namespace obj
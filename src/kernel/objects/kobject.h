@@ -7,6 +7,7 @@
 
 namespace obj {
 
+class port_observers;
 class thread;
 
 /// Base type for all user-interactable kernel objects
@@ -51,12 +52,23 @@ public:
     /// Get this object's type-relative object id
     inline uint32_t obj_id() const { return m_obj_id; }
 
-    /// Increment the handle refcount
-    inline void handle_retain() { ++m_handle_count; }
+    /// Get the ports watching this object
+    /// \returns  The observer set, or null if this type can't be watched
+    virtual port_observers * observers() { return nullptr; }
+
+    /// Get the signals currently asserted on this object
+    virtual j6_signal_t signals() const { return 0; }
+
+    /// Increment the handle refcount. Atomic, since some objects (like
+    /// VMAs found by vm_space::get) are retained without a lock.
+    inline void handle_retain() {
+        __atomic_add_fetch(&m_handle_count, 1, __ATOMIC_ACQ_REL);
+    }
 
     /// Decrement the handle refcount
     inline void handle_release() {
-        if (--m_handle_count == 0) on_no_handles();
+        if (__atomic_sub_fetch(&m_handle_count, 1, __ATOMIC_ACQ_REL) == 0)
+            on_no_handles();
     }
 
 protected:
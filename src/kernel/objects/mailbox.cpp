@@ -31,6 +31,7 @@ mailbox::close()
 
     m_callers.clear(j6_status_closed);
     m_responders.clear(j6_status_closed);
+    m_observers.notify(j6_signal_mailbox_closed);
 
     util::scoped_lock lock {m_reply_lock};
     for (auto &waiting : m_reply_map)
@@ -48,23 +49,39 @@ mailbox::call()
 
     thread *responder = m_responders.pop_next();
     if (responder) {
-        log::spam(logs::ipc, "thread[%2x]:: mbx[%2x] call() waking thread[%2x]...",
+        log::spam(logs::ipc, "thread[%2x]:: mbx[%2x] call() handing off to thread[%2x]...",
             current.obj_id(), obj_id(), responder->obj_id());
-        responder->wake(j6_status_ok);
-    } else {
-        log::spam(logs::ipc, "thread[%2x]:: mbx[%2x] call() found no responder yet.",
-            current.obj_id(), obj_id());
+        return current.handoff(*responder, j6_status_ok);
     }
 
+    log::spam(logs::ipc, "thread[%2x]:: mbx[%2x] call() found no responder yet.",
+        current.obj_id(), obj_id());
+
+    m_observers.notify(j6_signal_mailbox_readable);
     return current.block();
 }
 
+j6_signal_t
+mailbox::signals() const
+{
+    j6_signal_t s = 0;
+    if (!m_callers.empty()) s |= j6_signal_mailbox_readable;
+    if (closed()) s |= j6_signal_mailbox_closed;
+    return s;
+}
+
 j6_status_t
 mailbox::receive(ipc::message_ptr &data, reply_tag_t &reply_tag, bool block)
 {
     if (closed())
         return j6_status_closed;
 
+    return receive(data, reply_tag, block, nullptr);
+}
+
+j6_status_t
+mailbox::receive(ipc::message_ptr &data, reply_tag_t &reply_tag, bool block, thread *wake)
+{
     thread &current = thread::current();
     thread *caller = nullptr;
 
@@ -73,18 +90,27 @@ mailbox::receive(ipc::message_ptr &data, reply_tag_t &reply_tag, bool block)
         if (caller)
             break;
 
-        if (!block)
+        if (!block) {
+            if (wake) wake->wake(j6_status_ok);
             return j6_status_would_block;
+        }
 
         log::spam(logs::ipc, "thread[%2x]:: mbx[%2x] receive() blocking waiting for a caller",
             current.obj_id(), obj_id());
 
         m_responders.add_thread(&current);
-        j6_status_t s = current.block();
+
+        j6_status_t s = wake ?
+            current.handoff(*wake, j6_status_ok) :
+            current.block();
+        wake = nullptr;
+
         if (s != j6_status_ok)
             return s;
     }
 
+    if (wake) wake->wake(j6_status_ok);
+
     util::scoped_lock lock {m_reply_lock};
     reply_tag = ++m_next_reply_tag;
     m_reply_map.insert({ reply_tag, caller });
@@ -97,28 +123,51 @@ mailbox::receive(ipc::message_ptr &data, reply_tag_t &reply_tag, bool block)
     return j6_status_ok;
 }
 
-j6_status_t
-mailbox::reply(reply_tag_t reply_tag, ipc::message_ptr data)
+thread *
+mailbox::take_caller(reply_tag_t reply_tag)
 {
-    if (closed())
-        return j6_status_closed;
-
     util::scoped_lock lock {m_reply_lock};
     reply_to *rt = m_reply_map.find(reply_tag);
     if (!rt)
-        return j6_err_invalid_arg;
+        return nullptr;
 
     thread *caller = rt->thread;
     m_reply_map.erase(reply_tag);
     lock.release();
 
-    thread &current = thread::current();
     log::spam(logs::ipc, "thread[%2x]:: mbx[%2x] reply() to caller thread[%2x], rt = %x",
-        current.obj_id(), obj_id(), caller->obj_id(), reply_tag);
+        thread::current().obj_id(), obj_id(), caller->obj_id(), reply_tag);
+
+    return caller;
+}
+
+j6_status_t
+mailbox::reply(reply_tag_t reply_tag, ipc::message_ptr data)
+{
+    if (closed())
+        return j6_status_closed;
+
+    thread *caller = take_caller(reply_tag);
+    if (!caller)
+        return j6_err_invalid_arg;
 
     caller->set_message_data(util::move(data));
     caller->wake(j6_status_ok);
     return j6_status_ok;
 }
 
+j6_status_t
+mailbox::reply_receive(ipc::message_ptr &data, reply_tag_t &reply_tag, bool block)
+{
+    if (closed())
+        return j6_status_closed;
+
+    thread *caller = take_caller(reply_tag);
+    if (!caller)
+        return j6_err_invalid_arg;
+
+    caller->set_message_data(util::move(data));
+    return receive(data, reply_tag, block, caller);
+}
+
 } // namespace obj
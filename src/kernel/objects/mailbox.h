@@ -11,6 +11,7 @@
 #include "ipc_message.h"
 #include "memory.h"
 #include "objects/kobject.h"
+#include "objects/port.h"
 #include "wait_queue.h"
 
 namespace obj {
@@ -60,9 +61,33 @@ public:
     /// \returns        j6_status_ok if the reply was successfully sent
     j6_status_t reply(reply_tag_t reply_tag, ipc::message_ptr data);
 
+    /// Reply to a pending message, then receive the next available message. If no
+    /// message is waiting and this call blocks, the current thread switches directly
+    /// to the caller being replied to.
+    /// \arg data         [in] the reply message, [out] the received message
+    /// \arg reply_tag    [in] the reply_tag of the message being replied to,
+    ///                   [out] the reply_tag to use when replying to the new message
+    /// \arg block        True if this call should block when no messages are available.
+    /// \returns          j6_status_ok if the reply was sent and a message was received
+    j6_status_t reply_receive(ipc::message_ptr &data, reply_tag_t &reply_tag, bool block);
+
+    virtual port_observers * observers() override { return &m_observers; }
+
+    /// Get j6_signal_mailbox_readable if a caller is waiting to be received,
+    /// and j6_signal_mailbox_closed if the mailbox is closed
+    virtual j6_signal_t signals() const override;
+
 private:
+    /// Find and remove the caller waiting on a reply tag
+    thread * take_caller(reply_tag_t reply_tag);
+
+    /// Receive the next message, as receive(). If `wake` is non-null, that thread is
+    /// woken first, by handing off to it directly if this call must block.
+    j6_status_t receive(ipc::message_ptr &data, reply_tag_t &reply_tag, bool block, thread *wake);
+
     wait_queue m_callers;
     wait_queue m_responders;
+    port_observers m_observers;
 
     struct reply_to { reply_tag_t reply_tag; thread *thread; };
     using reply_map =
@@ -0,0 +1,169 @@
+#include "clock.h"
+#include "objects/port.h"
+#include "objects/thread.h"
+
+namespace obj {
+
+void
+port_observers::notify(j6_signal_t signals)
+{
+    util::scoped_lock lock {m_lock};
+    for (port_binding *b : m_bindings) {
+        j6_signal_t s = signals & b->mask;
+        if (s) b->owner->queue(b, s);
+    }
+}
+
+void
+port_observers::add(port_binding *b)
+{
+    util::scoped_lock lock {m_lock};
+    m_bindings.append(b);
+}
+
+void
+port_observers::remove(port_binding *b)
+{
+    util::scoped_lock lock {m_lock};
+    m_bindings.remove_swap(b);
+}
+
+
+port::port() :
+    kobject {kobject::type::port}
+{
+}
+
+port::~port()
+{
+    for (key_binding &kb : m_bindings)
+        release(kb.binding);
+}
+
+void
+port::release(port_binding *b)
+{
+    // Once it's gone from the observers, nothing else can queue it
+    b->target->observers()->remove(b);
+
+    {
+        util::scoped_lock lock {m_lock};
+        if (b->pending)
+            m_ready.remove(b);
+    }
+
+    b->target->handle_release();
+    delete b;
+}
+
+j6_status_t
+port::bind(kobject *target, uint64_t key, j6_signal_t signals)
+{
+    port_observers *observers = target->observers();
+    if (!observers || !key)
+        return j6_err_invalid_arg;
+
+    // Register with the target before the binding can be found by key,
+    // so that unbind() never sees a half-made binding
+    port_binding *b = new port_binding {this, target, key, signals, 0};
+    target->handle_retain();
+    observers->add(b);
+
+    j6_signal_t asserted = target->signals() & signals;
+    if (asserted)
+        queue(b, asserted);
+
+    util::scoped_lock lock {m_lock};
+    j6_status_t status =
+        m_bindings.find(key) ? j6_err_collision :
+        m_bindings.count() >= max_bindings ? j6_err_insufficient :
+        j6_status_ok;
+
+    if (status != j6_status_ok) {
+        lock.release();
+        release(b);
+        return status;
+    }
+
+    m_bindings.insert({key, b});
+    return j6_status_ok;
+}
+
+j6_status_t
+port::unbind(uint64_t key)
+{
+    util::scoped_lock lock {m_lock};
+    key_binding *kb = m_bindings.find(key);
+    if (!kb)
+        return j6_err_invalid_arg;
+
+    port_binding *b = kb->binding;
+    m_bindings.erase(key);
+    lock.release();
+
+    release(b);
+    return j6_status_ok;
+}
+
+void
+port::queue(port_binding *b, j6_signal_t signals)
+{
+    util::scoped_lock lock {m_lock};
+    bool queued = b->pending;
+    b->pending |= signals;
+    if (queued)
+        return;
+
+    m_ready.append(b);
+    thread *waiter = m_waiters.pop_next();
+    lock.release();
+
+    if (waiter)
+        waiter->wake();
+}
+
+size_t
+port::take(j6_port_packet *packets, size_t count)
+{
+    size_t n = m_ready.count();
+    if (n > count) n = count;
+
+    for (size_t i = 0; i < n; ++i) {
+        port_binding *b = m_ready[i];
+        packets[i] = {b->key, b->pending};
+        b->pending = 0;
+    }
+
+    m_ready.remove_at(0, n);
+    return n;
+}
+
+size_t
+port::read(j6_port_packet *packets, size_t count)
+{
+    util::scoped_lock lock {m_lock};
+    return take(packets, count);
+}
+
+size_t
+port::wait(j6_port_packet *packets, size_t count, uint64_t deadline)
+{
+    thread &current = thread::current();
+
+    while (true) {
+        util::scoped_lock lock {m_lock};
+        size_t n = take(packets, count);
+        if (n)
+            return n;
+
+        if (deadline && clock::get().value() >= deadline)
+            return 0;
+
+        // Waking clears the timeout, so set it again each time
+        current.set_wake_timeout(deadline);
+        m_waiters.add_thread(&current);
+        current.block(lock);
+    }
+}
+
+} // namespace obj
@@ -0,0 +1,125 @@
+#pragma once
+/// \file port.h
+/// Definition of port kobject types
+
+#include <j6/cap_flags.h>
+#include <j6/types.h>
+#include <util/linked_list.h>
+#include <util/node_map.h>
+#include <util/spinlock.h>
+#include <util/vector.h>
+
+#include "heap_allocator.h"
+#include "objects/kobject.h"
+#include "wait_queue.h"
+
+namespace obj {
+
+class port;
+
+/// One port's interest in the signals of one object
+struct port_binding
+{
+    port *owner;
+    kobject *target;
+    uint64_t key;
+    j6_signal_t mask;
+
+    /// Signals asserted since the binding's last packet was read.
+    /// Nonzero exactly while the binding is on its port's ready list.
+    /// Only changed while holding the port's lock.
+    j6_signal_t pending;
+};
+
+/// The set of ports watching an object. Objects that can be waited on
+/// keep one of these, and notify it when their signals are asserted.
+class port_observers
+{
+public:
+    /// Queue a packet on every port watching for any of the given signals
+    /// \arg signals  The signals that were just asserted
+    void notify(j6_signal_t signals);
+
+    /// Start notifying a binding's port
+    void add(port_binding *b);
+
+    /// Stop notifying a binding's port. Once this returns, no notify()
+    /// call will touch the binding again.
+    void remove(port_binding *b);
+
+private:
+    util::spinlock m_lock;
+    util::vector<port_binding*> m_bindings;
+};
+
+/// Ports collect readiness packets from the objects bound to them, so
+/// that one thread can wait on many objects at once
+class port :
+    public kobject
+{
+public:
+    /// Capabilities on a newly constructed port handle
+    static constexpr j6_cap_t creation_caps = j6_cap_port_all;
+    static constexpr kobject::type type = kobject::type::port;
+
+    /// Most objects one port may be bound to at once. Keeps the binding
+    /// map at 2 MiB, well under the heap's largest block.
+    static constexpr size_t max_bindings = 64 * 1024;
+
+    port();
+    virtual ~port();
+
+    /// Start watching an object. If any of the signals are already
+    /// asserted, a packet is queued immediately.
+    /// \arg target   The object to watch, which must have observers
+    /// \arg key      Nonzero key to identify packets for this object
+    /// \arg signals  The signals to watch for
+    /// \returns      j6_err_collision if the key is already bound, or
+    ///               j6_err_insufficient if the port has max_bindings
+    j6_status_t bind(kobject *target, uint64_t key, j6_signal_t signals);
+
+    /// Stop watching an object, discarding any packet queued for it
+    /// \arg key  The key the object was bound with
+    /// \returns  j6_err_invalid_arg if the key is not bound
+    j6_status_t unbind(uint64_t key);
+
+    /// Take queued packets without blocking
+    /// \arg packets  [out] Array to fill with packets
+    /// \arg count    Number of packets `packets` has room for
+    /// \returns      The number of packets read
+    size_t read(j6_port_packet *packets, size_t count);
+
+    /// Take queued packets, blocking until there is at least one
+    /// \arg packets   [out] Array to fill with packets
+    /// \arg count     Number of packets `packets` has room for
+    /// \arg deadline  Clock value to give up at, or 0 to wait forever
+    /// \returns       The number of packets read, or 0 on timeout
+    size_t wait(j6_port_packet *packets, size_t count, uint64_t deadline);
+
+    /// Queue signals for a binding, waking a waiter if it wasn't
+    /// already queued. Called by the bound object's observers.
+    void queue(port_binding *b, j6_signal_t signals);
+
+private:
+    /// Take queued packets. Caller must hold m_lock.
+    size_t take(j6_port_packet *packets, size_t count);
+
+    /// Unregister a binding from its target, drop any packet queued for
+    /// it, and free it. Caller must not hold m_lock.
+    void release(port_binding *b);
+
+    struct key_binding { uint64_t key; port_binding *binding; };
+    using binding_map =
+        util::node_map<uint64_t, key_binding, 0, heap_allocated>;
+
+    util::spinlock m_lock;
+    binding_map m_bindings;
+    util::vector<port_binding*> m_ready;
+    wait_queue m_waiters;
+
+    friend uint64_t & get_map_key(key_binding &kb);
+};
+
+inline uint64_t & get_map_key(port::key_binding &kb) { return kb.key; }
+
+} // namespace obj
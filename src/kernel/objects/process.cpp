@@ -21,6 +21,9 @@ namespace obj {
 
 process::process(const char *name) :
     kobject {kobject::type::process},
+    m_handles {nullptr},
+    m_handles_size {0},
+    m_handle_count {0},
     m_state {state::running}
 {
     if constexpr(__use_process_names) {
@@ -37,6 +40,9 @@ process::process(const char *name) :
 process::process(page_table *kpml4) :
     kobject {kobject::type::process},
     m_space {kpml4},
+    m_handles {nullptr},
+    m_handles_size {0},
+    m_handle_count {0},
     m_state {state::running}
 {
     if constexpr(__use_process_names) {
@@ -48,6 +54,17 @@ process::process(page_table *kpml4) :
 
 process::~process()
 {
+    for (size_t i = 0; i < m_handles_size; ++i) {
+        handle_table *table = m_handles[i];
+        if (!table) continue;
+        for (handle_leaf *leaf : table->leaves)
+            delete leaf;
+        delete table;
+    }
+
+    delete [] m_handles;
+    for (handle_table **old : m_old_handles)
+        delete [] old;
 }
 
 process & process::current() { return *current_cpu().process; }
@@ -129,6 +146,72 @@ process::thread_exited(thread *th)
     th->handle_release();
 }
 
+j6_handle_t *
+process::find_handle(size_t index)
+{
+    size_t dir_index = index >> (handle_leaf_bits + handle_table_bits);
+    size_t size = __atomic_load_n(&m_handles_size, __ATOMIC_ACQUIRE);
+    if (dir_index >= size)
+        return nullptr;
+
+    handle_table **dir = __atomic_load_n(&m_handles, __ATOMIC_ACQUIRE);
+    handle_table *table = __atomic_load_n(&dir[dir_index], __ATOMIC_ACQUIRE);
+    if (!table)
+        return nullptr;
+
+    size_t table_index = (index >> handle_leaf_bits) & ((1 << handle_table_bits) - 1);
+    handle_leaf *leaf = __atomic_load_n(&table->leaves[table_index], __ATOMIC_ACQUIRE);
+    if (!leaf)
+        return nullptr;
+
+    return &leaf->handles[index & ((1 << handle_leaf_bits) - 1)];
+}
+
+j6_handle_t &
+process::add_handle_entry(size_t index)
+{
+    size_t dir_index = index >> (handle_leaf_bits + handle_table_bits);
+    if (dir_index >= m_handles_size) {
+        size_t size = m_handles_size ? m_handles_size : 4;
+        while (size <= dir_index)
+            size *= 2;
+
+        handle_table **dir = new handle_table* [size];
+        for (size_t i = 0; i < m_handles_size; ++i)
+            dir[i] = m_handles[i];
+        for (size_t i = m_handles_size; i < size; ++i)
+            dir[i] = nullptr;
+
+        // Readers may still be using the old directory
+        if (m_handles)
+            m_old_handles.append(m_handles);
+
+        // Publish the directory before the size, so a reader that sees
+        // the new size also sees the new directory
+        __atomic_store_n(&m_handles, dir, __ATOMIC_RELEASE);
+        __atomic_store_n(&m_handles_size, size, __ATOMIC_RELEASE);
+    }
+
+    handle_table *table = m_handles[dir_index];
+    if (!table) {
+        table = new handle_table;
+        for (handle_leaf *&leaf : table->leaves)
+            leaf = nullptr;
+        __atomic_store_n(&m_handles[dir_index], table, __ATOMIC_RELEASE);
+    }
+
+    size_t table_index = (index >> handle_leaf_bits) & ((1 << handle_table_bits) - 1);
+    handle_leaf *leaf = table->leaves[table_index];
+    if (!leaf) {
+        leaf = new handle_leaf;
+        for (j6_handle_t &h : leaf->handles)
+            h = j6_handle_invalid;
+        __atomic_store_n(&table->leaves[table_index], leaf, __ATOMIC_RELEASE);
+    }
+
+    return leaf->handles[index & ((1 << handle_leaf_bits) - 1)];
+}
+
 void
 process::add_handle(j6_handle_t handle)
 {
@@ -138,31 +221,57 @@ process::add_handle(j6_handle_t handle)
 
     capability *c = g_cap_table.retain(handle);
     kassert(c, "Trying to add a non-existant handle to a process!");
+    if (!c)
+        return;
 
-    if (c) {
-        util::scoped_lock lock {m_handles_lock};
-        m_handles.add(handle);
+    size_t index = cap_table::slot_index(handle);
+
+    util::scoped_lock lock {m_handles_lock};
+    j6_handle_t &entry = add_handle_entry(index);
+
+    if (entry == handle) {
+        // Already held, don't keep the extra reference
+        lock.release();
+        g_cap_table.release(handle);
+        return;
     }
+
+    kassert(entry == j6_handle_invalid,
+            "Process holds a stale handle to a reused capability slot");
+
+    __atomic_store_n(&entry, handle, __ATOMIC_RELEASE);
+    ++m_handle_count;
 }
 
 bool
 process::remove_handle(j6_handle_t handle)
 {
+    if (handle == j6_handle_invalid)
+        return false;
+
+    size_t index = cap_table::slot_index(handle);
+
     util::scoped_lock lock {m_handles_lock};
-    bool removed = m_handles.remove(handle);
-    lock.release();
+    j6_handle_t *entry = find_handle(index);
+    if (!entry || *entry != handle)
+        return false;
 
-    if (removed)
-        g_cap_table.release(handle);
+    __atomic_store_n(entry, j6_handle_invalid, __ATOMIC_RELEASE);
+    --m_handle_count;
+    lock.release();
 
-    return removed;
+    g_cap_table.release(handle);
+    return true;
 }
 
 bool
 process::has_handle(j6_handle_t handle)
 {
-    util::scoped_lock lock {m_handles_lock};
-    return m_handles.contains(handle);
+    if (handle == j6_handle_invalid)
+        return false;
+
+    j6_handle_t *entry = find_handle(cap_table::slot_index(handle));
+    return entry && __atomic_load_n(entry, __ATOMIC_ACQUIRE) == handle;
 }
 
 size_t
@@ -171,21 +280,31 @@ process::list_handles(j6_handle_descriptor *handles, size_t len)
     util::scoped_lock lock {m_handles_lock};
 
     size_t count = 0;
-    for (j6_handle_t handle : m_handles) {
-
-        capability *cap = g_cap_table.find_without_retain(handle);
-        kassert(cap, "Found process handle that wasn't in the cap table");
-        if (!cap) continue;
-
-        j6_handle_descriptor &desc = handles[count];
-        desc.handle = handle;
-        desc.caps = cap->caps;
-        desc.type = static_cast<j6_object_type>(cap->type);
-
-        if (++count == len) break;
+    for (size_t i = 0; i < m_handles_size && count < len; ++i) {
+        handle_table *table = m_handles[i];
+        if (!table) continue;
+
+        for (handle_leaf *leaf : table->leaves) {
+            if (!leaf) continue;
+
+            for (j6_handle_t handle : leaf->handles) {
+                if (handle == j6_handle_invalid || count == len)
+                    continue;
+
+                capability *cap = g_cap_table.find_without_retain(handle);
+                kassert(cap, "Found process handle that wasn't in the cap table");
+                if (!cap) continue;
+
+                j6_handle_descriptor &desc = handles[count];
+                desc.handle = handle;
+                desc.caps = cap->caps;
+                desc.type = static_cast<j6_object_type>(cap->type);
+                ++count;
+            }
+        }
     }
 
-    return m_handles.count();
+    return m_handle_count;
 }
 
 } // namespace obj
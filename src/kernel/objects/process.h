@@ -3,7 +3,6 @@
 /// Definition of process kobject types
 
 #include <j6/cap_flags.h>
-#include <util/node_map.h>
 #include <util/vector.h>
 
 #include "heap_allocator.h"
@@ -73,7 +72,8 @@ public:
     /// \returns     True if the handle was removed
     bool remove_handle(j6_handle_t handle);
 
-    /// Return whether this process has access to the given object capability
+    /// Return whether this process has access to the given object capability.
+    /// Does not lock, so may race with the handle being added or removed.
     /// \args handle The handle to the capability
     /// \returns     True if the process has been given access to that capability
     bool has_handle(j6_handle_t handle);
@@ -113,7 +113,37 @@ private:
     util::vector<thread*> m_threads;
     util::spinlock m_threads_lock;
 
-    util::node_set<j6_handle_t, j6_handle_invalid, heap_allocated> m_handles;
+    /// The handles this process holds are kept in a sparse table indexed
+    /// by their cap_table slot, so that memory use follows the handles
+    /// held rather than the highest slot in use. Leaves of handles are
+    /// grouped into tables, which are indexed by a growable directory.
+    /// Slots this process doesn't hold are j6_handle_invalid.
+    static constexpr size_t handle_leaf_bits = 9;
+    static constexpr size_t handle_table_bits = 9;
+
+    struct handle_leaf {
+        j6_handle_t handles[1 << handle_leaf_bits];
+    };
+
+    struct handle_table {
+        handle_leaf *leaves[1 << handle_table_bits];
+    };
+
+    /// Find the entry for the given slot index without locking.
+    /// \returns  The entry, or nullptr if there is no leaf for it yet
+    j6_handle_t * find_handle(size_t index);
+
+    /// Find the entry for the given slot index, adding leaves, tables, or
+    /// growing the directory as needed. Caller must hold m_handles_lock.
+    j6_handle_t & add_handle_entry(size_t index);
+
+    /// Nodes are never freed until the process is destroyed, and replaced
+    /// directories are kept in m_old_handles, so has_handle() can walk
+    /// the table without locking.
+    handle_table **m_handles;
+    size_t m_handles_size;
+    size_t m_handle_count;
+    util::vector<handle_table**> m_old_handles;
     util::spinlock m_handles_lock;
 
     enum class state : uint8_t { running, exited };
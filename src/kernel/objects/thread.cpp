@@ -15,6 +15,8 @@
 extern "C" void initialize_user_cpu();
 extern obj::vm_area_guarded &g_kernel_stacks;
 
+DEFINE_SLAB_ALLOCATOR(obj::thread)
+
 
 namespace obj {
 
@@ -28,7 +30,20 @@ thread::thread(process &parent, uint8_t pri, uintptr_t rsp0) :
     parent.handle_retain();
     parent.space().initialize_tcb(m_tcb);
     m_tcb.priority = pri;
+    m_tcb.base_priority = pri < scheduler::promote_limit ? pri : scheduler::promote_limit;
+    m_tcb.blocked = false;
+    m_tcb.affinity = ~0ull;
+    m_tcb.timer_index = ~0u;
+    m_tcb.ready_since = 0;
+    m_tcb.run_cycles = 0;
+    m_tcb.wait_cycles = 0;
+    m_tcb.voluntary_switches = 0;
+    m_tcb.involuntary_switches = 0;
+    m_tcb.migrations = 0;
+    m_tcb.last_cpu = nullptr;
     m_tcb.thread = this;
+    m_tcb.xsave = 0;
+    m_tcb.fpu_cpu = nullptr;
 
     if (!rsp0)
         setup_kernel_stack();
@@ -79,6 +94,20 @@ thread::block(util::scoped_lock &lock)
     return m_wake_value;
 }
 
+uint64_t
+thread::handoff(thread &next, uint64_t value)
+{
+    kassert(current_cpu().thread == this,
+            "handoff() called on non-current thread");
+
+    clear_state(state::ready);
+    if (!scheduler::get().handoff(next.tcb(), value)) {
+        next.wake(value);
+        scheduler::get().schedule();
+    }
+    return m_wake_value;
+}
+
 j6_status_t
 thread::join()
 {
@@ -101,7 +130,7 @@ thread::wake(uint64_t value)
 
     m_wake_value = value;
     wake_only();
-    scheduler::get().maybe_schedule(tcb());
+    scheduler::get().requeue(tcb());
 }
 
 void
@@ -116,9 +145,22 @@ thread::exit()
 {
     m_wake_timeout = 0;
     set_state(state::exited);
+
+    // An unreceived message may be borrowing this process' memory, and
+    // holding a reference to it
+    get_message_data();
+
     m_parent.thread_exited(this);
     m_join_queue.clear();
-    block();
+    m_observers.notify(j6_signal_thread_exited);
+
+    if (current_cpu().thread == this) {
+        block();
+    } else {
+        // Not running, so take it off its CPU's blocked list
+        clear_state(state::ready);
+        scheduler::get().requeue(tcb());
+    }
 }
 
 void
@@ -176,8 +218,10 @@ thread::add_thunk_user(uintptr_t rip3, uint64_t arg0, uint64_t arg1, uintptr_t r
 void
 thread::init_xsave_area()
 {
+    // Heap blocks are aligned to their power-of-two size, which
+    // meets XSAVE's 64-byte alignment requirement
     void *xsave_area = new uint8_t [xsave_size];
-    memset(xsave_area, 0, xsave_size);
+    xsave_init_area(xsave_area);
     m_tcb.xsave = reinterpret_cast<uintptr_t>(xsave_area);
 }
 
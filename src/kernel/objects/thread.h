@@ -9,9 +9,12 @@
 #include "cpu.h"
 #include "ipc_message.h"
 #include "objects/kobject.h"
+#include "objects/port.h"
+#include "slab_allocated.h"
 #include "wait_queue.h"
 
 struct page_table;
+class scheduler;
 
 namespace obj {
     class thread;
@@ -27,13 +30,20 @@ struct TCB
     uintptr_t rflags3;
     uintptr_t pml4;
     uintptr_t xsave;
+    cpu_data *fpu_cpu;
     // End of area used by asembly
 
     obj::thread* thread;
 
     uint8_t priority;
 
-    // note: 3 bytes padding
+    /// The most urgent priority promotion can raise this thread to
+    uint8_t base_priority;
+
+    /// True while the thread is on its CPU's blocked list
+    bool blocked;
+
+    // note: 1 byte padding
     // TODO: move state into TCB?
 
     uint32_t time_left;
@@ -41,6 +51,27 @@ struct TCB
 
     uintptr_t kernel_stack;
     cpu_data *cpu;
+
+    /// Bitmask of the CPU indices this thread may run on
+    uint64_t affinity;
+
+    /// Index of this thread's entry in its CPU's wake timer heap, or
+    /// ~0 if it has none
+    uint32_t timer_index;
+
+    /// The next thread in the run queue inbox this thread was posted to
+    TCB *inbox_next;
+
+    // Scheduler accounting. Times are in TSC cycles.
+    uint64_t ready_since;
+    uint64_t run_cycles;
+    uint64_t wait_cycles;
+    uint64_t voluntary_switches;
+    uint64_t involuntary_switches;
+    uint64_t migrations;
+
+    /// The CPU this thread most recently started running on
+    cpu_data *last_cpu;
 };
 
 using tcb_list = util::linked_list<TCB>;
@@ -52,7 +83,8 @@ namespace obj {
 class process;
 
 class thread :
-    public kobject
+    public kobject,
+    public slab_allocated<thread, 4 * arch::frame_size>
 {
 public:
     /// Capabilities on a newly constructed thread handle
@@ -93,6 +125,13 @@ public:
     /// \arg p  The new thread priority
     inline void set_priority(uint8_t p) { if (!constant()) m_tcb.priority = p; }
 
+    virtual port_observers * observers() override { return &m_observers; }
+
+    /// Get j6_signal_thread_exited if the thread has exited
+    virtual j6_signal_t signals() const override {
+        return exited() ? j6_signal_thread_exited : 0;
+    }
+
     /// Block this thread, waiting for a value
     /// \returns   The value passed to wake()
     uint64_t block();
@@ -102,6 +141,14 @@ public:
     /// \returns   The value passed to wake()
     uint64_t block(util::scoped_lock &held);
 
+    /// Wake another thread and block this one, switching directly to the
+    /// woken thread when the scheduler allows it. Must be called on the
+    /// current thread.
+    /// \arg next  The thread to wake
+    /// \arg value The value that next's block() should return
+    /// \returns   The value passed to this thread's wake()
+    uint64_t handoff(thread &next, uint64_t value = 0);
+
     /// Block the calling thread until this thread exits
     j6_status_t join();
 
@@ -171,6 +218,7 @@ private:
     thread(const thread &other) = delete;
     thread(const thread &&other) = delete;
     friend class process;
+    friend class ::scheduler;
     friend void ::cpu_initialize_thread_state();
 
     /// Constructor. Used when a kernel stack already exists.
@@ -199,6 +247,7 @@ private:
     ipc::message_ptr m_message;
 
     wait_queue m_join_queue;
+    port_observers m_observers;
 };
 
 } // namespace obj
@@ -1,3 +1,4 @@
+#include <j6/memutils.h>
 
 #include "kassert.h"
 #include "frame_allocator.h"
@@ -13,6 +14,7 @@ vm_area::vm_area(size_t size, util::bitset32 flags) :
     m_size {mem::page_count(size) * mem::frame_size},
     m_flags {flags},
     m_spaces {m_vector_static, 0, static_size},
+    m_cow_dependents {0},
     kobject {kobject::type::vma}
 {
 }
@@ -66,6 +68,31 @@ vm_area::can_resize(size_t size)
     return true;
 }
 
+bool
+vm_area::get_sized_page(uintptr_t offset, uintptr_t &phys, size_t &size, bool &shared)
+{
+    size = frame_size;
+    shared = false;
+    return get_page(mem::page_align_down(offset), phys);
+}
+
+size_t
+vm_area::max_page_size(uintptr_t offset) const
+{
+    using mem::huge_page_size;
+    using mem::large_page_size;
+
+    if (m_flags.get(vm_flags::huge_pages) &&
+        (offset & ~(huge_page_size - 1)) + huge_page_size <= m_size)
+        return huge_page_size;
+
+    if (m_flags.get(vm_flags::large_pages) &&
+        (offset & ~(large_page_size - 1)) + large_page_size <= m_size)
+        return large_page_size;
+
+    return frame_size;
+}
+
 vm_area_fixed::vm_area_fixed(uintptr_t start, size_t size, util::bitset32 flags) :
     m_start {start},
     vm_area {size, flags}
@@ -98,6 +125,48 @@ vm_area_fixed::get_page(uintptr_t offset, uintptr_t &phys, bool alloc)
     return true;
 }
 
+bool
+vm_area_fixed::get_sized_page(uintptr_t offset, uintptr_t &phys, size_t &size, bool &shared)
+{
+    if (offset >= m_size)
+        return false;
+
+    shared = false;
+
+    // The physical range must be aligned the same as the page
+    size = max_page_size(offset);
+    while (size > frame_size && (m_start & (size - 1)))
+        size = size == mem::huge_page_size ? mem::large_page_size : frame_size;
+
+    phys = m_start + (offset & ~(size - 1));
+    return true;
+}
+
+bool
+vm_area_fixed::next_resident(uintptr_t start, uintptr_t &offset, uintptr_t &phys, size_t &size, bool &shared)
+{
+    if (start >= m_size || !get_sized_page(start, phys, size, shared))
+        return false;
+
+    offset = start & ~(size - 1);
+    if (offset != start) {
+        // Starting partway into a large page, just report the next
+        // normal page
+        offset = start;
+        phys = m_start + start;
+        size = frame_size;
+    }
+    return true;
+}
+
+bool
+vm_area_fixed::can_fault_around() const
+{
+    // Neighbouring pages are already backed, mapping them costs nothing
+    // but the page table entries
+    return !m_flags.get(vm_flags::no_fault_around);
+}
+
 vm_area_untracked::vm_area_untracked(size_t size, util::bitset32 flags) :
     vm_area {size, flags}
 {
@@ -146,10 +215,97 @@ vm_area_open::~vm_area_open()
 bool
 vm_area_open::get_page(uintptr_t offset, uintptr_t &phys, bool alloc)
 {
-    if (alloc)
-        return page_tree::find_or_add(m_mapped, offset, phys);
-    else
-        return page_tree::find(m_mapped, offset, &phys);
+    // Look for a large or huge page covering the offset first, so that
+    // the range isn't tracked twice
+    size_t size = 0;
+    if (page_tree::find_sized(m_mapped, offset, phys, size)) {
+        // Return the 4KiB page within a large or huge page
+        phys += mem::page_align_down(offset & (size - 1));
+        return true;
+    }
+
+    if (!alloc)
+        return false;
+    return page_tree::find_or_add(m_mapped, offset, phys);
+}
+
+bool
+vm_area_open::get_sized_page(uintptr_t offset, uintptr_t &phys, size_t &size, bool &shared)
+{
+    shared = false;
+    if (page_tree::find_sized(m_mapped, offset, phys, size))
+        return true;
+
+    size_t max_size = max_page_size(offset);
+    while (max_size > frame_size) {
+        if (page_tree::add_sized(m_mapped, offset & ~(max_size - 1), max_size, phys)) {
+            size = max_size;
+            return true;
+        }
+
+        // Couldn't get (or fit) a page that big, try the next size down
+        max_size = max_size == mem::huge_page_size ? mem::large_page_size : frame_size;
+    }
+
+    size = frame_size;
+    return page_tree::find_or_add(m_mapped, mem::page_align_down(offset), phys);
+}
+
+bool
+vm_area_open::next_resident(uintptr_t start, uintptr_t &offset, uintptr_t &phys, size_t &size, bool &shared)
+{
+    if (start >= m_size)
+        return false;
+
+    shared = false;
+    return page_tree::find_next(m_mapped, start, offset, phys, size);
+}
+
+bool
+vm_area_open::can_move_pages() const
+{
+    // Pages can't be moved out from under other address spaces, or
+    // copy-on-write areas sharing them, and large pages are not split up
+    return m_spaces.count() == 1 &&
+        !__atomic_load_n(&m_cow_dependents, __ATOMIC_SEQ_CST) &&
+        !m_flags.get(vm_flags::large_pages) &&
+        !m_flags.get(vm_flags::huge_pages);
+}
+
+bool
+vm_area_open::can_fault_around() const
+{
+    // Large and huge pages already map far more than the fault-around
+    // window at a time
+    return
+        !m_flags.get(vm_flags::no_fault_around) &&
+        !m_flags.get(vm_flags::large_pages) &&
+        !m_flags.get(vm_flags::huge_pages);
+}
+
+bool
+vm_area_open::take_page(uintptr_t offset, uintptr_t &phys)
+{
+    if (offset >= m_size)
+        return false;
+
+    uintptr_t page = 0;
+    if (!page_tree::find_or_add(m_mapped, offset, page))
+        return false;
+
+    return page_tree::remove(m_mapped, offset, phys);
+}
+
+bool
+vm_area_open::give_page(uintptr_t offset, uintptr_t phys, uintptr_t &old)
+{
+    if (offset >= m_size)
+        return false;
+
+    old = 0;
+    page_tree::remove(m_mapped, offset, old);
+    page_tree::add_existing(m_mapped, offset, phys);
+    return true;
 }
 
 void
@@ -211,4 +367,155 @@ vm_area_ring::get_page(uintptr_t offset, uintptr_t &phys, bool alloc)
     return vm_area_open::get_page(offset, phys, alloc);
 }
 
+bool
+vm_area_ring::get_sized_page(uintptr_t offset, uintptr_t &phys, size_t &size, bool &shared)
+{
+    return vm_area::get_sized_page(offset, phys, size, shared);
+}
+
+
+vm_area_cow::vm_area_cow(vm_area *source, uintptr_t offset, size_t length, size_t size, util::bitset32 flags) :
+    m_source {source},
+    m_source_offset {offset},
+    m_source_size {length ? mem::page_count(length) * frame_size : 0},
+    m_mapped {nullptr},
+    vm_area {size, flags}
+{
+    m_source->handle_retain();
+    m_source->add_cow_dependent();
+
+    size_t source_size = m_source->size();
+    if (m_source_offset >= source_size)
+        m_source_size = 0;
+    else if (m_source_size > source_size - m_source_offset)
+        m_source_size = source_size - m_source_offset;
+
+    if (m_source_size > m_size)
+        m_source_size = m_size;
+}
+
+vm_area_cow::~vm_area_cow()
+{
+    // the page_tree only holds our own copies, and will free them
+    delete m_mapped;
+    m_source->remove_cow_dependent();
+    m_source->handle_release();
+}
+
+bool
+vm_area_cow::add_to(vm_space *space)
+{
+    // Copying a page only remaps it in the space that faulted, so other
+    // spaces would keep seeing the shared page. Read-only areas never
+    // copy pages.
+    if (!m_flags.get(vm_flags::write) || !m_spaces.count())
+        return vm_area::add_to(space);
+    return m_spaces[0] == space;
+}
+
+bool
+vm_area_cow::find_page(uintptr_t offset, uintptr_t &phys, bool alloc, bool &shared)
+{
+    shared = false;
+
+    size_t size = 0;
+    if (page_tree::find_sized(m_mapped, offset, phys, size))
+        return true;
+
+    if (offset < m_source_size) {
+        shared = true;
+        return m_source->get_page(m_source_offset + offset, phys, alloc);
+    }
+
+    if (!alloc)
+        return false;
+    return page_tree::find_or_add(m_mapped, offset, phys);
+}
+
+bool
+vm_area_cow::get_page(uintptr_t offset, uintptr_t &phys, bool alloc)
+{
+    offset = mem::page_align_down(offset);
+    if (offset >= m_size)
+        return false;
+
+    util::scoped_lock lock {m_lock};
+    bool shared = false;
+    return find_page(offset, phys, alloc, shared);
+}
+
+bool
+vm_area_cow::get_sized_page(uintptr_t offset, uintptr_t &phys, size_t &size, bool &shared)
+{
+    offset = mem::page_align_down(offset);
+    if (offset >= m_size)
+        return false;
+
+    // Whether the page is shared must be decided under the same lock as
+    // finding it, or a copy made in between would be mapped writable
+    // over the source's frame
+    util::scoped_lock lock {m_lock};
+    size = frame_size;
+    return find_page(offset, phys, true, shared);
+}
+
+bool
+vm_area_cow::next_resident(uintptr_t start, uintptr_t &offset, uintptr_t &phys, size_t &size, bool &shared)
+{
+    if (start >= m_size)
+        return false;
+
+    util::scoped_lock lock {m_lock};
+
+    shared = false;
+    bool found = page_tree::find_next(m_mapped, start, offset, phys, size);
+
+    uintptr_t shared_offset = 0;
+    uintptr_t shared_phys = 0;
+    size_t shared_size = 0;
+    bool source_shared = false;
+    if (start < m_source_size &&
+        m_source->next_resident(m_source_offset + start, shared_offset, shared_phys, shared_size, source_shared)) {
+        // Shared pages are always mapped as normal pages, and pages this
+        // area has its own copy of take precedence
+        shared_offset -= m_source_offset;
+        if (shared_offset < m_source_size && (!found || shared_offset < offset)) {
+            offset = shared_offset;
+            phys = shared_phys;
+            size = frame_size;
+            shared = true;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+bool
+vm_area_cow::copy_page(uintptr_t offset, uintptr_t &phys)
+{
+    offset = mem::page_align_down(offset);
+    if (offset >= m_size)
+        return false;
+
+    util::scoped_lock lock {m_lock};
+
+    // Another CPU may have already copied it
+    size_t size = 0;
+    if (page_tree::find_sized(m_mapped, offset, phys, size))
+        return true;
+
+    uintptr_t shared = 0;
+    if (offset >= m_source_size ||
+        !m_source->get_page(m_source_offset + offset, shared))
+        return false;
+
+    if (!frame_allocator::get().allocate(1, &phys))
+        return false;
+
+    memcpy(mem::to_virtual<void>(phys), mem::to_virtual<void>(shared), frame_size);
+    page_tree::add_existing(m_mapped, offset, phys);
+    return true;
+}
+
 } // namespace obj
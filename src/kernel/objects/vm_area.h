@@ -7,6 +7,7 @@
 
 #include <j6/cap_flags.h>
 #include <util/bitset.h>
+#include <util/spinlock.h>
 #include <util/vector.h>
 
 #include "block_allocator.h"
@@ -74,6 +75,66 @@ public:
     /// \returns    True if there should be a page at the given offset
     virtual bool get_page(uintptr_t offset, uintptr_t &phys, bool alloc = true) = 0;
 
+    /// Get the page backing the given offset, allocating it if necessary.
+    /// If this area was created with the large_pages or huge_pages flags,
+    /// the page may be a 2MiB or 1GiB page containing the offset.
+    /// \arg offset The offset into the VMA
+    /// \arg phys   [out] Receives the physical address of the start of the page
+    /// \arg size   [out] Receives the size of the page, in bytes
+    /// \arg shared [out] Receives whether the page is shared copy-on-write,
+    ///             and so must be mapped read-only until it is copied
+    /// \returns    True if there should be a page at the given offset
+    virtual bool get_sized_page(uintptr_t offset, uintptr_t &phys, size_t &size, bool &shared);
+
+    /// Find the first page at or after the given offset that already has
+    /// memory behind it, without allocating anything.
+    /// \arg start  Page-aligned offset into the VMA to start looking from
+    /// \arg offset [out] Receives the offset of the page found
+    /// \arg phys   [out] Receives the physical address of the page
+    /// \arg size   [out] Receives the size of the page, in bytes
+    /// \arg shared [out] Receives whether the page is shared copy-on-write
+    /// \returns    True if a page was found
+    virtual bool next_resident(uintptr_t start, uintptr_t &offset, uintptr_t &phys, size_t &size, bool &shared) { return false; }
+
+    /// Check if pages can be moved into or out of this area with
+    /// take_page() and give_page().
+    virtual bool can_move_pages() const { return false; }
+
+    /// Check if pages near a faulting page may be mapped in along with
+    /// it, allocating them if necessary.
+    virtual bool can_fault_around() const { return false; }
+
+    /// Give this area its own copy of a copy-on-write page.
+    /// \arg offset The offset into the VMA
+    /// \arg phys   [out] Receives the physical address of the copy
+    /// \returns    True if the page is now private to this area
+    virtual bool copy_page(uintptr_t offset, uintptr_t &phys) { return false; }
+
+    /// Remove the page at the given offset from this area, giving up
+    /// ownership of its frame. A frame is allocated first if the page
+    /// did not exist yet. The caller must clear any mappings of it.
+    /// \arg offset The offset into the VMA
+    /// \arg phys   [out] Receives the physical address of the frame
+    /// \returns    True if the page was removed
+    virtual bool take_page(uintptr_t offset, uintptr_t &phys) { return false; }
+
+    /// Place the given frame at the given offset in this area, taking
+    /// ownership of it.
+    /// \arg offset The offset into the VMA
+    /// \arg phys   The physical address of the frame
+    /// \arg old    [out] Receives the frame previously at that offset, or 0.
+    ///             The caller must clear mappings of it, then free it.
+    /// \returns    True if the page was replaced
+    virtual bool give_page(uintptr_t offset, uintptr_t phys, uintptr_t &old) { return false; }
+
+    /// Track that a copy-on-write area shares this area's pages. While
+    /// any do, this area's frames may be mapped by other address spaces,
+    /// and must not be moved out of it.
+    void add_cow_dependent() { __atomic_add_fetch(&m_cow_dependents, 1, __ATOMIC_SEQ_CST); }
+
+    /// Track that a copy-on-write area no longer shares this area's pages
+    void remove_cow_dependent() { __atomic_sub_fetch(&m_cow_dependents, 1, __ATOMIC_SEQ_CST); }
+
 protected:
     /// A VMA is not deleted until both no handles remain AND it's not
     /// mapped by any VM space.
@@ -81,9 +142,14 @@ protected:
 
     bool can_resize(size_t size);
 
+    /// Get the largest page size this area's flags allow for the given
+    /// offset, such that the whole page lies within the area.
+    size_t max_page_size(uintptr_t offset) const;
+
     size_t m_size;
     util::bitset32 m_flags;
     util::vector<vm_space*> m_spaces;
+    uint32_t m_cow_dependents;
 
     // Initial static space for m_spaces - most areas will never grow
     // beyond this size, so avoid allocations
@@ -107,6 +173,9 @@ public:
 
     virtual size_t resize(size_t size) override;
     virtual bool get_page(uintptr_t offset, uintptr_t &phys, bool alloc = true) override;
+    virtual bool get_sized_page(uintptr_t offset, uintptr_t &phys, size_t &size, bool &shared) override;
+    virtual bool next_resident(uintptr_t start, uintptr_t &offset, uintptr_t &phys, size_t &size, bool &shared) override;
+    virtual bool can_fault_around() const override;
 
 private:
     uintptr_t m_start;
@@ -125,6 +194,13 @@ public:
     virtual ~vm_area_open();
 
     virtual bool get_page(uintptr_t offset, uintptr_t &phys, bool alloc = true) override;
+    virtual bool get_sized_page(uintptr_t offset, uintptr_t &phys, size_t &size, bool &shared) override;
+    virtual bool next_resident(uintptr_t start, uintptr_t &offset, uintptr_t &phys, size_t &size, bool &shared) override;
+
+    virtual bool can_move_pages() const override;
+    virtual bool can_fault_around() const override;
+    virtual bool take_page(uintptr_t offset, uintptr_t &phys) override;
+    virtual bool give_page(uintptr_t offset, uintptr_t phys, uintptr_t &old) override;
 
     /// Tell this VMA about an existing mapping that did not originate
     /// from get_page.
@@ -176,6 +252,8 @@ public:
     void return_section(uintptr_t addr);
 
     virtual bool get_page(uintptr_t offset, uintptr_t &phys, bool alloc = true) override;
+    virtual bool can_move_pages() const override { return false; }
+    virtual bool can_fault_around() const override { return false; }
 
 private:
     size_t m_pages;
@@ -198,9 +276,54 @@ public:
 
     virtual bool get_page(uintptr_t offset, uintptr_t &phys, bool alloc = true) override;
 
+    /// Ring buffers map each page twice, so are always backed by
+    /// normal-sized pages.
+    virtual bool get_sized_page(uintptr_t offset, uintptr_t &phys, size_t &size, bool &shared) override;
+    virtual bool next_resident(uintptr_t start, uintptr_t &offset, uintptr_t &phys, size_t &size, bool &shared) override { return false; }
+    virtual bool can_move_pages() const override { return false; }
+    virtual bool can_fault_around() const override { return false; }
+
 private:
     size_t m_bufsize;
     page_tree *m_mapped;
 };
 
+
+/// Area that shares the pages of a range of another area, copying each
+/// page the first time it is written. Pages past the end of the source
+/// range are allocated as in an open area. Writes to the source area
+/// are visible through pages that have not yet been copied. A writable
+/// COW area can only be mapped into one address space; one without the
+/// write flag never copies, and so works as a read-only view of its
+/// source that can be mapped anywhere.
+class vm_area_cow :
+    public vm_area
+{
+public:
+    /// Constructor.
+    /// \arg source The area to share pages from
+    /// \arg offset Page-aligned offset of the shared range in the source
+    /// \arg length Length of the shared range
+    /// \arg size   Virtual size of the memory area
+    /// \arg flags  Flags for this memory area
+    vm_area_cow(vm_area *source, uintptr_t offset, size_t length, size_t size, util::bitset32 flags);
+    virtual ~vm_area_cow();
+
+    virtual bool add_to(vm_space *space) override;
+    virtual bool get_page(uintptr_t offset, uintptr_t &phys, bool alloc = true) override;
+    virtual bool get_sized_page(uintptr_t offset, uintptr_t &phys, size_t &size, bool &shared) override;
+    virtual bool next_resident(uintptr_t start, uintptr_t &offset, uintptr_t &phys, size_t &size, bool &shared) override;
+    virtual bool copy_page(uintptr_t offset, uintptr_t &phys) override;
+
+private:
+    /// Get the page at a page-aligned offset. Caller must hold m_lock.
+    bool find_page(uintptr_t offset, uintptr_t &phys, bool alloc, bool &shared);
+
+    vm_area *m_source;
+    uintptr_t m_source_offset;
+    size_t m_source_size;
+    page_tree *m_mapped;
+    util::spinlock m_lock;
+};
+
 } // namespace obj
@@ -238,7 +238,8 @@ page_table::free(page_table::level l)
         if (!is_present(i)) continue;
         if (is_page(l, i)) {
             size_t count = mem::page_count(entry_sizes[unsigned(l)]);
-            fa.free(entries[i] & ~0xfffull, count);
+            uint64_t mask = l == level::pt ? ~0xfffull : ~0x1fffull;
+            fa.free(entries[i] & mask, count);
         } else {
             get(i)->free(l + 1);
         }
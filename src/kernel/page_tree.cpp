@@ -3,7 +3,9 @@
 
 #include "kassert.h"
 #include "frame_allocator.h"
+#include "memory.h"
 #include "page_tree.h"
+#include "zero_pool.h"
 
 // Page tree levels map the following parts of an offset. Note the xxx part of
 // the offset but represent the bits of the actual sub-page virtual address.
@@ -32,7 +34,7 @@ page_tree::find_or_add(page_tree * &root, uint64_t offset, uintptr_t &page)
 
     if (!(ent & 1)) {
         // No entry for this page exists, so make one
-        if (!frame_allocator::get().allocate(1, &ent))
+        if (!zero_pool::allocate(&ent))
             return false;
         ent |= 1;
     }
@@ -51,3 +53,147 @@ page_tree::add_existing(page_tree * &root, uint64_t offset, uintptr_t page)
     kassert(!(ent & 1), "Replacing existing mapping in page_tree::add_existing");
     ent = page | 1;
 }
+
+bool
+page_tree::remove(page_tree *root, uint64_t offset, uintptr_t &page)
+{
+    page_tree *node = root;
+    while (node) {
+        size_t index = 0;
+        if (!node->contains(offset, index))
+            return false;
+
+        if (!node->m_level) {
+            uint64_t &ent = node->m_entries.entries[index];
+            if (!(ent & 1) || (ent & (large_flag | huge_flag)))
+                return false;
+
+            page = ent & ~0xfffull;
+            ent = 0;
+            return true;
+        }
+
+        node = static_cast<page_tree*>(node->m_entries.children[index]);
+    }
+    return false;
+}
+
+bool
+page_tree::find_sized(page_tree *root, uint64_t offset, uintptr_t &page, size_t &size)
+{
+    uint64_t ent = 0;
+
+    uint64_t huge = offset & ~(mem::huge_page_size - 1);
+    if (find(root, huge, &ent) && (ent & 1) && (ent & huge_flag)) {
+        page = ent & ~0xfffull;
+        size = mem::huge_page_size;
+        return true;
+    }
+
+    uint64_t large = offset & ~(mem::large_page_size - 1);
+    if (find(root, large, &ent) && (ent & 1) && (ent & large_flag)) {
+        page = ent & ~0xfffull;
+        size = mem::large_page_size;
+        return true;
+    }
+
+    if (find(root, offset, &ent) && (ent & 1)) {
+        page = ent & ~0xfffull;
+        size = mem::frame_size;
+        return true;
+    }
+
+    return false;
+}
+
+bool
+page_tree::add_sized(page_tree * &root, uint64_t offset, size_t size, uintptr_t &page)
+{
+    kassert(size == mem::large_page_size || size == mem::huge_page_size,
+            "Bad page size in page_tree::add_sized");
+    kassert(!(offset & (size - 1)), "Unaligned offset in page_tree::add_sized");
+
+    if (!range_empty(root, offset, offset + size))
+        return false;
+
+    // Zeroing a page this big would hold up the fault too long, so only
+    // take one that's already been zeroed
+    uintptr_t phys = 0;
+    if (!zero_pool::allocate_sized(size, &phys))
+        return false;
+
+    node_type * radix_root = root;
+    uint64_t &ent = radix_tree::find_or_add(radix_root, offset);
+    root = static_cast<page_tree*>(radix_root);
+
+    ent = phys | 1 | (size == mem::huge_page_size ? huge_flag : large_flag);
+    page = phys;
+    return true;
+}
+
+bool
+page_tree::find_next(const page_tree *node, uint64_t start, uint64_t &offset, uintptr_t &page, size_t &size)
+{
+    if (!node)
+        return false;
+
+    uint64_t node_end = node->m_base + (1ull << level_shift(node->m_level + 1));
+    if (start >= node_end)
+        return false;
+
+    const size_t shift = level_shift(node->m_level);
+    for (size_t i = 0; i < 64; ++i) {
+        uint64_t slot = node->m_base + (i << shift);
+        if (slot + (1ull << shift) <= start)
+            continue;
+
+        if (!node->m_level) {
+            uint64_t ent = node->m_entries.entries[i];
+            if (!(ent & 1) || slot < start)
+                continue;
+
+            offset = slot;
+            page = ent & ~0xfffull;
+            size =
+                (ent & huge_flag) ? mem::huge_page_size :
+                (ent & large_flag) ? mem::large_page_size :
+                mem::frame_size;
+            return true;
+        }
+
+        const page_tree *child = static_cast<const page_tree*>(node->m_entries.children[i]);
+        if (find_next(child, start, offset, page, size))
+            return true;
+    }
+
+    return false;
+}
+
+bool
+page_tree::range_empty(const page_tree *node, uint64_t start, uint64_t end)
+{
+    if (!node)
+        return true;
+
+    uint64_t node_end = node->m_base + (1ull << level_shift(node->m_level + 1));
+    if (end <= node->m_base || start >= node_end)
+        return true;
+
+    const size_t shift = level_shift(node->m_level);
+    for (size_t i = 0; i < 64; ++i) {
+        uint64_t slot = node->m_base + (i << shift);
+        if (slot + (1ull << shift) <= start || slot >= end)
+            continue;
+
+        if (!node->m_level) {
+            if (node->m_entries.entries[i] & 1)
+                return false;
+        } else {
+            const page_tree *child = static_cast<const page_tree*>(node->m_entries.children[i]);
+            if (!range_empty(child, start, end))
+                return false;
+        }
+    }
+
+    return true;
+}
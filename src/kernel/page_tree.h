@@ -13,7 +13,7 @@ class page_tree :
 {
 public:
     /// Get the physical address of the page at the given offset. If one does
-    /// not exist yet, allocate a page, insert it, and return that. Overrides
+    /// not exist yet, allocate a zeroed page, insert it, and return that. Overrides
     /// `util::radix_tree::find_or_add`.
     /// \arg root    [inout] The root node of the tree. This pointer may be updated.
     /// \arg offset  Offset into the VMA, in bytes
@@ -26,4 +26,50 @@ public:
     /// \arg offset  Offset into the VMA, in bytes
     /// \arg page    The mapped page physical address
     static void add_existing(page_tree * &root, uint64_t offset, uintptr_t page);
+
+    /// Remove a normal-sized page from the tree, without freeing it.
+    /// \arg root    The root node of the tree
+    /// \arg offset  Offset into the VMA, in bytes
+    /// \arg page    [out] Receives the physical address of the page removed
+    /// \returns     True if a page was removed
+    static bool remove(page_tree *root, uint64_t offset, uintptr_t &page);
+
+    /// Find the page backing the given offset. Large and huge pages are
+    /// tracked by a single entry at their aligned offset, so this checks
+    /// for those first.
+    /// \arg root    The root node of the tree
+    /// \arg offset  Offset into the VMA, in bytes
+    /// \arg page    [out] Receives the physical address of the start of the page
+    /// \arg size    [out] Receives the size of the page, in bytes
+    /// \returns     True if a page was found
+    static bool find_sized(page_tree *root, uint64_t offset, uintptr_t &page, size_t &size);
+
+    /// Find the first page tracked at or after the given offset.
+    /// \arg root    The root node of the tree
+    /// \arg start   Offset into the VMA, in bytes, to start looking from
+    /// \arg offset  [out] Receives the offset of the page found
+    /// \arg page    [out] Receives the physical address of the page
+    /// \arg size    [out] Receives the size of the page, in bytes
+    /// \returns     True if a page was found
+    static bool find_next(const page_tree *root, uint64_t start, uint64_t &offset, uintptr_t &page, size_t &size);
+
+    /// Insert a large or huge page from the zero pool. Fails if any pages
+    /// are already tracked in the range the new page would cover, or if
+    /// no zeroed page of that size is ready.
+    /// \arg root    [inout] The root node of the tree. This pointer may be updated.
+    /// \arg offset  Offset into the VMA, in bytes, aligned to `size`
+    /// \arg size    Size of the page, either mem::large_page_size or mem::huge_page_size
+    /// \arg page    [out] Receives the physical address of the page
+    /// \returns     True if a page was allocated
+    static bool add_sized(page_tree * &root, uint64_t offset, size_t size, uintptr_t &page);
+
+    /// Entry flag marking a large page
+    static constexpr uintptr_t large_flag = 0x2;
+
+    /// Entry flag marking a huge page
+    static constexpr uintptr_t huge_flag = 0x4;
+
+private:
+    /// Check that no pages are tracked in the range [start, end)
+    static bool range_empty(const page_tree *node, uint64_t start, uint64_t end);
 };
@@ -17,7 +17,10 @@
 #include "objects/system.h"
 #include "objects/thread.h"
 #include "objects/vm_area.h"
+#include "profiler.h"
 #include "scheduler.h"
+#include "tlb.h"
+#include "vm_space.h"
 
 using obj::process;
 using obj::thread;
@@ -25,18 +28,381 @@ using obj::thread;
 extern "C" void task_switch(TCB *tcb);
 scheduler *scheduler::s_instance = nullptr;
 
+/// Another CPU to steal work from, and how far away it is
+struct steal_victim
+{
+    uint16_t index;
+    uint8_t distance;   ///< 0: same core, 1: same package, 2: other package
+};
+
+/// A pending wake timeout for a blocked thread
+struct wake_timer
+{
+    uint64_t deadline;
+    tcb_node *tcb;
+};
+
+/// A bounded FIFO of ready threads of one priority. Only the CPU that
+/// owns it pushes, at the back. That CPU and any CPU stealing from it
+/// take from the front, claiming an entry by advancing `head` with a
+/// compare-and-swap, so none of them takes a lock.
+struct ready_ring
+{
+    static constexpr size_t capacity = 64;
+
+    uint64_t head = 0;
+    uint64_t tail = 0;
+    tcb_node *slots[capacity] = {};
+
+    /// Get the number of threads in the ring. Only exact on the owning
+    /// CPU, and only while nothing is stealing from it.
+    size_t size() const
+    {
+        // Read head first: tail never falls behind it
+        uint64_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        uint64_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+        return t - h;
+    }
+
+    /// Add a thread at the back. Only the owning CPU may push.
+    /// \returns  False if the ring is full
+    bool push(tcb_node *node)
+    {
+        uint64_t t = tail;
+        if (t - __atomic_load_n(&head, __ATOMIC_ACQUIRE) >= capacity)
+            return false;
+
+        __atomic_store_n(&slots[t % capacity], node, __ATOMIC_RELAXED);
+        __atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    /// Take the thread at the front. Any CPU may pop.
+    /// \returns  The thread, or null if the ring is empty
+    tcb_node * pop()
+    {
+        uint64_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        while (true) {
+            if (h == __atomic_load_n(&tail, __ATOMIC_ACQUIRE))
+                return nullptr;
+
+            // The slot can't be reused until head moves past it, in
+            // which case the exchange fails and h is reloaded
+            tcb_node *node = __atomic_load_n(&slots[h % capacity], __ATOMIC_RELAXED);
+            if (__atomic_compare_exchange_n(&head, &h, h + 1, false,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return node;
+        }
+    }
+};
+
 struct run_queue
 {
     tcb_node *current = nullptr;
+
+    /// Id of the thread that last switched out, which may not have
+    /// finished saving its state. Other CPUs read this without the lock.
     uint64_t prev = 0;
-    tcb_list ready[scheduler::num_priorities];
+
+    /// Priority of the running thread, for other CPUs deciding whether to
+    /// preempt it. Most urgent until the scheduler starts, so that none do.
+    uint8_t running = 0;
+
+    /// Ready threads, by priority. This CPU pushes onto them while holding
+    /// the lock, but other CPUs steal from them without it.
+    ready_ring ready[scheduler::num_priorities];
+
+    /// Ready threads that didn't fit in their ring, to be moved into it in
+    /// order as it empties. Only this CPU uses these, holding the lock.
+    tcb_list overflow[scheduler::num_priorities];
+
+    /// Threads made ready to run on this CPU by any CPU, most recent first.
+    /// They're posted without the lock, and moved to the ready lists by
+    /// this CPU when it schedules.
+    TCB *inbox = nullptr;
+
+    /// Number of threads in the ready lists and inbox. The idle thread is
+    /// in a ready list exactly when something else is running, so this is
+    /// also the CPU's load.
+    uint32_t queued = 0;
+
+    /// Set when a ready thread's priority or affinity is changed, so that
+    /// this CPU re-sorts its ready lists when it next schedules
+    bool resort = false;
+
     tcb_list blocked;
 
+    /// Threads that exited while running, to be released once switched away from
+    tcb_list exited;
+
+    /// Ready threads found on this CPU that their affinity no longer
+    /// allows, to be moved by this CPU once they're switched away from
+    tcb_list migrating;
+
+    /// Min-heap of wake timeouts of threads blocked on this CPU. Each thread
+    /// has at most one entry, at its TCB's timer_index, which holds a
+    /// reference to the thread and is removed when the thread is woken.
+    util::vector<wake_timer> timers;
+
+    /// Length of the last LAPIC timer interval programmed, in us
+    uint32_t interval = 0;
+
     uint64_t last_promotion = 0;
     uint64_t last_steal = 0;
+
+    /// TSC value when the current thread was last charged for its time
+    uint64_t last_tsc = 0;
+
+    /// Other CPUs to steal from, nearest first
+    util::vector<steal_victim> victims;
+
+    /// Load and placement counters. Other CPUs read these without the lock.
+    scheduler::cpu_stats stats = {};
+
     util::spinlock lock;
 };
 
+static inline bool
+allowed_on(const TCB *t, unsigned index)
+{
+    return index < 64 ?
+        (t->affinity >> index) & 1 :
+        t->affinity == ~0ull;
+}
+
+static inline uint32_t
+get_load(const run_queue &queue)
+{
+    return __atomic_load_n(&queue.queued, __ATOMIC_RELAXED);
+}
+
+/// Add a ready thread to the back of the ready list for its priority.
+/// Caller must be the queue's CPU, and hold its lock.
+static void
+enqueue(run_queue &queue, tcb_node *node)
+{
+    uint8_t pri = node->priority;
+    if (!queue.overflow[pri].empty() || !queue.ready[pri].push(node))
+        queue.overflow[pri].push_back(node);
+
+    __atomic_add_fetch(&queue.queued, 1, __ATOMIC_RELAXED);
+}
+
+/// Take the thread at the front of a ready list. Caller must be the
+/// queue's CPU, and hold its lock.
+/// \returns  The thread, or null if the list is empty
+static tcb_node *
+dequeue(run_queue &queue, unsigned pri)
+{
+    ready_ring &ring = queue.ready[pri];
+    tcb_list &overflow = queue.overflow[pri];
+
+    tcb_node *node = ring.pop();
+    if (!node)
+        node = overflow.pop_front();
+
+    // Move waiting threads into the ring, where other CPUs can steal them.
+    // Once a thread is in the ring, another CPU may take it at any time,
+    // so it must be off the overflow list first.
+    while (!overflow.empty()) {
+        tcb_node *waiting = overflow.pop_front();
+        if (!ring.push(waiting)) {
+            overflow.push_front(waiting);
+            break;
+        }
+    }
+
+    if (node)
+        __atomic_sub_fetch(&queue.queued, 1, __ATOMIC_RELAXED);
+    return node;
+}
+
+/// Check if a CPU has anything ready to run besides its idle thread.
+/// Caller must be the queue's CPU, and hold its lock.
+static bool
+has_ready(const run_queue &queue)
+{
+    for (unsigned pri = 0; pri < scheduler::idle_priority; ++pri)
+        if (queue.ready[pri].size() || !queue.overflow[pri].empty())
+            return true;
+    return false;
+}
+
+/// Hand a ready thread to a CPU through its inbox. Any CPU may post,
+/// without holding any lock. The thread's cpu must already be set.
+/// \returns  True if the thread is more urgent than what that CPU is
+///           running, so the CPU should be sent a schedule IPI
+static bool
+post(run_queue &queue, tcb_node *node)
+{
+    uint8_t priority = node->priority;
+    __atomic_add_fetch(&queue.queued, 1, __ATOMIC_RELAXED);
+
+    TCB *head = __atomic_load_n(&queue.inbox, __ATOMIC_RELAXED);
+    do {
+        node->inbox_next = head;
+    } while (!__atomic_compare_exchange_n(&queue.inbox, &head, static_cast<TCB*>(node),
+                true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    // Paired with the check in set_running(): either this sees what the
+    // CPU is about to run, or the CPU sees this thread in its inbox
+    return __atomic_load_n(&queue.running, __ATOMIC_SEQ_CST) > priority;
+}
+
+/// Move the threads in a CPU's inbox to its ready lists, in the order
+/// they were posted. Caller must be the queue's CPU, and hold its lock.
+static void
+drain_inbox(run_queue &queue)
+{
+    TCB *posted = __atomic_exchange_n(&queue.inbox, nullptr, __ATOMIC_ACQUIRE);
+
+    // The inbox is a stack, so reverse it
+    TCB *list = nullptr;
+    size_t count = 0;
+    while (posted) {
+        TCB *next = posted->inbox_next;
+        posted->inbox_next = list;
+        list = posted;
+        posted = next;
+        ++count;
+    }
+
+    // They were already counted when they were posted
+    __atomic_sub_fetch(&queue.queued, count, __ATOMIC_RELAXED);
+
+    while (list) {
+        TCB *next = list->inbox_next;
+        enqueue(queue, static_cast<tcb_node*>(list));
+        list = next;
+    }
+}
+
+/// Record the priority of the thread this CPU is about to run. Caller
+/// must be the queue's CPU, and hold its lock.
+static void
+set_running(cpu_data &cpu, run_queue &queue, const TCB *next)
+{
+    __atomic_store_n(&queue.running, next->priority, __ATOMIC_SEQ_CST);
+
+    // A thread posted before the store above may have seen an older, more
+    // urgent priority and not sent an IPI, so send one ourselves
+    if (__atomic_load_n(&queue.inbox, __ATOMIC_SEQ_CST))
+        cpu.apic->send_ipi(lapic::ipi_fixed, isr::ipiSchedule, cpu.id);
+}
+
+static inline void
+count_stat(uint64_t &counter)
+{
+    __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+}
+
+/// Charge the current thread for the time since it was last charged.
+/// Caller must hold the queue's lock.
+static void
+charge_current(run_queue &queue)
+{
+    uint64_t tsc = rdtsc();
+    uint64_t used = tsc - queue.last_tsc;
+    queue.last_tsc = tsc;
+
+    tcb_node *tcb = queue.current;
+    tcb->run_cycles += used;
+    if (tcb->priority == scheduler::idle_priority)
+        __atomic_add_fetch(&queue.stats.idle_cycles, used, __ATOMIC_RELAXED);
+}
+
+static constexpr uint32_t no_timer = ~0u;
+
+/// Put a timer at a heap position, keeping its thread's index up to date
+static inline void
+place_timer(util::vector<wake_timer> &heap, size_t i, const wake_timer &timer)
+{
+    heap[i] = timer;
+    timer.tcb->timer_index = i;
+}
+
+static void
+sift_up(util::vector<wake_timer> &heap, size_t i)
+{
+    wake_timer timer = heap[i];
+    while (i) {
+        size_t parent = (i - 1) / 2;
+        if (heap[parent].deadline <= timer.deadline)
+            break;
+        place_timer(heap, i, heap[parent]);
+        i = parent;
+    }
+    place_timer(heap, i, timer);
+}
+
+static void
+sift_down(util::vector<wake_timer> &heap, size_t i)
+{
+    const size_t count = heap.count();
+    wake_timer timer = heap[i];
+    while (true) {
+        size_t least = i;
+        uint64_t least_deadline = timer.deadline;
+        size_t left = i * 2 + 1;
+        size_t right = left + 1;
+        if (left < count && heap[left].deadline < least_deadline) {
+            least = left;
+            least_deadline = heap[left].deadline;
+        }
+        if (right < count && heap[right].deadline < least_deadline)
+            least = right;
+        if (least == i)
+            break;
+
+        place_timer(heap, i, heap[least]);
+        i = least;
+    }
+    place_timer(heap, i, timer);
+}
+
+/// Set a thread's wake timeout, replacing any it already has
+/// \returns  True if a new entry was added, which needs a reference
+static bool
+push_timer(util::vector<wake_timer> &heap, uint64_t deadline, tcb_node *tcb)
+{
+    size_t i = tcb->timer_index;
+    if (i != no_timer) {
+        uint64_t old = heap[i].deadline;
+        heap[i].deadline = deadline;
+        if (deadline < old)
+            sift_up(heap, i);
+        else
+            sift_down(heap, i);
+        return false;
+    }
+
+    heap.append({deadline, tcb});
+    sift_up(heap, heap.count() - 1);
+    return true;
+}
+
+/// Remove a thread's wake timeout, if it has one
+/// \returns  True if an entry was removed, whose reference the caller
+///           must release
+static bool
+remove_timer(util::vector<wake_timer> &heap, tcb_node *tcb)
+{
+    size_t i = tcb->timer_index;
+    if (i == no_timer)
+        return false;
+
+    tcb->timer_index = no_timer;
+    wake_timer last = heap.pop();
+    if (i == heap.count())
+        return true;
+
+    // The last entry may belong either above or below the removed one
+    place_timer(heap, i, last);
+    sift_down(heap, i);
+    sift_up(heap, last.tcb->timer_index);
+    return true;
+}
+
 scheduler::scheduler(unsigned cpus) :
     m_add_index {0}
 {
@@ -64,7 +430,7 @@ inline T * push(uintptr_t &rsp, size_t size = sizeof(T)) {
 }
 
 void
-scheduler::create_kernel_task(void (*task)(), uint8_t priority, bool constant)
+scheduler::create_kernel_task(void (*task)(), uint8_t priority, bool constant, uint64_t affinity)
 {
     process &kp = process::kernel_process();
     thread *th = kp.create_thread(0, priority);
@@ -72,11 +438,13 @@ scheduler::create_kernel_task(void (*task)(), uint8_t priority, bool constant)
 
     th->add_thunk_kernel(reinterpret_cast<uintptr_t>(task));
 
+    // Not yet running, so it's placed by its affinity when it wakes
+    tcb->affinity = affinity;
     tcb->time_left = quantum(priority);
     if (constant)
         th->set_state(thread::state::constant);
 
-    th->set_state(thread::state::ready);
+    th->wake();
 
     log::verbose(logs::task, "Spawned new kernel task <%02lx:%02lx>", kp.obj_id(), th->obj_id());
 }
@@ -97,16 +465,160 @@ scheduler::start()
         util::scoped_lock lock {queue.lock};
         thread *idle = cpu.thread;
         queue.current = idle->tcb();
+        queue.running = idle_priority;
+        queue.last_tsc = rdtsc();
+
+        for (uint8_t distance = 0; distance < 3; ++distance) {
+            for (unsigned i = 0; i < g_num_cpus; ++i) {
+                const cpu_data &other = *g_cpu_data[i];
+                if (i == cpu.index) continue;
+
+                uint8_t d =
+                    other.package != cpu.package ? 2 :
+                    other.core != cpu.core ? 1 : 0;
+                if (d == distance)
+                    queue.victims.append({static_cast<uint16_t>(i), d});
+            }
+        }
     }
 
+    tlb::set_online();
+
     cpu.apic->enable_timer(isr::isrTimer, false);
     cpu.apic->reset_timer(10);
 }
 
+cpu_data *
+scheduler::select_cpu(TCB *t, cpu_data *prev, cpu_data *waker)
+{
+    // Find the least-loaded allowed CPU, starting somewhere different
+    // each time so that ties are spread around
+    const unsigned start = __atomic_fetch_add(&m_add_index, 1, __ATOMIC_RELAXED) % g_num_cpus;
+    unsigned least = start;
+    uint32_t least_load = -1u;
+    for (unsigned i = 0; i < g_num_cpus && least_load; ++i) {
+        unsigned index = (start + i) % g_num_cpus;
+        if (!allowed_on(t, index))
+            continue;
+
+        uint32_t load = get_load(m_run_queues[index]);
+        if (load < least_load) {
+            least = index;
+            least_load = load;
+        }
+    }
+
+    if (prev && !allowed_on(t, prev->index))
+        prev = nullptr;
+
+    if (waker && !allowed_on(t, waker->index))
+        waker = nullptr;
+
+    cpu_data *least_cpu = g_cpu_data[least];
+    if (!prev) {
+        count_stat(m_run_queues[least].stats.placed);
+        return least_cpu;
+    }
+
+    run_queue &prev_queue = m_run_queues[prev->index];
+    const uint32_t prev_load = get_load(prev_queue);
+    if (!prev_load) {
+        count_stat(prev_queue.stats.wake_local);
+        return prev;
+    }
+
+    // With nothing else queued on the waker's CPU, the waker is likely
+    // to block on the thread it just woke (eg, an IPC partner), so run
+    // the two on the same CPU and cache
+    if (waker && waker != prev) {
+        run_queue &waker_queue = m_run_queues[waker->index];
+        if (get_load(waker_queue) <= 1) {
+            count_stat(waker_queue.stats.wake_affine);
+            return waker;
+        }
+    }
+
+    // Leave the thread where it last ran unless it would have to wait
+    // while another CPU sits idle, or another CPU is much less loaded
+    const uint32_t slack = least_load ? imbalance : 0;
+    if (prev_load <= least_load + slack) {
+        count_stat(prev_queue.stats.wake_local);
+        return prev;
+    }
+
+    count_stat(m_run_queues[least].stats.wake_balanced);
+    return least_cpu;
+}
+
+scheduler::cpu_stats
+scheduler::get_stats(unsigned cpu) const
+{
+    const run_queue &queue = m_run_queues[cpu];
+    cpu_stats stats = queue.stats;
+    stats.load = get_load(queue);
+    return stats;
+}
+
+scheduler::thread_stats
+scheduler::get_thread_stats(const TCB *t)
+{
+    thread *th = t->thread;
+    return thread_stats {
+        th->koid(),
+        th->parent().koid(),
+        t->run_cycles,
+        t->wait_cycles,
+        t->voluntary_switches,
+        t->involuntary_switches,
+        t->migrations,
+        t->cpu ? t->cpu->index : uint16_t(0),
+        t->priority,
+    };
+}
+
+size_t
+scheduler::get_thread_stats(thread_stats *stats, size_t max)
+{
+    size_t count = 0;
+    auto add = [&](const TCB *t) {
+        if (count < max)
+            stats[count] = get_thread_stats(t);
+        ++count;
+    };
+
+    for (run_queue &queue : m_run_queues) {
+        util::scoped_lock lock {queue.lock};
+        if (queue.current)
+            add(queue.current);
+
+        // Only this queue's CPU adds to its ready rings, and it holds the
+        // lock to do so, but other CPUs may steal from them meanwhile
+        for (const ready_ring &ring : queue.ready) {
+            uint64_t h = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+            uint64_t t = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+            for (; h < t; ++h)
+                add(ring.slots[h % ready_ring::capacity]);
+        }
+
+        for (auto &pri_list : queue.overflow)
+            for (auto *tcb : pri_list) add(tcb);
+
+        // Threads are only removed from the inbox with the lock held
+        for (const TCB *t = __atomic_load_n(&queue.inbox, __ATOMIC_ACQUIRE);
+                t; t = t->inbox_next)
+            add(t);
+
+        for (auto *tcb : queue.blocked) add(tcb);
+        for (auto *tcb : queue.migrating) add(tcb);
+    }
+
+    return count;
+}
+
 void
 scheduler::add_thread(TCB *t)
 {
-    cpu_data *cpu = g_cpu_data[m_add_index++ % g_num_cpus];
+    cpu_data *cpu = select_cpu(t, nullptr, nullptr);
     run_queue &queue = m_run_queues[cpu->index];
     util::scoped_lock lock {queue.lock};
 
@@ -115,124 +627,415 @@ scheduler::add_thread(TCB *t)
 
     t->cpu = cpu;
     t->time_left = quantum(t->priority);
+    t->blocked = true;
     queue.blocked.push_back(static_cast<tcb_node*>(t));
 }
 
 void
-scheduler::prune(run_queue &queue, uint64_t now)
+scheduler::requeue(TCB *t)
 {
-    // Find processes that are ready or have exited and
-    // move them to the appropriate lists.
-    auto *tcb = queue.blocked.front();
-    while (tcb) {
-        thread *th = tcb->thread;
-        uint8_t priority = tcb->priority;
+    tcb_node *node = static_cast<tcb_node*>(t);
+    thread *th = node->thread;
+
+    cpu_data *cpu = nullptr;
+    run_queue *queue = nullptr;
+    util::spinlock::waiter waiter {false, nullptr, "requeue"};
+
+    // The thread may be migrated to another CPU while we wait for the lock
+    while (true) {
+        cpu = node->cpu;
+        kassert(cpu, "thread with a null cpu");
+        queue = &m_run_queues[cpu->index];
+        queue->lock.acquire(&waiter);
+        if (node->cpu == cpu)
+            break;
+        queue->lock.release(&waiter);
+    }
+
+    // Whether a wake timeout's reference to the thread needs releasing
+    bool had_timer = false;
+    bool preempt = false;
+
+    if (node->blocked) {
+        if (th->has_state(thread::state::exited)) {
+            queue->blocked.remove(node);
+            node->blocked = false;
+            had_timer = remove_timer(queue->timers, node);
+            queue->lock.release(&waiter);
+            if (had_timer)
+                th->handle_release();
+            th->handle_release();
+            return;
+        }
+
+        if (th->has_state(thread::state::ready)) {
+            queue->blocked.remove(node);
+            node->blocked = false;
+            node->ready_since = rdtsc();
+            had_timer = remove_timer(queue->timers, node);
+
+            // A thread that may still be switching out on its old CPU
+            // can't run anywhere else yet
+            cpu_data *target = queue->prev == th->obj_id() ?
+                cpu : select_cpu(node, cpu, &current_cpu());
+
+            // Even for this CPU, go through the inbox: only a CPU's own
+            // schedule() adds to its ready lists
+            node->cpu = target;
+            preempt = post(m_run_queues[target->index], node);
+            cpu = target;
+        }
+    } else {
+        preempt = __atomic_load_n(&queue->running, __ATOMIC_RELAXED) > node->priority;
+    }
+
+    queue->lock.release(&waiter);
+
+    if (had_timer)
+        th->handle_release();
+
+    if (preempt)
+        current_cpu().apic->send_ipi(
+            lapic::ipi_fixed, isr::ipiSchedule, cpu->id);
+}
+
+void
+scheduler::queue_current(cpu_data &cpu, run_queue &queue)
+{
+    tcb_node *tcb = queue.current;
+    thread *th = tcb->thread;
+
+    // Other CPUs may steal the thread as soon as it's on a ready list, so
+    // first mark it as not done switching out
+    __atomic_store_n(&queue.prev, th->obj_id(), __ATOMIC_RELEASE);
+
+    if (th->has_state(thread::state::exited)) {
+        // Wait until the next schedule to release it, because we may be
+        // deleting our current page tables
+        queue.exited.push_back(tcb);
+    } else if (!th->has_state(thread::state::ready)) {
+        tcb->blocked = true;
+        queue.blocked.push_back(tcb);
 
         uint64_t timeout = th->wake_timeout();
-        if (timeout && timeout <= now)
+        if (timeout && push_timer(queue.timers, timeout, tcb))
+            th->handle_retain();
+    } else if (!allowed_on(tcb, cpu.index)) {
+        tcb->ready_since = queue.last_tsc;
+        queue.migrating.push_back(tcb);
+    } else {
+        tcb->ready_since = queue.last_tsc;
+        enqueue(queue, tcb);
+    }
+}
+
+void
+scheduler::expire_timers(cpu_data &cpu, run_queue &queue, uint64_t now)
+{
+    while (!queue.timers.empty() && queue.timers[0].deadline <= now) {
+        tcb_node *tcb = queue.timers[0].tcb;
+        thread *th = tcb->thread;
+        remove_timer(queue.timers, tcb);
+
+        // Threads' entries are removed when they're woken, so this thread
+        // is still blocked here, unless it's being woken right now
+        if (tcb->blocked) {
             th->wake_only();
+            if (!th->has_state(thread::state::exited)) {
+                queue.blocked.remove(tcb);
+                tcb->blocked = false;
+                tcb->ready_since = queue.last_tsc;
+                log::spam(logs::sched, "Readying thread %llx on timeout", th->koid());
+                if (allowed_on(tcb, cpu.index))
+                    enqueue(queue, tcb);
+                else
+                    queue.migrating.push_back(tcb);
+            }
+        }
 
-        bool ready = th->has_state(thread::state::ready);
-        bool exited = th->has_state(thread::state::exited);
-        bool constant = th->has_state(thread::state::constant);
-        bool current = tcb == queue.current;
+        th->handle_release();
+    }
+}
 
-        auto *remove = tcb;
-        tcb = tcb->next();
-        if (!exited && !ready)
-            continue;
+void
+scheduler::move_migrating(run_queue &queue)
+{
+    if (queue.migrating.empty())
+        return;
 
-        if (exited) {
-            // If the current thread has exited, wait until the next call
-            // to prune() to delete it, because we may be deleting our current
-            // page tables
-            if (current) continue;
+    tcb_list moving;
+    {
+        util::scoped_lock lock {queue.lock};
+        moving.append(queue.migrating);
+    }
 
-            queue.blocked.remove(remove);
-            th->handle_release();
-        } else {
-            queue.blocked.remove(remove);
-            log::spam(logs::sched, "Prune: readying unblocked thread %llx", th->koid());
-            queue.ready[remove->priority].push_back(remove);
-        }
+    while (!moving.empty()) {
+        tcb_node *node = moving.pop_front();
+        cpu_data *cpu = select_cpu(node, nullptr, nullptr);
+
+        node->cpu = cpu;
+        if (post(m_run_queues[cpu->index], node))
+            current_cpu().apic->send_ipi(
+                lapic::ipi_fixed, isr::ipiSchedule, cpu->id);
+    }
+}
+
+/// Lock the run queue of the CPU a thread is on, following it if it
+/// migrates while waiting for the lock
+static run_queue &
+lock_thread_queue(util::vector<run_queue> &queues, tcb_node *node,
+        util::spinlock::waiter &waiter)
+{
+    while (true) {
+        cpu_data *cpu = node->cpu;
+        kassert(cpu, "thread with a null cpu");
+        run_queue &queue = queues[cpu->index];
+        queue.lock.acquire(&waiter);
+        if (node->cpu == cpu)
+            return queue;
+        queue.lock.release(&waiter);
+    }
+}
+
+void
+scheduler::set_priority(TCB *t, uint8_t priority, bool constant)
+{
+    tcb_node *node = static_cast<tcb_node*>(t);
+    thread *th = node->thread;
+
+    util::spinlock::waiter waiter {false, nullptr, "set_priority"};
+    run_queue &queue = lock_thread_queue(m_run_queues, node, waiter);
+
+    if (constant)
+        th->set_state(thread::state::constant);
+    else
+        th->clear_state(thread::state::constant);
+
+    node->base_priority = priority;
+    node->priority = priority;
+    node->time_left = quantum(priority);
+
+    // A ready thread may be waiting in the list for its old priority,
+    // which only its CPU can take it out of
+    bool ready = !node->blocked && queue.current != node;
+    if (ready)
+        __atomic_store_n(&queue.resort, true, __ATOMIC_RELEASE);
+
+    bool preempt = ready &&
+        __atomic_load_n(&queue.running, __ATOMIC_RELAXED) > priority;
+    cpu_data *cpu = node->cpu;
+    queue.lock.release(&waiter);
+
+    if (preempt)
+        current_cpu().apic->send_ipi(
+            lapic::ipi_fixed, isr::ipiSchedule, cpu->id);
+}
+
+void
+scheduler::set_affinity(TCB *t, uint64_t mask)
+{
+    tcb_node *node = static_cast<tcb_node*>(t);
+
+    util::spinlock::waiter waiter {false, nullptr, "set_affinity"};
+    run_queue &queue = lock_thread_queue(m_run_queues, node, waiter);
+
+    node->affinity = mask;
+
+    // Ready threads are left to their CPU to move, as it's the only one
+    // that knows they've finished switching out, and the only one that
+    // can take them off its ready lists. Blocked threads are placed by
+    // their affinity when they wake.
+    cpu_data *cpu = node->cpu;
+    bool move = !allowed_on(node, cpu->index) && !node->blocked;
+    if (move && queue.current != node)
+        __atomic_store_n(&queue.resort, true, __ATOMIC_RELEASE);
+    queue.lock.release(&waiter);
+
+    if (!move)
+        return;
+
+    cpu_data &me = current_cpu();
+    if (cpu == &me)
+        schedule();
+    else
+        me.apic->send_ipi(lapic::ipi_fixed, isr::ipiSchedule, cpu->id);
+}
+
+void
+scheduler::reap_exited(run_queue &queue)
+{
+    while (!queue.exited.empty()) {
+        tcb_node *tcb = queue.exited.pop_front();
+        tcb->thread->handle_release();
     }
 }
 
 void
-scheduler::check_promotions(run_queue &queue, uint64_t now)
+scheduler::arm_timer(cpu_data &cpu, run_queue &queue, TCB *next, uint64_t now)
 {
-    for (auto &pri_list : queue.ready) {
-        for (auto *tcb : pri_list) {
+    // The idle thread has no quantum to end: anything woken onto this
+    // CPU sends it an IPI, so it only needs the next wake timeout, if any
+    bool idle = next->priority == idle_priority;
+    uint64_t interval = idle ? 0 : next->time_left;
+
+    if (!queue.timers.empty()) {
+        uint64_t deadline = queue.timers[0].deadline;
+        uint64_t until = deadline > now ? deadline - now : 1;
+        if (idle || until < interval)
+            interval = until;
+    }
+
+    queue.interval = interval;
+    cpu.apic->reset_timer(interval);
+}
+
+uint32_t
+scheduler::stop_timer(cpu_data &cpu, run_queue &queue)
+{
+    // The timer may have been set short of the thread's quantum for a
+    // wake timeout, so charge only the time actually used
+    uint32_t left = cpu.apic->stop_timer();
+    uint32_t used = queue.interval > left ? queue.interval - left : 0;
+    uint32_t time_left = queue.current->time_left;
+    return used < time_left ? time_left - used : 0;
+}
+
+void
+scheduler::sort_ready(cpu_data &cpu, run_queue &queue, uint64_t now, bool promote)
+{
+    // Take everything off the lists first, so no thread is seen twice
+    tcb_list ready[num_priorities];
+    for (unsigned pri = 0; pri < num_priorities; ++pri)
+        while (tcb_node *tcb = dequeue(queue, pri))
+            ready[pri].push_back(tcb);
+
+    for (unsigned pri = 0; pri < num_priorities; ++pri) {
+        while (!ready[pri].empty()) {
+            tcb_node *tcb = ready[pri].pop_front();
             const thread *th = tcb->thread;
 
-            if (th->has_state(thread::state::constant))
+            if (!allowed_on(tcb, cpu.index)) {
+                // Its affinity changed while it waited
+                queue.migrating.push_back(tcb);
                 continue;
+            }
 
-            const uint64_t age = now - tcb->last_ran;
+            // Use the thread's own priority rather than the list it was
+            // on, which is stale if its priority was set while it waited
             const uint8_t priority = tcb->priority;
-
-            bool stale =
+            const uint64_t age = now - tcb->last_ran;
+            bool stale = promote &&
+                !th->has_state(thread::state::constant) &&
                 age > quantum(priority) * 2 &&
-                tcb->priority > promote_limit;
+                priority > tcb->base_priority;
 
             if (stale) {
                 // If the thread is stale, promote it
-                queue.ready[priority].remove(tcb);
-                tcb->priority -= 1;
+                tcb->priority = priority - 1;
                 tcb->time_left = quantum(tcb->priority);
-                queue.ready[tcb->priority].push_back(tcb);
                 log::verbose(logs::sched, "Scheduler promoting thread %llx, priority %d",
                         th->koid(), tcb->priority);
             }
+
+            enqueue(queue, tcb);
         }
     }
 
-    queue.last_promotion = now;
+    if (promote)
+        queue.last_promotion = now;
 }
 
+/// Move ready threads of each priority from another CPU's ready lists to
+/// this one's, until they're balanced. Caller must be `to`'s CPU, and hold
+/// its lock. The victim isn't locked: threads are taken from the front of
+/// its rings the same way its own CPU takes them.
+/// \arg idle  Round up, so that an idle CPU takes a lone waiting thread
 static size_t
-balance_lists(tcb_list &to, tcb_list &from, cpu_data &new_cpu)
+balance_queues(run_queue &to, run_queue &from, cpu_data &new_cpu, bool idle)
 {
-    size_t to_len = to.length();
-    size_t from_len = from.length();
+    size_t stolen = 0;
+
+    // Steal from most urgent queues first, don't steal idle threads.
+    // Blocked threads stay put, their wake timeouts are per-CPU.
+    for (unsigned pri = 0; pri < scheduler::idle_priority; ++pri) {
+        ready_ring &src = from.ready[pri];
+
+        size_t to_len = to.ready[pri].size() + to.overflow[pri].length();
+        size_t from_len = src.size();
+
+        // Only steal from the rich, don't be Dennis Moore
+        if (from_len <= to_len)
+            continue;
 
-    // Only steal from the rich, don't be Dennis Moore
-    if (from_len <= to_len)
-        return 0;
+        size_t steal = (from_len - to_len + (idle ? 1 : 0)) / 2;
+        while (steal) {
+            tcb_node *node = src.pop();
+            if (!node)
+                break;
+            __atomic_sub_fetch(&from.queued, 1, __ATOMIC_RELAXED);
 
-    size_t steal = (from_len - to_len) / 2;
-    for (size_t i = 0; i < steal; ++i) {
-        tcb_node *node = from.pop_front();
-        node->cpu = &new_cpu;
-        to.push_front(node);
+            // The thread that last switched out may not have finished
+            // saving its state, so it can't run anywhere else yet. It
+            // can only be checked once taken, so give it back, and leave
+            // the rest of this list for its own CPU.
+            if (node->thread->obj_id() == __atomic_load_n(&from.prev, __ATOMIC_ACQUIRE) ||
+                !allowed_on(node, new_cpu.index)) {
+                post(from, node);
+                break;
+            }
+
+            node->cpu = &new_cpu;
+            enqueue(to, node);
+            ++stolen;
+            --steal;
+        }
     }
-    return steal;
+    return stolen;
 }
 
-void
-scheduler::steal_work(cpu_data &cpu)
+run_queue *
+scheduler::choose_victim(run_queue &queue, uint32_t min_load)
 {
-    run_queue &my_queue = m_run_queues[cpu.index];
+    run_queue *best = nullptr;
+    uint32_t best_load = 0;
+    uint8_t distance = 0;
 
-    const unsigned count = m_run_queues.count();
-    for (unsigned i = 0; i < count; ++i) {
-        if (i == cpu.index) continue;
+    for (const steal_victim &v : queue.victims) {
+        // Prefer any victim in a nearer group to a busier one farther away
+        if (v.distance != distance) {
+            if (best) break;
+            distance = v.distance;
+        }
 
-        run_queue &other_queue = m_run_queues[i];
-        util::scoped_lock other_queue_lock {other_queue.lock};
+        run_queue &other = m_run_queues[v.index];
+        uint32_t load = get_load(other);
+        if (load >= min_load && load > best_load) {
+            best = &other;
+            best_load = load;
+        }
+    }
 
-        size_t stolen = 0;
+    return best;
+}
 
-        // Steal from most urgent queues first, don't steal idle threads
-        for (unsigned pri = 0; pri < idle_priority; ++pri)
-            stolen += balance_lists(my_queue.ready[pri], other_queue.ready[pri], cpu);
+void
+scheduler::steal_work(cpu_data &cpu, bool idle)
+{
+    run_queue &my_queue = m_run_queues[cpu.index];
 
-        stolen += balance_lists(my_queue.blocked, other_queue.blocked, cpu);
-        other_queue_lock.release();
+    // Loads count the running thread, so a victim needs at least two to
+    // have one waiting. When balancing, only take from much busier CPUs.
+    uint32_t min_load = idle ? 2 : get_load(my_queue) + 2;
+    run_queue *other_queue = choose_victim(my_queue, min_load);
+    if (!other_queue)
+        return;
 
-        if (stolen)
-            log::verbose(logs::sched, "CPU%02x stole %2d tasks from CPU%02x",
-                    cpu.index, stolen, i);
+    size_t stolen = balance_queues(my_queue, *other_queue, cpu, idle);
+    if (stolen) {
+        __atomic_add_fetch(&my_queue.stats.stolen, stolen, __ATOMIC_RELAXED);
+
+        log::verbose(logs::sched, "CPU%02x stole %2d tasks from CPU%02x",
+                cpu.index, stolen, static_cast<unsigned>(other_queue - &m_run_queues[0]));
     }
 }
 
@@ -241,9 +1044,10 @@ scheduler::schedule()
 {
     cpu_data &cpu = current_cpu();
     run_queue &queue = m_run_queues[cpu.index];
-    lapic &apic = *cpu.apic;
 
-    uint32_t remaining = apic.stop_timer();
+    move_migrating(queue);
+
+    uint32_t remaining = stop_timer(cpu, queue);
     uint64_t now = clock::get().value();
 
     // We need to explicitly lock/unlock here instead of
@@ -253,13 +1057,11 @@ scheduler::schedule()
     // function, which screws up RAII
     util::spinlock::waiter waiter {false, nullptr, "schedule"};
     queue.lock.acquire(&waiter);
+    charge_current(queue);
 
-    // Only one CPU can be stealing at a time
-    if (m_steal_turn == cpu.index &&
-        now - queue.last_steal > steal_frequency) {
-        steal_work(cpu);
+    if (now - queue.last_steal > steal_frequency) {
+        steal_work(cpu, false);
         queue.last_steal = now;
-        m_steal_turn = (m_steal_turn + 1) % m_run_queues.count();
     }
 
     queue.current->time_left = remaining;
@@ -282,62 +1084,173 @@ scheduler::schedule()
         queue.current->time_left += bonus;
     }
 
-    if (th->has_state(thread::state::ready)) {
-        queue.ready[queue.current->priority].push_back(queue.current);
-    } else {
-        queue.blocked.push_back(queue.current);
-    }
+    reap_exited(queue);
+    queue_current(cpu, queue);
+    drain_inbox(queue);
 
     clock::get().update();
-    prune(queue, now);
-    if (now - queue.last_promotion > promote_frequency)
-        check_promotions(queue, now);
+    expire_timers(cpu, queue, now);
 
-    priority = 0;
-    while (queue.ready[priority].empty()) {
-        ++priority;
-        kassert(priority < num_priorities, "All runlists are empty");
-    }
+    bool resort = __atomic_exchange_n(&queue.resort, false, __ATOMIC_ACQUIRE);
+    bool promote = now - queue.last_promotion > promote_frequency;
+    if (resort || promote)
+        sort_ready(cpu, queue, now, promote);
 
     queue.current->last_ran = now;
 
-    auto *next = queue.ready[priority].pop_front();
+    // About to go idle, so pull work from elsewhere right away
+    if (!has_ready(queue) && g_num_cpus > 1)
+        steal_work(cpu, true);
+
+    tcb_node *next = nullptr;
+    while (!next) {
+        priority = 0;
+        while (!(next = dequeue(queue, priority))) {
+            ++priority;
+            kassert(priority < num_priorities, "All runlists are empty");
+        }
+
+        if (next->thread->has_state(thread::state::exited)) {
+            // Killed while waiting to run
+            queue.exited.push_back(next);
+            next = nullptr;
+        } else if (!allowed_on(next, cpu.index)) {
+            // Its affinity changed while it waited
+            queue.migrating.push_back(next);
+            next = nullptr;
+        } else if (next->priority > priority) {
+            // It was made less urgent while it waited
+            enqueue(queue, next);
+            next = nullptr;
+        }
+    }
+
+    if (queue.last_tsc > next->ready_since)
+        next->wait_cycles += queue.last_tsc - next->ready_since;
+
     next->last_ran = now;
-    apic.reset_timer(next->time_left);
+    arm_timer(cpu, queue, next, now);
+    set_running(cpu, queue, next);
 
     if (next == queue.current) {
         queue.lock.release(&waiter);
         return;
     }
 
-    queue.prev = queue.current->thread->obj_id();
+    switch_to(cpu, queue, next, waiter);
+}
+
+void
+scheduler::switch_to(cpu_data &cpu, run_queue &queue, TCB *t,
+        util::spinlock::waiter &waiter)
+{
+    tcb_node *next = static_cast<tcb_node*>(t);
+    thread *th = queue.current->thread;
     thread *next_thread = next->thread;
 
+    if (th->has_state(thread::state::ready) &&
+        !th->has_state(thread::state::exited))
+        ++queue.current->involuntary_switches;
+    else
+        ++queue.current->voluntary_switches;
+
+    if (next->last_cpu != &cpu) {
+        if (next->last_cpu)
+            ++next->migrations;
+        next->last_cpu = &cpu;
+    }
+
+    process &prev_process = th->parent();
+    process &next_process = next_thread->parent();
+    if (&prev_process != &next_process) {
+        prev_process.space().set_active_on(cpu.index, false);
+        next_process.space().set_active_on(cpu.index, true);
+    }
+
+    // PCIDs are per-CPU, so this is needed even when staying in the
+    // same process: the thread may last have run on another CPU
+    next->pml4 = tlb::switch_cr3(cpu, next_process.space());
+
     cpu.thread = next_thread;
-    cpu.process = &next_thread->parent();
+    cpu.process = &next_process;
     queue.current = next;
 
+    count_stat(queue.stats.switches);
+
     log::spam(logs::sched, "CPU%02x switching threads %llx->%llx",
             cpu.index, th->koid(), next_thread->koid());
     log::spam(logs::sched, "    priority %d time left %d @ %lld.",
-            next->priority, next->time_left, now);
+            next->priority, next->time_left, next->last_ran);
     log::spam(logs::sched, "    PML4 %llx", next->pml4);
 
     queue.lock.release(&waiter);
     task_switch(queue.current);
+
+    // Now running as whichever thread was switched back in, possibly on
+    // another CPU. The thread that switched out there has finished
+    // saving its state, so threads re-pinned while running can move now
+    // instead of waiting for that CPU's next schedule(), which may not
+    // come for a long time if it's idle.
+    move_migrating(m_run_queues[current_cpu().index]);
 }
 
-void
-scheduler::maybe_schedule(TCB *t)
+bool
+scheduler::handoff(TCB *t, uint64_t value)
 {
-    cpu_data *cpu = t->cpu;
-    kassert(cpu, "thread with a null cpu");
+    cpu_data &cpu = current_cpu();
+    run_queue &queue = m_run_queues[cpu.index];
+    tcb_node *next = static_cast<tcb_node*>(t);
+    thread *next_thread = next->thread;
 
-    run_queue &queue = m_run_queues[cpu->index];
-    uint8_t current_pri = queue.current->priority;
-    if (current_pri <= t->priority)
-        return;
+    // Claim the target from the blocked list of whichever CPU holds it.
+    // If it's already been woken, or it may still be running or switching
+    // out on another CPU, leave it to the normal wake path.
+    cpu_data *other_cpu = next->cpu;
+    run_queue &other = m_run_queues[other_cpu->index];
+    {
+        util::scoped_lock lock {other.lock};
+        if (next->cpu != other_cpu ||
+            !allowed_on(next, cpu.index) ||
+            next_thread->has_state(thread::state::ready) ||
+            next_thread->has_state(thread::state::exited) ||
+            !next->blocked ||
+            (&other != &queue && other.prev == next_thread->obj_id()))
+            return false;
+
+        other.blocked.remove(next);
+        next->blocked = false;
+        next->cpu = &cpu;
+        if (remove_timer(other.timers, next))
+            next_thread->handle_release();
+    }
+
+    next_thread->m_wake_value = value;
+    next_thread->wake_only();
+
+    uint32_t remaining = stop_timer(cpu, queue);
+    uint64_t now = clock::get().value();
+
+    util::spinlock::waiter waiter {false, nullptr, "handoff"};
+    queue.lock.acquire(&waiter);
+    charge_current(queue);
+
+    tcb_node *prev = queue.current;
+    prev->time_left = remaining;
+    prev->last_ran = now;
+
+    // The current thread may have been woken again already by another
+    // CPU, so queue it as schedule() would
+    reap_exited(queue);
+    queue_current(cpu, queue);
+
+    // Donate the rest of the timeslice to the target
+    if (remaining)
+        next->time_left = remaining;
+
+    next->last_ran = now;
+    arm_timer(cpu, queue, next, now);
+    set_running(cpu, queue, next);
 
-    current_cpu().apic->send_ipi(
-        lapic::ipi_fixed, isr::ipiSchedule, cpu->id);
+    switch_to(cpu, queue, next, waiter);
+    return true;
 }
@@ -3,6 +3,7 @@
 /// The task scheduler and related definitions
 
 #include <stdint.h>
+#include <util/spinlock.h>
 #include <util/vector.h>
 
 extern cpu_data** g_cpu_data;
@@ -47,6 +48,37 @@ public:
     /// How many quanta a process gets before being rescheduled
     static const uint16_t process_quanta = 10;
 
+    /// How many more runnable threads the CPU a thread last ran on may
+    /// have than the least-loaded CPU before the thread is moved
+    static const uint32_t imbalance = 1;
+
+    /// Per-CPU scheduling statistics
+    struct cpu_stats
+    {
+        uint32_t load;          ///< Runnable threads, not counting the idle thread
+        uint64_t switches;      ///< Context switches
+        uint64_t placed;        ///< New threads placed on this CPU
+        uint64_t wake_local;    ///< Threads woken on the CPU they last ran on
+        uint64_t wake_affine;   ///< Threads woken on their waker's CPU
+        uint64_t wake_balanced; ///< Threads woken on the least-loaded CPU
+        uint64_t stolen;        ///< Threads stolen from other CPUs
+        uint64_t idle_cycles;   ///< TSC cycles spent running the idle thread
+    };
+
+    /// Scheduling accounting for one thread
+    struct thread_stats
+    {
+        uint64_t koid;          ///< The thread's kobject id
+        uint64_t process;       ///< The kobject id of the thread's process
+        uint64_t run_cycles;    ///< TSC cycles spent running
+        uint64_t wait_cycles;   ///< TSC cycles spent ready, waiting to run
+        uint64_t voluntary;     ///< Switches away after blocking or exiting
+        uint64_t involuntary;   ///< Switches away while still ready
+        uint64_t migrations;    ///< Times it ran on a different CPU than before
+        uint16_t cpu;           ///< Index of the CPU the thread is queued on
+        uint8_t priority;       ///< Current priority
+    };
+
     /// Constructor.
     /// \arg cpus  The number of CPUs to schedule for
     scheduler(unsigned cpus);
@@ -61,10 +93,12 @@ public:
     /// \arg proc     Function to run as a kernel task
     /// \arg priority Priority to start the process with
     /// \arg constant True if this task cannot be promoted/demoted
+    /// \arg affinity Bitmask of CPU indices the task may run on
     void create_kernel_task(
             void (*task)(),
             uint8_t priority,
-            bool constant = false);
+            bool constant = false,
+            uint64_t affinity = ~0ull);
 
     /// Get the quantum for a given priority.
     static uint32_t quantum(int priority);
@@ -76,14 +110,59 @@ public:
     /// Run the scheduler, possibly switching to a new task
     void schedule();
 
-    /// Check if the CPU is running a more important task. If not,
-    /// run the scheduler.
-    void maybe_schedule(TCB *t);
+    /// Move a thread out of its CPU's blocked list once it has been made
+    /// ready or has exited, and preempt that CPU if the thread is more
+    /// urgent than what it is running.
+    /// \arg t  The thread's TCB
+    void requeue(TCB *t);
+
+    /// Switch directly to a blocked thread, skipping the run queues. The
+    /// current thread must already have cleared its ready state. The
+    /// target is migrated to this CPU if it is not already here, is marked
+    /// ready, and runs on the rest of the current thread's timeslice.
+    /// \arg next   The TCB of the thread to switch to
+    /// \arg value  The value next's block() call should return
+    /// \returns    False if the target could not be switched to, in which
+    ///             case nothing has been changed
+    bool handoff(TCB *next, uint64_t value);
 
     /// Start scheduling a new thread.
     /// \arg t  The new thread's TCB
     void add_thread(TCB *t);
 
+    /// Set a thread's base priority, the most urgent priority promotion
+    /// can raise it to, and reset its current priority to match.
+    /// \arg t         The thread's TCB
+    /// \arg priority  The new base priority
+    /// \arg constant  True if the thread should stay at exactly this
+    ///                priority, never being promoted or demoted
+    void set_priority(TCB *t, uint8_t priority, bool constant);
+
+    /// Set the CPUs a thread may run on. A thread that is running or
+    /// ready on a CPU it is no longer allowed on is moved once that CPU
+    /// switches away from it. Blocked threads move when they wake.
+    /// \arg t     The thread's TCB
+    /// \arg mask  Bitmask of allowed CPU indices
+    void set_affinity(TCB *t, uint64_t mask);
+
+    /// Get a CPU's scheduling statistics. Counters are read without
+    /// locking, so are only approximate while that CPU is running.
+    /// \arg cpu  The index of the CPU
+    cpu_stats get_stats(unsigned cpu) const;
+
+    /// Get a thread's scheduling accounting. Time is charged when its CPU
+    /// reschedules, so a running thread's current timeslice isn't counted.
+    /// \arg t  The thread's TCB
+    static thread_stats get_thread_stats(const TCB *t);
+
+    /// Get the scheduling accounting of every thread, one CPU at a time.
+    /// Threads moving between CPUs during the call may be missed, or
+    /// counted twice.
+    /// \arg stats  [out] Array to fill with thread records
+    /// \arg max    Number of records `stats` has room for
+    /// \returns    The number of threads found, which may be more than `max`
+    size_t get_thread_stats(thread_stats *stats, size_t max);
+
     /// Get a reference to the scheduler
     /// \returns  A reference to the global system scheduler
     static scheduler & get() { return *s_instance; }
@@ -94,9 +173,67 @@ private:
     static constexpr uint64_t promote_frequency = 100;
     static constexpr uint64_t steal_frequency = 10;
 
-    void prune(run_queue &queue, uint64_t now);
-    void check_promotions(run_queue &queue, uint64_t now);
-    void steal_work(cpu_data &cpu);
+    /// Put the current thread back on the appropriate list of its run
+    /// queue, registering its wake timeout if it is blocking with one.
+    void queue_current(cpu_data &cpu, run_queue &queue);
+
+    /// Move threads whose affinity no longer allows this CPU to CPUs
+    /// that they're allowed on. Must be called without holding the run
+    /// queue's lock.
+    void move_migrating(run_queue &queue);
+
+    /// Ready the threads whose wake timeouts have passed
+    void expire_timers(cpu_data &cpu, run_queue &queue, uint64_t now);
+
+    /// Release threads that exited while running on this CPU
+    void reap_exited(run_queue &queue);
+
+    /// Program the LAPIC timer for the next thread's quantum, or for the
+    /// next wake timeout if that comes first. The idle thread only gets
+    /// the wake timeout, and no timer at all if there is none.
+    void arm_timer(cpu_data &cpu, run_queue &queue, TCB *next, uint64_t now);
+
+    /// Stop the LAPIC timer.
+    /// \returns  The time left in the current thread's quantum, in us
+    uint32_t stop_timer(cpu_data &cpu, run_queue &queue);
+
+    /// Choose the CPU a thread should become runnable on. New threads go
+    /// to the least-loaded CPU. Woken threads stay where their cache is
+    /// warm if that CPU is idle, move next to their waker if nothing else
+    /// is queued there, and otherwise stay put unless another CPU is
+    /// less loaded by more than `imbalance`.
+    /// Only CPUs allowed by the thread's affinity are considered.
+    /// \arg t      The thread's TCB
+    /// \arg prev   The CPU the thread last ran on, or null for a new thread
+    /// \arg waker  The CPU of the waking thread, or null
+    cpu_data * select_cpu(TCB *t, cpu_data *prev, cpu_data *waker);
+
+    /// Re-sort this CPU's ready threads: move any whose priority was set
+    /// while they waited to the right list, set aside any no longer
+    /// allowed on this CPU to be migrated, and optionally promote any
+    /// that have waited too long. Caller must hold the run queue's lock.
+    /// \arg promote  True to promote threads that have waited too long
+    void sort_ready(cpu_data &cpu, run_queue &queue, uint64_t now, bool promote);
+
+    /// Choose a CPU to steal from. Other CPUs are tried in order of how
+    /// much cache they share with this one, and the most loaded CPU of
+    /// the nearest group with any worth stealing from is chosen.
+    /// \arg queue     This CPU's run queue
+    /// \arg min_load  The least load a victim must have
+    /// \returns       The victim's run queue, or null
+    run_queue * choose_victim(run_queue &queue, uint32_t min_load);
+
+    /// Move ready threads from another CPU to this one. Caller must
+    /// hold this CPU's run queue lock. Victims aren't locked at all, so
+    /// any number of CPUs may steal at once.
+    /// \arg idle  True if this CPU has nothing to run, in which case
+    ///            it takes work from any CPU with threads waiting
+    void steal_work(cpu_data &cpu, bool idle);
+
+    /// Switch this CPU from its current thread to `next`, releasing the
+    /// run queue lock held by `waiter` before the switch.
+    void switch_to(cpu_data &cpu, run_queue &queue, TCB *next,
+            util::spinlock::waiter &waiter);
 
     uint32_t m_add_index;
     uint32_t m_tick_count;
@@ -105,7 +242,6 @@ private:
 
     util::vector<run_queue> m_run_queues;
 
-    unsigned m_steal_turn = 0;
     static scheduler *s_instance;
 };
 
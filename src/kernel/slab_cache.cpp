@@ -0,0 +1,285 @@
+#include <util/basic_types.h>
+#include <util/new.h>
+
+#include "cpu.h"
+#include "heap_allocator.h"
+#include "kassert.h"
+#include "slab_cache.h"
+
+extern heap_allocator &g_kernel_heap;
+
+slab_cache *slab_cache::s_first = nullptr;
+
+static constexpr size_t
+align_to(size_t n, size_t align)
+{
+    return (n + align - 1) & ~(align - 1);
+}
+
+slab_cache::slab_cache(const char *name, size_t size, size_t align, size_t slab_size) :
+    m_name {name},
+    m_slab_size {slab_size},
+    m_next_color {0},
+    m_spare {nullptr},
+    m_slabs {0},
+    m_slab_free {0},
+    m_full {nullptr},
+    m_empty {nullptr},
+    m_full_count {0},
+    m_cpus {},
+    m_next {s_first}
+{
+    kassert(slab_size && (slab_size & (slab_size - 1)) == 0,
+            "Slab size must be a power of two");
+
+    // Free objects hold the free list pointer
+    if (align < sizeof(void*)) align = sizeof(void*);
+    if (size < sizeof(void*)) size = sizeof(void*);
+
+    m_size = align_to(size, align);
+    m_first_offset = align_to(sizeof(slab), align);
+    kassert(m_first_offset + m_size <= slab_size, "Slab too small for its objects");
+
+    m_per_slab = (slab_size - m_first_offset) / m_size;
+
+    // Spread the leftover space at the end of the slab across the slabs
+    // as different starting offsets, so that the same object in different
+    // slabs doesn't always land on the same cache lines
+    size_t leftover = slab_size - m_first_offset - m_per_slab * m_size;
+    m_color_align = align;
+    m_colors = leftover / align + 1;
+
+    s_first = this;
+}
+
+slab_cache::cpu_magazines &
+slab_cache::current_magazines()
+{
+    unsigned index = current_cpu().index;
+    kassert(index < max_cpus, "Slab cache only supports 64 CPUs");
+    return m_cpus[index];
+}
+
+void *
+slab_cache::allocate()
+{
+    cpu_magazines &cpu = current_magazines();
+
+    magazine *m = cpu.loaded;
+    if (m && m->count)
+        return m->objects[--m->count];
+
+    m = cpu.previous;
+    if (m && m->count) {
+        cpu.previous = cpu.loaded;
+        cpu.loaded = m;
+        return m->objects[--m->count];
+    }
+
+    return allocate_slow(cpu);
+}
+
+void
+slab_cache::free(void *p)
+{
+    if (!p) return;
+
+    cpu_magazines &cpu = current_magazines();
+
+    magazine *m = cpu.loaded;
+    if (m && m->count < magazine_size) {
+        m->objects[m->count++] = p;
+        return;
+    }
+
+    m = cpu.previous;
+    if (m && m->count < magazine_size) {
+        cpu.previous = cpu.loaded;
+        cpu.loaded = m;
+        m->objects[m->count++] = p;
+        return;
+    }
+
+    free_slow(cpu, p);
+}
+
+void *
+slab_cache::allocate_slow(cpu_magazines &cpu)
+{
+    util::scoped_lock lock {m_lock};
+
+    magazine *full = m_full;
+    if (!full)
+        return slab_allocate();
+
+    m_full = full->next;
+    --m_full_count;
+
+    // Both of this CPU's magazines are empty: keep one, give the
+    // other back to the depot, and load the full one
+    if (cpu.previous) {
+        cpu.previous->next = m_empty;
+        m_empty = cpu.previous;
+    }
+    cpu.previous = cpu.loaded;
+    cpu.loaded = full;
+
+    return full->objects[--full->count];
+}
+
+void
+slab_cache::free_slow(cpu_magazines &cpu, void *p)
+{
+    util::scoped_lock lock {m_lock};
+
+    // Both of this CPU's magazines (if any) are full. Retire the previous
+    // one to the depot, or to the slabs if the depot is already holding
+    // enough, and load an empty one.
+    magazine *empty = nullptr;
+    if (cpu.previous) {
+        if (m_full_count < depot_limit) {
+            cpu.previous->next = m_full;
+            m_full = cpu.previous;
+            ++m_full_count;
+        } else {
+            drain(cpu.previous);
+            empty = cpu.previous;
+        }
+        cpu.previous = nullptr;
+    }
+
+    if (!empty && m_empty) {
+        empty = m_empty;
+        m_empty = empty->next;
+    }
+
+    if (!empty) {
+        empty = reinterpret_cast<magazine*>(g_kernel_heap.allocate(sizeof(magazine)));
+        if (!empty) {
+            slab_free(p);
+            return;
+        }
+        empty->count = 0;
+    }
+
+    cpu.previous = cpu.loaded;
+    cpu.loaded = empty;
+    empty->objects[empty->count++] = p;
+}
+
+void
+slab_cache::drain(magazine *m)
+{
+    while (m->count)
+        slab_free(m->objects[--m->count]);
+}
+
+slab_cache::slab *
+slab_cache::new_slab()
+{
+    void *mem = g_kernel_heap.allocate(m_slab_size);
+    if (!mem)
+        return nullptr;
+
+    uintptr_t base = reinterpret_cast<uintptr_t>(mem);
+    kassert((base & (m_slab_size - 1)) == 0, "Heap returned an unaligned slab");
+
+    slab *s = new (mem) slab;
+    s->cache = this;
+    s->in_use = 0;
+
+    uintptr_t start = base + m_first_offset + m_next_color * m_color_align;
+    m_next_color = (m_next_color + 1) % m_colors;
+
+    void **link = &s->free;
+    for (size_t i = 0; i < m_per_slab; ++i) {
+        void *object = reinterpret_cast<void*>(start + i * m_size);
+        *link = object;
+        link = reinterpret_cast<void**>(object);
+    }
+    *link = nullptr;
+
+    ++m_slabs;
+    m_slab_free += m_per_slab;
+    return s;
+}
+
+void *
+slab_cache::slab_allocate()
+{
+    slab *s = m_partial.front();
+    if (!s) {
+        if (m_spare) {
+            s = m_spare;
+            m_spare = nullptr;
+        } else {
+            s = new_slab();
+            if (!s) return nullptr;
+        }
+        m_partial.push_front(s);
+    }
+
+    void *p = s->free;
+    s->free = *reinterpret_cast<void**>(p);
+    ++s->in_use;
+    --m_slab_free;
+
+    // Full slabs aren't on any list, they're found again from their
+    // objects' addresses when those are freed
+    if (!s->free)
+        m_partial.remove(s);
+
+    return p;
+}
+
+void
+slab_cache::slab_free(void *p)
+{
+    uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+    slab *s = reinterpret_cast<slab*>(addr & ~(m_slab_size - 1));
+    kassert(s->cache == this, "Freeing an object to the wrong slab cache");
+
+    bool was_full = !s->free;
+    *reinterpret_cast<void**>(p) = s->free;
+    s->free = p;
+    --s->in_use;
+    ++m_slab_free;
+
+    if (was_full)
+        m_partial.push_front(s);
+
+    if (s->in_use)
+        return;
+
+    // Keep one empty slab around so a cache hovering around a slab
+    // boundary doesn't keep going back to the heap
+    m_partial.remove(s);
+    if (!m_spare) {
+        m_spare = s;
+        return;
+    }
+
+    --m_slabs;
+    m_slab_free -= m_per_slab;
+    g_kernel_heap.free(s);
+}
+
+slab_cache::stats
+slab_cache::get_stats()
+{
+    size_t cached = 0;
+    for (unsigned i = 0; i < max_cpus; ++i) {
+        const cpu_magazines &cpu = m_cpus[i];
+        magazine *loaded = __atomic_load_n(&cpu.loaded, __ATOMIC_RELAXED);
+        magazine *previous = __atomic_load_n(&cpu.previous, __ATOMIC_RELAXED);
+        if (loaded) cached += loaded->count;
+        if (previous) cached += previous->count;
+    }
+
+    util::scoped_lock lock {m_lock};
+    size_t total = m_slabs * m_per_slab;
+    size_t free = m_slab_free + cached + m_full_count * magazine_size;
+    if (free > total) free = total;
+
+    return {total - free, free, m_slabs};
+}
@@ -0,0 +1,140 @@
+#pragma once
+/// \file slab_cache.h
+/// A cache of fixed-size kernel objects with per-CPU magazines
+
+#include <stddef.h>
+#include <stdint.h>
+#include <util/linked_list.h>
+#include <util/spinlock.h>
+
+/// A cache of fixed-size kernel objects, carved out of slabs allocated
+/// from the kernel heap. Each CPU keeps a pair of magazines (small stacks
+/// of free objects) that satisfy allocations and frees without locking.
+/// Full and empty magazines are exchanged whole with the cache's depot,
+/// so only the depot and the slab layer behind it take the cache's lock,
+/// and the heap lock is only taken to allocate or release a whole slab.
+class slab_cache
+{
+public:
+    /// Maximum number of CPUs that get their own magazines
+    static constexpr unsigned max_cpus = 64;
+
+    /// Number of objects held by one magazine
+    static constexpr size_t magazine_size = 14;
+
+    /// Number of full magazines the depot holds before it starts
+    /// returning freed objects to their slabs
+    static constexpr size_t depot_limit = 16;
+
+    /// Usage statistics for a cache
+    struct stats
+    {
+        size_t active;  ///< Objects allocated and in use
+        size_t free;    ///< Objects free in slabs, magazines and the depot
+        size_t slabs;   ///< Slabs currently allocated from the heap
+    };
+
+    /// Constructor. Does not allocate, so caches may be static objects.
+    /// \arg name       Name of the cache, for statistics
+    /// \arg size       Size of each object
+    /// \arg align      Required alignment of each object
+    /// \arg slab_size  Size of each slab, must be a power of two
+    slab_cache(const char *name, size_t size, size_t align, size_t slab_size);
+
+    /// Allocate an object. The object's memory is not cleared.
+    void * allocate();
+
+    /// Free an object previously returned by allocate()
+    void free(void *p);
+
+    /// Get current usage statistics. Other CPUs' magazines are read
+    /// without locking, so the values are only approximate while other
+    /// CPUs are using the cache.
+    stats get_stats();
+
+    /// Get the name of this cache
+    inline const char * name() const { return m_name; }
+
+    /// Get the size of the objects in this cache
+    inline size_t object_size() const { return m_size; }
+
+    /// Get the first of all the slab caches in the kernel
+    static slab_cache * first() { return s_first; }
+
+    /// Get the next slab cache in the kernel
+    inline slab_cache * next() const { return m_next; }
+
+private:
+    struct magazine
+    {
+        magazine *next;
+        size_t count;
+        void *objects[magazine_size];
+    };
+
+    struct cpu_magazines
+    {
+        magazine *loaded;
+        magazine *previous;
+    };
+
+    struct slab_header
+    {
+        slab_cache *cache;
+        void *free;
+        size_t in_use;
+    };
+
+    using slab_list = util::linked_list<slab_header>;
+    using slab = slab_list::item_type;
+
+    /// Allocate when the current CPU's magazines are both empty
+    void * allocate_slow(cpu_magazines &cpu);
+
+    /// Free when the current CPU's magazines are both full
+    void free_slow(cpu_magazines &cpu, void *p);
+
+    /// Take an object from a slab. Caller must hold m_lock.
+    void * slab_allocate();
+
+    /// Return an object to its slab. Caller must hold m_lock.
+    void slab_free(void *p);
+
+    /// Allocate and carve up a new slab. Caller must hold m_lock.
+    slab * new_slab();
+
+    /// Return all the objects in a magazine to their slabs. Caller
+    /// must hold m_lock.
+    void drain(magazine *m);
+
+    /// Get the current CPU's magazines
+    cpu_magazines & current_magazines();
+
+    const char *m_name;
+    size_t m_size;
+    size_t m_slab_size;
+    size_t m_per_slab;
+    size_t m_first_offset;
+    size_t m_colors;
+    size_t m_color_align;
+    size_t m_next_color;
+
+    util::spinlock m_lock;
+
+    slab_list m_partial;
+    slab *m_spare;
+    size_t m_slabs;
+    size_t m_slab_free;
+
+    magazine *m_full;
+    magazine *m_empty;
+    size_t m_full_count;
+
+    cpu_magazines m_cpus[max_cpus];
+
+    slab_cache *m_next;
+    static slab_cache *s_first;
+
+    slab_cache() = delete;
+    slab_cache(const slab_cache &) = delete;
+};
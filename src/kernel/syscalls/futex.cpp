@@ -1,6 +1,7 @@
 #include <j6/errors.h>
 #include <util/basic_types.h>
-#include <util/node_map.h>
+#include <util/hash.h>
+#include <util/linked_list.h>
 #include <util/spinlock.h>
 
 #include "clock.h"
@@ -13,30 +14,103 @@ using namespace obj;
 
 namespace syscalls {
 
-struct futex
+struct futex_bucket;
+
+/// A thread blocked on a futex. Waiters live on the waiting thread's
+/// kernel stack, and are linked into the bucket for the futex's physical
+/// address. The bucket holds a handle reference to the thread, so its
+/// stack outlives the waiter even if the thread exits while queued.
+struct futex_waiter
 {
+    thread *waiter;
     uintptr_t address;
-    wait_queue queue;
+    uint32_t bitset;
 
-    futex() = default;
-    futex(futex &&other) :
-        address {other.address},
-        queue {util::move(other.queue)} {}
+    /// The bucket this waiter is queued in, or null once it's been woken.
+    /// Only changed while holding that bucket's lock.
+    futex_bucket *bucket;
+};
 
-    futex & operator=(futex &&other) {
-        address = other.address;
-        queue = util::move(other.queue);
-        return *this;
-    }
+using waiter_list = util::linked_list<futex_waiter>;
+using waiter_node = waiter_list::item_type;
+
+/// One shard of the futex table
+struct futex_bucket
+{
+    util::spinlock lock;
+    waiter_list waiters;
 };
 
-inline uint64_t & get_map_key(futex &f) { return f.address; }
+static constexpr size_t futex_bucket_count = 256;
+static constexpr uint32_t futex_bitset_any = 0xffffffff;
 
-util::node_map<uintptr_t, futex> g_futexes;
-util::spinlock g_futexes_lock;
+static futex_bucket g_futex_buckets[futex_bucket_count];
+
+static futex_bucket &
+get_bucket(uintptr_t phys)
+{
+    return g_futex_buckets[util::hash(phys) % futex_bucket_count];
+}
+
+/// Wake waiters on the given futex. Caller must hold the bucket's lock.
+/// \arg b       The bucket for the futex
+/// \arg phys    The physical address of the futex
+/// \arg count   The maximum number of waiters to wake, or 0 for all
+/// \arg bitset  Only wake waiters whose bitset shares a bit with this
+/// \returns     The number of waiters woken
+static size_t
+wake_waiters(futex_bucket &b, uintptr_t phys, size_t count, uint32_t bitset)
+{
+    size_t woken = 0;
+    waiter_node *w = b.waiters.front();
+    while (w && (!count || woken < count)) {
+        waiter_node *next = w->next();
+        if (w->address != phys || !(w->bitset & bitset)) {
+            w = next;
+            continue;
+        }
+
+        b.waiters.remove(w);
+
+        // Once the bucket is cleared, w may go away at any point
+        thread *t = w->waiter;
+        __atomic_store_n(&w->bucket, nullptr, __ATOMIC_RELEASE);
+
+        if (!t->exited()) {
+            t->wake(j6_status_ok);
+            ++woken;
+        }
+        t->handle_release();
+        w = next;
+    }
+    return woken;
+}
+
+/// Remove a waiter from whichever bucket it is queued in, if any
+/// \returns  True if the waiter was still queued
+static bool
+dequeue(waiter_node &w)
+{
+    while (true) {
+        futex_bucket *b = __atomic_load_n(&w.bucket, __ATOMIC_ACQUIRE);
+        if (!b)
+            return false;
+
+        // The waiter may have been requeued to another bucket before
+        // we got the lock, so check again once holding it
+        util::scoped_lock lock {b->lock};
+        if (w.bucket != b)
+            continue;
+
+        b->waiters.remove(&w);
+        w.bucket = nullptr;
+        w.waiter->handle_release();
+        return true;
+    }
+}
 
 j6_status_t
-futex_wait(const uint32_t *value, uint32_t expected, uint64_t timeout)
+futex_wait(const uint32_t *value, uint32_t expected, uint64_t timeout, uint32_t bitset)
 {
     thread& t = thread::current();
     process &p = t.parent();
@@ -47,12 +121,23 @@ futex_wait(const uint32_t *value, uint32_t expected, uint64_t timeout)
     }
 
     uintptr_t address = reinterpret_cast<uintptr_t>(value);
-    vm_space &space = process::current().space();
-    uintptr_t phys = space.find_physical(address);
+    uintptr_t phys = p.space().find_physical(address);
+    futex_bucket &b = get_bucket(phys);
+
+    waiter_node w;
+    w.waiter = &t;
+    w.address = phys;
+    w.bitset = bitset ? bitset : futex_bitset_any;
+    w.bucket = &b;
 
-    util::scoped_lock lock {g_futexes_lock};
+    util::scoped_lock lock {b.lock};
 
-    futex &f = g_futexes[phys];
+    // Check again under the bucket lock, so that a wake between the first
+    // check and blocking is not lost
+    if (*value != expected) {
+        log::spam(logs::syscall, "<%02x:%02x> futex %lx: %x != %x", p.obj_id(), t.obj_id(), value, *value, expected);
+        return j6_status_futex_changed;
+    }
 
     if (timeout) {
         timeout += clock::get().value();
@@ -61,39 +146,79 @@ futex_wait(const uint32_t *value, uint32_t expected, uint64_t timeout)
 
     log::spam(logs::syscall, "<%02x:%02x> blocking on futex %lx", p.obj_id(), t.obj_id(), value);
 
-    lock.release();
-    f.queue.wait();
+    t.handle_retain();
+    b.waiters.push_back(&w);
+    t.block(lock);
 
+    // If we're still queued, nothing woke us: the timeout expired
+    if (dequeue(w)) {
+        log::spam(logs::syscall, "<%02x:%02x> timed out on futex %lx", p.obj_id(), t.obj_id(), value);
+        return j6_err_timed_out;
+    }
+
+    t.set_wake_timeout(0);
     log::spam(logs::syscall, "<%02x:%02x> woke on futex %lx", p.obj_id(), t.obj_id(), value);
     return j6_status_ok;
 }
 
 j6_status_t
-futex_wake(const uint32_t *value, size_t count)
+futex_wake(const uint32_t *value, size_t count, uint32_t bitset)
 {
     uintptr_t address = reinterpret_cast<uintptr_t>(value);
     vm_space &space = process::current().space();
     uintptr_t phys = space.find_physical(address);
+    futex_bucket &b = get_bucket(phys);
 
-    util::scoped_lock lock {g_futexes_lock};
+    util::scoped_lock lock {b.lock};
+    wake_waiters(b, phys, count, bitset ? bitset : futex_bitset_any);
+    return j6_status_ok;
+}
 
-    futex *f = g_futexes.find(phys);
-    if (f) {
-        if (count) {
-            for (unsigned i = 0; i < count; ++i) {
-                obj::thread *t = f->queue.pop_next();
-                if (!t) break;
-                t->wake();
+j6_status_t
+futex_requeue(const uint32_t *value, uint32_t expected, size_t wake, const uint32_t *target, size_t count)
+{
+    vm_space &space = process::current().space();
+    uintptr_t phys = space.find_physical(reinterpret_cast<uintptr_t>(value));
+    uintptr_t target_phys = space.find_physical(reinterpret_cast<uintptr_t>(target));
+
+    futex_bucket &from = get_bucket(phys);
+    futex_bucket &to = get_bucket(target_phys);
+
+    // Always take bucket locks in address order
+    futex_bucket *first = &from < &to ? &from : &to;
+    futex_bucket *second = &from < &to ? &to : &from;
+
+    util::scoped_lock lock {first->lock};
+    util::spinlock::waiter second_waiter {false, nullptr, "futex_requeue"};
+    if (second != first)
+        second->lock.acquire(&second_waiter);
+
+    j6_status_t status = j6_status_futex_changed;
+    if (*value == expected) {
+        if (wake)
+            wake_waiters(from, phys, wake, futex_bitset_any);
+
+        size_t moved = 0;
+        waiter_node *w = phys == target_phys ? nullptr : from.waiters.front();
+        while (w && (!count || moved < count)) {
+            waiter_node *next = w->next();
+            if (w->address == phys) {
+                from.waiters.remove(w);
+                w->address = target_phys;
+                __atomic_store_n(&w->bucket, &to, __ATOMIC_RELEASE);
+                to.waiters.push_back(w);
+                ++moved;
             }
-        } else {
-            f->queue.clear();
+            w = next;
         }
 
-        if (f->queue.empty())
-            g_futexes.erase(phys);
+        status = j6_status_ok;
     }
 
-    return j6_status_ok;
+    if (second != first)
+        second->lock.release(&second_waiter);
+
+    return status;
 }
 
 } // namespace syscalls
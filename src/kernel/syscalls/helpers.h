@@ -2,6 +2,7 @@
 /// \file syscalls/helpers.h
 /// Utility functions for use in syscall handler implementations
 
+#include <j6/cap_flags.h>
 #include <j6/types.h>
 
 #include "capabilities.h"
@@ -31,12 +32,19 @@ j6_status_t get_handle(j6_handle_t id, j6_cap_t caps, T *&object, bool optional
     }
 
     capability *capdata = g_cap_table.retain(id);
-    if (!capdata || capdata->type != T::type)
+    if (!capdata)
+        return j6_err_invalid_arg;
+
+    if (capdata->type != T::type) {
+        g_cap_table.release(id);
         return j6_err_invalid_arg;
+    }
 
     obj::process &p = obj::process::current();
-    if (!p.has_handle(id) || (capdata->caps & caps) != caps)
+    if (!p.has_handle(id) || (capdata->caps & caps) != caps) {
+        g_cap_table.release(id);
         return j6_err_denied;
+    }
 
     object = static_cast<T*>(capdata->object);
     return j6_status_ok;
@@ -61,8 +69,39 @@ inline j6_status_t get_handle<obj::kobject>(j6_handle_t id, j6_cap_t caps, obj::
         return j6_err_invalid_arg;
 
     obj::process &p = obj::process::current();
-    if (!p.has_handle(id) || (capdata->caps & caps) != caps)
+    if (!p.has_handle(id) || (capdata->caps & caps) != caps) {
+        g_cap_table.release(id);
+        return j6_err_denied;
+    }
+
+    object = capdata->object;
+    return j6_status_ok;
+}
+
+/// Get an object a port can watch from a handle, which must have the
+/// capability to wait on that type of object. The handle is retained,
+/// and must be released with release_handle().
+inline j6_status_t get_waitable_handle(j6_handle_t id, obj::kobject *&object)
+{
+    capability *capdata = g_cap_table.retain(id);
+    if (!capdata)
+        return j6_err_invalid_arg;
+
+    j6_cap_t caps = 0;
+    switch (capdata->type) {
+    case obj::kobject::type::event:   caps = j6_cap_event_wait; break;
+    case obj::kobject::type::mailbox: caps = j6_cap_mailbox_receive; break;
+    case obj::kobject::type::thread:  caps = j6_cap_thread_join; break;
+    default:
+        g_cap_table.release(id);
+        return j6_err_invalid_arg;
+    }
+
+    obj::process &p = obj::process::current();
+    if (!p.has_handle(id) || (capdata->caps & caps) != caps) {
+        g_cap_table.release(id);
         return j6_err_denied;
+    }
 
     object = capdata->object;
     return j6_status_ok;
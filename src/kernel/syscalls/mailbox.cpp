@@ -4,14 +4,94 @@
 #include <util/util.h>
 
 #include "ipc_message.h"
+#include "memory.h"
 #include "objects/mailbox.h"
 #include "objects/thread.h"
 #include "syscalls/helpers.h"
+#include "vm_space.h"
 
 using namespace obj;
 
 namespace syscalls {
 
+/// Build a message from the calling thread's buffers. If requested and the
+/// data is large and page-aligned, move its pages instead of copying. If
+/// `borrow` is set, the calling thread will stay blocked until the message
+/// is received, so large data can be left in place to be copied straight
+/// into the receiver.
+static ipc::message_ptr
+make_message(uint64_t tag, util::buffer data, util::counted<j6_handle_t> handles, uint64_t flags, bool borrow)
+{
+    uintptr_t addr = reinterpret_cast<uintptr_t>(data.pointer);
+    bool move = (flags & j6_mailbox_flag_move) &&
+        data.count >= ipc::remap_threshold &&
+        (addr & (mem::frame_size - 1)) == 0;
+
+    if (move) {
+        size_t pages = mem::page_count(data.count);
+        uintptr_t *frames = new uintptr_t [pages];
+
+        vm_space &space = process::current().space();
+        if (space.take_pages(addr, pages, frames)) {
+            // Don't send whatever follows the data on its last page. This
+            // is only done once the frame is ours, never through the
+            // sender's mapping.
+            size_t tail = pages * mem::frame_size - data.count;
+            if (tail) {
+                uint8_t *last = mem::to_virtual<uint8_t>(frames[pages - 1]);
+                memset(last + mem::frame_size - tail, 0, tail);
+            }
+            return new ipc::message {tag, {frames, pages}, data.count, handles};
+        }
+
+        delete [] frames;
+    }
+
+    if (borrow && data.count >= ipc::borrow_threshold &&
+        handles.count <= ipc::message::max_borrowed_handles)
+        return new ipc::message {tag, process::current(), data, handles};
+
+    return new ipc::message {tag, data, handles};
+}
+
+/// Deliver a received message into the calling thread's buffers. Remapped
+/// data is moved into place if the buffer allows, otherwise copied.
+static void
+deliver_message(ipc::message_ptr &message,
+        uint64_t *tag,
+        void *in_data,
+        size_t *data_len,
+        size_t data_size,
+        j6_handle_t *in_handles,
+        size_t *handles_count,
+        size_t handles_size)
+{
+    util::counted<j6_handle_t> msg_handles = message->handles();
+
+    if (msg_handles) {
+        for (unsigned i = 0; i < msg_handles.count; ++i)
+            process::current().add_handle(msg_handles[i]);
+    }
+
+    *tag = message->tag;
+    *data_len = data_size > message->data_size ? message->data_size : data_size;
+
+    bool moved = false;
+    util::counted<uintptr_t> frames = message->frames();
+    if (frames && *data_len == message->data_size &&
+        data_size >= frames.count * mem::frame_size) {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(in_data);
+        vm_space &space = process::current().space();
+        moved = space.give_pages(addr, frames.count, frames.pointer);
+    }
+
+    if (!moved)
+        *data_len = message->copy_data({in_data, *data_len});
+
+    *handles_count = handles_size > msg_handles.count ? msg_handles.count : handles_size;
+    memcpy(in_handles, msg_handles.pointer, *handles_count * sizeof(j6_handle_t));
+}
+
 j6_status_t
 mailbox_create(j6_handle_t *self)
 {
@@ -38,35 +118,27 @@ mailbox_call(
         size_t data_size,
         j6_handle_t *in_handles,
         size_t *handles_count,
-        size_t handles_size)
+        size_t handles_size,
+        uint64_t flags)
 {
     thread &cur = thread::current();
 
     util::buffer data {in_data, *data_len};
     util::counted<j6_handle_t> handles {in_handles, *handles_count};
 
-    ipc::message_ptr message = new ipc::message {*tag, data, handles};
+    ipc::message_ptr message = make_message(*tag, data, handles, flags, true);
     cur.set_message_data(util::move(message));
 
     j6_status_t s = self->call();
-    if (s != j6_status_ok)
+    if (s != j6_status_ok) {
+        // Drop the message if it was never received
+        cur.get_message_data();
         return s;
-
-    message = cur.get_message_data();
-    util::counted<j6_handle_t> msg_handles = message->handles();
-    util::buffer msg_data = message->data();
-
-    if (message->handle_count) {
-        for (unsigned i = 0; i < msg_handles.count; ++i)
-            process::current().add_handle(msg_handles[i]);
     }
 
-    *tag = message->tag;
-    *data_len = data_size > msg_data.count ? msg_data.count : data_size;
-    memcpy(in_data, msg_data.pointer, *data_len);
-
-    *handles_count = handles_size > msg_handles.count ? msg_handles.count : handles_size;
-    memcpy(in_handles, msg_handles.pointer, *handles_count * sizeof(j6_handle_t));
+    message = cur.get_message_data();
+    deliver_message(message, tag, in_data, data_len, data_size,
+            in_handles, handles_count, handles_size);
 
     return j6_status_ok;
 }
@@ -88,33 +160,21 @@ mailbox_respond(
     util::counted<j6_handle_t> handles {in_handles, *handles_count};
 
     ipc::message_ptr message;
+    bool block = flags & j6_flag_block;
+    j6_status_t s = j6_status_ok;
 
     if (*reply_tag) {
-        message = new ipc::message {*tag, data, handles};
-        j6_status_t s = self->reply(*reply_tag, util::move(message));
-        if (s != j6_status_ok)
-            return s;
+        message = make_message(*tag, data, handles, flags, false);
+        s = self->reply_receive(message, *reply_tag, block);
+    } else {
+        s = self->receive(message, *reply_tag, block);
     }
 
-    bool block = flags & j6_flag_block;
-    j6_status_t s = self->receive(message, *reply_tag, block);
     if (s != j6_status_ok)
         return s;
 
-    util::counted<j6_handle_t> msg_handles = message->handles();
-    util::buffer msg_data = message->data();
-
-    if (msg_handles) {
-        for (unsigned i = 0; i < msg_handles.count; ++i)
-            process::current().add_handle(msg_handles[i]);
-    }
-
-    *tag = message->tag;
-    *data_len = data_size > msg_data.count ? msg_data.count : data_size;
-    memcpy(in_data, msg_data.pointer, *data_len);
-
-    *handles_count = handles_size > msg_handles.count ? msg_handles.count : handles_size;
-    memcpy(in_handles, msg_handles.pointer, *handles_count * sizeof(j6_handle_t));
+    deliver_message(message, tag, in_data, data_len, data_size,
+            in_handles, handles_count, handles_size);
 
     return j6_status_ok;
 }
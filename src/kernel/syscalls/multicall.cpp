@@ -0,0 +1,52 @@
+#include <j6/errors.h>
+#include <j6/flags.h>
+#include <j6/types.h>
+
+#include "syscall.h"
+#include "syscalls/helpers.h"
+
+static_assert(max_syscall_args <= sizeof(j6_multicall_entry::args) / sizeof(uint64_t),
+        "j6_multicall_entry cannot hold the arguments of every syscall");
+
+namespace syscalls {
+
+/// The verify functions in the syscall registry, as called by the
+/// syscall prelude: up to six register arguments, and a pointer to
+/// any more as the seventh.
+using verify_fn = j6_status_t (*)(
+        uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t *);
+
+j6_status_t
+multicall(j6_multicall_entry *calls, size_t *calls_size, uint64_t flags)
+{
+    const size_t count = *calls_size;
+    const bool stop = flags & j6_multicall_flag_stop;
+
+    size_t i = 0;
+    j6_status_t result = j6_status_ok;
+    while (i < count) {
+        j6_multicall_entry &entry = calls[i++];
+
+        uintptr_t fn = 0;
+        if (entry.call < num_syscalls && syscall_batchable[entry.call])
+            fn = syscall_registry[entry.call];
+
+        if (fn) {
+            uint64_t *a = entry.args;
+            entry.status = reinterpret_cast<verify_fn>(fn)(
+                a[0], a[1], a[2], a[3], a[4], a[5], &a[6]);
+        } else {
+            entry.status = j6_err_invalid_arg;
+        }
+
+        if (stop && j6_is_err(entry.status)) {
+            result = entry.status;
+            break;
+        }
+    }
+
+    *calls_size = i;
+    return result;
+}
+
+} // namespace syscalls
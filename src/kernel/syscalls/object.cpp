@@ -3,7 +3,9 @@
 #include <util/vector.h>
 
 #include "kassert.h"
+#include "clock.h"
 #include "logger.h"
+#include "objects/port.h"
 #include "objects/thread.h"
 #include "syscalls/helpers.h"
 
@@ -18,4 +20,49 @@ object_koid(kobject *self, j6_koid_t *koid)
     return j6_status_ok;
 }
 
+j6_status_t
+object_wait_many(j6_wait_item *items, size_t *items_size, uint64_t timeout)
+{
+    // Every item is a binding on the temporary port
+    static constexpr size_t max_items = 64;
+
+    const size_t count = *items_size;
+    if (!count || count > max_items)
+        return j6_err_invalid_arg;
+
+    // Wait with a temporary port, keying each item by its index. Any
+    // bindings are dropped with the port on return.
+    port p;
+    for (size_t i = 0; i < count; ++i) {
+        items[i].observed = 0;
+
+        kobject *o = nullptr;
+        j6_status_t s = get_waitable_handle(items[i].handle, o);
+        if (s != j6_status_ok)
+            return s;
+
+        s = p.bind(o, i + 1, items[i].signals);
+        release_handle(items[i].handle);
+        if (s != j6_status_ok)
+            return s;
+    }
+
+    uint64_t deadline = timeout ? clock::get().value() + timeout : 0;
+
+    static constexpr size_t chunk_size = 16;
+    j6_port_packet chunk[chunk_size];
+
+    size_t n = p.wait(chunk, chunk_size, deadline);
+    if (!n)
+        return j6_err_timed_out;
+
+    while (n) {
+        for (size_t i = 0; i < n; ++i)
+            items[chunk[i].key - 1].observed |= chunk[i].signals;
+        n = p.read(chunk, chunk_size);
+    }
+
+    return j6_status_ok;
+}
+
 } // namespace syscalls
@@ -0,0 +1,68 @@
+#include <j6/errors.h>
+#include <j6/types.h>
+
+#include "clock.h"
+#include "objects/port.h"
+#include "syscalls/helpers.h"
+
+using namespace obj;
+
+namespace syscalls {
+
+j6_status_t
+port_create(j6_handle_t *self)
+{
+    construct_handle<port>(self);
+    return j6_status_ok;
+}
+
+j6_status_t
+port_bind(port *self, j6_handle_t target, uint64_t key, j6_signal_t signals)
+{
+    kobject *o = nullptr;
+    j6_status_t s = get_waitable_handle(target, o);
+    if (s != j6_status_ok)
+        return s;
+
+    s = self->bind(o, key, signals);
+    release_handle(target);
+    return s;
+}
+
+j6_status_t
+port_unbind(port *self, uint64_t key)
+{
+    return self->unbind(key);
+}
+
+j6_status_t
+port_wait(port *self, j6_port_packet *packets, size_t *packets_size, uint64_t timeout)
+{
+    const size_t max = *packets_size;
+    if (!max)
+        return j6_err_invalid_arg;
+
+    uint64_t deadline = timeout ? clock::get().value() + timeout : 0;
+
+    // Packets are taken under the port's lock, so gather them on the
+    // stack before copying them out
+    static constexpr size_t chunk_size = 16;
+    j6_port_packet chunk[chunk_size];
+
+    size_t total = 0;
+    size_t n = self->wait(chunk, max < chunk_size ? max : chunk_size, deadline);
+    while (n) {
+        for (size_t i = 0; i < n; ++i)
+            packets[total + i] = chunk[i];
+        total += n;
+
+        size_t want = max - total;
+        if (want > chunk_size) want = chunk_size;
+        n = want ? self->read(chunk, want) : 0;
+    }
+
+    *packets_size = total;
+    return total ? j6_status_ok : j6_err_timed_out;
+}
+
+} // namespace syscalls
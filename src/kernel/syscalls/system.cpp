@@ -1,4 +1,5 @@
 #include <j6/errors.h>
+#include <j6/memutils.h>
 #include <j6/types.h>
 
 #include "cpu.h"
@@ -10,7 +11,10 @@
 #include "objects/thread.h"
 #include "objects/system.h"
 #include "objects/vm_area.h"
+#include "scheduler.h"
+#include "slab_cache.h"
 #include "syscalls/helpers.h"
+#include "zero_pool.h"
 
 extern log::logger &g_logger;
 
@@ -88,4 +92,128 @@ system_request_iopl(system *self, unsigned iopl)
     return j6_status_ok;
 }
 
+j6_status_t
+system_get_slab_stats(system *self, void *stats, size_t *stats_len)
+{
+    size_t count = 0;
+    for (slab_cache *c = slab_cache::first(); c; c = c->next())
+        ++count;
+
+    size_t needed = count * sizeof(j6_slab_stats);
+    if (*stats_len < needed) {
+        *stats_len = needed;
+        return j6_err_insufficient;
+    }
+
+    j6_slab_stats *out = reinterpret_cast<j6_slab_stats*>(stats);
+    for (slab_cache *c = slab_cache::first(); c; c = c->next()) {
+        slab_cache::stats s = c->get_stats();
+
+        memset(out->name, 0, sizeof(out->name));
+        const char *name = c->name();
+        for (size_t i = 0; name[i] && i < sizeof(out->name) - 1; ++i)
+            out->name[i] = name[i];
+
+        out->object_size = c->object_size();
+        out->active = s.active;
+        out->free = s.free;
+        out->slabs = s.slabs;
+        ++out;
+    }
+
+    *stats_len = needed;
+    return j6_status_ok;
+}
+
+j6_status_t
+system_get_zero_pool_stats(system *self, void *stats, size_t *stats_len)
+{
+    if (*stats_len < sizeof(j6_zero_pool_stats)) {
+        *stats_len = sizeof(j6_zero_pool_stats);
+        return j6_err_insufficient;
+    }
+
+    zero_pool::stats s = zero_pool::get_stats();
+
+    j6_zero_pool_stats *out = reinterpret_cast<j6_zero_pool_stats*>(stats);
+    out->count = s.count;
+    out->capacity = s.capacity;
+    out->hits = s.hits;
+    out->misses = s.misses;
+    out->zeroed = s.zeroed;
+
+    *stats_len = sizeof(j6_zero_pool_stats);
+    return j6_status_ok;
+}
+
+j6_status_t
+system_get_sched_stats(system *self, void *stats, size_t *stats_len)
+{
+    size_t needed = g_num_cpus * sizeof(j6_sched_stats);
+    if (*stats_len < needed) {
+        *stats_len = needed;
+        return j6_err_insufficient;
+    }
+
+    scheduler &s = scheduler::get();
+    j6_sched_stats *out = reinterpret_cast<j6_sched_stats*>(stats);
+    for (unsigned i = 0; i < g_num_cpus; ++i) {
+        scheduler::cpu_stats cs = s.get_stats(i);
+        out[i].load = cs.load;
+        out[i].switches = cs.switches;
+        out[i].placed = cs.placed;
+        out[i].wake_local = cs.wake_local;
+        out[i].wake_affine = cs.wake_affine;
+        out[i].wake_balanced = cs.wake_balanced;
+        out[i].stolen = cs.stolen;
+        out[i].idle_cycles = cs.idle_cycles;
+    }
+
+    *stats_len = needed;
+    return j6_status_ok;
+}
+
+j6_status_t
+system_get_thread_stats(system *self, void *stats, size_t *stats_len)
+{
+    scheduler &s = scheduler::get();
+
+    // Records are gathered under the run queue locks, so collect them
+    // into kernel memory and copy them out afterwards. Don't allocate
+    // for more threads than exist.
+    size_t max = *stats_len / sizeof(j6_thread_stats);
+    size_t count = s.get_thread_stats(nullptr, 0);
+    if (max > count)
+        max = count;
+
+    scheduler::thread_stats *records = max ?
+        new scheduler::thread_stats [max] : nullptr;
+
+    count = s.get_thread_stats(records, max);
+    size_t needed = count * sizeof(j6_thread_stats);
+    if (count > max) {
+        delete [] records;
+        *stats_len = needed;
+        return j6_err_insufficient;
+    }
+
+    j6_thread_stats *out = reinterpret_cast<j6_thread_stats*>(stats);
+    for (size_t i = 0; i < count; ++i) {
+        const scheduler::thread_stats &ts = records[i];
+        out[i].koid = ts.koid;
+        out[i].process = ts.process;
+        out[i].run_cycles = ts.run_cycles;
+        out[i].wait_cycles = ts.wait_cycles;
+        out[i].voluntary_switches = ts.voluntary;
+        out[i].involuntary_switches = ts.involuntary;
+        out[i].migrations = ts.migrations;
+        out[i].cpu = ts.cpu;
+        out[i].priority = ts.priority;
+    }
+
+    delete [] records;
+    *stats_len = needed;
+    return j6_status_ok;
+}
+
 } // namespace syscalls
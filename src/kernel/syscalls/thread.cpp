@@ -4,7 +4,9 @@
 #include "clock.h"
 #include "logger.h"
 #include "objects/process.h"
+#include "objects/system.h"
 #include "objects/thread.h"
+#include "scheduler.h"
 #include "syscalls/helpers.h"
 
 using namespace obj;
@@ -25,7 +27,7 @@ thread_create(j6_handle_t *self, process *proc, uintptr_t stack_top, uintptr_t e
 
     *self = g_cap_table.create(child, thread::creation_caps);
 
-    child->set_state(thread::state::ready);
+    child->wake();
 
     log::verbose(logs::task, "Thread <%02lx:%02lx> spawned new thread <%02lx:%02lx>",
         parent_pr.obj_id(), parent_th.obj_id(), proc->obj_id(), child->obj_id());
@@ -71,4 +73,72 @@ thread_sleep(uint64_t duration)
     return j6_status_ok;
 }
 
+j6_status_t
+thread_set_affinity(thread *self, uint64_t mask)
+{
+    const uint64_t cpus = g_num_cpus < 64 ? (1ull << g_num_cpus) - 1 : ~0ull;
+    if (!mask)
+        mask = ~0ull;
+    else if (!(mask & cpus))
+        return j6_err_invalid_arg;
+
+    scheduler::get().set_affinity(self->tcb(), mask);
+    return j6_status_ok;
+}
+
+j6_status_t
+thread_get_affinity(thread *self, uint64_t *mask)
+{
+    *mask = self->tcb()->affinity;
+    return j6_status_ok;
+}
+
+j6_status_t
+thread_set_priority(thread *self, uint8_t priority, unsigned constant, system *sys)
+{
+    if (priority > scheduler::max_priority)
+        return j6_err_invalid_arg;
+
+    // A thread that is never demoted, or starts above where promotion
+    // can take it, can keep kernel tasks and everything else off the CPU
+    if (!sys && (constant || priority < scheduler::promote_limit))
+        return j6_err_denied;
+
+    scheduler::get().set_priority(self->tcb(), priority, constant);
+    return j6_status_ok;
+}
+
+j6_status_t
+thread_get_priority(thread *self, uint8_t *priority, unsigned *constant)
+{
+    *priority = self->tcb()->base_priority;
+    *constant = self->constant() ? 1 : 0;
+    return j6_status_ok;
+}
+
+j6_status_t
+thread_get_stats(thread *self, void *stats, size_t *stats_len)
+{
+    if (*stats_len < sizeof(j6_thread_stats)) {
+        *stats_len = sizeof(j6_thread_stats);
+        return j6_err_insufficient;
+    }
+
+    scheduler::thread_stats ts = scheduler::get_thread_stats(self->tcb());
+
+    j6_thread_stats *out = reinterpret_cast<j6_thread_stats*>(stats);
+    out->koid = ts.koid;
+    out->process = ts.process;
+    out->run_cycles = ts.run_cycles;
+    out->wait_cycles = ts.wait_cycles;
+    out->voluntary_switches = ts.voluntary;
+    out->involuntary_switches = ts.involuntary;
+    out->migrations = ts.migrations;
+    out->cpu = ts.cpu;
+    out->priority = ts.priority;
+
+    *stats_len = sizeof(j6_thread_stats);
+    return j6_status_ok;
+}
+
 } // namespace syscalls
@@ -2,6 +2,7 @@
 #include <j6/types.h>
 
 #include "logger.h"
+#include "memory.h"
 #include "objects/process.h"
 #include "objects/vm_area.h"
 #include "syscalls/helpers.h"
@@ -36,13 +37,45 @@ vma_create_map(j6_handle_t *self, size_t size, uintptr_t *base, uint32_t flags)
     return *base ? j6_status_ok : j6_err_collision;
 }
 
+j6_status_t
+vma_create_cow(j6_handle_t *self, vm_area *source, size_t offset, size_t length, size_t size, uint32_t flags)
+{
+    if (offset & (mem::frame_size - 1) || offset >= source->size())
+        return j6_err_invalid_arg;
+
+    // Shared pages are mapped as normal pages, which large and huge
+    // source pages can't be split into
+    util::bitset32 source_flags = source->flags();
+    if (source_flags.get(vm_flags::large_pages) ||
+        source_flags.get(vm_flags::huge_pages))
+        return j6_err_invalid_arg;
+
+    // COW areas are always made of normal-sized pages
+    util::bitset32 f = flags & vm_user_mask;
+    f.clear(vm_flags::large_pages);
+    f.clear(vm_flags::huge_pages);
+    f.clear(vm_flags::ring);
+
+    construct_handle<vm_area_cow>(self, source, offset, length, size, f);
+    return j6_status_ok;
+}
+
 j6_status_t
 vma_map(vm_area *self, process *proc, uintptr_t *base, uint32_t flags)
 {
     vm_space &space = proc ? proc->space() : process::current().space();
     util::bitset32 f = flags & vm_user_mask;
     *base = space.add(*base, self, f);
-    return *base ? j6_status_ok : j6_err_collision;
+    if (!*base)
+        return j6_err_collision;
+
+    if (f.get(vm_flags::prefault)) {
+        size_t pages = space.map_resident(*self);
+        log::verbose(logs::paging, "Prefaulted %d pages mapping vma %llx at %016llx",
+                pages, self->obj_id(), *base);
+    }
+
+    return j6_status_ok;
 }
 
 j6_status_t
@@ -64,6 +97,12 @@ vma_resize(vm_area *self, size_t *size)
     return j6_status_ok;
 }
 
-
+j6_status_t
+vma_populate(vm_area *self, process *proc, size_t offset, size_t size)
+{
+    vm_space &space = proc ? proc->space() : process::current().space();
+    return space.populate(*self, offset, size) ?
+        j6_status_ok : j6_err_invalid_arg;
+}
 
 } // namespace syscalls
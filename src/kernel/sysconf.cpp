@@ -1,6 +1,7 @@
 #include <j6/memutils.h>
 
 #include "kassert.h"
+#include "clock.h"
 #include "cpu.h"
 #include "frame_allocator.h"
 #include "memory.h"
@@ -47,7 +48,15 @@ sysconf_create()
     g_sysconf->kernel_version_gitsha = _kernel_header.version_gitsha;
 
     g_sysconf->sys_page_size = mem::frame_size;
-    g_sysconf->sys_large_page_size = 0;
-    g_sysconf->sys_huge_page_size = 0;
+    g_sysconf->sys_large_page_size = mem::large_page_size;
+    g_sysconf->sys_huge_page_size = mem::huge_page_size;
     g_sysconf->sys_num_cpus = g_num_cpus;
+
+    // Userspace can only read the clock itself if it's the TSC,
+    // otherwise leave the multiplier 0 to say it's unavailable
+    clock &clk = clock::get();
+    if (clk.is_tsc()) {
+        g_sysconf->clock_tsc_mult = clk.mult();
+        g_sysconf->clock_tsc_shift = clock::shift;
+    }
 }
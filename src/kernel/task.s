@@ -1,6 +1,12 @@
 %include "tasking.inc"
 
 extern xcr0_val
+extern g_xsave_mode
+
+%define CR0_TS 3
+
+; Values of xsave_mode in xsave.h
+%define XSAVE_MODE_XSAVEOPT 1
 
 global task_switch: function hidden (task_switch.end - task_switch)
 task_switch:
@@ -26,22 +32,35 @@ task_switch:
 	mov rcx, [gs:CPU_DATA.rflags3] ; rcx: current task's saved user rflags
 	mov [r15 + TCB.rflags3], rcx
 
-    ; Save processor extended state
-    mov rcx, [r15 + TCB.xsave]     ; rcx: current task's XSAVE area
-    cmp rcx, 0
-    jz .xsave_done
-
-    mov rax, [rel xcr0_val]
-    mov rdx, rax
-    shl rdx, 32
-    xsave [rcx]
+	; Save processor extended state. CR0.TS is clear only when the
+	; registers hold this task's state, see the restore below.
+	mov r13, cr0                   ; r13: CR0 value
+	bt r13, CR0_TS
+	jc .xsave_done
+
+	mov rcx, [r15 + TCB.xsave]     ; rcx: current task's XSAVE area
+	test rcx, rcx
+	jz .xsave_done
+
+	mov rax, [rel xcr0_val]
+	mov rdx, rax
+	shr rdx, 32
+	cmp byte [rel g_xsave_mode], XSAVE_MODE_XSAVEOPT
+	je .xsaveopt
+	ja .xsaves
+	xsave [rcx]
+	jmp .xsave_done
+.xsaveopt:
+	xsaveopt [rcx]
+	jmp .xsave_done
+.xsaves:
+	xsaves [rcx]
 .xsave_done:
 
 	; Install next task's TCB
 	mov [gs:CPU_DATA.tcb], rdi     ; rdi: next TCB (function param)
 	mov rsp, [rdi + TCB.rsp]       ; next task's stack pointer
-	mov r14, 0x00003fffffffffff
-	and r14, [rdi + TCB.pml4]      ; r14: next task's pml4 (phys portion of address)
+	mov r14, [rdi + TCB.pml4]      ; r14: next task's CR3 value (pml4, PCID, no-flush bit)
 
 	; Update syscall/interrupt rsp
 	mov rcx, [rdi + TCB.rsp0]      ; rcx: top of next task's kernel stack
@@ -54,24 +73,40 @@ task_switch:
 	mov rcx, [rdi + TCB.rsp3]      ; rcx: new task's saved user rsp
 	mov [gs:CPU_DATA.rsp3], rcx
 
-    ; Load processor extended state
-    mov rcx, [rdi + TCB.xsave]     ; rcx: new task's XSAVE area
-    cmp rcx, 0
-    jz .xrstor_done
-
-    mov rax, [rel xcr0_val]
-    mov rdx, rax
-    shl rdx, 32
-    xrstor [rcx]
+	; Restore processor extended state lazily: if this CPU's registers
+	; still hold the new task's state, let it use them, otherwise set
+	; CR0.TS so its first use traps to xsave_restore_current. Tasks
+	; without an XSAVE area never touch extended state, so CR0.TS is
+	; left alone for them.
+	cmp qword [rdi + TCB.xsave], 0
+	je .xrstor_done
+
+	cmp rdi, [gs:CPU_DATA.fpu_owner]
+	jne .xrstor_trap
+	mov rcx, [gs:CPU_DATA.self]
+	cmp rcx, [rdi + TCB.fpu_cpu]
+	jne .xrstor_trap
+
+	bt r13, CR0_TS
+	jnc .xrstor_done
+	clts
+	jmp .xrstor_done
+
+.xrstor_trap:
+	bts r13, CR0_TS
+	jc .xrstor_done
+	mov cr0, r13
 .xrstor_done:
 
 	; Update saved user rflags
 	mov rcx, [rdi + TCB.rflags3]   ; rcx: new task's saved user rflags
 	mov [gs:CPU_DATA.rflags3], rcx
 
-	; check if we need to update CR3
+	; check if we need to update CR3 (the no-flush bit always reads as 0)
 	mov rdx, cr3                   ; rdx: old CR3
-	cmp r14, rdx
+	mov rcx, r14
+	btr rcx, 63                    ; rcx: new CR3 without the no-flush bit
+	cmp rcx, rdx
 	je .no_cr3
 	mov cr3, r14
 .no_cr3:
@@ -0,0 +1,304 @@
+#include "apic.h"
+#include "cpu.h"
+#include "frame_allocator.h"
+#include "interrupts.h"
+#include "kassert.h"
+#include "memory.h"
+#include "tlb.h"
+#include "vm_space.h"
+
+extern "C" void _reload_cr3();
+extern cpu_data **g_cpu_data;
+
+namespace tlb {
+
+static uint64_t g_online_cpus = 0;
+
+void
+set_online()
+{
+    unsigned index = current_cpu().index;
+    kassert(index < 64, "TLB shootdown only supports 64 CPUs");
+    __atomic_fetch_or(&g_online_cpus, 1ull << index, __ATOMIC_SEQ_CST);
+}
+
+uint64_t
+online_cpus()
+{
+    return __atomic_load_n(&g_online_cpus, __ATOMIC_SEQ_CST);
+}
+
+/// Flush every TLB entry on this CPU, including global entries and
+/// those of every PCID, by toggling CR4.PGE
+static void
+flush_everything()
+{
+    constexpr uint64_t pge = 1ull << 7;
+    uint64_t cr4 = 0;
+    asm volatile ( "mov %%cr4, %0" : "=r"(cr4) );
+    asm volatile ( "mov %0, %%cr4" :: "r"(cr4 & ~pge) : "memory" );
+    asm volatile ( "mov %0, %%cr4" :: "r"(cr4) : "memory" );
+}
+
+static void
+invalidate(const range *ranges, size_t count, bool flush_all, bool global)
+{
+    // Reloading CR3 only flushes the current PCID's non-global entries.
+    // Kernel mappings are global, so need a heavier flush. (INVLPG does
+    // invalidate global entries.)
+    if (flush_all && global) {
+        flush_everything();
+        return;
+    }
+
+    if (flush_all) {
+        _reload_cr3();
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        uintptr_t addr = ranges[i].start;
+        for (size_t j = 0; j < ranges[i].pages; ++j) {
+            auto *p = reinterpret_cast<const uint8_t *>(addr);
+            asm volatile ( "invlpg %0" :: "m"(*p) : "memory" );
+            addr += mem::frame_size;
+        }
+    }
+}
+
+void
+handle_pending()
+{
+    queue &q = current_cpu().tlb;
+
+    range ranges[queue::max_ranges];
+    size_t count = 0;
+    bool flush_all = false;
+    bool global = false;
+    uint64_t seq = 0;
+
+    {
+        util::scoped_lock lock {q.lock};
+        seq = q.requested;
+        if (seq == q.completed)
+            return;
+
+        count = q.count;
+        flush_all = q.flush_all;
+        global = q.flush_global;
+        for (size_t i = 0; i < count; ++i)
+            ranges[i] = q.ranges[i];
+
+        q.count = 0;
+        q.flush_all = false;
+        q.flush_global = false;
+    }
+
+    invalidate(ranges, count, flush_all, global);
+    __atomic_store_n(&q.completed, seq, __ATOMIC_RELEASE);
+}
+
+void
+shootdown(uint64_t cpus, const range *ranges, size_t count, bool flush_all, bool global)
+{
+    cpu_data &cpu = current_cpu();
+    const uint64_t self = 1ull << cpu.index;
+
+    if (cpus & self)
+        invalidate(ranges, count, flush_all, global);
+
+    cpus &= online_cpus() & ~self;
+    if (!cpus)
+        return;
+
+    uint64_t waits[64];
+
+    for (uint64_t targets = cpus; targets; targets &= targets - 1) {
+        unsigned i = __builtin_ctzll(targets);
+        cpu_data &other = *g_cpu_data[i];
+        queue &q = other.tlb;
+
+        {
+            util::scoped_lock lock {q.lock};
+            if (flush_all || q.count + count > queue::max_ranges) {
+                q.flush_all = true;
+                q.flush_global = q.flush_global || global;
+                q.count = 0;
+            } else {
+                for (size_t j = 0; j < count; ++j)
+                    q.ranges[q.count++] = ranges[j];
+            }
+            waits[i] = ++q.requested;
+        }
+
+        cpu.apic->send_ipi(lapic::ipi_fixed, isr::ipiShootdown, other.id);
+    }
+
+    // Wait for every target to acknowledge. Keep servicing our own queue
+    // while waiting, in case a target is waiting on us in turn.
+    for (uint64_t targets = cpus; targets; targets &= targets - 1) {
+        unsigned i = __builtin_ctzll(targets);
+        queue &q = g_cpu_data[i]->tlb;
+        while (__atomic_load_n(&q.completed, __ATOMIC_ACQUIRE) < waits[i]) {
+            handle_pending();
+            asm volatile ("pause");
+        }
+    }
+}
+
+uint64_t
+switch_cr3(cpu_data &cpu, const vm_space &space)
+{
+    constexpr uint64_t no_flush = 1ull << 63;
+    const uint64_t pml4 = space.pml4_phys();
+
+    if (!cpu.features[cpu::feature::pcid])
+        return pml4;
+
+    // The kernel space only has global mappings, so there's never
+    // anything in PCID 0 to flush
+    if (space.is_kernel())
+        return pml4 | no_flush;
+
+    // The caller has already marked the space active on this CPU, so any
+    // shootdown after this point will reach this CPU directly
+    const uint64_t id = space.tlb_id();
+    const uint64_t gen = space.tlb_generation();
+
+    asid_cache &cache = cpu.asids;
+    for (unsigned i = 0; i < asid_cache::slots; ++i) {
+        asid_cache::slot &s = cache.assigned[i];
+        if (s.space != id)
+            continue;
+
+        bool fresh = s.generation == gen;
+        s.generation = gen;
+        return pml4 | (i + 1) | (fresh ? no_flush : 0);
+    }
+
+    // Take over the least recently assigned PCID, flushing whatever
+    // the previous space left in it
+    unsigned i = cache.next;
+    cache.next = (i + 1) % asid_cache::slots;
+    cache.assigned[i] = {id, gen};
+    return pml4 | (i + 1);
+}
+
+
+/// A frame's worth of frees waiting on a batch's shootdown
+struct batch::free_page
+{
+    static constexpr size_t capacity =
+        (mem::frame_size - sizeof(free_page*) - sizeof(size_t)) / sizeof(range);
+
+    free_page *next;
+    size_t count;
+    range frees[capacity];
+};
+
+batch::batch(const vm_space &space) :
+    m_space {space},
+    m_count {0},
+    m_pages {0},
+    m_free_count {0},
+    m_overflow {nullptr}
+{
+}
+
+batch::~batch()
+{
+    flush();
+}
+
+void
+batch::add(uintptr_t start, size_t pages)
+{
+    m_pages += pages;
+    if (m_pages > full_flush_pages)
+        return;
+
+    if (m_count) {
+        range &last = m_ranges[m_count - 1];
+        if (last.start + last.pages * mem::frame_size == start) {
+            last.pages += pages;
+            return;
+        }
+    }
+
+    if (m_count == max_ranges) {
+        // Out of room, just flush everything
+        m_pages = full_flush_pages + 1;
+        return;
+    }
+
+    m_ranges[m_count++] = {start, pages};
+}
+
+void
+batch::free_frames(uintptr_t phys, size_t count)
+{
+    range *last = nullptr;
+    if (m_overflow)
+        last = &m_overflow->frees[m_overflow->count - 1];
+    else if (m_free_count)
+        last = &m_frees[m_free_count - 1];
+
+    if (last && last->start + last->pages * mem::frame_size == phys) {
+        last->pages += count;
+        return;
+    }
+
+    if (m_free_count < max_frees) {
+        m_frees[m_free_count++] = {phys, count};
+        return;
+    }
+
+    // The frames can't be freed until the shootdown is done, and the
+    // caller may hold locks that the shootdown can't wait under, so keep
+    // the rest in frames of their own until then
+    if (!m_overflow || m_overflow->count == free_page::capacity) {
+        uintptr_t page_phys = 0;
+        size_t n = frame_allocator::get().allocate(1, &page_phys);
+        kassert(n, "Could not allocate a frame for a TLB batch");
+
+        free_page *page = mem::to_virtual<free_page>(page_phys);
+        page->next = m_overflow;
+        page->count = 0;
+        m_overflow = page;
+    }
+
+    m_overflow->frees[m_overflow->count++] = {phys, count};
+}
+
+void
+batch::flush()
+{
+    if (m_pages) {
+        // CPUs that don't have the space loaded can't be invalidated
+        // now, so have them flush it when they next switch to it
+        m_space.mark_stale();
+
+        bool flush_all = m_pages > full_flush_pages;
+        shootdown(m_space.active_cpus(), m_ranges, m_count, flush_all,
+                m_space.is_kernel());
+    }
+
+    frame_allocator &fa = frame_allocator::get();
+    for (size_t i = 0; i < m_free_count; ++i)
+        fa.free(m_frees[i].start, m_frees[i].pages);
+
+    while (m_overflow) {
+        free_page *page = m_overflow;
+        m_overflow = page->next;
+
+        for (size_t i = 0; i < page->count; ++i)
+            fa.free(page->frees[i].start, page->frees[i].pages);
+        fa.free(reinterpret_cast<uintptr_t>(page) & ~mem::linear_offset, 1);
+    }
+
+    m_count = 0;
+    m_pages = 0;
+    m_free_count = 0;
+}
+
+} // namespace tlb
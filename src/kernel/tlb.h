@@ -0,0 +1,145 @@
+#pragma once
+/// \file tlb.h
+/// TLB invalidation and cross-CPU shootdowns
+
+#include <stddef.h>
+#include <stdint.h>
+#include <util/spinlock.h>
+
+class vm_space;
+struct cpu_data;
+
+namespace tlb {
+
+/// Invalidating more than this many pages at once flushes the whole
+/// TLB instead of invalidating each page.
+static constexpr size_t full_flush_pages = 32;
+
+/// A range of virtual pages to invalidate
+struct range
+{
+    uintptr_t start;
+    size_t pages;
+};
+
+/// Per-CPU queue of invalidation requests from other CPUs
+struct queue
+{
+    static constexpr size_t max_ranges = 8;
+
+    util::spinlock lock;
+    range ranges[max_ranges];
+    size_t count;
+    bool flush_all;
+
+    /// Sequence number of the last request queued
+    uint64_t requested;
+
+    /// Sequence number of the last request this CPU has completed
+    uint64_t completed;
+
+    /// Whether a full flush must include global (kernel) entries
+    bool flush_global;
+};
+
+/// Per-CPU assignment of PCIDs to address spaces. Each CPU tags the TLB
+/// entries of its most recently used spaces with a PCID of its own, so
+/// switching between them doesn't flush their entries. A space's entries
+/// are flushed on a CPU when its PCID is given to another space, or when
+/// the space has had a shootdown since the CPU last loaded it.
+struct asid_cache
+{
+    /// Number of PCIDs used per CPU. PCID 0 is left for the kernel space.
+    static constexpr unsigned slots = 8;
+
+    struct slot
+    {
+        /// The vm_space::tlb_id() of the space using this PCID, or 0
+        uint64_t space;
+
+        /// The space's TLB generation when this CPU last loaded it
+        uint64_t generation;
+    };
+
+    slot assigned[slots];
+    unsigned next;
+};
+
+/// Mark the current CPU as able to receive shootdowns. Until then, other
+/// CPUs will not wait on it.
+void set_online();
+
+/// Get the set of CPUs that are able to receive shootdowns
+uint64_t online_cpus();
+
+/// Invalidate pages on a set of CPUs, and wait for them to finish. The
+/// current CPU, if included, is invalidated directly.
+/// \arg cpus       Bitmap of CPU indices to invalidate
+/// \arg ranges     The ranges of pages to invalidate
+/// \arg count      The number of ranges
+/// \arg flush_all  If true, ignore the ranges and flush the whole TLB
+/// \arg global     If true, a full flush also flushes global entries
+void shootdown(uint64_t cpus, const range *ranges, size_t count, bool flush_all, bool global);
+
+/// Get the value to load into CR3 to switch the given CPU to an address
+/// space. Assigns the space a PCID on this CPU if it doesn't have one,
+/// and sets the no-flush bit if the CPU's entries for it are still good.
+/// \arg cpu    The current CPU
+/// \arg space  The address space being switched to
+/// \returns    The CR3 value, including PCID and no-flush bit
+uint64_t switch_cr3(cpu_data &cpu, const vm_space &space);
+
+/// Process any invalidation requests queued for the current CPU. Called
+/// from the shootdown IPI handler.
+void handle_pending();
+
+/// Collects page invalidations (and frames to free once they are no longer
+/// mapped anywhere) so that several clears cost only one shootdown. The
+/// shootdown is sent when the batch is flushed or destroyed, which must
+/// not happen while holding a lock that a CPU could be waiting on with
+/// interrupts disabled.
+class batch
+{
+public:
+    /// Constructor.
+    /// \arg space  The address space whose mappings are being invalidated
+    batch(const vm_space &space);
+    ~batch();
+
+    /// Add a range of pages to be invalidated
+    /// \arg start  The virtual address of the first page
+    /// \arg pages  The number of pages
+    void add(uintptr_t start, size_t pages);
+
+    /// Free frames once the shootdown is complete. Never sends the
+    /// shootdown itself, so it is safe to call while holding locks.
+    /// \arg phys   Physical address of the first frame
+    /// \arg count  The number of frames
+    void free_frames(uintptr_t phys, size_t count);
+
+    /// Send the shootdown for all invalidations added so far, and free
+    /// any frames waiting on it.
+    void flush();
+
+private:
+    static constexpr size_t max_ranges = queue::max_ranges;
+    static constexpr size_t max_frees = 16;
+
+    const vm_space &m_space;
+
+    range m_ranges[max_ranges];
+    size_t m_count;
+    size_t m_pages;
+
+    range m_frees[max_frees];
+    size_t m_free_count;
+
+    /// Frames holding frees that didn't fit in m_frees
+    struct free_page;
+    free_page *m_overflow;
+
+    batch() = delete;
+    batch(const batch &) = delete;
+};
+
+} // namespace tlb
@@ -1,7 +1,7 @@
 #include <j6/memutils.h>
 #include <arch/memory.h>
 
-#include "apic.h"
+#include "cpu.h"
 #include "kassert.h"
 #include "frame_allocator.h"
 #include "logger.h"
@@ -14,12 +14,50 @@
 
 using obj::vm_flags;
 
+extern cpu_data **g_cpu_data;
+
 // The initial memory for the array of areas for the kernel space
 static constexpr size_t num_kernel_areas = 8;
 static uint64_t kernel_areas[num_kernel_areas * 2];
 
 static constexpr uint64_t locked_page_tag = 0xbadfe11a;
 
+/// Get the level of the table entry that maps the iterator's current
+/// address: pdp for a huge page, pd for a large page, otherwise pt.
+static page_table::level
+mapped_level(const page_table::iterator &it)
+{
+    using level = page_table::level;
+
+    util::bitset64 pdp = it.entry(level::pdp);
+    if ((pdp & page_flags::present) && (pdp & page_flags::page))
+        return level::pdp;
+
+    util::bitset64 pd = it.entry(level::pd);
+    if ((pd & page_flags::present) && (pd & page_flags::page))
+        return level::pd;
+
+    return level::pt;
+}
+
+/// Get the physical address mask for a page table entry at the given level.
+/// Large and huge page entries use bit 12 as a PAT bit.
+static inline uint64_t
+entry_address_mask(page_table::level l)
+{
+    return l == page_table::level::pt ? ~0xfffull : ~0x1fffull;
+}
+
+/// Get the physical address that the iterator's table maps the given
+/// virtual address to, whatever size page it is mapped with.
+static uintptr_t
+mapped_address(const page_table::iterator &it, uintptr_t virt)
+{
+    page_table::level lvl = mapped_level(it);
+    size_t size = page_table::entry_sizes[unsigned(lvl)];
+    return (it.entry(lvl) & entry_address_mask(lvl)) | (virt & (size - 1));
+}
+
 int
 vm_space::area::compare(const vm_space::area &o) const
 {
@@ -35,15 +73,28 @@ vm_space::area::operator==(const vm_space::area &o) const
 }
 
 
+/// Source of vm_space::tlb_id() values. 0 is the kernel space.
+static uint64_t s_next_tlb_id = 0;
+
 // Kernel address space contsructor
 vm_space::vm_space(page_table *p) :
     m_kernel {true},
     m_pml4 {p},
-    m_areas {reinterpret_cast<vm_space::area*>(kernel_areas), 0, num_kernel_areas}
+    m_cpus {0},
+    m_tlb_id {0},
+    m_tlb_gen {0},
+    m_areas {reinterpret_cast<vm_space::area*>(kernel_areas), 0, num_kernel_areas},
+    m_list {nullptr},
+    m_last_hit {0}
 {}
 
 vm_space::vm_space() :
-    m_kernel {false}
+    m_kernel {false},
+    m_cpus {0},
+    m_tlb_id {__atomic_add_fetch(&s_next_tlb_id, 1, __ATOMIC_RELAXED)},
+    m_tlb_gen {0},
+    m_list {nullptr},
+    m_last_hit {0}
 {
     m_pml4 = page_table::get_table_page();
     page_table *kpml4 = kernel_space().m_pml4;
@@ -63,8 +114,11 @@ vm_space::vm_space() :
 
 vm_space::~vm_space()
 {
-    for (auto &a : m_areas)
-        remove_area(a.area);
+    {
+        tlb::batch batch {*this};
+        for (auto &a : m_areas)
+            remove_area(a.area, batch);
+    }
 
     kassert(!is_kernel(), "Kernel vm_space destructor!");
     if (active())
@@ -73,6 +127,7 @@ vm_space::~vm_space()
     // All VMAs have been removed by now, so just
     // free all remaining pages and tables
     m_pml4->free(page_table::level::pml4);
+    retire_areas(m_list);
 }
 
 vm_space &
@@ -87,9 +142,26 @@ vm_space::add(uintptr_t base, obj::vm_area *new_area, util::bitset32 flags)
     if (!base)
         base = min_auto_address;
 
-    //TODO: optimize find/insert
+    // Place areas that want large or huge pages where they can use them
     bool exact = flags.get(vm_flags::exact);
-    for (size_t i = 0; i < m_areas.count(); ++i) {
+    uintptr_t align = mem::frame_size;
+    if (new_area->flags().get(vm_flags::huge_pages) && new_area->size() >= mem::huge_page_size)
+        align = mem::huge_page_size;
+    else if (new_area->flags().get(vm_flags::large_pages) && new_area->size() >= mem::large_page_size)
+        align = mem::large_page_size;
+
+    if (!exact)
+        base = (base + align - 1) & ~(align - 1);
+
+    area_list *old_list = nullptr;
+    util::scoped_lock lock {m_lock};
+
+    // Start from the area before base, if any: nothing earlier can overlap
+    size_t first = find_index(m_areas.begin(), m_areas.count(), base);
+    if (first == m_areas.count())
+        first = 0;
+
+    for (size_t i = first; i < m_areas.count(); ++i) {
         const vm_space::area &cur = m_areas[i];
         uintptr_t cur_end = cur.base + cur.area->size();
         if (base >= cur_end)
@@ -101,34 +173,54 @@ vm_space::add(uintptr_t base, obj::vm_area *new_area, util::bitset32 flags)
         else if (exact)
             return 0;
         else
-            base = cur_end;
+            base = (cur_end + align - 1) & ~(align - 1);
     }
 
-    m_areas.sorted_insert({base, new_area});
-    new_area->add_to(this);
+    if (!new_area->add_to(this))
+        return 0;
+
     new_area->handle_retain();
+    m_areas.sorted_insert({base, new_area});
+    old_list = publish_areas();
+    lock.release();
+
+    retire_areas(old_list);
     return base;
 }
 
 void
-vm_space::remove_area(obj::vm_area *area)
+vm_space::remove_area(obj::vm_area *area, tlb::batch &batch)
 {
     area->remove_from(this);
-    clear(*area, 0, mem::page_count(area->size()));
+    clear(*area, 0, mem::page_count(area->size()), false, &batch);
     area->handle_release();
 }
 
 bool
 vm_space::remove(obj::vm_area *area)
 {
-    for (auto &a : m_areas) {
-        if (a.area == area) {
-            remove_area(area);
-            m_areas.remove(a);
-            return true;
-        }
+    tlb::batch batch {*this};
+    area_list *old_list = nullptr;
+
+    {
+        util::scoped_lock lock {m_lock};
+        uintptr_t base = 0;
+        if (!find_vma(*area, base))
+            return false;
+
+        // Once it's out of m_areas, nothing can map the area's pages
+        // again, so clear them in the same step
+        m_areas.remove({base, area});
+        old_list = publish_areas();
+        clear_range(base, mem::page_count(area->size()), false, batch);
     }
-    return false;
+
+    // Lockless readers may still have the area from the old list, but
+    // will have retained it by the time they're done with the list
+    retire_areas(old_list);
+    area->remove_from(this);
+    area->handle_release();
+    return true;
 }
 
 bool
@@ -154,22 +246,122 @@ vm_space::can_resize(const obj::vm_area &vma, size_t size) const
     return end <= space_end;
 }
 
+size_t
+vm_space::find_index(const area *areas, size_t count, uintptr_t addr) const
+{
+    // Faults and lookups tend to come in runs in the same area
+    size_t hint = __atomic_load_n(&m_last_hit, __ATOMIC_RELAXED);
+    if (hint < count && areas[hint].base <= addr &&
+        (hint + 1 == count || addr < areas[hint + 1].base))
+        return hint;
+
+    // Areas are sorted by base and don't overlap, so find the last one
+    // starting at or before addr
+    size_t start = 0;
+    size_t end = count;
+    while (end > start) {
+        size_t m = start + (end - start) / 2;
+        if (areas[m].base <= addr)
+            start = m + 1;
+        else
+            end = m;
+    }
+    return start ? start - 1 : count;
+}
+
 obj::vm_area *
 vm_space::get(uintptr_t addr, uintptr_t *base)
 {
-    for (auto &a : m_areas) {
-        uintptr_t end = a.base + a.area->size();
-        if (addr >= a.base && addr < end) {
-            if (base) *base = a.base;
-            return a.area;
+    // Read the published list without m_lock. Marking it as being read
+    // before checking that it's still the published list means a writer
+    // that replaces it will wait for us before freeing it. Kernel code
+    // isn't preemptible, so a CPU only ever reads one list at a time.
+    cpu_data &cpu = current_cpu();
+    area_list *list = nullptr;
+    do {
+        list = __atomic_load_n(&m_list, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&cpu.area_reader, list, __ATOMIC_SEQ_CST);
+    } while (__atomic_load_n(&m_list, __ATOMIC_SEQ_CST) != list);
+
+    obj::vm_area *found = nullptr;
+    if (list) {
+        size_t i = find_index(list->areas, list->count, addr);
+        if (i < list->count) {
+            // The area can't be released by remove() until we stop
+            // reading the list, so it's safe to retain here
+            const area &a = list->areas[i];
+            if (addr < a.base + a.area->size()) {
+                found = a.area;
+                found->handle_retain();
+                __atomic_store_n(&m_last_hit, i, __ATOMIC_RELAXED);
+                if (base) *base = a.base;
+            }
         }
     }
-    return nullptr;
+
+    __atomic_store_n(&cpu.area_reader, nullptr, __ATOMIC_RELEASE);
+    return found;
+}
+
+vm_space::area_list *
+vm_space::publish_areas()
+{
+    using mem::frame_size;
+
+    // Lists live in frames rather than the heap, so the kernel space can
+    // publish one before the heap exists, and faults on new heap pages
+    // never need the heap
+    const size_t count = m_areas.count();
+    const size_t bytes = sizeof(area_list) + count * sizeof(area);
+    size_t pages = 1;
+    while (pages * frame_size < bytes)
+        pages <<= 1;
+
+    frame_allocator &fa = frame_allocator::get();
+    uintptr_t phys = 0;
+    bool allocated = pages == 1 ?
+        fa.allocate(1, &phys) == 1 :
+        fa.allocate_aligned(pages, &phys);
+    kassert(allocated, "Could not allocate frames for a vm_space area list");
+
+    area_list *list = mem::to_virtual<area_list>(phys);
+    list->count = count;
+    list->pages = pages;
+    for (size_t i = 0; i < count; ++i)
+        list->areas[i] = m_areas[i];
+
+    area_list *old = m_list;
+    __atomic_store_n(&m_list, list, __ATOMIC_SEQ_CST);
+    return old;
+}
+
+void
+vm_space::retire_areas(area_list *list)
+{
+    if (!list)
+        return;
+
+    if (g_cpu_data) {
+        for (unsigned i = 0; i < g_num_cpus; ++i) {
+            const cpu_data *cpu = g_cpu_data[i];
+            while (cpu && __atomic_load_n(&cpu->area_reader, __ATOMIC_SEQ_CST) == list)
+                asm volatile ("pause" ::: "memory");
+        }
+    }
+
+    uintptr_t phys = reinterpret_cast<uintptr_t>(list) & ~mem::linear_offset;
+    frame_allocator::get().free(phys, list->pages);
 }
 
 bool
 vm_space::find_vma(const obj::vm_area &vma, uintptr_t &base) const
 {
+    size_t hint = __atomic_load_n(&m_last_hit, __ATOMIC_RELAXED);
+    if (hint < m_areas.count() && m_areas[hint].area == &vma) {
+        base = m_areas[hint].base;
+        return true;
+    }
+
     for (auto &a : m_areas) {
         if (a.area != &vma) continue;
         base = a.base;
@@ -178,31 +370,54 @@ vm_space::find_vma(const obj::vm_area &vma, uintptr_t &base) const
     return false;
 }
 
+util::bitset64
+vm_space::entry_flags(const obj::vm_area &vma, bool large, bool ro) const
+{
+    // Kernel mappings are the same in every space, so they're global and
+    // survive switching address spaces
+    const util::bitset64 wc = large ? page_flags::wc_lg : page_flags::wc;
+    return
+        page_flags::present |
+        (m_kernel ? page_flags::global : page_flags::user) |
+        (vma.flags().get(vm_flags::write) && !ro ? page_flags::write : page_flags::none) |
+        (vma.flags().get(vm_flags::write_combine) ? wc : page_flags::none) |
+        (large ? page_flags::page : page_flags::none);
+}
+
 void
-vm_space::copy_from(const vm_space &source, const obj::vm_area &vma)
+vm_space::page_in(const obj::vm_area &vma, uintptr_t offset, uintptr_t phys, size_t count, page_table::level lvl, bool ro)
 {
-    uintptr_t to = 0;
-    uintptr_t from = 0;
-    if (!find_vma(vma, from) || !source.find_vma(vma, from))
+    using level = page_table::level;
+    util::scoped_lock lock {m_lock};
+
+    uintptr_t base = 0;
+    if (!find_vma(vma, base))
         return;
 
-    size_t count = mem::page_count(vma.size());
-    page_table::iterator dit {to, m_pml4};
-    page_table::iterator sit {from, source.m_pml4};
+    const bool large = lvl != level::pt;
+    const size_t page_size = page_table::entry_sizes[unsigned(lvl)];
 
-    while (count--) {
-        uint64_t &e = dit.entry(page_table::level::pt);
-        if (util::bitset64::from(e) & page_flags::present) {
-            // TODO: handle clobbering mapping
-        }
-        e = sit.entry(page_table::level::pt);
+    uintptr_t virt = base + offset;
+    util::bitset64 flags = entry_flags(vma, large, ro);
+
+    page_table::iterator it {virt, m_pml4};
+
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t &entry = it.entry(lvl);
+        entry = (phys + i * page_size) | flags;
+        log::spam(logs::paging, "Setting entry for %016llx: %016llx [%04llx]",
+                it.vaddress(), (phys + i * page_size), flags.value());
+
+        if (large)
+            it.next(lvl + 1);
+        else
+            ++it;
     }
 }
 
 void
-vm_space::page_in(const obj::vm_area &vma, uintptr_t offset, uintptr_t phys, size_t count)
+vm_space::page_in(const obj::vm_area &vma, uintptr_t offset, const uintptr_t *phys, size_t count)
 {
-    using mem::frame_size;
     util::scoped_lock lock {m_lock};
 
     uintptr_t base = 0;
@@ -210,75 +425,119 @@ vm_space::page_in(const obj::vm_area &vma, uintptr_t offset, uintptr_t phys, siz
         return;
 
     uintptr_t virt = base + offset;
-    util::bitset64 flags =
-        page_flags::present |
-        (m_kernel ? page_flags::none : page_flags::user) |
-        (vma.flags().get(vm_flags::write) ? page_flags::write : page_flags::none) |
-        (vma.flags().get(vm_flags::write_combine) ? page_flags::wc : page_flags::none);
+    util::bitset64 flags = entry_flags(vma, false, false);
 
     page_table::iterator it {virt, m_pml4};
 
-    for (size_t i = 0; i < count; ++i) {
+    for (size_t i = 0; i < count; ++i, ++it) {
         uint64_t &entry = it.entry(page_table::level::pt);
-        entry = (phys + i * frame_size) | flags;
+        if (!phys[i] || (entry & page_flags::present.value()))
+            continue;
+
+        entry = phys[i] | flags;
         log::spam(logs::paging, "Setting entry for %016llx: %016llx [%04llx]",
-                it.vaddress(), (phys + i * frame_size), flags.value());
-        ++it;
+                it.vaddress(), phys[i], flags.value());
+    }
+}
+
+size_t
+vm_space::map_run(const obj::vm_area &vma, uintptr_t offset, uintptr_t phys, size_t count,
+        page_table::level lvl, bool ro)
+{
+    using level = page_table::level;
+    util::scoped_lock lock {m_lock};
+
+    uintptr_t base = 0;
+    if (!find_vma(vma, base))
+        return 0;
+
+    const bool large = lvl != level::pt;
+    const size_t page_size = page_table::entry_sizes[unsigned(lvl)];
+    util::bitset64 flags = entry_flags(vma, large, ro);
+
+    page_table::iterator it {base + offset, m_pml4};
+
+    size_t mapped = 0;
+    for (size_t i = 0; i < count; ++i) {
+        // A present entry may be a page faulted in (or copied) since the
+        // caller looked, or at a large page level, a table of smaller pages
+        uint64_t &entry = it.entry(lvl);
+        if (!(entry & page_flags::present.value())) {
+            entry = (phys + i * page_size) | flags;
+            ++mapped;
+        }
+
+        if (large)
+            it.next(lvl + 1);
+        else
+            ++it;
     }
+
+    return mapped;
 }
 
 void
-vm_space::clear(const obj::vm_area &vma, uintptr_t offset, size_t count, bool free)
+vm_space::clear(const obj::vm_area &vma, uintptr_t offset, size_t count, bool free, tlb::batch *batch)
 {
-    using mem::frame_size;
+    // Without a batch from the caller, send the shootdown when done. This
+    // is declared before the lock so that we don't hold the lock while
+    // waiting on other CPUs.
+    tlb::batch local_batch {*this};
+    tlb::batch &b = batch ? *batch : local_batch;
+
     util::scoped_lock lock {m_lock};
 
     uintptr_t base = 0;
     if (!find_vma(vma, base))
         return;
 
-    uintptr_t addr = base + offset;
-    uintptr_t free_start = 0;
-    size_t free_count = 0;
+    clear_range(base + offset, count, free, b);
+}
+
+void
+vm_space::clear_range(uintptr_t addr, size_t count, bool free, tlb::batch &batch)
+{
+    using mem::frame_size;
+    using level = page_table::level;
 
-    frame_allocator &fa = frame_allocator::get();
     page_table::iterator it {addr, m_pml4};
 
-    while (count--) {
-        uint64_t &e = it.entry(page_table::level::pt);
-        uintptr_t phys = e & ~0xfffull;
+    while (count) {
+        level lvl = mapped_level(it);
+        size_t pages = page_table::entry_sizes[unsigned(lvl)] / frame_size;
+
+        uint64_t &e = it.entry(lvl);
+        uintptr_t phys = e & entry_address_mask(lvl);
         util::bitset64 flags = e;
 
         if (flags & page_flags::present) {
             e = 0;
-
-            auto *addr = reinterpret_cast<const uint8_t *>(it.vaddress());
-            asm ( "invlpg %0" :: "m"(*addr) : "memory" );
-
-            if (free_count && phys == free_start + (free_count * frame_size)) {
-                ++free_count;
-            } else {
-                if (free && free_count)
-                    fa.free(free_start, free_count);
-                free_start = phys;
-                free_count = 1;
-            }
+            batch.add(it.vaddress(), pages);
+            if (free)
+                batch.free_frames(phys, pages);
         }
 
-        ++it;
+        if (lvl == level::pt) {
+            ++it;
+            --count;
+        } else {
+            // Large and huge pages are cleared whole
+            it.next(lvl + 1);
+            count = count > pages ? count - pages : 0;
+        }
     }
-
-    current_cpu().apic->send_ipi_broadcast(
-        lapic::ipi_fixed, false, isr::ipiShootdown);
-
-    if (free && free_count)
-        fa.free(free_start, free_count);
 }
 
 void
-vm_space::lock(const obj::vm_area &vma, uintptr_t offset, size_t count)
+vm_space::lock(const obj::vm_area &vma, uintptr_t offset, size_t count, tlb::batch *batch)
 {
     using mem::frame_size;
+
+    // As in clear(), declared before the lock so that we don't hold it
+    // while waiting on other CPUs
+    tlb::batch local_batch {*this};
+    tlb::batch &b = batch ? *batch : local_batch;
+
     util::scoped_lock lock {m_lock};
 
     uintptr_t base = 0;
@@ -287,21 +546,21 @@ vm_space::lock(const obj::vm_area &vma, uintptr_t offset, size_t count)
 
     uintptr_t addr = base + offset;
 
-    frame_allocator &fa = frame_allocator::get();
     page_table::iterator it {addr, m_pml4};
 
     while (count--) {
+        kassert(mapped_level(it) == page_table::level::pt,
+                "Cannot lock a large page mapping");
+
         uint64_t &e = it.entry(page_table::level::pt);
         uintptr_t phys = e & ~0xfffull;
         util::bitset64 flags = e;
 
         if (flags & page_flags::present) {
             e = locked_page_tag;
-            if (flags & page_flags::accessed) {
-                auto *addr = reinterpret_cast<const uint8_t *>(it.vaddress());
-                asm ( "invlpg %0" :: "m"(*addr) : "memory" );
-            }
-            fa.free(phys, 1);
+            if (flags & page_flags::accessed)
+                b.add(it.vaddress(), 1);
+            b.free_frames(phys, 1);
         }
         ++it;
     }
@@ -310,6 +569,7 @@ vm_space::lock(const obj::vm_area &vma, uintptr_t offset, size_t count)
 uintptr_t
 vm_space::lookup(const obj::vm_area &vma, uintptr_t offset)
 {
+    util::scoped_lock lock {m_lock};
     uintptr_t base = 0;
     if (!find_vma(vma, base))
         return 0;
@@ -332,28 +592,74 @@ vm_space::activate() const
     __asm__ __volatile__ ( "mov %0, %%cr3" :: "r" (p) );
 }
 
+void
+vm_space::set_active_on(unsigned cpu, bool active)
+{
+    if (m_kernel)
+        return;
+
+    kassert(cpu < 64, "vm_space only tracks 64 CPUs");
+    if (active)
+        __atomic_fetch_or(&m_cpus, 1ull << cpu, __ATOMIC_SEQ_CST);
+    else
+        __atomic_fetch_and(&m_cpus, ~(1ull << cpu), __ATOMIC_SEQ_CST);
+}
+
+void
+vm_space::mark_stale() const
+{
+    __atomic_add_fetch(&m_tlb_gen, 1, __ATOMIC_SEQ_CST);
+}
+
+uintptr_t
+vm_space::pml4_phys() const
+{
+    return reinterpret_cast<uintptr_t>(m_pml4) & ~mem::linear_offset;
+}
+
+uint64_t
+vm_space::active_cpus() const
+{
+    // Kernel mappings are shared by every address space
+    if (m_kernel)
+        return tlb::online_cpus();
+
+    // Order the page table changes before reading the set of CPUs
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&m_cpus, __ATOMIC_SEQ_CST);
+}
+
 void
 vm_space::initialize_tcb(TCB &tcb)
 {
-    tcb.pml4 =
-        reinterpret_cast<uintptr_t>(m_pml4) &
-        ~mem::linear_offset;
+    tcb.pml4 = pml4_phys();
 }
 
 bool
 vm_space::handle_fault(uintptr_t addr, util::bitset8 fault)
 {
     // TODO: Handle more fult types
-    if (fault.get(fault_type::present))
+    if (fault.get(fault_type::present) && !fault.get(fault_type::write))
         return false;
 
-    uintptr_t page = (addr & ~0xfffull);
-
     uintptr_t base = 0;
     obj::vm_area *area = get(addr, &base);
     if (!area)
         return false;
 
+    bool handled = handle_area_fault(*area, base, addr, fault);
+    area->handle_release();
+    return handled;
+}
+
+bool
+vm_space::handle_area_fault(obj::vm_area &area, uintptr_t base, uintptr_t addr, util::bitset8 fault)
+{
+    uintptr_t page = (addr & ~0xfffull);
+
+    if (fault.get(fault_type::present))
+        return copy_on_write(area, base, page - base);
+
     if constexpr (__debug_heap_allocation) {
         page_table::iterator it {addr, m_pml4};
         uint64_t &e = it.entry(page_table::level::pt);
@@ -363,31 +669,388 @@ vm_space::handle_fault(uintptr_t addr, util::bitset8 fault)
     }
 
     uintptr_t offset = page - base;
+    size_t page_size = map_page(area, base, offset);
+    if (!page_size)
+        return false;
+
+    if (page_size == mem::frame_size && area.can_fault_around())
+        fault_around(area, base, offset);
+
+    return true;
+}
+
+/// Get the size of the page mapped at a virtual address, or 0 if none is
+static size_t
+mapped_size(uintptr_t virt, page_table *pml4)
+{
+    using level = page_table::level;
+    const page_table::iterator it {virt, pml4};
+
+    for (unsigned i = unsigned(level::pdp); i <= unsigned(level::pt); ++i) {
+        level l = level(i);
+        uint64_t entry = it.entry(l);
+        if (!(entry & page_flags::present.value()))
+            return 0;
+        if (l == level::pt || (entry & page_flags::page.value()))
+            return page_table::entry_sizes[i];
+    }
+    return 0;
+}
+
+size_t
+vm_space::map_page(obj::vm_area &area, uintptr_t base, uintptr_t offset)
+{
     uintptr_t phys_page = 0;
-    if (!area->get_page(offset, phys_page))
+    size_t page_size = 0;
+    bool shared = false;
+    if (!area.get_sized_page(offset, phys_page, page_size, shared))
+        return 0;
+
+    if (page_size > mem::frame_size) {
+        // Map the whole large or huge page if the area is aligned for it
+        // and nothing is mapped yet in its range
+        using level = page_table::level;
+        level lvl = page_size == mem::huge_page_size ? level::pdp : level::pd;
+        uintptr_t page_offset = offset & ~(page_size - 1);
+
+        const page_table::iterator it {base + page_offset, m_pml4};
+        if (!((base + page_offset) & (page_size - 1)) &&
+            !(it.entry(lvl) & page_flags::present.value())) {
+            page_in(area, page_offset, phys_page, 1, lvl);
+            return page_size;
+        }
+
+        // Otherwise fall back to mapping just the faulting page
+        phys_page += mem::page_align_down(offset) - page_offset;
+    }
+
+    // Don't replace a page mapped since the lookup: if it's a private
+    // copy made by another CPU, the shared page must not cover it
+    map_run(area, mem::page_align_down(offset), phys_page, 1, page_table::level::pt, shared);
+    return mem::frame_size;
+}
+
+bool
+vm_space::copy_on_write(obj::vm_area &area, uintptr_t base, uintptr_t offset)
+{
+    if (!area.flags().get(vm_flags::write))
+        return false;
+
+    uintptr_t phys = 0;
+    if (!area.copy_page(offset, phys))
         return false;
 
-    page_in(*area, offset, phys_page, 1);
+    page_in(area, offset, phys, 1);
+
+    // Other CPUs may still have the shared page cached read-only, and
+    // must not keep reading it once this copy diverges
+    tlb::batch batch {*this};
+    batch.add(base + offset, 1);
+    return true;
+}
+
+void
+vm_space::fault_around(obj::vm_area &area, uintptr_t base, uintptr_t offset)
+{
+    // Map the aligned window of the area around the fault, so that
+    // sequential touches only fault once per window
+    static constexpr size_t window = fault_around_pages * mem::frame_size;
+    uintptr_t start = offset & ~(window - 1);
+    uintptr_t end = start + window;
+    if (end > area.size())
+        end = mem::page_align_up(area.size());
+
+    uintptr_t phys[fault_around_pages] = {0};
+    for (uintptr_t o = start; o < end; o += mem::frame_size) {
+        // Skip the faulting page and anything already mapped
+        if (o == mem::page_align_down(offset) || mapped_size(base + o, m_pml4))
+            continue;
+
+        size_t i = (o - start) / mem::frame_size;
+        if (!area.get_page(o, phys[i]))
+            phys[i] = 0;
+    }
+
+    page_in(area, start, phys, (end - start) / mem::frame_size);
+}
+
+bool
+vm_space::populate(obj::vm_area &area, uintptr_t offset, size_t length)
+{
+    uintptr_t base = 0;
+    {
+        util::scoped_lock lock {m_lock};
+        if (!find_vma(area, base))
+            return false;
+    }
+
+    if (offset >= area.size() || length > area.size() - offset)
+        return false;
+
+    uintptr_t end = mem::page_align_up(offset + length);
+    uintptr_t o = mem::page_align_down(offset);
+    while (o < end) {
+        size_t page_size = mapped_size(base + o, m_pml4);
+        if (!page_size)
+            page_size = map_page(area, base, o);
+        if (!page_size)
+            page_size = mem::frame_size;
+
+        // Continue after the whole page that is now mapped
+        o = (o & ~(page_size - 1)) + page_size;
+    }
+
     return true;
 }
 
+size_t
+vm_space::map_resident(obj::vm_area &area)
+{
+    using level = page_table::level;
+
+    uintptr_t base = 0;
+    {
+        util::scoped_lock lock {m_lock};
+        if (!find_vma(area, base))
+            return 0;
+    }
+
+    const uintptr_t end = mem::page_align_up(area.size());
+
+    size_t mapped = 0;
+    uintptr_t offset = 0;
+    uintptr_t phys = 0;
+    size_t size = 0;
+    bool ro = false;
+    bool found = area.next_resident(0, offset, phys, size, ro);
+
+    while (found && offset < end) {
+        // Large and huge pages can only be mapped whole if the virtual
+        // address is aligned the same, otherwise map their normal pages
+        level lvl = level::pt;
+        size_t count = 1;
+        if (size > mem::frame_size && !((base + offset) & (size - 1)))
+            lvl = size == mem::huge_page_size ? level::pdp : level::pd;
+        else if (size > mem::frame_size)
+            count = ((offset + size > end ? end : offset + size) - offset) / mem::frame_size;
+
+        // Extend runs of normal pages that are physically contiguous, so
+        // that they're mapped in one pass
+        uintptr_t next = offset + count * page_table::entry_sizes[unsigned(lvl)];
+        uintptr_t next_offset = 0;
+        uintptr_t next_phys = 0;
+        size_t next_size = 0;
+        bool next_ro = false;
+        found = next < end && area.next_resident(next, next_offset, next_phys, next_size, next_ro);
+
+        while (lvl == level::pt && found &&
+                next_offset == next &&
+                next_size == mem::frame_size &&
+                next_phys == phys + count * mem::frame_size &&
+                next_ro == ro) {
+            ++count;
+            next += mem::frame_size;
+            found = next < end && area.next_resident(next, next_offset, next_phys, next_size, next_ro);
+        }
+
+        mapped += map_run(area, offset, phys, count, lvl, ro);
+
+        offset = next_offset;
+        phys = next_phys;
+        size = next_size;
+        ro = next_ro;
+    }
+
+    return mapped;
+}
+
+uint8_t *
+vm_space::lookup(uintptr_t addr, bool write, size_t &avail)
+{
+    if (!m_kernel && addr >= mem::kernel_offset)
+        return nullptr;
+
+    const page_table::iterator it {addr, m_pml4};
+    page_table::level lvl = mapped_level(it);
+    util::bitset64 entry = it.entry(lvl);
+
+    if (!(entry & page_flags::present) ||
+        (write && !(entry & page_flags::write)))
+        return nullptr;
+
+    size_t size = page_table::entry_sizes[unsigned(lvl)];
+    avail = size - (addr & (size - 1));
+    return mem::to_virtual<uint8_t>(mapped_address(it, addr));
+}
+
+bool
+vm_space::fault_in(uintptr_t addr, bool write)
+{
+    if (!m_kernel && addr >= mem::kernel_offset)
+        return false;
+
+    util::bitset8 fault = 0;
+    if (write)
+        fault.set(fault_type::write);
+
+    {
+        const page_table::iterator it {addr, m_pml4};
+        util::bitset64 entry = it.entry(mapped_level(it));
+        if (entry & page_flags::present) {
+            // Mapped by another thread since the caller looked
+            if (!write || (entry & page_flags::write))
+                return true;
+            fault.set(fault_type::present);
+        }
+    }
+
+    return handle_fault(addr, fault);
+}
+
 size_t
 vm_space::copy(vm_space &source, vm_space &dest, const void *from, void *to, size_t length)
 {
-    uintptr_t ifrom = reinterpret_cast<uintptr_t>(from);
-    uintptr_t ito = reinterpret_cast<uintptr_t>(to);
+    const range src {reinterpret_cast<uintptr_t>(from), length};
+    const range dst {reinterpret_cast<uintptr_t>(to), length};
+    return copy(source, dest, {&src, 1}, {&dst, 1});
+}
+
+size_t
+vm_space::copy(vm_space &source, vm_space &dest,
+        util::counted<const range> from, util::counted<const range> to)
+{
+    // Frames are only freed once their mappings have been cleared while
+    // holding their space's lock, so holding both locks keeps either side
+    // from being unmapped and reused mid-copy. They're always taken in the
+    // same order, so that copies in opposite directions can't deadlock.
+    vm_space &first = &source < &dest ? source : dest;
+    vm_space &second = &source < &dest ? dest : source;
+
+    size_t copied = 0;
+
+    size_t si = 0, di = 0;     // Current range in each list
+    size_t soff = 0, doff = 0; // Offset into the current ranges
+    unsigned faults = 0;       // Faults taken for the current chunk
+
+    while (si < from.count && di < to.count) {
+        const range &s = from[si];
+        const range &d = to[di];
+        if (soff == s.length) { ++si; soff = 0; continue; }
+        if (doff == d.length) { ++di; doff = 0; continue; }
+
+        size_t n = s.length - soff;
+        if (n > d.length - doff) n = d.length - doff;
+        if (n > copy_chunk) n = copy_chunk;
+
+        const uint8_t *sp = nullptr;
+        uint8_t *dp = nullptr;
+        {
+            util::spinlock::waiter w1 {false, nullptr, "copy"};
+            util::spinlock::waiter w2 {false, nullptr, "copy"};
+            first.m_lock.acquire(&w1);
+            if (&second != &first)
+                second.m_lock.acquire(&w2);
+
+            size_t savail = 0, davail = 0;
+            sp = source.lookup(s.addr + soff, false, savail);
+            dp = dest.lookup(d.addr + doff, true, davail);
+            if (sp && dp) {
+                // Copy as much as is contiguous on both sides
+                if (n > savail) n = savail;
+                if (n > davail) n = davail;
+                memcpy(dp, sp, n);
+            }
+
+            if (&second != &first)
+                second.m_lock.release(&w2);
+            first.m_lock.release(&w1);
+        }
+
+        if (!sp || !dp) {
+            // At most: fault the page in, then copy it if it's
+            // copy-on-write, then once more in case another thread
+            // unmapped it in between
+            if (++faults > 3 ||
+                (!sp && !source.fault_in(s.addr + soff, false)) ||
+                (!dp && !dest.fault_in(d.addr + doff, true)))
+                break;
+            continue;
+        }
+
+        faults = 0;
+        soff += n;
+        doff += n;
+        copied += n;
+    }
 
-    page_table::iterator sit {ifrom, source.m_pml4};
-    page_table::iterator dit {ito, dest.m_pml4};
+    return copied;
+}
 
-    // TODO: iterate page mappings and continue copying. For now i'm blindly
-    // assuming both buffers are fully contained within single pages
-    memcpy(
-        mem::to_virtual<void>((*dit & ~0xfffull) | (ito & 0xffful)),
-        mem::to_virtual<void>((*sit & ~0xfffull) | (ifrom & 0xffful)),
-        length);
+bool
+vm_space::can_move_pages(uintptr_t addr, size_t count)
+{
+    uintptr_t end = addr + count * mem::frame_size;
+    while (addr < end) {
+        uintptr_t base = 0;
+        obj::vm_area *area = get(addr, &base);
+        if (!area)
+            return false;
 
-    return length;
+        bool movable = area->can_move_pages();
+        addr = base + area->size();
+        area->handle_release();
+        if (!movable)
+            return false;
+    }
+    return true;
+}
+
+bool
+vm_space::take_pages(uintptr_t addr, size_t count, uintptr_t *frames)
+{
+    if (addr & (mem::frame_size - 1) || !can_move_pages(addr, count))
+        return false;
+
+    tlb::batch batch {*this};
+    for (size_t i = 0; i < count; ++i) {
+        uintptr_t virt = addr + i * mem::frame_size;
+        uintptr_t base = 0;
+        obj::vm_area *area = get(virt, &base);
+
+        bool taken = area->take_page(virt - base, frames[i]);
+        kassert(taken, "Could not take page from movable area");
+        clear(*area, virt - base, 1, false, &batch);
+        area->handle_release();
+    }
+    return true;
+}
+
+bool
+vm_space::give_pages(uintptr_t addr, size_t count, uintptr_t *frames)
+{
+    if (addr & (mem::frame_size - 1) || !can_move_pages(addr, count))
+        return false;
+
+    tlb::batch batch {*this};
+    for (size_t i = 0; i < count; ++i) {
+        uintptr_t virt = addr + i * mem::frame_size;
+        uintptr_t base = 0;
+        obj::vm_area *area = get(virt, &base);
+
+        uintptr_t old = 0;
+        bool given = area->give_page(virt - base, frames[i], old);
+        kassert(given, "Could not give page to movable area");
+
+        clear(*area, virt - base, 1, false, &batch);
+        if (old)
+            batch.free_frames(old, 1);
+
+        // Map it now, since the caller is about to read it
+        page_in(*area, virt - base, frames[i], 1);
+        frames[i] = 0;
+        area->handle_release();
+    }
+    return true;
 }
 
 uintptr_t
@@ -400,6 +1063,7 @@ vm_space::find_physical(uintptr_t virt)
 
     uintptr_t phys = 0;
     area->get_page(virt - base, phys, false);
+    area->handle_release();
     return phys;
 }
 
@@ -6,11 +6,13 @@
 
 #include <j6/flags.h>
 #include <util/bitset.h>
+#include <util/counted.h>
 #include <util/spinlock.h>
 #include <util/vector.h>
 
 #include "objects/vm_area.h"
 #include "page_table.h"
+#include "tlb.h"
 
 struct TCB;
 
@@ -46,10 +48,13 @@ public:
     /// \returns   True if the area was removed
     bool remove(obj::vm_area *area);
 
-    /// Get the virtual memory area corresponding to an address
+    /// Get the virtual memory area corresponding to an address. Doesn't
+    /// take the lock, and retains the area so that it can't be destroyed
+    /// by a concurrent remove().
     /// \arg addr  The address to check
     /// \arg base  [out] if not null, receives the base address of the area
-    /// \returns   The vm_area, or nullptr if not found
+    /// \returns   The vm_area, or nullptr if not found. The caller must
+    ///            call handle_release() on it when done.
     obj::vm_area * get(uintptr_t addr, uintptr_t *base = nullptr);
 
     /// Check if this is the kernel space
@@ -63,21 +68,39 @@ public:
     /// \arg offset Offset of the starting virutal address from the VMA base
     /// \arg phys   The starting physical address
     /// \arg count  The number of contiugous physical pages to map
-    void page_in(const obj::vm_area &area, uintptr_t offset, uintptr_t phys, size_t count);
+    /// \arg lvl    The table level to map at: pt for normal pages, pd for
+    ///             large pages, or pdp for huge pages
+    /// \arg ro     Map the pages read-only, even if the area is writable
+    void page_in(const obj::vm_area &area, uintptr_t offset, uintptr_t phys, size_t count,
+            page_table::level lvl = page_table::level::pt, bool ro = false);
+
+    /// Map virtual addressses to the given list of physical pages. Entries
+    /// that are 0, or whose virtual address is already mapped, are skipped.
+    /// \arg area   The VMA this mapping applies to
+    /// \arg offset Offset of the starting virutal address from the VMA base
+    /// \arg phys   The physical address of each page
+    /// \arg count  The number of pages to map
+    void page_in(const obj::vm_area &area, uintptr_t offset, const uintptr_t *phys, size_t count);
 
     /// Clear mappings from the given region
     /// \arg area   The VMA these mappings applies to
     /// \arg offset Offset of the starting virutal address from the VMA base
     /// \arg count  The number of pages worth of mappings to clear
     /// \arg free   If true, free the pages back to the system
-    void clear(const obj::vm_area &vma, uintptr_t offset, size_t count, bool free = false);
+    /// \arg batch  If set, add the TLB invalidations to this batch instead
+    ///             of sending a shootdown immediately
+    void clear(const obj::vm_area &vma, uintptr_t offset, size_t count, bool free = false,
+            tlb::batch *batch = nullptr);
 
     /// Clear mappings from the given region, and mark it as locked. Used for
     /// debugging heap allocation reuse.
     /// \arg area   The VMA these mappings applies to
     /// \arg offset Offset of the starting virutal address from the VMA base
     /// \arg count  The number of pages worth of mappings to clear
-    void lock(const obj::vm_area &vma, uintptr_t offset, size_t count);
+    /// \arg batch  If set, add the TLB invalidations to this batch instead
+    ///             of sending a shootdown immediately
+    void lock(const obj::vm_area &vma, uintptr_t offset, size_t count,
+            tlb::batch *batch = nullptr);
 
     /// Look up the address of a given VMA's offset
     uintptr_t lookup(const obj::vm_area &vma, uintptr_t offset);
@@ -88,6 +111,33 @@ public:
     /// Set this space as the current active space
     void activate() const;
 
+    /// Track whether this space is loaded on the given CPU, so that TLB
+    /// shootdowns only go to CPUs that have it loaded. Other CPUs may still
+    /// have its mappings cached under a PCID, see mark_stale().
+    /// \arg cpu     Index of the CPU
+    /// \arg active  True if the CPU is switching to this space
+    void set_active_on(unsigned cpu, bool active);
+
+    /// Get the set of CPUs (as a bitmap of CPU indices) that currently
+    /// have this space loaded
+    uint64_t active_cpus() const;
+
+    /// Mark this space's cached mappings as stale on every CPU. CPUs that
+    /// don't have it loaded flush its PCID the next time they switch to it.
+    /// Must be called before active_cpus() when sending a shootdown.
+    void mark_stale() const;
+
+    /// Get the identifier for this space in per-CPU PCID assignments.
+    /// Unlike the space's address, it is never reused.
+    inline uint64_t tlb_id() const { return m_tlb_id; }
+
+    /// Get the number of times this space has been marked stale
+    inline uint64_t tlb_generation() const {
+        return __atomic_load_n(&m_tlb_gen, __ATOMIC_SEQ_CST); }
+
+    /// Get the physical address of this space's PML4
+    uintptr_t pml4_phys() const;
+
     /// Allocate pages into virtual memory. May allocate less than requested.
     /// \arg virt  The virtual address at which to allocate
     /// \arg count The number of pages to allocate
@@ -97,6 +147,27 @@ public:
 
     enum class fault_type { present, write, user, reserved, fetch };
 
+    /// Number of pages around a faulting page that are mapped along with
+    /// it, in areas that allow fault-around. Must be a power of two.
+    static constexpr size_t fault_around_pages = 16;
+
+    /// Map in every page of an area in the given range, allocating them if
+    /// necessary, so that touching them later doesn't fault.
+    /// \arg area   The VMA to populate
+    /// \arg offset Offset into the VMA of the start of the range
+    /// \arg length Length of the range, in bytes
+    /// \returns    False if the area is not in this space, or the range
+    ///             is not within the area
+    bool populate(obj::vm_area &area, uintptr_t offset, size_t length);
+
+    /// Map in every page of an area that already has memory behind it,
+    /// without allocating any more. Used when mapping an area that has
+    /// already been filled in elsewhere, to avoid faulting it back in
+    /// one page at a time.
+    /// \arg area   The VMA to map
+    /// \returns    The number of pages (of any size) newly mapped
+    size_t map_resident(obj::vm_area &area);
+
     /// Handle a page fault.
     /// \arg addr  Address which caused the fault
     /// \arg ft    Flags from the interrupt about the kind of fault
@@ -106,15 +177,57 @@ public:
     /// Set up a TCB to operate in this address space.
     void initialize_tcb(TCB &tcb);
 
-    /// Copy data from one address space to another
+    /// A range of virtual addresses, for vectored copies
+    struct range
+    {
+        uintptr_t addr;
+        size_t length;
+    };
+
+    /// Copy data from one address space to another. Pages that are not
+    /// mapped yet are faulted in, and copy-on-write pages in the
+    /// destination are copied first. Both spaces are locked while data is
+    /// copied, so other threads can't unmap either side mid-copy.
     /// \arg source The address space data is being copied from
     /// \arg dest   The address space data is being copied to
     /// \arg from   Pointer to the data in the source address space
     /// \arg to     Pointer to the destination in the dest address space
     /// \arg length Amount of data to copy, in bytes
-    /// \returnd    The number of bytes copied
+    /// \returns    The number of bytes copied, which is less than `length`
+    ///             only if part of either buffer could not be mapped
     static size_t copy(vm_space &source, vm_space &dest, const void *from, void *to, size_t length);
 
+    /// Copy data from one address space to another, gathering it from a
+    /// list of source ranges and scattering it into a list of destination
+    /// ranges. Copying stops when either list runs out.
+    /// \arg source The address space data is being copied from
+    /// \arg dest   The address space data is being copied to
+    /// \arg from   The ranges to copy from in the source address space
+    /// \arg to     The ranges to copy to in the dest address space
+    /// \returns    The number of bytes copied
+    static size_t copy(vm_space &source, vm_space &dest,
+            util::counted<const range> from, util::counted<const range> to);
+
+    /// Move the frames backing a page-aligned range out of this space. The
+    /// range is left unmapped, and will fault in new pages if touched.
+    /// Either all pages are moved, or none are.
+    /// \arg addr   The page-aligned virtual address of the range
+    /// \arg count  The number of pages in the range
+    /// \arg frames [out] Array of at least `count` entries to receive the
+    ///             physical addresses of the frames
+    /// \returns    True if the pages were moved
+    bool take_pages(uintptr_t addr, size_t count, uintptr_t *frames);
+
+    /// Move frames into a page-aligned range of this space, replacing (and
+    /// freeing) the pages that were there. Either all pages are replaced,
+    /// or none are.
+    /// \arg addr   The page-aligned virtual address of the range
+    /// \arg count  The number of pages in the range
+    /// \arg frames The physical addresses of the frames to move in. Moved
+    ///             entries are set to 0.
+    /// \returns    True if the pages were moved
+    bool give_pages(uintptr_t addr, size_t count, uintptr_t *frames);
+
     /// Get the physical address of a virtual address from this space
     /// \arg vrit  The virtual address
     /// \returns   The physical address mapped to that virtual address,
@@ -124,20 +237,93 @@ public:
 private:
     friend class obj::vm_area;
 
-    /// Find a given VMA in this address space
+    /// Find a given VMA in this address space. Caller must hold m_lock.
     bool find_vma(const obj::vm_area &vma, uintptr_t &base) const;
 
+    struct area;
+
+    /// Find the index in a sorted array of areas of the area that would
+    /// contain the given address: the last area starting at or before it.
+    /// \arg areas  The sorted areas, either m_areas or a published list
+    /// \arg count  The number of areas
+    /// \arg addr   The address to find
+    /// \returns    The index, or count if there is none
+    size_t find_index(const area *areas, size_t count, uintptr_t addr) const;
+
     /// Check if a VMA can be resized
     bool can_resize(const obj::vm_area &vma, size_t size) const;
 
-    /// Copy a range of mappings from the given address space 
-    void copy_from(const vm_space &source, const obj::vm_area &vma);
+    /// Check if every page in a range belongs to an area that allows
+    /// moving pages in and out
+    bool can_move_pages(uintptr_t addr, size_t count);
+
+    /// Map the page of an area containing the given offset, allocating it
+    /// if necessary. Maps a whole large or huge page if the area uses them.
+    /// \returns  The size of the page mapped, or 0 if there is no page
+    size_t map_page(obj::vm_area &area, uintptr_t base, uintptr_t offset);
+
+    /// Handle a page fault in a known area
+    bool handle_area_fault(obj::vm_area &area, uintptr_t base, uintptr_t addr, util::bitset8 fault);
+
+    /// Map the pages around a faulting page that aren't already mapped
+    void fault_around(obj::vm_area &area, uintptr_t base, uintptr_t offset);
+
+    /// Handle a write fault on a read-only copy-on-write page by giving
+    /// the area its own copy of the page and mapping that instead
+    bool copy_on_write(obj::vm_area &area, uintptr_t base, uintptr_t offset);
+
+    /// Get a kernel pointer to the memory mapped at a virtual address in
+    /// this space. The memory is only guaranteed to stay mapped, and its
+    /// frame not be reused, while the caller holds m_lock.
+    /// \arg addr   The virtual address
+    /// \arg write  True if the memory will be written to
+    /// \arg avail  [out] The number of bytes mapped contiguously from addr
+    /// \returns    The kernel pointer, or nullptr if no page is mapped at
+    ///             addr (or it's not writable, for writes)
+    uint8_t * lookup(uintptr_t addr, bool write, size_t &avail);
+
+    /// Fault in the page at a virtual address, as lookup() would need it.
+    /// Caller must not hold m_lock.
+    /// \returns  False if there is no memory at addr, or it can't be written
+    bool fault_in(uintptr_t addr, bool write);
+
+    /// Most data copy() copies while holding the spaces' locks
+    static constexpr size_t copy_chunk = 16 * arch::frame_size;
+
+    /// Map a run of contiguous physical pages like page_in, but skip any
+    /// entries that are already mapped.
+    /// \returns  The number of entries set
+    size_t map_run(const obj::vm_area &area, uintptr_t offset, uintptr_t phys, size_t count,
+            page_table::level lvl, bool ro);
+
+    /// Get the page table entry flags for mapping pages of an area
+    /// \arg area   The VMA being mapped
+    /// \arg large  True if the entries are for large or huge pages
+    /// \arg ro     Map the pages read-only, even if the area is writable
+    util::bitset64 entry_flags(const obj::vm_area &area, bool large, bool ro) const;
 
     /// Remove an area's mappings from this space
-    void remove_area(obj::vm_area *area);
+    void remove_area(obj::vm_area *area, tlb::batch &batch);
+
+    /// Clear mappings starting at a virtual address. Caller must hold m_lock.
+    void clear_range(uintptr_t addr, size_t count, bool free, tlb::batch &batch);
+
+    struct area_list;
+
+    /// Publish a copy of m_areas for lockless readers. Caller must hold
+    /// m_lock, and pass the returned old list to retire_areas() once it
+    /// has released it.
+    area_list * publish_areas();
+
+    /// Wait for any CPUs still reading an unpublished list, then free it
+    static void retire_areas(area_list *list);
 
     bool m_kernel;
     page_table *m_pml4;
+    uint64_t m_cpus;
+
+    uint64_t m_tlb_id;
+    mutable uint64_t m_tlb_gen;
 
     struct area {
         uintptr_t base;
@@ -147,5 +333,19 @@ private:
     };
     util::vector<area> m_areas;
 
+    /// Immutable copy of m_areas for lockless readers, kept in frames of
+    /// its own. Writers replace it while holding m_lock, and only free the
+    /// old list once no CPU is reading it.
+    struct area_list {
+        size_t count;
+        size_t pages;
+        area areas[0];
+    };
+    area_list *m_list;
+
+    /// Index of the last area found by get() or find_vma(). Only a hint,
+    /// it is checked against the areas before use.
+    size_t m_last_hit;
+
     util::spinlock m_lock;
 };
\ No newline at end of file
@@ -1,7 +1,28 @@
 #include <util/basic_types.h>
+#include "memory.h"
 #include "objects/thread.h"
+#include "slab_cache.h"
 #include "wait_queue.h"
 
+using thread_deque = util::deque<obj::thread*, 6, wait_queue::node_allocator>;
+
+static slab_cache g_wait_queue_nodes {"wait_queue",
+    sizeof(thread_deque::node_type), alignof(thread_deque::node_type),
+    mem::frame_size};
+
+void *
+wait_queue::node_allocator::allocate(size_t size)
+{
+    kassert(size == sizeof(thread_deque::node_type), "Wrong size wait_queue node allocation");
+    return g_wait_queue_nodes.allocate();
+}
+
+void
+wait_queue::node_allocator::free(void *p)
+{
+    g_wait_queue_nodes.free(p);
+}
+
 wait_queue::wait_queue(wait_queue &&other) :
     m_threads {util::move(other.m_threads)} {}
 
@@ -36,12 +36,20 @@ public:
     /// Check if the queue is empty
     bool empty() const { return m_threads.empty(); }
 
+    /// Allocates the deque's nodes from a slab cache shared by all
+    /// wait queues, instead of the general kernel heap
+    struct node_allocator
+    {
+        static void * allocate(size_t size);
+        static void free(void *p);
+    };
+
 private:
     /// Get rid of any exited threads that are next
     /// in the queue. Caller must hold the queue lock.
     void pop_exited();
 
     util::spinlock m_lock;
-    util::deque<obj::thread*, 6> m_threads;
+    util::deque<obj::thread*, 6, node_allocator> m_threads;
 };
 
@@ -1,13 +1,20 @@
 #include <stdint.h>
 #include <cpu/cpu_id.h>
+#include <j6/memutils.h>
 
 #include "cpu.h"
+#include "objects/thread.h"
 #include "xsave.h"
 
 uint64_t xcr0_val = 0;
+xsave_mode g_xsave_mode = xsave_mode::xsave;
 static size_t xsave_size_val = 0;
 const size_t &xsave_size = xsave_size_val;
 
+// The legacy region and header that start every XSAVE area
+static constexpr size_t xsave_header_end = 576;
+static constexpr size_t xcomp_bv_offset = 520;
+
 void
 xsave_init()
 {
@@ -18,13 +25,70 @@ xsave_init()
         static_cast<uint64_t>(regs.eax);
 
     xcr0_val = static_cast<uint64_t>(xcr0::J6_SUPPORTED) & cpu_supported;
-    xsave_size_val = regs.ebx;
+
+    // CPUID only reports the area size for the components already enabled
+    // in XCR0, so work it out from the components we're going to enable
+    const auto features = cpuid.features();
+    if (features[cpu::feature::xsaves])
+        g_xsave_mode = xsave_mode::xsaves;
+    else if (features[cpu::feature::xsaveopt])
+        g_xsave_mode = xsave_mode::xsaveopt;
+
+    size_t size = xsave_header_end;
+    for (unsigned i = 2; i < 64; ++i) {
+        if (!(xcr0_val & (1ull << i)))
+            continue;
+
+        const auto comp = cpuid.get(0x0d, i);
+        if (g_xsave_mode == xsave_mode::xsaves) {
+            // Compacted format packs components in order, some 64-byte aligned
+            if (comp.ecx & 0x2)
+                size = (size + 63) & ~63ull;
+            size += comp.eax;
+        } else if (comp.ebx + comp.eax > size) {
+            size = comp.ebx + comp.eax;
+        }
+    }
+    xsave_size_val = size;
 }
 
 void
 xsave_enable()
 {
-    const uint64_t rax = (xcr0_val & 0xFFFFFFFF);
-    const uint64_t rdx = (xcr0_val >> 32);
     asm volatile ( "xsetbv" :: "c"(0), "d"(xcr0_val >> 32), "a"(xcr0_val) );
 }
+
+void
+xsave_init_area(void *area)
+{
+    memset(area, 0, xsave_size);
+
+    // An all-zero header restores every component to its initial state,
+    // but XRSTORS also needs the area marked as compacted.
+    if (g_xsave_mode == xsave_mode::xsaves) {
+        uint64_t *xcomp_bv = reinterpret_cast<uint64_t*>(
+                reinterpret_cast<uint8_t*>(area) + xcomp_bv_offset);
+        *xcomp_bv = (1ull << 63) | xcr0_val;
+    }
+}
+
+bool
+xsave_restore_current()
+{
+    cpu_data &cpu = current_cpu();
+    TCB *tcb = cpu.tcb;
+    if (!tcb->xsave)
+        return false;
+
+    asm volatile ( "clts" );
+
+    void *area = reinterpret_cast<void*>(tcb->xsave);
+    if (g_xsave_mode == xsave_mode::xsaves)
+        asm volatile ( "xrstors (%0)" :: "r"(area), "d"(xcr0_val >> 32), "a"(xcr0_val) : "memory" );
+    else
+        asm volatile ( "xrstor (%0)" :: "r"(area), "d"(xcr0_val >> 32), "a"(xcr0_val) : "memory" );
+
+    cpu.fpu_owner = tcb;
+    tcb->fpu_cpu = &cpu;
+    return true;
+}
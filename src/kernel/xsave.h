@@ -3,8 +3,29 @@
 /// XSAVE operations
 
 #include <stddef.h>
+#include <stdint.h>
+
+/// Instructions used to save and restore extended state, from most to
+/// least preferred. If you change this, remember to update 'task.s'
+enum class xsave_mode : uint8_t
+{
+    xsave,      ///< XSAVE/XRSTOR: standard format, always saves everything
+    xsaveopt,   ///< XSAVEOPT/XRSTOR: skips components not modified since the last restore
+    xsaves,     ///< XSAVES/XRSTORS: compacted format, also skips initialized components
+};
 
 extern const size_t &xsave_size;
+extern xsave_mode g_xsave_mode;
 
 void xsave_init();
 void xsave_enable();
+
+/// Prepare a newly-allocated XSAVE area so that it restores
+/// the initial extended state.
+/// \arg area  The area, xsave_size bytes and 64-byte aligned
+void xsave_init_area(void *area);
+
+/// Handle a device-not-available fault by restoring the current thread's
+/// extended state, which task_switch leaves unloaded until first use.
+/// \returns  False if the current thread has no extended state
+bool xsave_restore_current();
@@ -0,0 +1,287 @@
+#include <j6/memutils.h>
+#include <util/spinlock.h>
+
+#include "cpu.h"
+#include "frame_allocator.h"
+#include "memory.h"
+#include "objects/thread.h"
+#include "scheduler.h"
+#include "zero_pool.h"
+
+using mem::frame_size;
+
+extern cpu_data **g_cpu_data;
+
+namespace zero_pool {
+
+/// A pool of zeroed large or huge pages. These are rarely allocated, so
+/// all of them share one lock.
+struct sized_pool
+{
+    size_t size;
+    size_t capacity;
+    size_t count;
+    uintptr_t pages[large_capacity];
+
+    /// Whether anything has asked for pages of this size, so the pool
+    /// should be kept filled
+    bool active;
+};
+
+static_assert(huge_capacity <= large_capacity);
+
+static util::spinlock g_sized_lock;
+static sized_pool g_sized[] = {
+    {mem::large_page_size, large_capacity, 0, {}, false},
+    {mem::huge_page_size, huge_capacity, 0, {}, false},
+};
+
+/// The large and huge page refill task, once started
+static obj::thread *g_sized_task = nullptr;
+
+/// Whether the sized refill task is blocked waiting for a request.
+/// Only changed while holding g_sized_lock.
+static bool g_sized_task_blocked = false;
+
+/// Zero a frame with non-temporal stores, so that refilling the pool
+/// doesn't push the working set of whatever runs next out of the cache.
+/// Callers must sfence before handing the frame to anyone else.
+static void
+zero_frame(uintptr_t phys)
+{
+    uint64_t *p = mem::to_virtual<uint64_t>(phys);
+    uint64_t *end = p + frame_size / sizeof(uint64_t);
+    for (; p < end; p += 4) {
+        asm volatile (
+            "movnti %1, 0(%0);"
+            "movnti %1, 8(%0);"
+            "movnti %1, 16(%0);"
+            "movnti %1, 24(%0);"
+            :: "r"(p), "r"(0ull) : "memory");
+    }
+}
+
+bool
+allocate(uintptr_t *address)
+{
+    cache &pool = current_cpu().zeros;
+    bool wake = false;
+    bool hit = false;
+
+    {
+        util::scoped_lock lock {pool.lock};
+        hit = pool.count > 0;
+        if (hit) {
+            *address = pool.frames[--pool.count];
+            ++pool.hits;
+        } else {
+            ++pool.misses;
+        }
+
+        if (pool.task_blocked && pool.count < low_water) {
+            pool.task_blocked = false;
+            wake = true;
+        }
+    }
+
+    if (wake)
+        pool.task->wake();
+
+    if (hit)
+        return true;
+
+    if (!frame_allocator::get().allocate(1, address))
+        return false;
+
+    // This page is about to be used, so zero it through the cache
+    memset(mem::to_virtual<void>(*address), 0, frame_size);
+    return true;
+}
+
+void
+reclaim()
+{
+    frame_allocator &fa = frame_allocator::get();
+
+    // Before SMP is started, only this CPU has a pool
+    unsigned cpus = g_cpu_data ? g_num_cpus : 1;
+    for (unsigned i = 0; i < cpus; ++i) {
+        cpu_data *cpu = g_cpu_data ? g_cpu_data[i] : &current_cpu();
+        if (!cpu)
+            continue;
+
+        cache &pool = cpu->zeros;
+        util::scoped_lock lock {pool.lock};
+        for (size_t j = 0; j < pool.count; ++j)
+            fa.free(pool.frames[j], 1);
+        pool.count = 0;
+    }
+
+    util::scoped_lock lock {g_sized_lock};
+    for (sized_pool &pool : g_sized) {
+        for (size_t j = 0; j < pool.count; ++j)
+            fa.free(pool.pages[j], pool.size / frame_size);
+        pool.count = 0;
+        pool.active = false;
+    }
+}
+
+stats
+get_stats()
+{
+    stats s {0, 0, 0, 0, 0};
+    for (unsigned i = 0; i < g_num_cpus; ++i) {
+        const cache &pool = g_cpu_data[i]->zeros;
+        s.count += __atomic_load_n(&pool.count, __ATOMIC_RELAXED);
+        s.capacity += capacity;
+        s.hits += __atomic_load_n(&pool.hits, __ATOMIC_RELAXED);
+        s.misses += __atomic_load_n(&pool.misses, __ATOMIC_RELAXED);
+        s.zeroed += __atomic_load_n(&pool.zeroed, __ATOMIC_RELAXED);
+    }
+    return s;
+}
+
+bool
+allocate_sized(size_t size, uintptr_t *address)
+{
+    bool wake = false;
+    bool hit = false;
+
+    {
+        util::scoped_lock lock {g_sized_lock};
+        for (sized_pool &pool : g_sized) {
+            if (pool.size != size)
+                continue;
+
+            if (pool.count) {
+                *address = pool.pages[--pool.count];
+                hit = true;
+            }
+
+            pool.active = true;
+            if (g_sized_task_blocked) {
+                g_sized_task_blocked = false;
+                wake = true;
+            }
+            break;
+        }
+    }
+
+    if (wake)
+        g_sized_task->wake();
+
+    return hit;
+}
+
+static void
+refill_task()
+{
+    obj::thread &self = obj::thread::current();
+    frame_allocator &fa = frame_allocator::get();
+    uintptr_t frames[batch];
+
+    // This task is pinned to its CPU, so this is always its pool
+    cache &pool = current_cpu().zeros;
+    pool.task = &self;
+
+    while (true) {
+        size_t n = 0;
+        {
+            util::scoped_lock lock {pool.lock};
+            if (pool.task_blocked) {
+                // Spurious wake, keep waiting
+                self.block(lock);
+                continue;
+            }
+
+            if (pool.count >= capacity) {
+                pool.task_blocked = true;
+                self.block(lock);
+                continue;
+            }
+
+            n = capacity - pool.count;
+            if (n > batch) n = batch;
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            fa.allocate(1, &frames[i]);
+            zero_frame(frames[i]);
+        }
+        asm volatile ("sfence" ::: "memory");
+
+        {
+            // Only this task adds frames, so there is still room for all
+            // of them
+            util::scoped_lock lock {pool.lock};
+            for (size_t i = 0; i < n; ++i)
+                pool.frames[pool.count++] = frames[i];
+            pool.zeroed += n;
+        }
+
+        // Give anything else that's ready a chance to run
+        scheduler::get().schedule();
+    }
+}
+
+static void
+sized_refill_task()
+{
+    obj::thread &self = obj::thread::current();
+    frame_allocator &fa = frame_allocator::get();
+    g_sized_task = &self;
+
+    while (true) {
+        sized_pool *pool = nullptr;
+        {
+            util::scoped_lock lock {g_sized_lock};
+            for (sized_pool &p : g_sized) {
+                if (p.active && p.count < p.capacity) {
+                    pool = &p;
+                    break;
+                }
+            }
+
+            if (!pool) {
+                g_sized_task_blocked = true;
+                self.block(lock);
+                continue;
+            }
+        }
+
+        size_t frames = pool->size / frame_size;
+        uintptr_t phys = 0;
+        if (!fa.allocate_aligned(frames, &phys)) {
+            // Don't try again until something asks for this size again
+            util::scoped_lock lock {g_sized_lock};
+            pool->active = false;
+            continue;
+        }
+
+        // Zero the page a batch at a time, so that a huge page doesn't
+        // keep everything else on this CPU from running for its whole
+        // length. Fence each batch, as this task may move to another
+        // CPU when it schedules.
+        for (size_t i = 0; i < frames; i += batch) {
+            for (size_t j = 0; j < batch; ++j)
+                zero_frame(phys + (i + j) * frame_size);
+            asm volatile ("sfence" ::: "memory");
+            scheduler::get().schedule();
+        }
+
+        // Only this task adds pages, so there is still room for it
+        util::scoped_lock lock {g_sized_lock};
+        pool->pages[pool->count++] = phys;
+    }
+}
+
+void
+init()
+{
+    scheduler &s = scheduler::get();
+    for (unsigned i = 0; i < g_num_cpus; ++i)
+        s.create_kernel_task(refill_task, scheduler::max_priority, true, 1ull << i);
+    s.create_kernel_task(sized_refill_task, scheduler::max_priority, true);
+}
+
+} // namespace zero_pool
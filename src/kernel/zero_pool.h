@@ -0,0 +1,91 @@
+#pragma once
+/// \file zero_pool.h
+/// Pool of pre-zeroed physical frames for anonymous memory
+
+#include <stddef.h>
+#include <stdint.h>
+#include <util/spinlock.h>
+
+namespace obj {
+    class thread;
+}
+
+namespace zero_pool {
+
+/// Maximum number of zeroed frames held in each CPU's pool
+static constexpr size_t capacity = 256;
+
+/// A CPU's refill task is woken when its pool drops below this many frames
+static constexpr size_t low_water = capacity / 2;
+
+/// Number of frames the refill task zeroes before letting other
+/// threads run
+static constexpr size_t batch = 16;
+
+/// One CPU's pool of zeroed frames. Kernel code is not preemptible, and
+/// each CPU's refill task only runs on that CPU, so only the owning CPU
+/// uses its pool. Its lock is uncontended except when another CPU
+/// reclaims the pool's frames to avoid running out.
+struct cache
+{
+    util::spinlock lock;
+    size_t count;
+    uintptr_t frames[capacity];
+
+    /// This CPU's refill task, once started
+    obj::thread *task;
+
+    /// Whether the refill task is blocked waiting for the pool to drain
+    bool task_blocked;
+
+    size_t hits;
+    size_t misses;
+    size_t zeroed;
+};
+
+/// Usage statistics for the pool, summed over every CPU
+struct stats
+{
+    size_t count;    ///< Zeroed frames currently in the pool
+    size_t capacity; ///< Zeroed frames the pool can hold
+    size_t hits;     ///< Allocations satisfied from the pool
+    size_t misses;   ///< Allocations that had to zero a frame themselves
+    size_t zeroed;   ///< Frames zeroed by the refill tasks
+};
+
+/// Get a zeroed frame. Frames come from the current CPU's pool when it
+/// has any, otherwise a frame is allocated and zeroed synchronously.
+/// \arg address  [out] The physical address of the frame
+/// \returns      True if a frame was allocated
+bool allocate(uintptr_t *address);
+
+/// Maximum number of zeroed large pages kept ready
+static constexpr size_t large_capacity = 4;
+
+/// Maximum number of zeroed huge pages kept ready
+static constexpr size_t huge_capacity = 1;
+
+/// Get a zeroed large or huge page. These are never zeroed synchronously:
+/// if none is ready, the refill task is asked to start keeping pages of
+/// this size ready, and the caller should fall back to a smaller size.
+/// \arg size     Either mem::large_page_size or mem::huge_page_size
+/// \arg address  [out] The physical address of the page
+/// \returns      True if a zeroed page was ready
+bool allocate_sized(size_t size, uintptr_t *address);
+
+/// Return every frame held in the pools to the frame allocator, and stop
+/// keeping large and huge pages ready until they're asked for again.
+/// Used when the frame allocator runs low.
+void reclaim();
+
+/// Get current pool statistics. Other CPUs' counters are read without
+/// locking, so are only approximate.
+stats get_stats();
+
+/// Start an idle-priority kernel task on each CPU that keeps that CPU's
+/// pool filled, and one that keeps large and huge pages ready. Until this
+/// is called, all allocations zero synchronously, and no large or huge
+/// pages are handed out.
+void init();
+
+} // namespace zero_pool
@@ -141,9 +141,7 @@ channel::reserve(size_t size, uint8_t **area, bool block)
     j6::scoped_lock lock {m_tx.mutex};
     while (m_tx.buf.write_available() < size) {
         if (!block) return 0;
-        lock.release();
-        m_tx.waiting.wait();
-        lock.acquire();
+        m_tx.waiting.wait(m_tx.mutex);
     }
 
     return m_tx.buf.reserve(size, area);
@@ -156,7 +154,7 @@ channel::commit(size_t size)
     m_tx.buf.commit(size);
     if (!size) return;
 
-    m_tx.waiting.wake();
+    m_tx.waiting.wake(m_tx.mutex);
     j6::syslog(logs::ipc, log_level::spam,
         "Sending %d bytes to channel on {%x}", size, m_def.tx);
 }
@@ -167,10 +165,7 @@ channel::get_block(uint8_t const **area, bool block) const
     j6::scoped_lock lock {m_rx.mutex};
     while (!m_rx.buf.size()) {
         if (!block) return 0;
-
-        lock.release();
-        m_rx.waiting.wait();
-        lock.acquire();
+        m_rx.waiting.wait(m_rx.mutex);
     }
 
     return m_rx.buf.get_block(area);
@@ -179,11 +174,11 @@ channel::get_block(uint8_t const **area, bool block) const
 void
 channel::consume(size_t size)
 {
-    j6::scoped_lock lock {m_tx.mutex};
+    j6::scoped_lock lock {m_rx.mutex};
     m_rx.buf.consume(size);
     if (!size) return;
 
-    m_rx.waiting.wake();
+    m_rx.waiting.wake(m_rx.mutex);
     j6::syslog(logs::ipc, log_level::spam,
         "Read %d bytes from channel on {%x}", size, m_def.rx);
 }
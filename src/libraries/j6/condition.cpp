@@ -10,25 +10,38 @@
 namespace j6 {
 
 void
-condition::wait()
+condition::wait(mutex &m)
 {
     j6::syslog(j6::logs::app, j6::log_level::verbose, "Waiting on condition %lx", this);
-    uint32_t v = __atomic_add_fetch(&m_state, 1, __ATOMIC_ACQ_REL);
-    j6_status_t s = j6_futex_wait(&m_state, v, 0);
-    while (s == j6_status_futex_changed) {
-        v = m_state;
-        if (v == 0) break;
-        s = j6_futex_wait(&m_state, v, 0);
-    }
+    uint32_t seq = __atomic_load_n(&m_state, __ATOMIC_ACQUIRE);
+    m.unlock();
+
+    // If the condition was signalled since m was unlocked, this
+    // returns immediately with j6_status_futex_changed
+    j6_futex_wait(&m_state, seq, 0, 0);
+
+    // We may have been requeued onto the mutex along with other waiters,
+    // so lock it as contended to be sure they get woken in turn.
+    m.lock_contended();
     j6::syslog(j6::logs::app, j6::log_level::verbose, "Woke on condition %lx", this);
 }
 
 void
 condition::wake()
 {
-    uint32_t v = __atomic_exchange_n(&m_state, 0, __ATOMIC_ACQ_REL);
-    if (v)
-        j6_futex_wake(&m_state, 0);
+    __atomic_add_fetch(&m_state, 1, __ATOMIC_ACQ_REL);
+    j6_futex_wake(&m_state, 0, 0);
+}
+
+void
+condition::wake(mutex &m)
+{
+    uint32_t seq = __atomic_add_fetch(&m_state, 1, __ATOMIC_ACQ_REL);
+
+    // Wake one waiter and move the rest onto the mutex, instead of waking
+    // them all just to fight over it
+    while (j6_futex_requeue(&m_state, seq, 1, &m.m_state, 0) == j6_status_futex_changed)
+        seq = __atomic_load_n(&m_state, __ATOMIC_ACQUIRE);
 }
 
 
@@ -8,6 +8,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <j6/mutex.hh>
 
 namespace j6 {
 
@@ -16,9 +17,19 @@ class condition
 public:
     condition() : m_state {0} {}
 
-    void wait();
+    /// Wait for the condition to be signalled. The mutex must be held by
+    /// the caller, it is released while waiting and re-acquired before
+    /// returning.
+    void wait(mutex &m);
+
+    /// Wake all waiting threads.
     void wake();
 
+    /// Wake all waiting threads that waited with the given mutex. Only one
+    /// is woken immediately, the rest are moved to wait on the mutex itself
+    /// and woken in turn as it is unlocked.
+    void wake(mutex &m);
+
 private:
     uint32_t m_state;
 };
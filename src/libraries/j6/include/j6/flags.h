@@ -15,3 +15,15 @@ enum j6_flags {
 
     j6_flags_MAX // custom per-type flags should start here
 };
+
+enum j6_mailbox_flags {
+    /// Move page-aligned message data into the receiver by remapping its
+    /// pages instead of copying. The whole pages holding the sender's data
+    /// are unmapped, and will read back as new pages.
+    j6_mailbox_flag_move = j6_flags_MAX,
+};
+
+enum j6_multicall_flags {
+    /// Skip the rest of the batch after the first call that returns an error
+    j6_multicall_flag_stop = j6_flags_MAX,
+};
@@ -19,6 +19,13 @@ public:
     void unlock();
 
 private:
+    friend class condition;
+
+    /// Lock the mutex, marking it contended even if it was free. Used by
+    /// threads that may have been moved onto the mutex's wait queue along
+    /// with others, so that unlocking wakes the next one.
+    void lock_contended();
+
     uint32_t m_state;
 };
 
@@ -65,6 +65,9 @@ public:
     /// Wait for the thread to stop executing.
     void join() { j6_thread_join(m_thread); }
 
+    /// Get the handle to the thread, once it has been started
+    j6_handle_t handle() const { return m_thread; }
+
     thread() = delete;
     thread(const thread&) = delete;
 
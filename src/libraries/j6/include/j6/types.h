@@ -13,6 +13,12 @@ typedef uint64_t j6_status_t;
 /// Some objects have signals, which are a bitmap of 64 possible signals
 typedef uint64_t j6_signal_t;
 
+/// Signals of objects that can be waited on with ports. Events are
+/// waited on for their own signals.
+#define j6_signal_mailbox_readable  0x0000000000000001
+#define j6_signal_mailbox_closed    0x0000000000000002
+#define j6_signal_thread_exited     0x0000000000000001
+
 /// The first word of IPC messages are the tag. Tags with the high bit
 /// set are reserved for the system.
 typedef uint64_t j6_tag_t;
@@ -59,3 +65,78 @@ struct j6_log_entry
     uint64_t area     :  7;
     char message[0];
 };
+
+/// Usage of one kernel slab cache, as returned by j6_system_get_slab_stats
+struct j6_slab_stats
+{
+    char name[32];
+    uint64_t object_size;
+    uint64_t active;
+    uint64_t free;
+    uint64_t slabs;
+};
+
+/// Usage of the kernel's pre-zeroed frame pool, as returned by
+/// j6_system_get_zero_pool_stats
+struct j6_zero_pool_stats
+{
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t zeroed;
+};
+
+/// Scheduler statistics for one CPU, as returned in an array by
+/// j6_system_get_sched_stats
+struct j6_sched_stats
+{
+    uint64_t load;
+    uint64_t switches;
+    uint64_t placed;
+    uint64_t wake_local;
+    uint64_t wake_affine;
+    uint64_t wake_balanced;
+    uint64_t stolen;
+    uint64_t idle_cycles;
+};
+
+/// Scheduling accounting for one thread, as returned by
+/// j6_thread_get_stats, or in an array by j6_system_get_thread_stats.
+/// Times are in TSC cycles.
+struct j6_thread_stats
+{
+    uint64_t koid;
+    uint64_t process;
+    uint64_t run_cycles;
+    uint64_t wait_cycles;
+    uint64_t voluntary_switches;
+    uint64_t involuntary_switches;
+    uint64_t migrations;
+    uint32_t cpu;
+    uint32_t priority;
+};
+
+/// An object to wait on with j6_object_wait_many
+struct j6_wait_item
+{
+    j6_handle_t handle;
+    j6_signal_t signals;   ///< The signals to wait for
+    j6_signal_t observed;  ///< Set to the signals that were asserted
+};
+
+/// A readiness notification from a port, as returned by j6_port_wait
+struct j6_port_packet
+{
+    uint64_t key;
+    j6_signal_t signals;
+};
+
+/// One syscall in a batch made with j6_multicall. Entries are filled
+/// with the j6_multicall_* function for each syscall.
+struct j6_multicall_entry
+{
+    uint64_t call;          ///< The syscall number
+    uint64_t args[10];      ///< The syscall's arguments, in order
+    j6_status_t status;     ///< Set to the syscall's result
+};
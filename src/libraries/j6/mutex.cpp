@@ -15,18 +15,25 @@ mutex::lock()
         if (lock != 2)
             lock = __atomic_exchange_n(&m_state, 2, __ATOMIC_ACQ_REL);
         while (lock) {
-            j6_futex_wait(&m_state, 2, 0);
+            j6_futex_wait(&m_state, 2, 0, 0);
             lock = __atomic_exchange_n(&m_state, 2, __ATOMIC_ACQ_REL);
         }
     }
 }
 
+void
+mutex::lock_contended()
+{
+    while (__atomic_exchange_n(&m_state, 2, __ATOMIC_ACQ_REL))
+        j6_futex_wait(&m_state, 2, 0, 0);
+}
+
 void
 mutex::unlock()
 {
     if (__atomic_fetch_sub(&m_state, 1, __ATOMIC_ACQ_REL) != 1) {
         __atomic_store_n(&m_state, 0, __ATOMIC_RELEASE);
-        j6_futex_wake(&m_state, 1);
+        j6_futex_wake(&m_state, 1, 0);
     }
 }
 
@@ -21,7 +21,7 @@ client::register_service(uint64_t proto_id, util::counted<j6_handle_t> handles)
 
     j6_status_t s = j6_mailbox_call(m_service, &tag,
         &data, &data_size, data_size,
-        handles.pointer, &handles.count, handles.count);
+        handles.pointer, &handles.count, handles.count, 0);
 
     if (s != j6_status_ok)
         return s;
@@ -44,7 +44,7 @@ client::lookup_service(uint64_t proto_id, util::counted<j6_handle_t> &handles)
     j6::syslog(j6::logs::proto, j6::log_level::verbose, "Looking up service for %x", proto_id);
     j6_status_t s = j6_mailbox_call(m_service, &tag,
         &data, &data_size, data_size,
-        handles.pointer, &handles.count, handles_size);
+        handles.pointer, &handles.count, handles_size, 0);
 
     if (s != j6_status_ok) {
         j6::syslog(j6::logs::proto, j6::log_level::error, "Received error %lx trying to call service lookup", s);
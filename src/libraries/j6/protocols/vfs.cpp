@@ -36,26 +36,24 @@ client::load_file(char *path, j6_handle_t &vma, size_t &size)
     char *data = path;
     j6_status_t alternate = 0;
     if (path_len < sizeof(alternate)) {
-        data = reinterpret_cast<char*>(alternate);
+        data = reinterpret_cast<char*>(&alternate);
         for (unsigned i = 0; i < path_len; ++i)
             data[i] = path[i];
         data_len = sizeof(alternate);
     }
 
     j6_status_t s = j6_mailbox_call(m_service, &tag,
-        data, &data_len, path_len,
-        &vma, &handle_count, 1);
+        data, &data_len, data_len,
+        &vma, &handle_count, 1, 0);
 
     if (s != j6_status_ok)
         return s;
 
     if (tag == j6_proto_vfs_file && handle_count == 1) {
-        size = 0;
-
-        // Get the size into `size`
-        s = j6_vma_resize(vma, &size);
-        if (s != j6_status_ok)
-            return s;
+        // The file's size is the reply's data
+        if (data_len < sizeof(size))
+            return j6_err_unexpected;
+        size = *reinterpret_cast<size_t*>(data);
 
         return j6_status_ok; // handle is already in `vma`
     }
@@ -78,7 +76,7 @@ client::get_tag(char *tag, size_t &len)
 
     size_t in_len = 0;
     j6_status_t s = j6_mailbox_call(m_service, &message_tag,
-        tag, &in_len, len, nullptr, &handle_count, 0);
+        tag, &in_len, len, nullptr, &handle_count, 0, 0);
 
     if (s != j6_status_ok)
         return s;
@@ -1,4 +1,5 @@
 #include <stdarg.h>
+#include <stdint.h>
 #include <util/format.h>
 
 namespace util {
@@ -89,8 +90,32 @@ append_string(char_t *&out, size_t &count, size_t max, unsigned width, char_t co
 }
 
 
-template <typename char_t> size_t
-vformat(counted<char_t> output, char_t const *format, va_list va)
+/// Argument source reading from a va_list
+struct va_args
+{
+    va_list va;
+
+    va_args(va_list in) { va_copy(va, in); }
+    ~va_args() { va_end(va); }
+
+    template <typename T> T next() { return va_arg(va, T); }
+    template <typename T> T * next_ptr() { return va_arg(va, T*); }
+};
+
+/// Argument source reading from an array of packed 64-bit words
+struct packed_args
+{
+    counted<const uint64_t> args;
+    size_t index;
+
+    uint64_t word() { return index < args.count ? args[index++] : 0; }
+
+    template <typename T> T next() { return static_cast<T>(word()); }
+    template <typename T> T * next_ptr() { return reinterpret_cast<T*>(word()); }
+};
+
+template <typename char_t, typename arg_source> size_t
+vformat(counted<char_t> output, char_t const *format, arg_source &args)
 {
     using chars = char_traits<char_t>;
 
@@ -138,23 +163,23 @@ vformat(counted<char_t> output, char_t const *format, va_list va)
 
                 case chars::x:
                     if (long_type)
-                        append_int<char_t, uint64_t, 16>(out, count, max, va_arg(va, uint64_t), width, pad);
+                        append_int<char_t, uint64_t, 16>(out, count, max, args.template next<uint64_t>(), width, pad);
                     else
-                        append_int<char_t, uint32_t, 16>(out, count, max, va_arg(va, uint32_t), width, pad);
+                        append_int<char_t, uint32_t, 16>(out, count, max, args.template next<uint32_t>(), width, pad);
                     done = true;
                     break;
 
                 case chars::d:
                 case chars::u:
                     if (long_type)
-                        append_int<char_t, uint64_t, 10>(out, count, max, va_arg(va, uint64_t), width, pad);
+                        append_int<char_t, uint64_t, 10>(out, count, max, args.template next<uint64_t>(), width, pad);
                     else
-                        append_int<char_t, uint32_t, 10>(out, count, max, va_arg(va, uint32_t), width, pad);
+                        append_int<char_t, uint32_t, 10>(out, count, max, args.template next<uint32_t>(), width, pad);
                     done = true;
                     break;
 
                 case chars::s:
-                    append_string(out, count, max, width, va_arg(va, const char_t *));
+                    append_string(out, count, max, width, args.template next_ptr<const char_t>());
                     done = true;
                     break;
             }
@@ -174,7 +199,7 @@ size_t API format(counted<char> output, const char *format, ...)
 {
     va_list va;
     va_start(va, format);
-    size_t result = vformat<char>(output, format, va);
+    size_t result = vformat(output, format, va);
     va_end(va);
     return result;
 }
@@ -183,13 +208,28 @@ size_t API format(counted<wchar_t> output, const wchar_t *format, ...)
 {
     va_list va;
     va_start(va, format);
-    size_t result = vformat<wchar_t>(output, format, va);
+    size_t result = vformat(output, format, va);
     va_end(va);
     return result;
 }
 
-size_t API vformat(counted<char> output, const char *format, va_list va) { return vformat<char>(output, format, va); }
-size_t API vformat(counted<wchar_t> output, const wchar_t *format, va_list va) { return vformat<wchar_t>(output, format, va); }
+size_t API vformat(counted<char> output, const char *format, va_list va)
+{
+    va_args args {va};
+    return vformat<char>(output, format, args);
+}
+
+size_t API vformat(counted<wchar_t> output, const wchar_t *format, va_list va)
+{
+    va_args args {va};
+    return vformat<wchar_t>(output, format, args);
+}
+
+size_t API pformat(counted<char> output, const char *format, counted<const uint64_t> args)
+{
+    packed_args packed {args, 0};
+    return vformat<char>(output, format, packed);
+}
 
 
 } //namespace util
@@ -3,13 +3,14 @@
 /// A generic templatized linked list.
 
 #include <j6/memutils.h>
+#include <util/allocator.h>
 #include <util/assert.h>
 #include <util/basic_types.h>
 #include <util/linked_list.h>
 
 namespace util {
 
-template <typename T, unsigned N = 16>
+template <typename T, unsigned N = 16, typename Alloc = default_allocator>
 class deque
 {
 public:
@@ -59,7 +60,7 @@ public:
 
     inline void push_front(const T& item) {
         if (!m_first) { // need a new block at the start
-            node_type *n = new node_type;
+            node_type *n = reinterpret_cast<node_type*>(Alloc::allocate(sizeof(node_type)));
             memset(n, 0, sizeof(node_type));
             m_list.push_front(n);
             m_first = chunk_size;
@@ -69,7 +70,7 @@ public:
 
     inline void push_back(const T& item) {
         if (m_next == chunk_size) { // need a new block at the end
-            node_type *n = new node_type;
+            node_type *n = reinterpret_cast<node_type*>(Alloc::allocate(sizeof(node_type)));
             memset(n, 0, sizeof(node_type));
             m_list.push_back(n);
             m_next = 0;
@@ -81,7 +82,7 @@ public:
         assert(!empty() && "Calling pop_front() on an empty deque");
         T value = m_list.front()->items[m_first++];
         if (m_first == chunk_size) {
-            delete m_list.pop_front();
+            Alloc::free(m_list.pop_front());
             m_first = 0;
             if (m_list.empty())
                 m_next = chunk_size;
@@ -93,7 +94,7 @@ public:
         assert(!empty() && "Calling pop_back() on an empty deque");
         T value = m_list.back()->items[--m_next];
         if (m_next == 0) {
-            delete m_list.pop_back();
+            Alloc::free(m_list.pop_back());
             m_next = chunk_size;
             if (m_list.empty())
                 m_first = 0;
@@ -128,7 +129,7 @@ public:
 
     inline void clear() {
         while (!m_list.empty())
-            delete m_list.pop_front();
+            Alloc::free(m_list.pop_front());
         m_first = 0;
         m_next = chunk_size;
     }
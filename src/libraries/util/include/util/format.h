@@ -12,6 +12,11 @@ namespace util {
 size_t API format(counted<char> output, const char *format, ...);
 size_t API vformat(counted<char> output, const char *format, va_list va);
 
+/// Format using arguments that were already gathered into an array of
+/// 64-bit words, one per conversion in the format string. String
+/// arguments are pointers stored in their word.
+size_t API pformat(counted<char> output, const char *format, counted<const uint64_t> args);
+
 
 size_t API format(counted<wchar_t> output, const wchar_t *format, ...);
 size_t API vformat(counted<wchar_t> output, const wchar_t *format, va_list va);
@@ -1,10 +1,12 @@
 #include <stdint.h>
+#include <j6/cap_flags.h>
 #include <j6/flags.h>
 #include <j6/errors.h>
 #include <j6/memutils.h>
 #include <j6/protocols/vfs.h>
 #include <j6/syscalls.h>
 #include <j6/syslog.hh>
+#include <util/vector.h>
 
 #include "j6romfs.h"
 #include "initfs.h"
@@ -15,8 +17,21 @@ static constexpr size_t buffer_size = 2048;
 static char fs_tag[] = "init";
 static constexpr size_t fs_tag_len = sizeof(fs_tag) - 1;
 
+/// Files already loaded, kept so that every process loading a file gets
+/// the same VMA, and can share its pages copy-on-write. Clients only get
+/// the read-only view, since writes to the file's VMA would show through
+/// every other client's pages that haven't been copied yet.
+struct loaded_file
+{
+    const j6romfs::inode *inode;
+    j6_handle_t vma;
+    j6_handle_t view;
+};
+
+static util::vector<loaded_file> loaded_files;
+
 j6_status_t
-handle_load_request(j6romfs::fs &fs, const char *path, j6_handle_t &vma)
+handle_load_request(j6romfs::fs &fs, const char *path, j6_handle_t &vma, size_t &size)
 {
     const j6romfs::inode *in = fs.lookup_inode(path);
     if (!in) {
@@ -24,13 +39,40 @@ handle_load_request(j6romfs::fs &fs, const char *path, j6_handle_t &vma)
         return j6_status_ok;
     }
 
-    uintptr_t load_addr = 0;
-    j6_vma_create_map(&vma, in->size, &load_addr, j6_vm_flag_write);
-    util::buffer dest = util::buffer::from(load_addr, in->size);
-    fs.load_inode_data(in, dest);
-    j6_vma_unmap(vma, 0);
+    j6_handle_t view = j6_handle_invalid;
+    for (const loaded_file &f : loaded_files) {
+        if (f.inode == in) {
+            view = f.view;
+            break;
+        }
+    }
+
+    if (view == j6_handle_invalid) {
+        j6_handle_t file_vma = j6_handle_invalid;
+        uintptr_t load_addr = 0;
+        j6_status_t s = j6_vma_create_map(&file_vma, in->size, &load_addr, j6_vm_flag_write);
+        if (s != j6_status_ok)
+            return s;
+
+        util::buffer dest = util::buffer::from(load_addr, in->size);
+        fs.load_inode_data(in, dest);
+        j6_vma_unmap(file_vma, 0);
+
+        s = j6_vma_create_cow(&view, file_vma, 0, in->size, in->size, 0);
+        if (s != j6_status_ok) {
+            j6_handle_close(file_vma);
+            return s;
+        }
+
+        loaded_files.append({in, file_vma, view});
+    }
 
-    return j6_status_ok;
+    // Keep our handle, and give out one that can't be cloned further, or
+    // resized out from under other clients
+    size = in->size;
+    return j6_handle_clone(view, &vma,
+            j6_cap_vma_map |
+            j6_cap_vma_unmap);
 }
 
 void
@@ -59,6 +101,7 @@ initfs_start(j6romfs::fs &fs, j6_handle_t mb)
     static constexpr size_t max_handles = 1;
     size_t handles_count = 0;
     j6_handle_t give_handle = j6_handle_invalid;
+    size_t file_size = 0;
     uint64_t proto_id;
 
     j6_status_t s = j6_mailbox_respond(mb, &tag,
@@ -75,13 +118,15 @@ initfs_start(j6romfs::fs &fs, j6_handle_t mb)
         switch (tag) {
         case j6_proto_vfs_load:
             sanitize(buffer, out_len);
-            s = handle_load_request(fs, buffer, give_handle);
+            s = handle_load_request(fs, buffer, give_handle, file_size);
             if (s != j6_status_ok) {
                 tag = j6_proto_base_status;
                 *reinterpret_cast<j6_status_t*>(buffer) = s;
                 out_len = sizeof(j6_status_t);
                 break;
             }
+            *reinterpret_cast<size_t*>(buffer) = file_size;
+            out_len = sizeof(size_t);
             handles_count = 1;
             tag = j6_proto_vfs_file;
             break;
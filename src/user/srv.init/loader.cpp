@@ -120,39 +120,96 @@ map_phys(j6_handle_t sys, uintptr_t phys, size_t len, j6_vm_flags flags)
     return vma;
 }
 
+/// Make a batch of syscalls with one j6_multicall, stopping at the first
+/// failure. Logs the failed call, if any.
+/// \arg calls  The calls to make
+/// \arg count  The number of calls
+/// \arg path   The program being loaded, for error messages
+/// \arg what   What the calls are doing, for error messages
+/// \returns    True if every call succeeded
+static bool
+submit_batch(j6_multicall_entry *calls, size_t count, const char *path, const char *what)
+{
+    size_t made = count;
+    j6_status_t res = j6_multicall(calls, &made, j6_multicall_flag_stop);
+    if (res == j6_status_ok)
+        return true;
+
+    if (made)
+        j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': %s (call %lu of %lu): %lx",
+                path, what, made, count, res);
+    else
+        j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': %s: %lx", path, what, res);
+    return false;
+}
+
+/// A program image file loaded from the initrd into its own VMA. Segments
+/// are mapped copy-on-write from the VMA, so every process loaded from the
+/// same file shares the pages it doesn't write to.
+struct image_file
+{
+    const j6romfs::inode *inode;
+    j6_handle_t vma;
+    util::buffer data;
+};
+
+static util::vector<image_file> g_images;
+
 uintptr_t
-load_program_into(j6_handle_t proc, elf::file &file, uintptr_t image_base, const char *path)
+load_program_into(j6_handle_t proc, elf::file &file, j6_handle_t image_vma, uintptr_t image_base, const char *path)
 {
     uintptr_t eop = 0; // end of program
 
+    // Mapping segments into the child doesn't depend on any other
+    // segment, so the maps are batched into one j6_multicall
+    static constexpr size_t max_maps = 16;
+    j6_multicall_entry maps[max_maps];
+    uintptr_t map_addrs[max_maps];
+    size_t nmaps = 0;
+
     for (auto &seg : file.segments()) {
         if (seg.type != elf::segment_type::load)
             continue;
 
-        uintptr_t addr = 0;
-
         // TODO: way to remap VMA as read-only if there's no write flag on
         // the segment
         unsigned long flags = j6_vm_flag_write;
         if (seg.flags.get(elf::segment_flags::exec))
             flags |= j6_vm_flag_exec;
 
-        uintptr_t start = file.base() + seg.offset;
         size_t prologue = seg.vaddr & 0xfff;
         size_t epilogue = seg.mem_size - seg.file_size;
+        if ((seg.offset & 0xfff) != prologue) {
+            j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': segment is not page-aligned in the file", path);
+            return 0;
+        }
 
         j6_handle_t sub_vma = j6_handle_invalid;
-        j6_status_t res = j6_vma_create_map(&sub_vma, seg.mem_size+prologue, &addr, flags);
+        j6_status_t res = j6_vma_create_cow(&sub_vma, image_vma, seg.offset - prologue,
+                seg.file_size + prologue, seg.mem_size + prologue, flags);
         if (res != j6_status_ok) {
             j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': creating sub vma: %lx", path, res);
             return 0;
         }
 
-        uint8_t *src = reinterpret_cast<uint8_t *>(start);
-        uint8_t *dest = reinterpret_cast<uint8_t *>(addr);
-        memset(dest, 0, prologue);
-        memcpy(dest+prologue, src, seg.file_size);
-        memset(dest+prologue+seg.file_size, 0, epilogue);
+        if (epilogue) {
+            // Zero the BSS. Only the shared page it starts in is copied.
+            uintptr_t addr = 0;
+            res = j6_vma_map(sub_vma, 0, &addr, 0);
+            if (res != j6_status_ok) {
+                j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': mapping sub vma: %lx", path, res);
+                return 0;
+            }
+
+            uint8_t *dest = reinterpret_cast<uint8_t *>(addr);
+            memset(dest+prologue+seg.file_size, 0, epilogue);
+
+            res = j6_vma_unmap(sub_vma, 0);
+            if (res != j6_status_ok) {
+                j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': unmapping sub vma: %lx", path, res);
+                return 0;
+            }
+        }
 
         // end of segment
         uintptr_t eos = image_base + seg.vaddr + seg.mem_size + prologue;
@@ -161,34 +218,22 @@ load_program_into(j6_handle_t proc, elf::file &file, uintptr_t image_base, const
 
         uintptr_t start_addr = (image_base + seg.vaddr) & ~0xfffull;
         j6::syslog(j6::logs::srv, j6::log_level::verbose, "Mapping segment from %s at %012lx - %012lx", path, start_addr, start_addr+seg.mem_size);
-        res = j6_vma_map(sub_vma, proc, &start_addr, j6_vm_flag_exact);
-        if (res != j6_status_ok) {
-            j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': mapping sub vma to child: %lx", path, res);
-            return 0;
+        if (nmaps == max_maps) {
+            if (!submit_batch(maps, nmaps, path, "mapping sub vma to child"))
+                return 0;
+            nmaps = 0;
         }
 
-        res = j6_vma_unmap(sub_vma, 0);
-        if (res != j6_status_ok) {
-            j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': unmapping sub vma: %lx", path, res);
-            return 0;
-        }
+        map_addrs[nmaps] = start_addr;
+        j6_multicall_vma_map(&maps[nmaps], sub_vma, proc, &map_addrs[nmaps],
+                j6_vm_flag_exact | j6_vm_flag_prefault);
+        ++nmaps;
     }
 
-    return eop;
-}
-
-static bool
-give_handle(j6_handle_t proc, j6_handle_t h, const char *name)
-{
-    if (h != j6_handle_invalid) {
-        j6_status_t res = j6_process_give_handle(proc, h);
-        if (res != j6_status_ok) {
-            j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': giving handle: %lx", name, res);
-            return false;
-        }
-    }
+    if (nmaps && !submit_batch(maps, nmaps, path, "mapping sub vma to child"))
+        return 0;
 
-    return true;
+    return eop;
 }
 
 static j6_handle_t
@@ -201,29 +246,46 @@ create_process(j6_handle_t sys, j6_handle_t slp, j6_handle_t vfs, const char *pa
         return j6_handle_invalid;
     }
 
-    if (!give_handle(proc, sys, "system")) return j6_handle_invalid;
-    if (!give_handle(proc, slp, "SLP")) return j6_handle_invalid;
-    if (!give_handle(proc, vfs, "VFS")) return j6_handle_invalid;
+    const j6_handle_t handles[] = {sys, slp, vfs};
+    j6_multicall_entry gives[3];
+    size_t ngives = 0;
+    for (j6_handle_t h : handles)
+        if (h != j6_handle_invalid)
+            j6_multicall_process_give_handle(&gives[ngives++], proc, h);
+
+    if (ngives && !submit_batch(gives, ngives, path, "giving handles"))
+        return j6_handle_invalid;
+
     return proc;
 }
 
-static util::buffer
+static image_file
 load_file(const j6romfs::fs &fs, const char *path)
 {
     const j6romfs::inode *in = fs.lookup_inode(path);
     if (!in || in->type != j6romfs::inode_type::file)
         return {};
 
+    for (const image_file &image : g_images)
+        if (image.inode == in)
+            return image;
+
     j6::syslog(j6::logs::srv, j6::log_level::info, "  Loading file: %s", path);
 
-    uint8_t *data = new uint8_t [in->size];
-    util::buffer program {data, in->size};
+    uintptr_t addr = 0;
+    j6_handle_t vma = j6_handle_invalid;
+    j6_status_t res = j6_vma_create_map(&vma, in->size, &addr, j6_vm_flag_write);
+    if (res != j6_status_ok) {
+        j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': creating file vma: %lx", path, res);
+        return {};
+    }
 
-    fs.load_inode_data(in, program);
-    return program;
+    image_file image {in, vma, {reinterpret_cast<uint8_t*>(addr), in->size}};
+    fs.load_inode_data(in, image.data);
+    g_images.append(image);
+    return image;
 }
 
-
 bool
 load_program(
         const char *path, const j6romfs::fs &fs,
@@ -235,11 +297,11 @@ load_program(
     if (proc == j6_handle_invalid)
         return false;
 
-    util::buffer program_data = load_file(fs, path);
-    if (!program_data.pointer)
+    image_file program_file = load_file(fs, path);
+    if (!program_file.data.pointer)
         return false;
 
-    elf::file program_elf {program_data};
+    elf::file program_elf {program_file.data};
 
     bool dyn = program_elf.type() == elf::filetype::shared;
     uintptr_t program_image_base = 0;
@@ -253,7 +315,7 @@ load_program(
         return false;
     }
 
-    uintptr_t eop = load_program_into(proc, program_elf, program_image_base, path);
+    uintptr_t eop = load_program_into(proc, program_elf, program_file.vma, program_image_base, path);
     if (!eop)
         return false;
 
@@ -309,23 +371,22 @@ load_program(
         for (auto seg : program_elf.segments()) {
             if (seg.type == elf::segment_type::interpreter) {
                 const char *ldso_path = reinterpret_cast<const char*>(program_elf.base() + seg.offset);
-                util::buffer ldso_data = load_file(fs, ldso_path);
+                image_file ldso_file = load_file(fs, ldso_path);
                 j6::syslog(j6::logs::srv, j6::log_level::info, "  Image %s offset: 0x%lx", ldso_path, ldso_image_base);
-                if (!ldso_data.pointer)
+                if (!ldso_file.data.pointer)
                     return false;
 
-                elf::file ldso_elf {ldso_data};
+                elf::file ldso_elf {ldso_file.data};
                 if (!ldso_elf.valid(elf::filetype::shared)) {
                     j6::syslog(j6::logs::srv, j6::log_level::error, "error loading dynamic linker for '%s': ELF is invalid", path);
                     return false;
                 }
 
-                uintptr_t eop = load_program_into(proc, ldso_elf, ldso_image_base, ldso_path);
+                uintptr_t eop = load_program_into(proc, ldso_elf, ldso_file.vma, ldso_image_base, ldso_path);
                 eop = (eop & ~0xfffffull) + 0x100000;
                 loader_arg->loader_base = ldso_image_base;
                 loader_arg->start_addr = eop;
                 entrypoint = ldso_elf.entrypoint() + ldso_image_base;
-                delete [] reinterpret_cast<uint8_t*>(ldso_data.pointer);
                 break;
             }
         }
@@ -333,28 +394,18 @@ load_program(
 
     stack.build();
 
+    // Map the stack into the child, unmap it here, and start the
+    // child's first thread, in one trip into the kernel
     uintptr_t stack_base = stack_top-stack_size;
-    res = j6_vma_map(stack_vma, proc, &stack_base, j6_vm_flag_exact);
-    if (res != j6_status_ok) {
-        j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': mapping stack vma: %lx", path, res);
-        return false;
-    }
-
-    res = j6_vma_unmap(stack_vma, 0);
-    if (res != j6_status_ok) {
-        j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': unmapping stack vma: %lx", path, res);
-        return false;
-    }
-
     j6_handle_t thread = j6_handle_invalid;
-    res = j6_thread_create(&thread, proc, stack.child_pointer(), entrypoint, program_image_base, 0);
-    if (res != j6_status_ok) {
-        j6::syslog(j6::logs::srv, j6::log_level::error, "error loading '%s': creating thread: %lx", path, res);
+    j6_multicall_entry start[3];
+    j6_multicall_vma_map(&start[0], stack_vma, proc, &stack_base, j6_vm_flag_exact | j6_vm_flag_prefault);
+    j6_multicall_vma_unmap(&start[1], stack_vma, 0);
+    j6_multicall_thread_create(&start[2], &thread, proc, stack.child_pointer(), entrypoint, program_image_base, 0);
+
+    if (!submit_batch(start, 3, path, "starting process"))
         return false;
-    }
 
-    // TODO: smart pointer this, it's a memory leak if we return early
-    delete [] reinterpret_cast<uint8_t*>(program_data.pointer);
     return true;
 }
 
@@ -74,7 +74,8 @@ main(int argc, const char **argv, const char **env)
             j6_cap_system_bind_irq |
             j6_cap_system_get_log |
             j6_cap_system_map_phys |
-            j6_cap_system_change_iopl);
+            j6_cap_system_change_iopl |
+            j6_cap_system_schedule);
     if (s != j6_status_ok)
         return s;
 
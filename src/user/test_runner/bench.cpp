@@ -0,0 +1,43 @@
+#include <stdarg.h>
+#include <j6/syscalls.h>
+#include <j6/syslog.hh>
+#include <util/format.h>
+
+#include "bench.h"
+
+namespace test {
+namespace bench {
+
+uint64_t
+ticks_per_us()
+{
+    static uint64_t calibrated = 0;
+    if (calibrated)
+        return calibrated;
+
+    static constexpr uint64_t sample_us = 50000;
+    uint64_t start = ticks();
+    j6_thread_sleep(sample_us);
+    uint64_t stop = ticks();
+
+    calibrated = (stop - start) / sample_us;
+    if (!calibrated)
+        calibrated = 1;
+    return calibrated;
+}
+
+void
+report(const char *test_name, const char *fmt, ...)
+{
+    char buffer[160];
+
+    va_list va;
+    va_start(va, fmt);
+    util::vformat({buffer, sizeof(buffer) - 1}, fmt, va);
+    va_end(va);
+
+    j6::syslog(j6::logs::app, j6::log_level::info, "bench %s: %s", test_name, buffer);
+}
+
+} // namespace bench
+} // namespace test
@@ -0,0 +1,73 @@
+#pragma once
+/// \file bench.h
+/// Helpers for timing benchmark test cases
+
+#include <stddef.h>
+#include <stdint.h>
+#include <j6/errors.h>
+#include <j6/thread.hh>
+
+namespace test {
+namespace bench {
+
+/// Read the CPU timestamp counter
+inline uint64_t ticks() {
+    uint32_t high, low;
+    asm volatile ( "rdtsc" : "=a" (low), "=d" (high) );
+    return (static_cast<uint64_t>(high) << 32) | low;
+}
+
+/// Get the number of timestamp counter ticks per microsecond. The
+/// value is calibrated against the kernel clock on first use.
+uint64_t ticks_per_us();
+
+/// Convert a number of timestamp counter ticks to microseconds
+inline uint64_t to_us(uint64_t t) { return t / ticks_per_us(); }
+
+/// Log a benchmark result line to the system log
+/// \arg test_name  Name of the test case reporting the result
+/// \arg fmt        util::format-style format string
+void report(const char *test_name, const char *fmt, ...);
+
+/// Run `proc(i)` on `count` new threads at once, and return the
+/// number of ticks from releasing them until the last one exits.
+template <typename Proc>
+uint64_t run_threads(unsigned count, Proc proc, size_t stack_size = 0x10000)
+{
+    volatile unsigned ready = 0;
+    volatile bool go = false;
+
+    auto wrap = [&](unsigned i) {
+        return [&, i]() {
+            __atomic_add_fetch(&ready, 1, __ATOMIC_SEQ_CST);
+            while (!go) asm volatile ("pause");
+            proc(i);
+        };
+    };
+
+    using thread_t = j6::thread<decltype(wrap(0))>;
+    thread_t **threads = new thread_t* [count];
+    for (unsigned i = 0; i < count; ++i) {
+        threads[i] = new thread_t {wrap(i), stack_size};
+        threads[i]->start();
+    }
+
+    while (ready < count)
+        j6_thread_sleep(100);
+
+    uint64_t start = ticks();
+    go = true;
+
+    for (unsigned i = 0; i < count; ++i)
+        threads[i]->join();
+    uint64_t stop = ticks();
+
+    for (unsigned i = 0; i < count; ++i)
+        delete threads[i];
+    delete [] threads;
+
+    return stop - start;
+}
+
+} // namespace bench
+} // namespace test
@@ -0,0 +1,91 @@
+#include <j6/errors.h>
+#include <j6/flags.h>
+#include <j6/syscalls.h>
+#include <j6/types.h>
+
+#include "bench.h"
+#include "test_case.h"
+
+struct context_switch_benchmarks :
+    public test::fixture
+{
+    static constexpr size_t round_trips = 100000;
+
+    /// Modify vector registers, so that this thread's extended
+    /// state must be saved and restored around each switch
+    static inline void dirty_vector_state(uint64_t value) {
+        asm volatile (
+            "movq %0, %%xmm0;"
+            "paddq %%xmm0, %%xmm1;"
+            :: "r"(value) : "xmm0", "xmm1");
+    }
+};
+
+TEST_CASE( context_switch_benchmarks, ping_pong )
+{
+    j6_handle_t mb = j6_handle_invalid;
+    j6_status_t s = j6_mailbox_create(&mb);
+    REQUIRE( s == j6_status_ok, "Could not create a mailbox" );
+
+    // The responder touches vector registers when the message tag is 2,
+    // and exits when it is 0.
+    j6::thread responder {[&]() {
+        uint64_t tag = 0;
+        uint64_t reply_tag = 0;
+        size_t data_len = 0;
+        size_t handles_count = 0;
+        while (true) {
+            j6_status_t rs = j6_mailbox_respond(mb, &tag,
+                    nullptr, &data_len, 0,
+                    nullptr, &handles_count, 0,
+                    &reply_tag, j6_flag_block);
+            if (rs != j6_status_ok || tag == 0)
+                break;
+            if (tag == 2)
+                dirty_vector_state(tag);
+        }
+
+        j6_mailbox_respond(mb, &tag,
+                nullptr, &data_len, 0,
+                nullptr, &handles_count, 0,
+                &reply_tag, 0);
+    }, 0x10000};
+
+    s = responder.start();
+    REQUIRE( s == j6_status_ok, "Could not start mailbox responder thread" );
+
+    for (uint64_t mode = 1; mode <= 2; ++mode) {
+        uint64_t start = test::bench::ticks();
+        for (size_t i = 0; i < round_trips; ++i) {
+            if (mode == 2)
+                dirty_vector_state(i);
+
+            uint64_t tag = mode;
+            size_t data_len = 0;
+            size_t handles_count = 0;
+            s = j6_mailbox_call(mb, &tag,
+                    nullptr, &data_len, 0,
+                    nullptr, &handles_count, 0, 0);
+            if (s != j6_status_ok)
+                break;
+        }
+        uint64_t t = test::bench::ticks() - start;
+        CHECK( s == j6_status_ok, "Benchmark call failed" );
+
+        // Each round trip is two switches
+        test::bench::report(test_name, "%s: %lu ticks / %lu ns per switch",
+                mode == 2 ? "simd" : "integer",
+                t / round_trips / 2,
+                t * 1000 / test::bench::ticks_per_us() / round_trips / 2);
+    }
+
+    uint64_t tag = 0;
+    size_t data_len = 0;
+    size_t handles_count = 0;
+    j6_mailbox_call(mb, &tag,
+            nullptr, &data_len, 0,
+            nullptr, &handles_count, 0, 0);
+
+    responder.join();
+    j6_mailbox_close(mb);
+}
@@ -0,0 +1,93 @@
+#include <j6/errors.h>
+#include <j6/flags.h>
+#include <j6/syscalls.h>
+#include <j6/sysconf.h>
+#include <j6/types.h>
+
+#include "test_case.h"
+
+struct cow_tests :
+    public test::fixture
+{
+};
+
+TEST_CASE( cow_tests, copy_on_write )
+{
+    const size_t page_size = j6_sysconf(j6sc_page_size);
+    const size_t pages = 4;
+    const size_t words = page_size / sizeof(uint64_t);
+
+    j6_handle_t source = j6_handle_invalid;
+    uintptr_t source_base = 0;
+    j6_status_t s = j6_vma_create_map(&source, pages * page_size, &source_base, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Creating source VMA" );
+
+    volatile uint64_t *src = reinterpret_cast<volatile uint64_t*>(source_base);
+    for (size_t i = 0; i < pages; ++i)
+        src[i * words] = i + 1;
+
+    // Share the last three pages of the source, plus one page of our own
+    j6_handle_t cow = j6_handle_invalid;
+    s = j6_vma_create_cow(&cow, source, page_size,
+            (pages - 1) * page_size, pages * page_size, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Creating COW VMA" );
+
+    uintptr_t cow_base = 0;
+    s = j6_vma_map(cow, j6_handle_invalid, &cow_base, 0);
+    REQUIRE( s == j6_status_ok, "Mapping COW VMA" );
+
+    volatile uint64_t *dst = reinterpret_cast<volatile uint64_t*>(cow_base);
+    bool shared = true;
+    for (size_t i = 0; i < pages - 1; ++i)
+        shared = shared && dst[i * words] == i + 2;
+    CHECK( shared, "COW pages start with the source's contents" );
+
+    dst[0] = 100;
+    dst[(pages - 1) * words] = 200;
+    CHECK_BARE( dst[0] == 100 );
+    CHECK_BARE( dst[(pages - 1) * words] == 200 );
+    CHECK( src[words] == 2, "Writing a COW page doesn't change the source" );
+
+    src[words] = 300;
+    CHECK( dst[0] == 100, "Writing the source doesn't change a copied page" );
+
+    j6_handle_t other = j6_handle_invalid;
+    s = j6_process_create(&other, "cow_tests");
+    if (s == j6_status_ok) {
+        uintptr_t other_base = 0;
+        s = j6_vma_map(cow, other, &other_base, 0);
+        CHECK( s != j6_status_ok, "COW VMA can't be mapped into a second process" );
+        j6_handle_close(other);
+    }
+
+    j6_vma_unmap(cow, j6_handle_invalid);
+    j6_handle_close(cow);
+    j6_vma_unmap(source, j6_handle_invalid);
+    j6_handle_close(source);
+}
+
+TEST_CASE( cow_tests, invalid_offset )
+{
+    const size_t page_size = j6_sysconf(j6sc_page_size);
+
+    j6_handle_t source = j6_handle_invalid;
+    j6_status_t s = j6_vma_create(&source, page_size, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Creating source VMA" );
+
+    j6_handle_t cow = j6_handle_invalid;
+    s = j6_vma_create_cow(&cow, source, 12, page_size, page_size, 0);
+    CHECK( s == j6_err_invalid_arg, "Unaligned COW offset" );
+
+    s = j6_vma_create_cow(&cow, source, page_size, page_size, page_size, 0);
+    CHECK( s == j6_err_invalid_arg, "COW offset past the end of the source" );
+
+    j6_handle_close(source);
+
+    s = j6_vma_create(&source, 0x200000, j6_vm_flag_write | j6_vm_flag_large_pages);
+    REQUIRE( s == j6_status_ok, "Creating large page source VMA" );
+
+    s = j6_vma_create_cow(&cow, source, 0, page_size, page_size, 0);
+    CHECK( s == j6_err_invalid_arg, "COW of a large page source" );
+
+    j6_handle_close(source);
+}
@@ -24,3 +24,33 @@ TEST_CASE( handle_tests, clone_cap )
     s = j6_handle_clone(self1, &self2, j6_handle_caps(self1));
     CHECK( s == j6_err_denied, "Cloning non-clonable handle" );
 }
+
+TEST_CASE( handle_tests, closed_handle )
+{
+    j6_status_t s;
+    j6_handle_t self0 = __handle_self;
+
+    j6_handle_t closed = j6_handle_invalid;
+    s = j6_handle_clone(self0, &closed, j6_handle_caps(self0));
+    REQUIRE( s == j6_status_ok, "Cloning self handle" );
+
+    s = j6_handle_close(closed);
+    CHECK( s == j6_status_ok, "Closing cloned handle" );
+
+    // The closed handle's slot is likely to be reused here, the old
+    // handle must not refer to the new capability
+    j6_handle_t reused = j6_handle_invalid;
+    s = j6_handle_clone(self0, &reused, j6_handle_caps(self0));
+    REQUIRE( s == j6_status_ok, "Cloning self handle again" );
+    CHECK_BARE( reused != closed );
+
+    j6_handle_t other = j6_handle_invalid;
+    s = j6_handle_clone(closed, &other, j6_handle_caps(self0));
+    CHECK( s == j6_err_invalid_arg, "Cloning a closed handle" );
+
+    s = j6_handle_clone(reused, &other, j6_handle_caps(self0));
+    CHECK( s == j6_status_ok, "Cloning the new handle" );
+
+    j6_handle_close(other);
+    j6_handle_close(reused);
+}
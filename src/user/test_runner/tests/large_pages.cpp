@@ -0,0 +1,43 @@
+#include <j6/errors.h>
+#include <j6/flags.h>
+#include <j6/syscalls.h>
+#include <j6/sysconf.h>
+#include <j6/types.h>
+
+#include "test_case.h"
+
+struct large_page_tests :
+    public test::fixture
+{
+};
+
+TEST_CASE( large_page_tests, read_write )
+{
+    const size_t page_size = j6_sysconf(j6sc_page_size);
+    const size_t large_size = j6_sysconf(j6sc_large_page_size);
+    REQUIRE( large_size > page_size, "Large pages supported" );
+
+    const size_t size = large_size * 2;
+
+    j6_handle_t vma = j6_handle_invalid;
+    uintptr_t base = 0;
+    j6_status_t s = j6_vma_create_map(&vma, size, &base,
+            j6_vm_flag_write | j6_vm_flag_large_pages);
+    REQUIRE( s == j6_status_ok, "Creating large page VMA" );
+    CHECK( base % large_size == 0, "Large page VMA is aligned" );
+
+    volatile uint64_t *p = reinterpret_cast<volatile uint64_t*>(base);
+    const size_t stride = page_size / sizeof(uint64_t);
+    const size_t count = size / page_size;
+
+    for (size_t i = 0; i < count; ++i)
+        p[i * stride] = i;
+
+    bool matched = true;
+    for (size_t i = 0; i < count; ++i)
+        matched = matched && p[i * stride] == i;
+    CHECK( matched, "Large page contents read back" );
+
+    j6_vma_unmap(vma, j6_handle_invalid);
+    j6_handle_close(vma);
+}
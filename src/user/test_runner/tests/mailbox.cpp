@@ -7,6 +7,7 @@
 #include <j6/thread.hh>
 #include <j6/types.h>
 #include <j6/syscalls.h>
+#include <j6/sysconf.h>
 
 #include "test_case.h"
 #include "test_rng.h"
@@ -16,67 +17,156 @@ struct mailbox_tests :
 {
 };
 
-static constexpr uintptr_t caller_stack = 0x4000000;
-static j6_handle_t test_mailbox = j6_handle_invalid;
-
 TEST_CASE( mailbox_tests, would_block )
 {
-    return;
     j6_handle_t mb = j6_handle_invalid;
     j6_status_t s;
 
     s = j6_mailbox_create(&mb);
-    CHECK( s == j6_status_ok, "Could not create a mailbox" );
+    REQUIRE( s == j6_status_ok, "Could not create a mailbox" );
 
     uint64_t tag = 12345;
     uint64_t subtag = 67890;
-    j6_handle_t handle;
+    size_t data_len = 0;
+    size_t handles_count = 0;
     uint64_t reply_tag = 0;
     uint64_t flags = 0;
 
-    s = j6_mailbox_respond( mb, &tag, &subtag, &handle, &reply_tag, flags );
+    s = j6_mailbox_respond(mb, &tag,
+            &subtag, &data_len, sizeof(subtag),
+            nullptr, &handles_count, 0,
+            &reply_tag, flags);
     CHECK( s == j6_status_would_block, "Should have gotten would block error" );
 
     j6_mailbox_close(mb);
 }
 
-void
-caller_proc(void *)
+TEST_CASE( mailbox_tests, send_receive )
 {
+    j6_handle_t mb = j6_handle_invalid;
     j6_status_t s;
 
-    uint64_t tag = 12345;
-    uint64_t subtag = 67890;
-    j6_handle_t no_handle = j6_handle_invalid;
-
-    j6_mailbox_call( test_mailbox, &tag, &subtag, &no_handle );
+    s = j6_mailbox_create(&mb);
+    REQUIRE( s == j6_status_ok, "Could not create a mailbox" );
 
-    volatile int i = 0;
-    while (i != 0);
-}
+    uint64_t reply = 0;
+    j6_status_t call_status = j6_err_unexpected;
 
-TEST_CASE( mailbox_tests, send_receive )
-{
-    j6_status_t s;
+    j6::thread caller {[&]() {
+        uint64_t tag = 12345;
+        uint64_t subtag = 67890;
+        size_t data_len = sizeof(subtag);
+        size_t handles_count = 0;
 
-    s = j6_mailbox_create(&test_mailbox);
-    CHECK( s == j6_status_ok, "Could not create a mailbox" );
+        call_status = j6_mailbox_call(mb, &tag,
+                &subtag, &data_len, sizeof(subtag),
+                nullptr, &handles_count, 0, 0);
+        reply = subtag;
+    }, 0x10000};
 
-    j6::thread caller {caller_proc, caller_stack};
     s = caller.start();
-    CHECK( s == j6_status_ok, "Could not start mailbox caller thread" );
+    REQUIRE( s == j6_status_ok, "Could not start mailbox caller thread" );
 
     uint64_t tag = 0;
     uint64_t subtag = 0;
+    size_t data_len = 0;
+    size_t handles_count = 0;
     uint64_t reply_tag = 0;
-    j6_handle_t mb_handle = j6_handle_invalid;
 
-    s = j6_mailbox_respond( test_mailbox, &tag, &subtag, &mb_handle, &reply_tag, j6_mailbox_block );
+    s = j6_mailbox_respond(mb, &tag,
+            &subtag, &data_len, sizeof(subtag),
+            nullptr, &handles_count, 0,
+            &reply_tag, j6_flag_block);
     CHECK( s == j6_status_ok, "Did not respond successfully" );
 
     CHECK_BARE( tag == 12345 );
     CHECK_BARE( subtag == 67890 );
 
-    j6_mailbox_close(test_mailbox);
+    subtag = 24680;
+    data_len = sizeof(subtag);
+    s = j6_mailbox_respond(mb, &tag,
+            &subtag, &data_len, sizeof(subtag),
+            nullptr, &handles_count, 0,
+            &reply_tag, 0);
+    CHECK( s == j6_status_would_block, "Reply should not have found another caller" );
+
+    caller.join();
+    CHECK( call_status == j6_status_ok, "Call did not succeed" );
+    CHECK_BARE( reply == 24680 );
+
+    j6_mailbox_close(mb);
+}
+
+TEST_CASE( mailbox_tests, move_pages )
+{
+    const size_t page_size = j6_sysconf(j6sc_page_size);
+    const size_t size = 8 * page_size;
+
+    j6_handle_t mb = j6_handle_invalid;
+    j6_status_t s = j6_mailbox_create(&mb);
+    REQUIRE( s == j6_status_ok, "Could not create a mailbox" );
+
+    j6_handle_t send_vma = j6_handle_invalid;
+    uintptr_t send_base = 0;
+    s = j6_vma_create_map(&send_vma, size, &send_base, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create sending VMA" );
+
+    j6_handle_t recv_vma = j6_handle_invalid;
+    uintptr_t recv_base = 0;
+    s = j6_vma_create_map(&recv_vma, size, &recv_base, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create receiving VMA" );
+
+    uint64_t *send = reinterpret_cast<uint64_t*>(send_base);
+    uint64_t *recv = reinterpret_cast<uint64_t*>(recv_base);
+    const size_t words = size / sizeof(uint64_t);
+
+    test::rng rng {12345};
+    for (size_t i = 0; i < words; ++i)
+        send[i] = rng();
+
+    j6_status_t call_status = j6_err_unexpected;
+    j6::thread caller {[&]() {
+        uint64_t tag = 1;
+        size_t data_len = size;
+        size_t handles_count = 0;
+        call_status = j6_mailbox_call(mb, &tag,
+                send, &data_len, size,
+                nullptr, &handles_count, 0, j6_mailbox_flag_move);
+    }, 0x10000};
+
+    s = caller.start();
+    REQUIRE( s == j6_status_ok, "Could not start mailbox caller thread" );
+
+    uint64_t tag = 0;
+    size_t data_len = 0;
+    size_t handles_count = 0;
+    uint64_t reply_tag = 0;
+
+    s = j6_mailbox_respond(mb, &tag,
+            recv, &data_len, size,
+            nullptr, &handles_count, 0,
+            &reply_tag, j6_flag_block);
+    CHECK( s == j6_status_ok, "Did not respond successfully" );
+    CHECK_BARE( data_len == size );
+
+    rng = test::rng {12345};
+    bool matched = true;
+    for (size_t i = 0; i < words; ++i)
+        matched = matched && recv[i] == rng();
+    CHECK( matched, "Moved pages have the sent contents" );
+
+    data_len = 0;
+    j6_mailbox_respond(mb, &tag,
+            recv, &data_len, size,
+            nullptr, &handles_count, 0,
+            &reply_tag, 0);
+
     caller.join();
+    CHECK( call_status == j6_status_ok, "Call did not succeed" );
+
+    j6_mailbox_close(mb);
+    j6_vma_unmap(send_vma, j6_handle_invalid);
+    j6_vma_unmap(recv_vma, j6_handle_invalid);
+    j6_handle_close(send_vma);
+    j6_handle_close(recv_vma);
 }
@@ -0,0 +1,271 @@
+#include <j6/errors.h>
+#include <j6/flags.h>
+#include <j6/syscalls.h>
+#include <j6/sysconf.h>
+#include <j6/types.h>
+
+#include "bench.h"
+#include "test_case.h"
+
+struct mailbox_benchmarks :
+    public test::fixture
+{
+    static constexpr size_t min_size = 0x1000;
+    static constexpr size_t max_size = 0x100000;
+    static constexpr size_t total_bytes = 0x4000000;
+    static constexpr size_t round_trips = 100000;
+};
+
+TEST_CASE( mailbox_benchmarks, throughput )
+{
+    j6_handle_t mb = j6_handle_invalid;
+    j6_status_t s = j6_mailbox_create(&mb);
+    REQUIRE( s == j6_status_ok, "Could not create a mailbox" );
+
+    // Create both buffers up front, in the main thread
+    j6_handle_t send_vma = j6_handle_invalid;
+    uintptr_t send_base = 0;
+    s = j6_vma_create_map(&send_vma, max_size, &send_base, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create sending VMA" );
+
+    j6_handle_t recv_vma = j6_handle_invalid;
+    uintptr_t recv_base = 0;
+    s = j6_vma_create_map(&recv_vma, max_size, &recv_base, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create receiving VMA" );
+
+    void *send = reinterpret_cast<void*>(send_base);
+    void *recv = reinterpret_cast<void*>(recv_base);
+
+    // The responder acknowledges every message with an empty reply, until
+    // it receives a message tagged 0.
+    j6::thread responder {[&]() {
+        uint64_t tag = 0;
+        uint64_t reply_tag = 0;
+        size_t handles_count = 0;
+        while (true) {
+            size_t data_len = 0;
+            j6_status_t rs = j6_mailbox_respond(mb, &tag,
+                    recv, &data_len, max_size,
+                    nullptr, &handles_count, 0,
+                    &reply_tag, j6_flag_block);
+            if (rs != j6_status_ok || tag == 0)
+                break;
+        }
+
+        size_t data_len = 0;
+        j6_mailbox_respond(mb, &tag,
+                recv, &data_len, max_size,
+                nullptr, &handles_count, 0,
+                &reply_tag, 0);
+    }, 0x10000};
+
+    s = responder.start();
+    REQUIRE( s == j6_status_ok, "Could not start mailbox responder thread" );
+
+    const uint64_t modes[] = {0, j6_mailbox_flag_move};
+    for (size_t size = min_size; size <= max_size; size <<= 1) {
+        for (uint64_t flags : modes) {
+            size_t rounds = total_bytes / size;
+
+            uint64_t start = test::bench::ticks();
+            for (size_t i = 0; i < rounds; ++i) {
+                uint64_t tag = 1;
+                size_t data_len = size;
+                size_t handles_count = 0;
+                s = j6_mailbox_call(mb, &tag,
+                        send, &data_len, size,
+                        nullptr, &handles_count, 0, flags);
+                if (s != j6_status_ok)
+                    break;
+            }
+            uint64_t us = test::bench::to_us(test::bench::ticks() - start);
+            CHECK( s == j6_status_ok, "Benchmark call failed" );
+
+            test::bench::report(test_name, "%7lu bytes %s: %6lu MiB/s",
+                    size, flags ? "move" : "copy",
+                    us ? (total_bytes * 1000000 / us) >> 20 : 0);
+        }
+    }
+
+    uint64_t tag = 0;
+    size_t data_len = 0;
+    size_t handles_count = 0;
+    j6_mailbox_call(mb, &tag,
+            nullptr, &data_len, 0,
+            nullptr, &handles_count, 0, 0);
+
+    responder.join();
+    j6_mailbox_close(mb);
+
+    j6_vma_unmap(send_vma, j6_handle_invalid);
+    j6_vma_unmap(recv_vma, j6_handle_invalid);
+    j6_handle_close(send_vma);
+    j6_handle_close(recv_vma);
+}
+
+TEST_CASE( mailbox_benchmarks, copy_alignment )
+{
+    static constexpr size_t sizes[] = {0x40, 0x400, 0x1000, 0x10000, 0x100000};
+    static constexpr size_t offsets[] = {0, 8, 1, 0xff9};
+    static constexpr size_t buffer_size = max_size + 0x1000;
+
+    j6_handle_t mb = j6_handle_invalid;
+    j6_status_t s = j6_mailbox_create(&mb);
+    REQUIRE( s == j6_status_ok, "Could not create a mailbox" );
+
+    j6_handle_t send_vma = j6_handle_invalid;
+    uintptr_t send_base = 0;
+    s = j6_vma_create_map(&send_vma, buffer_size, &send_base, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create sending VMA" );
+
+    j6_handle_t recv_vma = j6_handle_invalid;
+    uintptr_t recv_base = 0;
+    s = j6_vma_create_map(&recv_vma, buffer_size, &recv_base, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Could not create receiving VMA" );
+
+    // The responder receives at the same offset the caller sends from. It
+    // reads the offset before each message arrives, so the first message
+    // after the offset changes lands at the old one.
+    volatile size_t recv_offset = 0;
+    j6::thread responder {[&]() {
+        uint64_t tag = 0;
+        uint64_t reply_tag = 0;
+        size_t handles_count = 0;
+        while (true) {
+            size_t data_len = 0;
+            void *recv = reinterpret_cast<void*>(recv_base + recv_offset);
+            j6_status_t rs = j6_mailbox_respond(mb, &tag,
+                    recv, &data_len, max_size,
+                    nullptr, &handles_count, 0,
+                    &reply_tag, j6_flag_block);
+            if (rs != j6_status_ok || tag == 0)
+                break;
+        }
+
+        size_t data_len = 0;
+        j6_mailbox_respond(mb, &tag,
+                nullptr, &data_len, 0,
+                nullptr, &handles_count, 0,
+                &reply_tag, 0);
+    }, 0x10000};
+
+    s = responder.start();
+    REQUIRE( s == j6_status_ok, "Could not start mailbox responder thread" );
+
+    uint8_t *send_bytes = reinterpret_cast<uint8_t*>(send_base);
+    for (size_t i = 0; i < buffer_size; ++i)
+        send_bytes[i] = i * 7;
+
+    bool matched = true;
+    for (size_t size : sizes) {
+        for (size_t offset : offsets) {
+            size_t rounds = total_bytes / size;
+            if (rounds > round_trips) rounds = round_trips;
+
+            recv_offset = offset;
+            void *send = send_bytes + offset;
+
+            uint64_t start = test::bench::ticks();
+            for (size_t i = 0; i < rounds; ++i) {
+                uint64_t tag = 1;
+                size_t data_len = size;
+                size_t handles_count = 0;
+                s = j6_mailbox_call(mb, &tag,
+                        send, &data_len, size,
+                        nullptr, &handles_count, 0, 0);
+                if (s != j6_status_ok)
+                    break;
+            }
+            uint64_t us = test::bench::to_us(test::bench::ticks() - start);
+            CHECK( s == j6_status_ok, "Benchmark call failed" );
+
+            const uint8_t *recv = reinterpret_cast<const uint8_t*>(recv_base + offset);
+            for (size_t i = 0; i < size; ++i)
+                matched = matched && recv[i] == uint8_t((i + offset) * 7);
+
+            test::bench::report(test_name, "%7lu bytes +%03lx: %6lu MiB/s",
+                    size, offset, us ? (rounds * size * 1000000 / us) >> 20 : 0);
+        }
+    }
+    CHECK( matched, "Received data matches what was sent" );
+
+    uint64_t tag = 0;
+    size_t data_len = 0;
+    size_t handles_count = 0;
+    j6_mailbox_call(mb, &tag,
+            nullptr, &data_len, 0,
+            nullptr, &handles_count, 0, 0);
+
+    responder.join();
+    j6_mailbox_close(mb);
+
+    j6_vma_unmap(send_vma, j6_handle_invalid);
+    j6_vma_unmap(recv_vma, j6_handle_invalid);
+    j6_handle_close(send_vma);
+    j6_handle_close(recv_vma);
+}
+
+TEST_CASE( mailbox_benchmarks, round_trip )
+{
+    j6_handle_t mb = j6_handle_invalid;
+    j6_status_t s = j6_mailbox_create(&mb);
+    REQUIRE( s == j6_status_ok, "Could not create a mailbox" );
+
+    // Echo each message back to the caller, until a message tagged 0
+    j6::thread responder {[&]() {
+        uint64_t tag = 0;
+        uint64_t reply_tag = 0;
+        uint64_t value = 0;
+        size_t handles_count = 0;
+        while (true) {
+            size_t data_len = sizeof(value);
+            j6_status_t rs = j6_mailbox_respond(mb, &tag,
+                    &value, &data_len, sizeof(value),
+                    nullptr, &handles_count, 0,
+                    &reply_tag, j6_flag_block);
+            if (rs != j6_status_ok || tag == 0)
+                break;
+        }
+
+        size_t data_len = 0;
+        j6_mailbox_respond(mb, &tag,
+                &value, &data_len, sizeof(value),
+                nullptr, &handles_count, 0,
+                &reply_tag, 0);
+    }, 0x10000};
+
+    s = responder.start();
+    REQUIRE( s == j6_status_ok, "Could not start mailbox responder thread" );
+
+    bool echoed = true;
+    uint64_t start = test::bench::ticks();
+    for (size_t i = 0; i < round_trips; ++i) {
+        uint64_t tag = 1;
+        uint64_t value = i;
+        size_t data_len = sizeof(value);
+        size_t handles_count = 0;
+        s = j6_mailbox_call(mb, &tag,
+                &value, &data_len, sizeof(value),
+                nullptr, &handles_count, 0, 0);
+        echoed = echoed && value == i;
+        if (s != j6_status_ok)
+            break;
+    }
+    uint64_t t = test::bench::ticks() - start;
+    CHECK( s == j6_status_ok, "Benchmark call failed" );
+    CHECK( echoed, "Responder echoed every value" );
+
+    test::bench::report(test_name, "%lu calls: %lu ticks / %lu ns per round trip",
+            round_trips, t / round_trips,
+            t * 1000 / test::bench::ticks_per_us() / round_trips);
+
+    uint64_t tag = 0;
+    size_t data_len = 0;
+    size_t handles_count = 0;
+    j6_mailbox_call(mb, &tag,
+            nullptr, &data_len, 0,
+            nullptr, &handles_count, 0, 0);
+
+    responder.join();
+    j6_mailbox_close(mb);
+}
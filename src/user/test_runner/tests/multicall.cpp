@@ -0,0 +1,120 @@
+#include <j6/errors.h>
+#include <j6/flags.h>
+#include <j6/syscalls.h>
+#include <j6/sysconf.h>
+#include <j6/types.h>
+
+#include "bench.h"
+#include "test_case.h"
+
+struct multicall_tests :
+    public test::fixture
+{
+};
+
+TEST_CASE( multicall_tests, statuses_and_stop )
+{
+    j6_handle_t ev = j6_handle_invalid;
+    j6_multicall_entry calls[4];
+    j6_multicall_noop(&calls[0]);
+    j6_multicall_event_create(&calls[1], &ev);
+    calls[2].call = ~0ull; // No such syscall
+    j6_multicall_noop(&calls[3]);
+
+    size_t count = 4;
+    j6_status_t s = j6_multicall(calls, &count, 0);
+    CHECK( s == j6_status_ok, "Multicall without stop" );
+    CHECK( count == 4, "Every entry is made without stop" );
+    CHECK( calls[0].status == j6_status_ok, "noop entry" );
+    CHECK( calls[1].status == j6_status_ok && ev != j6_handle_invalid, "Out params are written" );
+    CHECK( calls[2].status == j6_err_invalid_arg, "Unknown syscall fails its entry" );
+    CHECK( calls[3].status == j6_status_ok, "Entries after a failure are made" );
+
+    calls[3].status = j6_err_unexpected;
+    count = 4;
+    s = j6_multicall(calls, &count, j6_multicall_flag_stop);
+    CHECK( s == j6_err_invalid_arg, "Multicall with stop returns the failure" );
+    CHECK( count == 3, "Count includes the failed entry" );
+    CHECK( calls[3].status == j6_err_unexpected, "Entries after a failure are not made" );
+
+    j6_handle_close(ev);
+}
+
+struct multicall_benchmarks :
+    public test::fixture
+{
+    static constexpr size_t iterations = 500;
+    static constexpr size_t segments = 4;
+    static constexpr size_t handles = 3;
+};
+
+TEST_CASE( multicall_benchmarks, loader )
+{
+    // Set up a child process the way srv.init does: give it handles, and
+    // map copy-on-write segments of an image into it
+    const size_t page_size = j6_sysconf(j6sc_page_size);
+    const uintptr_t base = 0x4000'0000;
+
+    j6_handle_t image = j6_handle_invalid;
+    uintptr_t image_addr = 0;
+    j6_status_t s = j6_vma_create_map(&image, segments * page_size, &image_addr, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Creating image VMA" );
+
+    j6_handle_t give[handles];
+    for (j6_handle_t &h : give) {
+        s = j6_event_create(&h);
+        REQUIRE( s == j6_status_ok, "Creating handle to give" );
+    }
+
+    uint64_t ticks[2] = {0, 0};
+    for (size_t i = 0; i < iterations; ++i) {
+        for (unsigned batched = 0; batched < 2; ++batched) {
+            j6_handle_t proc = j6_handle_invalid;
+            s = j6_process_create(&proc, "multicall_bench");
+            REQUIRE( s == j6_status_ok, "Creating process" );
+
+            j6_handle_t segs[segments];
+            uintptr_t addrs[segments];
+            for (size_t j = 0; j < segments; ++j) {
+                s = j6_vma_create_cow(&segs[j], image, j * page_size, page_size, page_size, j6_vm_flag_write);
+                REQUIRE( s == j6_status_ok, "Creating segment VMA" );
+                addrs[j] = base + j * page_size;
+            }
+
+            const uint32_t flags = j6_vm_flag_exact | j6_vm_flag_prefault;
+            uint64_t start = test::bench::ticks();
+            if (batched) {
+                j6_multicall_entry calls[handles + segments];
+                for (size_t j = 0; j < handles; ++j)
+                    j6_multicall_process_give_handle(&calls[j], proc, give[j]);
+                for (size_t j = 0; j < segments; ++j)
+                    j6_multicall_vma_map(&calls[handles + j], segs[j], proc, &addrs[j], flags);
+
+                size_t count = handles + segments;
+                s = j6_multicall(calls, &count, j6_multicall_flag_stop);
+            } else {
+                for (size_t j = 0; j < handles && s == j6_status_ok; ++j)
+                    s = j6_process_give_handle(proc, give[j]);
+                for (size_t j = 0; j < segments && s == j6_status_ok; ++j)
+                    s = j6_vma_map(segs[j], proc, &addrs[j], flags);
+            }
+            ticks[batched] += test::bench::ticks() - start;
+            CHECK( s == j6_status_ok, "Setting up child" );
+
+            for (j6_handle_t seg : segs)
+                j6_handle_close(seg);
+            j6_handle_close(proc);
+        }
+    }
+
+    for (j6_handle_t h : give)
+        j6_handle_close(h);
+    j6_vma_unmap(image, j6_handle_invalid);
+    j6_handle_close(image);
+
+    const size_t calls = handles + segments;
+    for (unsigned batched = 0; batched < 2; ++batched)
+        test::bench::report(test_name, "%s: %lu calls, %lu ns per child",
+                batched ? "one multicall" : "separate calls", calls,
+                ticks[batched] * 1000 / test::bench::ticks_per_us() / iterations);
+}
@@ -0,0 +1,73 @@
+#include <j6/condition.hh>
+#include <j6/errors.h>
+#include <j6/mutex.hh>
+#include <j6/syscalls.h>
+#include <j6/sysconf.h>
+
+#include "bench.h"
+#include "test_case.h"
+
+struct condition_tests :
+    public test::fixture
+{
+    static constexpr unsigned waiters = 4;
+};
+
+TEST_CASE( condition_tests, wake_requeue )
+{
+    j6::mutex m;
+    j6::condition c;
+    bool go = false;
+    unsigned woken = 0;
+
+    test::bench::run_threads(waiters + 1, [&](unsigned i) {
+        if (i == waiters) {
+            // Let the waiters all block first
+            j6_thread_sleep(10000);
+            j6::scoped_lock lock {m};
+            go = true;
+            c.wake(m);
+            return;
+        }
+
+        j6::scoped_lock lock {m};
+        while (!go)
+            c.wait(m);
+        ++woken;
+    });
+
+    CHECK( woken == waiters, "Every waiter was woken" );
+}
+
+struct mutex_benchmarks :
+    public test::fixture
+{
+    static constexpr size_t iterations = 10000;
+    static constexpr size_t max_threads = 8;
+};
+
+TEST_CASE( mutex_benchmarks, contended )
+{
+    size_t cpus = j6_sysconf(j6sc_num_cpus);
+    size_t max = cpus * 2;
+    if (max > max_threads) max = max_threads;
+
+    for (unsigned n = 1; n <= max; ++n) {
+        j6::mutex m;
+        size_t counter = 0;
+
+        uint64_t t = test::bench::run_threads(n, [&](unsigned) {
+            for (size_t i = 0; i < iterations; ++i) {
+                j6::scoped_lock lock {m};
+                ++counter;
+            }
+        });
+
+        CHECK( counter == n * iterations, "Mutex lost an increment" );
+
+        uint64_t us = test::bench::to_us(t);
+        uint64_t ops = n * iterations;
+        test::bench::report(test_name, "%2d threads: %8lu locks/s",
+                n, us ? ops * 1000000 / us : 0);
+    }
+}
@@ -0,0 +1,261 @@
+#include <j6/errors.h>
+#include <j6/flags.h>
+#include <j6/syscalls.h>
+#include <j6/sysconf.h>
+#include <j6/types.h>
+
+#include "bench.h"
+#include "test_case.h"
+
+struct fault_benchmarks :
+    public test::fixture
+{
+    static constexpr size_t pages_per_thread = 1024;
+    static constexpr size_t max_threads = 32;
+    static constexpr size_t touch_size = 16 * 1024 * 1024;
+
+    /// Map a new area, touch every page of it once, and report the
+    /// average time per page in nanoseconds
+    static void touch_pages(const char *test_name, const char *mode,
+            uint32_t flags, bool populate);
+};
+
+void
+fault_benchmarks::touch_pages(const char *test_name, const char *mode,
+        uint32_t flags, bool populate)
+{
+    const size_t page_size = j6_sysconf(j6sc_page_size);
+    const size_t pages = touch_size / page_size;
+
+    j6_handle_t vma = j6_handle_invalid;
+    uintptr_t base = 0;
+    j6_status_t s = j6_vma_create_map(&vma, touch_size, &base, flags);
+    if (s != j6_status_ok)
+        return;
+
+    uint64_t start = test::bench::ticks();
+    if (populate)
+        j6_vma_populate(vma, j6_handle_invalid, 0, touch_size);
+
+    volatile uint8_t *p = reinterpret_cast<volatile uint8_t*>(base);
+    for (size_t i = 0; i < pages; ++i)
+        p[i * page_size] = 1;
+    uint64_t t = test::bench::ticks() - start;
+
+    test::bench::report(test_name, "%-16s %6lu ns/page",
+            mode, t * 1000 / test::bench::ticks_per_us() / pages);
+
+    j6_vma_unmap(vma, j6_handle_invalid);
+    j6_handle_close(vma);
+}
+
+TEST_CASE( fault_benchmarks, faults_per_cpu )
+{
+    const size_t page_size = j6_sysconf(j6sc_page_size);
+    size_t cpus = j6_sysconf(j6sc_num_cpus);
+    if (cpus > max_threads) cpus = max_threads;
+
+    for (unsigned n = 1; n <= cpus; ++n) {
+        j6_handle_t vmas[max_threads];
+        uintptr_t bases[max_threads];
+
+        // Create all the areas up front, so only the faults themselves
+        // are measured. Fault-around is turned off so that every page
+        // touched takes a fault.
+        for (unsigned i = 0; i < n; ++i) {
+            bases[i] = 0;
+            j6_status_t s = j6_vma_create_map(&vmas[i],
+                    pages_per_thread * page_size, &bases[i],
+                    j6_vm_flag_write | j6_vm_flag_no_fault_around);
+            REQUIRE( s == j6_status_ok, "Creating benchmark VMA" );
+        }
+
+        uint64_t t = test::bench::run_threads(n, [&](unsigned i) {
+            volatile uint8_t *p = reinterpret_cast<volatile uint8_t*>(bases[i]);
+            for (size_t j = 0; j < pages_per_thread; ++j)
+                p[j * page_size] = 1;
+        });
+
+        uint64_t us = test::bench::to_us(t);
+        uint64_t faults = n * pages_per_thread;
+        test::bench::report(test_name, "%2d cpus: %8lu faults/s",
+                n, us ? faults * 1000000 / us : 0);
+
+        for (unsigned i = 0; i < n; ++i) {
+            j6_vma_unmap(vmas[i], j6_handle_invalid);
+            j6_handle_close(vmas[i]);
+        }
+    }
+}
+
+TEST_CASE( fault_benchmarks, touch_latency )
+{
+    touch_pages(test_name, "fault per page",
+            j6_vm_flag_write | j6_vm_flag_no_fault_around, false);
+    touch_pages(test_name, "fault-around",
+            j6_vm_flag_write, false);
+    touch_pages(test_name, "populate first",
+            j6_vm_flag_write, true);
+}
+
+TEST_CASE( fault_benchmarks, populate_range )
+{
+    const size_t page_size = j6_sysconf(j6sc_page_size);
+    const size_t size = 8 * page_size;
+
+    j6_handle_t vma = j6_handle_invalid;
+    j6_status_t s = j6_vma_create(&vma, size, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Creating VMA" );
+
+    s = j6_vma_populate(vma, j6_handle_invalid, 0, size);
+    CHECK( s == j6_err_invalid_arg, "Populating an unmapped VMA" );
+
+    uintptr_t base = 0;
+    s = j6_vma_map(vma, j6_handle_invalid, &base, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Mapping VMA" );
+
+    s = j6_vma_populate(vma, j6_handle_invalid, page_size, size);
+    CHECK( s == j6_err_invalid_arg, "Populating past the end of a VMA" );
+
+    s = j6_vma_populate(vma, j6_handle_invalid, page_size, size - page_size);
+    CHECK( s == j6_status_ok, "Populating a range of a VMA" );
+
+    volatile uint64_t *p = reinterpret_cast<volatile uint64_t*>(base);
+    const size_t words = size / sizeof(uint64_t);
+    for (size_t i = 0; i < words; ++i)
+        p[i] = i;
+
+    bool matched = true;
+    for (size_t i = 0; i < words; ++i)
+        matched = matched && p[i] == i;
+    CHECK( matched, "Populated pages are writable" );
+
+    j6_vma_unmap(vma, j6_handle_invalid);
+    j6_handle_close(vma);
+}
+
+TEST_CASE( fault_benchmarks, remap_prefault )
+{
+    const size_t page_size = j6_sysconf(j6sc_page_size);
+    const size_t pages = touch_size / page_size;
+
+    // Fault-around is turned off so that without prefaulting, every
+    // page touched after remapping takes a fault
+    j6_handle_t vma = j6_handle_invalid;
+    uintptr_t base = 0;
+    j6_status_t s = j6_vma_create_map(&vma, touch_size, &base,
+            j6_vm_flag_write | j6_vm_flag_no_fault_around);
+    REQUIRE( s == j6_status_ok, "Creating VMA" );
+
+    volatile uint64_t *p = reinterpret_cast<volatile uint64_t*>(base);
+    const size_t stride = page_size / sizeof(uint64_t);
+    for (size_t i = 0; i < pages; ++i)
+        p[i * stride] = i;
+
+    static constexpr uint32_t modes[] = {0, j6_vm_flag_prefault};
+    static constexpr const char *names[] = {"fault on touch", "prefault"};
+
+    for (unsigned m = 0; m < 2; ++m) {
+        j6_vma_unmap(vma, j6_handle_invalid);
+
+        uint64_t start = test::bench::ticks();
+        base = 0;
+        s = j6_vma_map(vma, j6_handle_invalid, &base, modes[m]);
+        REQUIRE( s == j6_status_ok, "Remapping VMA" );
+
+        p = reinterpret_cast<volatile uint64_t*>(base);
+        bool matched = true;
+        for (size_t i = 0; i < pages; ++i)
+            matched = matched && p[i * stride] == i;
+        uint64_t t = test::bench::ticks() - start;
+
+        CHECK( matched, "Remapped pages keep their contents" );
+        test::bench::report(test_name, "%-16s %6lu ns/page",
+                names[m], t * 1000 / test::bench::ticks_per_us() / pages);
+    }
+
+    j6_vma_unmap(vma, j6_handle_invalid);
+    j6_handle_close(vma);
+}
+
+TEST_CASE( fault_benchmarks, fresh_pages_zeroed )
+{
+    const size_t page_size = j6_sysconf(j6sc_page_size);
+    const size_t size = 64 * page_size;
+    const size_t words = size / sizeof(uint64_t);
+
+    // Dirty some frames and free them, so the next area is likely to
+    // get the same frames back
+    j6_handle_t vma = j6_handle_invalid;
+    uintptr_t base = 0;
+    j6_status_t s = j6_vma_create_map(&vma, size, &base, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Creating first VMA" );
+
+    volatile uint64_t *p = reinterpret_cast<volatile uint64_t*>(base);
+    for (size_t i = 0; i < words; ++i)
+        p[i] = ~i;
+
+    j6_vma_unmap(vma, j6_handle_invalid);
+    j6_handle_close(vma);
+
+    s = j6_vma_create_map(&vma, size, &base, j6_vm_flag_write);
+    REQUIRE( s == j6_status_ok, "Creating second VMA" );
+
+    p = reinterpret_cast<volatile uint64_t*>(base);
+    bool zeroed = true;
+    for (size_t i = 0; i < words; ++i)
+        zeroed = zeroed && p[i] == 0;
+    CHECK( zeroed, "Newly touched pages are zeroed" );
+
+    j6_vma_unmap(vma, j6_handle_invalid);
+    j6_handle_close(vma);
+}
+
+TEST_CASE( fault_benchmarks, many_areas )
+{
+    static constexpr size_t area_count = 256;
+    static constexpr size_t area_pages = 4;
+    const size_t page_size = j6_sysconf(j6sc_page_size);
+
+    j6_handle_t *vmas = new j6_handle_t [area_count];
+    uintptr_t *bases = new uintptr_t [area_count];
+
+    for (size_t i = 0; i < area_count; ++i) {
+        bases[i] = 0;
+        j6_status_t s = j6_vma_create_map(&vmas[i], area_pages * page_size, &bases[i],
+                j6_vm_flag_write | j6_vm_flag_no_fault_around);
+        REQUIRE( s == j6_status_ok, "Creating benchmark VMA" );
+    }
+
+    // Touch the areas round-robin, so that consecutive faults are never
+    // in the same area
+    uint64_t start = test::bench::ticks();
+    for (size_t p = 0; p < area_pages; ++p) {
+        for (size_t i = 0; i < area_count; ++i) {
+            volatile uint64_t *w = reinterpret_cast<volatile uint64_t*>(bases[i] + p * page_size);
+            *w = i;
+        }
+    }
+    uint64_t t = test::bench::ticks() - start;
+
+    bool matched = true;
+    for (size_t p = 0; p < area_pages; ++p) {
+        for (size_t i = 0; i < area_count; ++i) {
+            volatile uint64_t *w = reinterpret_cast<volatile uint64_t*>(bases[i] + p * page_size);
+            matched = matched && *w == i;
+        }
+    }
+    CHECK( matched, "Every area kept its own contents" );
+
+    const size_t faults = area_count * area_pages;
+    test::bench::report(test_name, "%lu areas: %6lu ns/fault",
+            area_count, t * 1000 / test::bench::ticks_per_us() / faults);
+
+    for (size_t i = 0; i < area_count; ++i) {
+        j6_vma_unmap(vmas[i], j6_handle_invalid);
+        j6_handle_close(vmas[i]);
+    }
+
+    delete [] vmas;
+    delete [] bases;
+}
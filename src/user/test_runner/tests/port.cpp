@@ -0,0 +1,194 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include <j6/errors.h>
+#include <j6/flags.h>
+#include <j6/thread.hh>
+#include <j6/types.h>
+#include <j6/syscalls.h>
+
+#include "test_case.h"
+
+struct port_tests :
+    public test::fixture
+{
+};
+
+TEST_CASE( port_tests, wait_many_ready )
+{
+    j6_handle_t ev1 = j6_handle_invalid;
+    j6_handle_t ev2 = j6_handle_invalid;
+    j6_status_t s;
+
+    s = j6_event_create(&ev1);
+    REQUIRE( s == j6_status_ok, "Could not create an event" );
+    s = j6_event_create(&ev2);
+    REQUIRE( s == j6_status_ok, "Could not create an event" );
+
+    j6_event_signal(ev1, 0x5);
+    j6_event_signal(ev2, 0x2);
+
+    j6_wait_item items[] = {
+        {ev1, 0x4, 0},
+        {ev2, 0x1, 0},
+    };
+    size_t count = 2;
+
+    s = j6_object_wait_many(items, &count, 0);
+    CHECK( s == j6_status_ok, "Wait on already-signalled event" );
+    CHECK( items[0].observed == 0x4, "Only watched signals are observed" );
+    CHECK( items[1].observed == 0, "Unwatched signals are not observed" );
+
+    // Waiting on a port doesn't consume an event's signals
+    j6_signal_t signals = 0;
+    s = j6_event_wait(ev1, &signals, 0);
+    CHECK( s == j6_status_ok && signals == 0x5, "Event signals still pending" );
+
+    count = 1;
+    s = j6_object_wait_many(items, &count, 1000);
+    CHECK( s == j6_err_timed_out, "Wait with nothing signalled times out" );
+
+    j6_wait_item many[65];
+    for (j6_wait_item &item : many)
+        item = {ev1, 0x4, 0};
+    count = 65;
+    s = j6_object_wait_many(many, &count, 0);
+    CHECK( s == j6_err_invalid_arg, "Waiting on too many items" );
+
+    j6_handle_close(ev1);
+    j6_handle_close(ev2);
+}
+
+TEST_CASE( port_tests, wait_many_thread_exit )
+{
+    j6_handle_t ev = j6_handle_invalid;
+    j6_status_t s = j6_event_create(&ev);
+    REQUIRE( s == j6_status_ok, "Could not create an event" );
+
+    j6::thread th {[]() { j6_thread_sleep(1000); }, 0x10000};
+    s = th.start();
+    REQUIRE( s == j6_status_ok, "Could not start thread" );
+
+    j6_wait_item items[] = {
+        {ev, ~0ull, 0},
+        {th.handle(), j6_signal_thread_exited, 0},
+    };
+    size_t count = 2;
+
+    s = j6_object_wait_many(items, &count, 0);
+    CHECK( s == j6_status_ok, "Wait for thread exit" );
+    CHECK( items[0].observed == 0, "Event was not signalled" );
+    CHECK( items[1].observed == j6_signal_thread_exited, "Thread exit observed" );
+
+    th.join();
+    j6_handle_close(ev);
+}
+
+TEST_CASE( port_tests, bind_coalesce_unbind )
+{
+    j6_handle_t port = j6_handle_invalid;
+    j6_handle_t ev = j6_handle_invalid;
+    j6_status_t s;
+
+    s = j6_port_create(&port);
+    REQUIRE( s == j6_status_ok, "Could not create a port" );
+    s = j6_event_create(&ev);
+    REQUIRE( s == j6_status_ok, "Could not create an event" );
+
+    s = j6_port_bind(port, ev, 0, ~0ull);
+    CHECK( s == j6_err_invalid_arg, "Key 0 is not allowed" );
+
+    s = j6_port_bind(port, ev, 42, ~0ull);
+    CHECK( s == j6_status_ok, "Bind an event" );
+
+    s = j6_port_bind(port, ev, 42, ~0ull);
+    CHECK( s == j6_err_collision, "Binding the same key twice" );
+
+    j6_event_signal(ev, 0x1);
+    j6_event_signal(ev, 0x8);
+
+    j6_port_packet packets[4];
+    size_t count = 4;
+    s = j6_port_wait(port, packets, &count, 0);
+    CHECK( s == j6_status_ok, "Wait on port" );
+    CHECK( count == 1, "Signals coalesce into one packet" );
+    CHECK( packets[0].key == 42, "Packet has the binding's key" );
+    CHECK( packets[0].signals == 0x9, "Packet has both signals" );
+
+    s = j6_port_unbind(port, 42);
+    CHECK( s == j6_status_ok, "Unbind" );
+
+    j6_event_signal(ev, 0x2);
+    count = 4;
+    s = j6_port_wait(port, packets, &count, 1000);
+    CHECK( s == j6_err_timed_out, "No packets after unbind" );
+
+    s = j6_port_unbind(port, 42);
+    CHECK( s == j6_err_invalid_arg, "Unbind an unbound key" );
+
+    for (uint64_t key = 1; key <= 4096; ++key) {
+        s = j6_port_bind(port, ev, key, ~0ull);
+        if (s != j6_status_ok) break;
+    }
+    CHECK( s == j6_status_ok, "Bind thousands of objects" );
+
+    j6_handle_close(ev);
+    j6_handle_close(port);
+}
+
+TEST_CASE( port_tests, mailbox_readable )
+{
+    j6_handle_t port = j6_handle_invalid;
+    j6_handle_t mb = j6_handle_invalid;
+    j6_status_t s;
+
+    s = j6_port_create(&port);
+    REQUIRE( s == j6_status_ok, "Could not create a port" );
+    s = j6_mailbox_create(&mb);
+    REQUIRE( s == j6_status_ok, "Could not create a mailbox" );
+
+    s = j6_port_bind(port, mb, 1, j6_signal_mailbox_readable);
+    REQUIRE( s == j6_status_ok, "Bind a mailbox" );
+
+    j6_status_t call_status = j6_err_unexpected;
+    j6::thread caller {[&]() {
+        uint64_t tag = 7;
+        size_t data_len = 0;
+        size_t handles_count = 0;
+        call_status = j6_mailbox_call(mb, &tag,
+                nullptr, &data_len, 0,
+                nullptr, &handles_count, 0, 0);
+    }, 0x10000};
+
+    s = caller.start();
+    REQUIRE( s == j6_status_ok, "Could not start caller thread" );
+
+    j6_port_packet packet;
+    size_t count = 1;
+    s = j6_port_wait(port, &packet, &count, 0);
+    CHECK( s == j6_status_ok && count == 1, "Wait for a caller" );
+    CHECK( packet.signals == j6_signal_mailbox_readable, "Mailbox is readable" );
+
+    // Receive without blocking, then reply
+    uint64_t tag = 0;
+    uint64_t reply_tag = 0;
+    size_t data_len = 0;
+    size_t handles_count = 0;
+    s = j6_mailbox_respond(mb, &tag,
+            nullptr, &data_len, 0,
+            nullptr, &handles_count, 0,
+            &reply_tag, 0);
+    CHECK( s == j6_status_ok && tag == 7, "Receive the call" );
+
+    s = j6_mailbox_respond(mb, &tag,
+            nullptr, &data_len, 0,
+            nullptr, &handles_count, 0,
+            &reply_tag, 0);
+    CHECK( s == j6_status_would_block, "Reply, with no more callers" );
+
+    caller.join();
+    CHECK( call_status == j6_status_ok, "Call got its reply" );
+
+    j6_mailbox_close(mb);
+    j6_handle_close(port);
+}
@@ -0,0 +1,262 @@
+#include <j6/errors.h>
+#include <j6/init.h>
+#include <j6/syscalls.h>
+#include <j6/sysconf.h>
+#include <j6/types.h>
+
+#include "bench.h"
+#include "test_case.h"
+
+static uint32_t load(uint32_t &v) { return __atomic_load_n(&v, __ATOMIC_SEQ_CST); }
+static void store(uint32_t &v, uint32_t x) { __atomic_store_n(&v, x, __ATOMIC_SEQ_CST); }
+
+struct scheduler_tests :
+    public test::fixture
+{
+};
+
+TEST_CASE( scheduler_tests, affinity_and_priority )
+{
+    size_t cpus = j6_sysconf(j6sc_num_cpus);
+    uint32_t done = 0;
+
+    j6::thread th {[&]() {
+        while (!load(done))
+            j6_futex_wait(&done, 0, 0, 0);
+    }, 0x10000};
+
+    j6_status_t s = th.start();
+    REQUIRE( s == j6_status_ok, "Could not start thread" );
+    j6_handle_t h = th.handle();
+
+    uint64_t mask = 0;
+    s = j6_thread_get_affinity(h, &mask);
+    CHECK( s == j6_status_ok && mask == ~0ull, "New threads may run on any CPU" );
+
+    uint64_t last = 1ull << (cpus - 1);
+    s = j6_thread_set_affinity(h, last);
+    CHECK( s == j6_status_ok, "Pinning a thread" );
+    j6_thread_get_affinity(h, &mask);
+    CHECK( mask == last, "Pinned affinity reads back" );
+
+    if (cpus < 64) {
+        s = j6_thread_set_affinity(h, 1ull << cpus);
+        CHECK( s == j6_err_invalid_arg, "Affinity with no existing CPUs" );
+    }
+
+    s = j6_thread_set_priority(h, 3, 1, j6_handle_invalid);
+    CHECK( s == j6_err_denied, "Constant priority needs the system handle" );
+
+    s = j6_thread_set_priority(h, 0, 0, j6_handle_invalid);
+    CHECK( s == j6_err_denied, "Priority past the promotion limit needs the system handle" );
+
+    s = j6_thread_set_priority(h, 3, 0, j6_handle_invalid);
+    CHECK( s == j6_status_ok, "Setting an unprivileged priority" );
+
+    j6_handle_t sys = j6_find_init_handle(0);
+    s = j6_thread_set_priority(h, 3, 1, sys);
+    CHECK( s == j6_status_ok, "Setting constant priority" );
+
+    uint8_t priority = 0;
+    unsigned constant = 0;
+    j6_thread_get_priority(h, &priority, &constant);
+    CHECK( priority == 3 && constant, "Constant priority reads back" );
+
+    s = j6_thread_set_priority(h, 0xff, 0, sys);
+    CHECK( s == j6_err_invalid_arg, "Priority past the least urgent level" );
+
+    store(done, 1);
+    j6_futex_wake(&done, 0, 0);
+    th.join();
+}
+
+TEST_CASE( scheduler_tests, thread_accounting )
+{
+    uint32_t state = 0;
+
+    // Do some work, then block until told to exit
+    j6::thread th {[&]() {
+        volatile uint64_t sink = 0;
+        for (size_t i = 0; i < 1000000; ++i)
+            sink = sink + i;
+
+        store(state, 1);
+        j6_futex_wake(&state, 0, 0);
+        while (load(state) != 2)
+            j6_futex_wait(&state, 1, 0, 0);
+    }, 0x10000};
+
+    j6_status_t s = th.start();
+    REQUIRE( s == j6_status_ok, "Could not start thread" );
+
+    while (!load(state))
+        j6_futex_wait(&state, 0, 0, 0);
+
+    // Give the thread time to block
+    j6_thread_sleep(1000); // 1ms
+
+    j6_thread_stats stats;
+    size_t len = sizeof(stats);
+    s = j6_thread_get_stats(th.handle(), &stats, &len);
+    CHECK( s == j6_status_ok && len == sizeof(stats), "Getting thread stats" );
+    CHECK( stats.koid != 0, "Thread stats have a koid" );
+    CHECK( stats.run_cycles > 0, "Running thread was charged for its time" );
+    CHECK( stats.voluntary_switches > 0, "Blocking counts as a voluntary switch" );
+
+    len = sizeof(stats) - 1;
+    s = j6_thread_get_stats(th.handle(), &stats, &len);
+    CHECK( s == j6_err_insufficient && len == sizeof(stats), "Short buffer reports size" );
+
+    store(state, 2);
+    j6_futex_wake(&state, 0, 0);
+    th.join();
+}
+
+struct scheduler_benchmarks :
+    public test::fixture
+{
+    static constexpr size_t round_trips = 20000;
+    static constexpr size_t work_iterations = 20000000;
+    static constexpr unsigned max_threads = 16;
+
+    /// Time a futex ping-pong between two new threads, optionally pinned
+    /// \arg mask_a  Affinity of the first thread, or 0 for none
+    /// \arg mask_b  Affinity of the second thread, or 0 for none
+    /// \returns     Nanoseconds per round trip
+    static uint64_t pinned_ping_pong(uint64_t mask_a, uint64_t mask_b);
+};
+
+uint64_t
+scheduler_benchmarks::pinned_ping_pong(uint64_t mask_a, uint64_t mask_b)
+{
+    // Odd values are the second thread's turn, 0 holds both at the start
+    uint32_t turn = 0;
+    uint64_t ticks = 0;
+
+    j6::thread a {[&]() {
+        while (!load(turn))
+            j6_futex_wait(&turn, 0, 0, 0);
+
+        uint64_t start = test::bench::ticks();
+        for (uint32_t i = 1; i < round_trips * 2; i += 2) {
+            store(turn, i);
+            j6_futex_wake(&turn, 1, 0);
+            while (load(turn) == i)
+                j6_futex_wait(&turn, i, 0, 0);
+        }
+        ticks = test::bench::ticks() - start;
+        store(turn, -1u);
+        j6_futex_wake(&turn, 1, 0);
+    }, 0x10000};
+
+    j6::thread b {[&]() {
+        while (true) {
+            uint32_t t = load(turn);
+            if (t == -1u)
+                break;
+
+            if (!(t & 1)) {
+                j6_futex_wait(&turn, t, 0, 0);
+                continue;
+            }
+
+            store(turn, t + 1);
+            j6_futex_wake(&turn, 1, 0);
+        }
+    }, 0x10000};
+
+    a.start();
+    b.start();
+    if (mask_a) j6_thread_set_affinity(a.handle(), mask_a);
+    if (mask_b) j6_thread_set_affinity(b.handle(), mask_b);
+
+    store(turn, 2);
+    j6_futex_wake(&turn, 0, 0);
+
+    a.join();
+    b.join();
+    return ticks * 1000 / test::bench::ticks_per_us() / round_trips;
+}
+
+TEST_CASE( scheduler_benchmarks, ping_pong )
+{
+    // 0: the responder's turn to wait, 1: the responder's turn to
+    // answer, 2: the responder should exit
+    uint32_t turn = 0;
+
+    j6::thread responder {[&]() {
+        while (true) {
+            uint32_t t = load(turn);
+            if (t == 2)
+                break;
+
+            if (t == 0) {
+                j6_futex_wait(&turn, 0, 0, 0);
+                continue;
+            }
+
+            store(turn, 0);
+            j6_futex_wake(&turn, 1, 0);
+        }
+    }, 0x10000};
+
+    j6_status_t s = responder.start();
+    REQUIRE( s == j6_status_ok, "Could not start ping-pong responder thread" );
+
+    uint64_t start = test::bench::ticks();
+    for (size_t i = 0; i < round_trips; ++i) {
+        store(turn, 1);
+        j6_futex_wake(&turn, 1, 0);
+        while (load(turn) == 1)
+            j6_futex_wait(&turn, 1, 0, 0);
+    }
+    uint64_t t = test::bench::ticks() - start;
+
+    store(turn, 2);
+    j6_futex_wake(&turn, 1, 0);
+    responder.join();
+
+    test::bench::report(test_name, "%lu round trips: %lu ns per round trip",
+            round_trips, t * 1000 / test::bench::ticks_per_us() / round_trips);
+}
+
+TEST_CASE( scheduler_benchmarks, throughput )
+{
+    size_t cpus = j6_sysconf(j6sc_num_cpus);
+    unsigned max = cpus * 2;
+    if (max > max_threads) max = max_threads;
+
+    uint64_t single = 0;
+    for (unsigned n = 1; n <= max; ++n) {
+        // Every thread does the same fixed amount of work, so with good
+        // placement the time stays flat until there are more threads
+        // than CPUs
+        uint64_t t = test::bench::run_threads(n, [&](unsigned) {
+            volatile uint64_t sink = 0;
+            for (size_t i = 0; i < work_iterations; ++i)
+                sink = sink + i;
+        });
+
+        if (n == 1)
+            single = t;
+
+        uint64_t us = test::bench::to_us(t);
+        test::bench::report(test_name, "%2u threads: %6lu us, %3lu%% of one thread's rate per thread",
+                n, us, t ? single * 100 / t : 0);
+    }
+}
+
+TEST_CASE( scheduler_benchmarks, pinned_ping_pong )
+{
+    size_t cpus = j6_sysconf(j6sc_num_cpus);
+
+    test::bench::report(test_name, "default placement: %lu ns per round trip",
+            pinned_ping_pong(0, 0));
+
+    test::bench::report(test_name, "pinned together:   %lu ns per round trip",
+            pinned_ping_pong(1, 1));
+
+    if (cpus > 1)
+        test::bench::report(test_name, "pinned apart:      %lu ns per round trip",
+                pinned_ping_pong(1, 2));
+}
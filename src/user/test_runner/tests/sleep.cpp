@@ -0,0 +1,56 @@
+#include <j6/errors.h>
+#include <j6/syscalls.h>
+#include <j6/sysconf.h>
+
+#include "bench.h"
+#include "test_case.h"
+
+struct sleep_tests :
+    public test::fixture
+{
+    static constexpr unsigned sleepers = 8;
+    static constexpr uint64_t step_us = 2000;
+};
+
+TEST_CASE( sleep_tests, wake_order )
+{
+    unsigned order[sleepers];
+    uint64_t slept[sleepers];
+    unsigned next = 0;
+
+    // Thread i sleeps for (sleepers - i) steps, so they should wake
+    // in the reverse of the order they started
+    test::bench::run_threads(sleepers, [&](unsigned i) {
+        uint64_t duration = (sleepers - i) * step_us;
+        uint64_t start = test::bench::ticks();
+        j6_thread_sleep(duration);
+        slept[i] = test::bench::to_us(test::bench::ticks() - start);
+        order[__atomic_fetch_add(&next, 1, __ATOMIC_SEQ_CST)] = i;
+    });
+
+    REQUIRE( next == sleepers, "Every sleeper woke" );
+
+    bool in_order = true;
+    for (unsigned i = 0; i < sleepers; ++i)
+        in_order = in_order && order[i] == sleepers - 1 - i;
+    CHECK( in_order, "Sleepers woke in deadline order" );
+
+    bool long_enough = true;
+    for (unsigned i = 0; i < sleepers; ++i)
+        long_enough = long_enough && slept[i] >= (sleepers - i) * step_us;
+    CHECK( long_enough, "Sleepers slept at least their duration" );
+}
+
+TEST_CASE( sleep_tests, user_clock )
+{
+    // The clock can only be read without a syscall when it's the TSC
+    if (!j6_sysconf(j6sc_tsc_mult))
+        return;
+
+    uint64_t start = j6_clock_us();
+    CHECK( start != 0, "User clock is running" );
+
+    j6_thread_sleep(step_us);
+    uint64_t slept = j6_clock_us() - start;
+    CHECK( slept >= step_us, "User clock agrees with the kernel's sleep deadline" );
+}